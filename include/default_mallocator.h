@@ -30,14 +30,54 @@ static inline void *default_mallocator_calloc(size_t nmem, size_t size)
     return mallocator_calloc(default_mallocator(), nmem, size);
 }
 
+static inline void *default_mallocator_malloc_at_least(size_t size, size_t *actual)
+{
+    return mallocator_malloc_at_least(default_mallocator(), size, actual);
+}
+
+static inline size_t default_mallocator_usable_size(void *ptr, size_t size)
+{
+    return mallocator_usable_size(default_mallocator(), ptr, size);
+}
+
+static inline void *default_mallocator_aligned_alloc(size_t alignment, size_t size)
+{
+    return mallocator_aligned_alloc(default_mallocator(), alignment, size);
+}
+
 static inline void *default_mallocator_realloc(void *ptr, size_t size, size_t new_size)
 {
     return mallocator_realloc(default_mallocator(), ptr, size, new_size);
 }
 
+static inline bool default_mallocator_try_expand(void *ptr, size_t size, size_t new_size)
+{
+    return mallocator_try_expand(default_mallocator(), ptr, size, new_size);
+}
+
 static inline void default_mallocator_free(void *ptr, size_t size)
 {
     mallocator_free(default_mallocator(), ptr, size);
 }
 
+static inline bool default_mallocator_free_unsized(void *ptr)
+{
+    return mallocator_free_unsized(default_mallocator(), ptr);
+}
+
+static inline void *default_mallocator_realloc_unsized(void *ptr, size_t new_size)
+{
+    return mallocator_realloc_unsized(default_mallocator(), ptr, new_size);
+}
+
+static inline size_t default_mallocator_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    return mallocator_malloc_batch(default_mallocator(), size, n, ptrs);
+}
+
+static inline void default_mallocator_free_batch(void **ptrs, size_t size, size_t n)
+{
+    mallocator_free_batch(default_mallocator(), ptrs, size, n);
+}
+
 #endif // DEFAULT_MALLOCATOR_H
@@ -8,6 +8,7 @@
  * - Collects statistics on allocation
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 
 /**
@@ -26,6 +27,10 @@ typedef struct
     size_t bytes_allocated;
     size_t bytes_freed;
     size_t bytes_failed;
+    size_t bytes_padding;	/* Usable bytes beyond the size of aligned allocations */
+    size_t blocks_resized;	/* Blocks expanded in place - growth is counted in bytes_allocated */
+    size_t blocks_deferred;	/* Deferred frees pending - still counted as allocated */
+    size_t bytes_deferred;
 } mallocator_stats_t;
 
 /**
@@ -92,6 +97,91 @@ void mallocator_iterate(mallocator_t *mallocator, mallocator_iter_fn fn, void *a
  */
 void mallocator_stats(mallocator_t *mallocator, mallocator_stats_t *stats);
 
+/**
+ * Return usage statistics summed over mallocator and its descendants. While maintenance is running
+ * (see mallocator_maintenance_start) this is the aggregate refreshed by the last maintenance pass,
+ * otherwise it is computed on demand.
+ */
+void mallocator_subtree_stats(mallocator_t *mallocator, mallocator_stats_t *stats);
+
+/**
+ * Set a hard limit of limit bytes (0 for none) on the live bytes allocated from mallocator and its
+ * descendants. Allocations which would exceed the limit of the mallocator or of any ancestor fail,
+ * and are counted in blocks_failed. The bytes live in the subtree when a limit is first set are
+ * charged against it. A limit lower than the live bytes causes allocations to fail until enough
+ * is freed. Threads charge up to a quarter of the limit ahead of their allocations, which is taken
+ * back before an allocation fails.
+ * \note Limits should be set while the subtree is not allocating.
+ */
+void mallocator_set_limit(mallocator_t *mallocator, size_t limit);
+
+/**
+ * Return the limit of mallocator (0 for none), and optionally the live bytes charged against it.
+ */
+size_t mallocator_limit(mallocator_t *mallocator, size_t *used);
+
+/**
+ * Shrinker function.
+ * The function is called when mallocator, which is the mallocator it was added to or an
+ * ancestor, crosses its high watermark. It should release up to target bytes, e.g. by dropping
+ * cache entries, and return the number of bytes released.
+ * \note The function is called from a dedicated thread, without any mallocator locks held.
+ */
+typedef size_t (*mallocator_shrinker_fn)(void *arg, mallocator_t *mallocator, size_t target);
+
+/**
+ * Set watermarks on the live bytes allocated from mallocator and its descendants, with the same
+ * tracking as mallocator_set_limit. When live bytes rise to high, the shrinkers in the subtree
+ * are called asynchronously with a target of the bytes above low, until that many have been
+ * released. A high watermark of 0 disables shrinking. Returns false if the shrink thread cannot
+ * be started.
+ * \note Only one shrink of a mallocator is pending at a time, the high watermark must be
+ * crossed again for another.
+ */
+bool mallocator_set_watermarks(mallocator_t *mallocator, size_t low, size_t high);
+
+/**
+ * Add a shrinker function to mallocator. Returns false on allocation failure.
+ */
+bool mallocator_add_shrinker(mallocator_t *mallocator, mallocator_shrinker_fn fn, void *arg);
+
+/**
+ * Remove a shrinker function from mallocator. The function will not be called after this
+ * returns, unless this is called from a shrinker function.
+ */
+void mallocator_remove_shrinker(mallocator_t *mallocator, mallocator_shrinker_fn fn, void *arg);
+
+/**
+ * Rate limit policy, for allocations over the rate.
+ */
+typedef enum
+{
+    MALLOCATOR_RATE_FAIL,	/* Fail the allocation */
+    MALLOCATOR_RATE_SPIN,	/* Spin until the allocation is within the rate, or fail after max_delay_ns */
+    MALLOCATOR_RATE_SLEEP,	/* Sleep until the allocation is within the rate, or fail after max_delay_ns */
+} mallocator_rate_policy_t;
+
+/**
+ * Allocation rate limit, as token buckets of bytes and operations.
+ */
+typedef struct
+{
+    size_t bytes_per_sec;	/* 0 for no limit on bytes */
+    size_t ops_per_sec;		/* 0 for no limit on operations */
+    size_t burst_bytes;		/* Bucket size, one second's worth if 0 */
+    size_t burst_ops;		/* Bucket size, one second's worth if 0 */
+    mallocator_rate_policy_t policy;
+    unsigned long max_delay_ns;	/* Longest delay of an allocation by SPIN or SLEEP */
+} mallocator_rate_limit_t;
+
+/**
+ * Set a limit on the rate of allocation from mallocator and its descendants, or clear it if
+ * rate_limit is NULL. Allocations over the rate of the mallocator or of any ancestor are failed,
+ * counted in blocks_failed, or delayed according to the policy. Frees are not limited. Returns
+ * false on allocation failure.
+ */
+bool mallocator_set_rate_limit(mallocator_t *mallocator, const mallocator_rate_limit_t *rate_limit);
+
 /* Allocation */
 
 /**
@@ -104,18 +194,145 @@ void *mallocator_malloc(mallocator_t *mallocator, size_t size);
  */
 void *mallocator_calloc(mallocator_t *mallocator, size_t nmem, size_t size);
 
+/**
+ * Allocate at least size bytes, returning the usable size of the block in actual. The whole
+ * usable size is counted as allocated.
+ * \note The block should be released passing actual as the allocated size.
+ */
+void *mallocator_malloc_at_least(mallocator_t *mallocator, size_t size, size_t *actual);
+
+/**
+ * Return the usable size of a block allocated with size bytes, which is at least size. The
+ * caller may use the slack, but must still pass size when the block is released.
+ */
+size_t mallocator_usable_size(mallocator_t *mallocator, void *ptr, size_t size);
+
+/**
+ * See aligned_alloc. alignment must be a power of two. The block is counted as size bytes in
+ * the statistics, and the usable bytes of the block beyond size as padding.
+ * \note The block should be released with mallocator_free, passing size.
+ */
+void *mallocator_aligned_alloc(mallocator_t *mallocator, size_t alignment, size_t size);
+
 /**
  * See realloc.
  * \note Unlike realloc, the old size should be passed in for statistic collection.
  */
 void *mallocator_realloc(mallocator_t *mallocator, void *ptr, size_t size, size_t new_size);
 
+/**
+ * Try to grow a block of size bytes to new_size bytes without moving it. Returns false, leaving
+ * the block unchanged, if it cannot be expanded in place.
+ * \note new_size must be at least size. On success the block should be released passing new_size.
+ */
+bool mallocator_try_expand(mallocator_t *mallocator, void *ptr, size_t size, size_t new_size);
+
 /**
  * See free.
  * \note Unlike free, the allocated size should be passed in for statistic collection.
  */
 void mallocator_free(mallocator_t *mallocator, void *ptr, size_t size);
 
+/**
+ * Queue a free to be made later, moving its cost off the calling thread. The block is pushed
+ * lock free onto a queue of the calling thread, and freed by mallocator_drain_deferred, by the
+ * maintenance thread (see mallocator_maintenance_start), or when the last reference to mallocator
+ * is released. Until then it is counted in blocks_deferred and bytes_deferred, as well as allocated.
+ * Blocks smaller than three pointers, and blocks which would exceed the bound on pending deferred
+ * bytes of the tree (see mallocator_set_defer_limit), are freed immediately.
+ */
+void mallocator_free_deferred(mallocator_t *mallocator, void *ptr, size_t size);
+
+/**
+ * Make all pending deferred frees of the tree containing mallocator, returning the bytes freed.
+ * This may be called concurrently with mallocator_free_deferred.
+ */
+size_t mallocator_drain_deferred(mallocator_t *mallocator);
+
+/**
+ * Set the bound on pending deferred bytes of the tree containing mallocator (16 MiB by default).
+ */
+void mallocator_set_defer_limit(mallocator_t *mallocator, size_t limit);
+
+/**
+ * Allocate n blocks of size bytes into ptrs, stopping at the first failure. Returns the number
+ * of blocks allocated, which are at the start of ptrs. The whole batch fails if n * size
+ * overflows.
+ * \note Each block may be released individually with mallocator_free or together with
+ * mallocator_free_batch.
+ */
+size_t mallocator_malloc_batch(mallocator_t *mallocator, size_t size, size_t n, void **ptrs);
+
+/**
+ * Free n blocks of size bytes.
+ */
+void mallocator_free_batch(mallocator_t *mallocator, void **ptrs, size_t size, size_t n);
+
+/**
+ * Free a block without its size, which is recovered from the implementation for accounting.
+ * Implementations which know the allocated size (see mallocator_header.h) account exactly,
+ * others account the usable size. Once a tree frees blocks unsized, its mallocators with limits
+ * or watermarks charge the block size of each allocation, so that these frees release what was
+ * charged.
+ * Returns false, leaving the block allocated, if the implementation cannot recover the size.
+ * stdlib, header and TLSF mallocators, and layers over them, support unsized frees, while mmap
+ * mallocators do not.
+ */
+bool mallocator_free_unsized(mallocator_t *mallocator, void *ptr);
+
+/**
+ * See realloc. The old size is recovered as for mallocator_free_unsized, and NULL is returned,
+ * leaving the block allocated, if it cannot be.
+ */
+void *mallocator_realloc_unsized(mallocator_t *mallocator, void *ptr, size_t new_size);
+
+/**
+ * Trim flags.
+ */
+enum
+{
+    MALLOCATOR_TRIM_PURGE = 1 << 0,	/* Also release free memory kept resident for latency, e.g. TLSF pools */
+};
+
+/**
+ * Release cached free memory in mallocator and its descendants to the OS, returning the number of
+ * bytes released. Each implementation is asked to trim once, including those shared by children
+ * (e.g. mmap and TLSF), and the stdlib heap, which is process wide, is trimmed once. This may be
+ * called concurrently with allocation.
+ */
+size_t mallocator_trim(mallocator_t *mallocator, unsigned flags);
+
+/**
+ * Maintenance configuration.
+ */
+typedef struct
+{
+    unsigned period_ms;		/* Interval between maintenance passes */
+    unsigned decay_ms;		/* Idle time before cached memory is trimmed (0 to never trim) */
+    unsigned trim_flags;	/* Flags passed to implementations when trimming */
+    int cpu;			/* CPU to run maintenance on (-1 for any) */
+} mallocator_maintenance_config_t;
+
+/**
+ * Start a background thread performing periodic maintenance of the tree of root:
+ * - Implementations idle for decay_ms are trimmed, once per idle period. Implementations shared
+ *   by children (e.g. mmap and TLSF) are idle once all mallocators using them are, and the stdlib
+ *   heap is trimmed once the whole tree has been idle for decay_ms
+ * - Subtree aggregates returned by mallocator_subtree_stats are refreshed
+ * - Freeing of destroyed mallocators, including destruction of their implementations, is deferred
+ *   to the maintenance thread
+ * - Pending deferred frees (see mallocator_free_deferred) are made
+ * Returns false if maintenance is already running or the thread cannot be started.
+ * \note Maintenance holds a reference to root, so must be stopped before root can be destroyed.
+ */
+bool mallocator_maintenance_start(mallocator_t *root, const mallocator_maintenance_config_t *config);
+
+/**
+ * Stop maintenance of the tree of root, waiting for any pass in progress and freeing destroyed
+ * mallocators.
+ */
+void mallocator_maintenance_stop(mallocator_t *root);
+
 /**
  * Leak reporter function.
  * The function will be called during the destruction of a mallocator which has allocated more
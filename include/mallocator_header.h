@@ -0,0 +1,30 @@
+#ifndef MALLOCATOR_HEADER_H
+#define MALLOCATOR_HEADER_H
+
+#include "mallocator.h"
+#include "mallocator_impl.h"
+
+/*
+ * Size header mallocator implementation for drop-in use with unsized frees.
+ * - Implements the mallocator interface
+ * - Prefixes each block with a small header recording the allocated size, so that
+ *   mallocator_free_unsized and mallocator_realloc_unsized account exactly
+ * - Costs MALLOCATOR_HEADER_SIZE bytes per block
+ * - Uses stdlib malloc/free/calloc/realloc, or wraps an inner implementation which is always
+ *   passed exact sizes - this adds unsized free support to implementations without it
+ */
+
+enum { MALLOCATOR_HEADER_SIZE = 16 };
+
+/**
+ * Create a root mallocator which records the size of each block in a header.
+ */
+mallocator_t *mallocator_header_create(const char *name);
+
+/**
+ * Create a header layer wrapping inner (NULL for stdlib), for use with mallocator_create_custom.
+ * Ownership of inner is taken, even on failure.
+ */
+mallocator_impl_t *mallocator_header_impl_create(mallocator_impl_t *inner);
+
+#endif // MALLOCATOR_HEADER_H
@@ -0,0 +1,57 @@
+#ifndef MALLOCATOR_HEAP_PROFILE_H
+#define MALLOCATOR_HEAP_PROFILE_H
+
+#include "mallocator_tracer.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Live heap profiles built from tracer events.
+ * - The profile is a tracer callback, so may be passed directly to mallocator_tracer_create or
+ *   mallocator_tracer_create_async, usually with mallocator_tracer_set_sampling
+ * - Live blocks are kept in a table sharded by address, each shard with its own lock, so events
+ *   from many threads rarely contend
+ * - The live heap may be written at any time, grouped by stack and mallocator node
+ *
+ * Output formats:
+ *   PPROF:   gperftools heap profile text, which pprof reads. Sampled profiles are written as
+ *            heap_v2 so that pprof scales them. Followed by MAPPED_LIBRARIES for symbolization.
+ *   FOLDED:  one line per stack and node, "<node>;<outermost frame>;...;<innermost frame> <bytes>",
+ *            for flame graph tools. Sampled bytes are scaled to estimate the live heap.
+ */
+
+typedef struct mallocator_heap_profile mallocator_heap_profile_t;
+
+typedef enum
+{
+    MALLOCATOR_HEAP_PROFILE_PPROF,
+    MALLOCATOR_HEAP_PROFILE_FOLDED,
+} mallocator_heap_profile_format_t;
+
+/**
+ * Create a profile. sample_interval is the mean interval passed to mallocator_tracer_set_sampling,
+ * or 0 if every allocation is traced.
+ */
+mallocator_heap_profile_t *mallocator_heap_profile_create(size_t sample_interval);
+
+/**
+ * Record an event. Matches mallocator_tracer_fn, with the profile as arg. This may be called
+ * concurrently.
+ */
+void mallocator_heap_profile_event(void *profile, const mallocator_tracer_event_t *event);
+
+/**
+ * Return the number of live blocks recorded, and optionally their bytes, without scaling.
+ */
+size_t mallocator_heap_profile_live(mallocator_heap_profile_t *profile, size_t *bytes);
+
+/**
+ * Write the live heap to file. Events may be recorded concurrently, in which case each shard is
+ * consistent but the profile as a whole is not a single point in time.
+ * Returns false if writing failed.
+ */
+bool mallocator_heap_profile_write(mallocator_heap_profile_t *profile, FILE *file, mallocator_heap_profile_format_t format);
+
+void mallocator_heap_profile_destroy(mallocator_heap_profile_t *profile);
+
+#endif // MALLOCATOR_HEAP_PROFILE_H
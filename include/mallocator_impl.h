@@ -5,12 +5,19 @@
  * Generic memory allocator interface.
  * - Allows for an object oriented allocator
  * - Provides C stdlib style interface
+ * - Implementations may be stacked, each layer wrapping an inner implementation
  */
 
 #include "mallocator.h"
+#include <stdint.h>
+#include <malloc.h>
+#include <assert.h>
 
 typedef struct mallocator_impl mallocator_impl_t;
 
+/* Block size of implementations which cannot recover the size of a block */
+#define MALLOCATOR_BLOCK_SIZE_UNKNOWN SIZE_MAX
+
 typedef struct
 {
     mallocator_impl_t *(*create_child)(void *parent_obj, const char *name);
@@ -25,12 +32,42 @@ typedef struct
 
     void (*free)(void *obj, void *ptr, size_t size);
 
+    /* Optional - aligned allocation fails if not implemented */
+    void *(*aligned_alloc)(void *obj, size_t alignment, size_t size);
+
+    /* Optional - allocate up to n blocks into ptrs, returning the number allocated */
+    size_t (*malloc_batch)(void *obj, size_t size, size_t n, void **ptrs);
+
+    /* Optional - free n blocks of the same size */
+    void (*free_batch)(void *obj, void **ptrs, size_t size, size_t n);
+
+    /* Optional - usable size is the requested size if not implemented */
+    size_t (*usable_size)(void *obj, void *ptr, size_t size);
+
+    /* Optional - malloc followed by usable_size if not implemented */
+    void *(*malloc_at_least)(void *obj, size_t size, size_t *actual);
+
+    /* Optional - expansion in place fails if not implemented */
+    bool (*try_expand)(void *obj, void *ptr, size_t size, size_t new_size);
+
+    /*
+     * Optional - size of a block for accounting unsized frees. This is the allocated size if it
+     * is known, otherwise the usable size. Layers forward this to their inner implementation with
+     * mallocator_impl_next_block_size. Unsized frees are not supported if not implemented, or if
+     * MALLOCATOR_BLOCK_SIZE_UNKNOWN is returned.
+     */
+    size_t (*block_size)(void *obj, void *ptr);
+
+    /* Optional - release cached free memory to the OS, returning the bytes released */
+    size_t (*trim)(void *obj, unsigned flags);
+
 } mallocator_interface_t;
 
 struct mallocator_impl
 {
     void *obj;					/* 'Subclass instance pointer' */
     const mallocator_interface_t *interface;	/* 'Subclass virtual function table' */
+    mallocator_impl_t *inner;			/* Wrapped implementation (NULL for stdlib) */
 };
 
 /* Helper functions */
@@ -65,8 +102,198 @@ static inline void mallocator_impl_free(mallocator_impl_t *impl, void *ptr, size
     impl->interface->free(impl->obj, ptr, size);
 }
 
+static inline void *mallocator_impl_aligned_alloc(mallocator_impl_t *impl, size_t alignment, size_t size)
+{
+    if (!impl->interface->aligned_alloc) return NULL;
+    return impl->interface->aligned_alloc(impl->obj, alignment, size);
+}
+
+static inline size_t mallocator_impl_malloc_batch(mallocator_impl_t *impl, size_t size, size_t n, void **ptrs)
+{
+    if (impl->interface->malloc_batch)
+	return impl->interface->malloc_batch(impl->obj, size, n, ptrs);
+
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+	ptrs[i] = impl->interface->malloc(impl->obj, size);
+	if (!ptrs[i]) break;
+    }
+    return i;
+}
+
+static inline void mallocator_impl_free_batch(mallocator_impl_t *impl, void **ptrs, size_t size, size_t n)
+{
+    if (impl->interface->free_batch)
+    {
+	impl->interface->free_batch(impl->obj, ptrs, size, n);
+	return;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+	impl->interface->free(impl->obj, ptrs[i], size);
+    }
+}
+
+static inline size_t mallocator_impl_usable_size(mallocator_impl_t *impl, void *ptr, size_t size)
+{
+    if (!impl->interface->usable_size) return size;
+    return impl->interface->usable_size(impl->obj, ptr, size);
+}
+
+static inline void *mallocator_impl_malloc_at_least(mallocator_impl_t *impl, size_t size, size_t *actual)
+{
+    if (impl->interface->malloc_at_least)
+	return impl->interface->malloc_at_least(impl->obj, size, actual);
+
+    void *ptr = impl->interface->malloc(impl->obj, size);
+    *actual = ptr ? mallocator_impl_usable_size(impl, ptr, size) : 0;
+    return ptr;
+}
+
+static inline bool mallocator_impl_try_expand(mallocator_impl_t *impl, void *ptr, size_t size, size_t new_size)
+{
+    if (!impl->interface->try_expand) return false;
+    return impl->interface->try_expand(impl->obj, ptr, size, new_size);
+}
+
+static inline size_t mallocator_impl_block_size(mallocator_impl_t *impl, void *ptr)
+{
+    if (!impl->interface->block_size) return MALLOCATOR_BLOCK_SIZE_UNKNOWN;
+    return impl->interface->block_size(impl->obj, ptr);
+}
+
+static inline size_t mallocator_impl_trim(mallocator_impl_t *impl, unsigned flags)
+{
+    if (!impl->interface->trim) return 0;
+    return impl->interface->trim(impl->obj, flags);
+}
+
+/*
+ * Layering helper functions
+ * Forward to the inner implementation, or to stdlib at the bottom of the stack. A layer owns its
+ * inner implementation: create_child should create a child of the inner implementation to wrap,
+ * and destroy should destroy it.
+ */
+
+static inline mallocator_impl_t *mallocator_impl_next_create_child(mallocator_impl_t *impl, const char *name)
+{
+    return impl->inner ? mallocator_impl_create_child(impl->inner, name) : NULL;
+}
+
+static inline void mallocator_impl_next_destroy(mallocator_impl_t *impl)
+{
+    if (impl->inner) mallocator_impl_destroy(impl->inner);
+}
+
+static inline void *mallocator_impl_next_malloc(mallocator_impl_t *impl, size_t size)
+{
+    return impl->inner ? mallocator_impl_malloc(impl->inner, size) : malloc(size);
+}
+
+static inline void *mallocator_impl_next_calloc(mallocator_impl_t *impl, size_t nmemb, size_t size)
+{
+    return impl->inner ? mallocator_impl_calloc(impl->inner, nmemb, size) : calloc(nmemb, size);
+}
+
+static inline void *mallocator_impl_next_realloc(mallocator_impl_t *impl, void *ptr, size_t size, size_t new_size)
+{
+    return impl->inner ? mallocator_impl_realloc(impl->inner, ptr, size, new_size) : realloc(ptr, new_size);
+}
+
+static inline void mallocator_impl_next_free(mallocator_impl_t *impl, void *ptr, size_t size)
+{
+    if (impl->inner) mallocator_impl_free(impl->inner, ptr, size);
+    else free(ptr);
+}
+
+static inline void *mallocator_impl_next_aligned_alloc(mallocator_impl_t *impl, size_t alignment, size_t size)
+{
+    return impl->inner ? mallocator_impl_aligned_alloc(impl->inner, alignment, size) : aligned_alloc(alignment, size);
+}
+
+static inline size_t mallocator_impl_next_malloc_batch(mallocator_impl_t *impl, size_t size, size_t n, void **ptrs)
+{
+    if (impl->inner)
+	return mallocator_impl_malloc_batch(impl->inner, size, n, ptrs);
+
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+	ptrs[i] = malloc(size);
+	if (!ptrs[i]) break;
+    }
+    return i;
+}
+
+static inline void mallocator_impl_next_free_batch(mallocator_impl_t *impl, void **ptrs, size_t size, size_t n)
+{
+    if (impl->inner)
+    {
+	mallocator_impl_free_batch(impl->inner, ptrs, size, n);
+	return;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+	free(ptrs[i]);
+    }
+}
+
+static inline size_t mallocator_impl_next_usable_size(mallocator_impl_t *impl, void *ptr, size_t size)
+{
+    return impl->inner ? mallocator_impl_usable_size(impl->inner, ptr, size) : malloc_usable_size(ptr);
+}
+
+static inline void *mallocator_impl_next_malloc_at_least(mallocator_impl_t *impl, size_t size, size_t *actual)
+{
+    if (impl->inner)
+	return mallocator_impl_malloc_at_least(impl->inner, size, actual);
+
+    void *ptr = malloc(size);
+    *actual = ptr ? malloc_usable_size(ptr) : 0;
+    return ptr;
+}
+
+static inline bool mallocator_impl_next_try_expand(mallocator_impl_t *impl, void *ptr, size_t size, size_t new_size)
+{
+    return impl->inner ? mallocator_impl_try_expand(impl->inner, ptr, size, new_size) : malloc_usable_size(ptr) >= new_size;
+}
+
+static inline size_t mallocator_impl_next_block_size(mallocator_impl_t *impl, void *ptr)
+{
+    return impl->inner ? mallocator_impl_block_size(impl->inner, ptr) : malloc_usable_size(ptr);
+}
 
-/* Create a mallocator with a custom allocator implementation */
+/* The stdlib heap is process wide, so is trimmed by mallocator_trim rather than by each layer */
+static inline size_t mallocator_impl_next_trim(mallocator_impl_t *impl, unsigned flags)
+{
+    return impl->inner ? mallocator_impl_trim(impl->inner, flags) : 0;
+}
+
+/* Return the first layer of a stack with the given interface (NULL if there is none) */
+static inline mallocator_impl_t *mallocator_impl_find(mallocator_impl_t *impl, const mallocator_interface_t *interface)
+{
+    while (impl && impl->interface != interface)
+	impl = impl->inner;
+    return impl;
+}
+
+/*
+ * Create a mallocator with a custom allocator implementation, which may be a stack of layers.
+ * On failure the caller retains ownership of impl.
+ */
 mallocator_t *mallocator_create_custom(const char *name, mallocator_impl_t *impl);
 
+/*
+ * Create a child mallocator to parent with its own allocator implementation, instead of one
+ * derived from the parent's. The child stays in the parent's tree, sharing its lock and leak
+ * reporter, and its children derive from impl. On failure the caller retains ownership of impl.
+ */
+mallocator_t *mallocator_create_child_custom(mallocator_t *parent, const char *name, mallocator_impl_t *impl);
+
+/* Return the custom allocator implementation of a mallocator (NULL if stdlib is used) */
+mallocator_impl_t *mallocator_get_impl(mallocator_t *mallocator);
+
 #endif // MALLOCATOR_IMPL_H
@@ -0,0 +1,49 @@
+#ifndef MALLOCATOR_MMAP_H
+#define MALLOCATOR_MMAP_H
+
+#include "mallocator.h"
+#include "mallocator_impl.h"
+
+/*
+ * mmap backed mallocator implementation for large allocations.
+ * - Implements the mallocator interface
+ * - Allocations of at least threshold bytes are served directly from anonymous mappings
+ * - Mappings of a huge page or more are huge page aligned and advised with MADV_HUGEPAGE
+ * - Mapped blocks are resized with mremap rather than copied
+ * - Smaller allocations fall back to stdlib malloc/free/calloc/realloc
+ * - Unsized frees are not supported, as mapped blocks are identified by their size - they fail
+ *   and leave the block allocated. Wrap with mallocator_header_impl_create to support them.
+ * - No hierarchy - a single instance is used for the whole mallocator tree
+ */
+
+enum { MALLOCATOR_MMAP_HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+
+/**
+ * mmap backend statistics. These cover mapped blocks only.
+ */
+typedef struct
+{
+    size_t blocks_mapped;	/* Live mapped blocks */
+    size_t bytes_mapped;	/* Live bytes mapped (page rounded) */
+    size_t bytes_requested;	/* Live bytes requested for mapped blocks */
+    size_t maps;		/* Number of blocks mapped */
+    size_t remaps;		/* Number of mapped blocks resized with mremap */
+} mallocator_mmap_stats_t;
+
+/**
+ * Create a root mallocator which maps allocations of threshold bytes or more.
+ */
+mallocator_t *mallocator_mmap_create(const char *name, size_t threshold);
+
+/**
+ * Create an mmap implementation, for use as the innermost layer of a stack.
+ */
+mallocator_impl_t *mallocator_mmap_impl_create(size_t threshold);
+
+/**
+ * Return mmap backend statistics for mallocator, which must be in a tree created by
+ * mallocator_mmap_create or with an mmap layer.
+ */
+void mallocator_mmap_stats(mallocator_t *mallocator, mallocator_mmap_stats_t *stats);
+
+#endif // MALLOCATOR_MMAP_H
@@ -2,13 +2,14 @@
 #define MALLOCATOR_MONKEY_H
 
 #include "mallocator.h"
+#include "mallocator_impl.h"
 #include <stdbool.h>
 
 /*
  * Unreliable mallocator implementation (name inspired by the Netflix Chaos monkey).
  * - Implements the mallocator interface
- * - Uses stdlib malloc/free/calloc/realloc
- * - No hierarchy - a single instance is used for the whole mallocator tree
+ * - Uses stdlib malloc/free/calloc/realloc, or wraps an inner implementation
+ * - Failure state is shared by the whole mallocator tree
  * - Injects failures in a controlled manner
  * - Failures may be at random intervals or after a number of allocations
  */
@@ -22,4 +23,15 @@ mallocator_t *mallocator_monkey_create_step(const char *name, unsigned num_succe
 
 mallocator_t *mallocator_monkey_create_custom(const char *name, mallocator_monkey_fail_fn fn, void *arg);
 
+/*
+ * Create a monkey layer wrapping inner (NULL for stdlib), for use with mallocator_create_custom.
+ * Ownership of inner is taken, even on failure.
+ */
+
+mallocator_impl_t *mallocator_monkey_impl_create_random(float p_failure, float p_recovery, mallocator_impl_t *inner);
+
+mallocator_impl_t *mallocator_monkey_impl_create_step(unsigned num_success, unsigned num_failure, bool repeat, mallocator_impl_t *inner);
+
+mallocator_impl_t *mallocator_monkey_impl_create_custom(mallocator_monkey_fail_fn fn, void *arg, mallocator_impl_t *inner);
+
 #endif // MALLOCATOR_MONKEY_H
@@ -0,0 +1,119 @@
+#ifndef MALLOCATOR_SHM_RING_H
+#define MALLOCATOR_SHM_RING_H
+
+#include "mallocator_tracer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Stream tracer events to another local process through a shared memory ring.
+ * - The ring is a tracer callback, so may be passed directly to mallocator_tracer_create. Events
+ *   are copied into shared memory without locks or I/O, from any number of threads.
+ * - The ring is a memfd, which other processes open as /proc/<pid>/fd/<fd>, or a POSIX shared
+ *   memory object, which they open as /dev/shm/<name>
+ * - A single reader, usually mallocator_shm_trace, follows the ring. Producers never overwrite
+ *   unread events - events which do not fit are dropped and counted in lost.
+ *
+ * Layout, in native byte order:
+ *   header:  mallocator_shm_ring_header_t, MALLOCATOR_SHM_RING_HEADER_SIZE bytes
+ *   data:    capacity bytes, a power of 2, starting after the header
+ * Records start at data offset (tail % capacity) and wrap around the end of data. Each is a
+ * mallocator_shm_ring_record_t, depth frames of 8 bytes, then name_len bytes of name, padded to a
+ * multiple of 8 bytes. A producer reserves a record by advancing head with a compare and swap,
+ * writes it and then stores its size, so a record size of 0 means it is not yet written. The reader
+ * copies a record, zeroes its bytes and then advances tail past it.
+ */
+
+enum
+{
+    MALLOCATOR_SHM_RING_VERSION = 1,
+    MALLOCATOR_SHM_RING_HEADER_SIZE = 256,
+    MALLOCATOR_SHM_RING_CAPACITY = 4 * 1024 * 1024,	/* Default data bytes */
+    MALLOCATOR_SHM_RING_CAPACITY_MIN = 64 * 1024,
+    MALLOCATOR_SHM_RING_NAME_MAX = 255,			/* Longer names are truncated */
+};
+
+typedef struct
+{
+    char magic[8];		/* "MALLRNG" */
+    uint32_t version;
+    uint32_t header_size;	/* Offset of data */
+    uint64_t capacity;		/* Data bytes */
+    uint64_t pid;		/* Producer process */
+    uint8_t reserved0[32];
+    uint64_t head;		/* Bytes reserved by producers (atomic) */
+    uint64_t events;		/* Events written (atomic) */
+    uint64_t lost;		/* Events dropped while the ring was full (atomic) */
+    uint8_t reserved1[40];
+    uint64_t tail;		/* Bytes consumed by the reader (atomic) */
+    uint8_t reserved2[120];
+} mallocator_shm_ring_header_t;
+
+typedef struct
+{
+    uint32_t size;		/* Record bytes, 0 until written (atomic) */
+    uint8_t type;		/* mallocator_tracer_type_t */
+    uint8_t reserved;
+    uint16_t name_len;
+    uint32_t stack;		/* Tracer stack ID, 0 for none */
+    uint32_t depth;		/* Frames following the record */
+    uint32_t tid;
+    int32_t cpu;
+    uint64_t timestamp;		/* Captured by the tracer, else CLOCK_MONOTONIC ns when written */
+    uint64_t ptr;
+    uint64_t args[3];		/* Sizes as in the trace EVENT record - malloc/free: size; calloc:
+				   nmemb, size; realloc: old_ptr, old_size, new_size; aligned_alloc:
+				   alignment, size */
+} mallocator_shm_ring_record_t;
+
+typedef struct mallocator_shm_ring mallocator_shm_ring_t;
+
+/**
+ * Create a ring of capacity data bytes (0 for the default), rounded up to a power of 2. If name is
+ * NULL the ring is a memfd, otherwise a POSIX shared memory object of that name, e.g. "/myapp",
+ * which is replaced if it exists and unlinked when the ring is destroyed.
+ * Returns NULL if the ring cannot be created.
+ */
+mallocator_shm_ring_t *mallocator_shm_ring_create(const char *name, size_t capacity);
+
+/**
+ * Attach to the ring of fd, which must be open for reading and writing, to read it. fd is not
+ * closed by the ring. Returns NULL if fd is not a ring of a supported version.
+ */
+mallocator_shm_ring_t *mallocator_shm_ring_open(int fd);
+
+/**
+ * Return the file descriptor of a ring created by mallocator_shm_ring_create.
+ */
+int mallocator_shm_ring_fd(mallocator_shm_ring_t *ring);
+
+/**
+ * Write an event. Matches mallocator_tracer_fn, with the ring as arg. This may be called
+ * concurrently.
+ */
+void mallocator_shm_ring_event(void *ring, const mallocator_tracer_event_t *event);
+
+/**
+ * Read the next event, returning false if there is none yet. The name and backtrace of event are
+ * valid until the next read. Only one reader may read a ring at a time.
+ */
+bool mallocator_shm_ring_read(mallocator_shm_ring_t *ring, mallocator_tracer_event_t *event);
+
+/**
+ * Return true if reading stopped because the ring is corrupt.
+ */
+bool mallocator_shm_ring_failed(mallocator_shm_ring_t *ring);
+
+/**
+ * Return the number of events dropped because the ring was full.
+ */
+size_t mallocator_shm_ring_lost(mallocator_shm_ring_t *ring);
+
+/**
+ * Return the process ID of the producer.
+ */
+int mallocator_shm_ring_pid(mallocator_shm_ring_t *ring);
+
+void mallocator_shm_ring_destroy(mallocator_shm_ring_t *ring);
+
+#endif // MALLOCATOR_SHM_RING_H
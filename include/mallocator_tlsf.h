@@ -0,0 +1,61 @@
+#ifndef MALLOCATOR_TLSF_H
+#define MALLOCATOR_TLSF_H
+
+#include "mallocator.h"
+#include "mallocator_impl.h"
+
+/*
+ * Two-Level Segregated Fit mallocator implementation for bounded latency allocation.
+ * - Implements the mallocator interface
+ * - Manages a single pool reserved up front - no system calls after creation
+ * - Free pages of the pool are only released by mallocator_trim with MALLOCATOR_TRIM_PURGE, and
+ *   fault back in on reuse. Allocations never wait for a purge, which takes at most 256KiB of a
+ *   free block out of the pool at a time.
+ * - O(1) worst case malloc and free, with immediate coalescing of free blocks
+ * - Short critical sections protected by a spin lock
+ * - No hierarchy - a single instance is used for the whole mallocator tree
+ */
+
+/* Pools must be smaller than this, the largest block size which can be indexed */
+#define MALLOCATOR_TLSF_POOL_MAX ((size_t) 1 << 40)
+
+/**
+ * TLSF pool statistics.
+ */
+typedef struct
+{
+    size_t pool_size;		/* Bytes managed by the pool */
+    size_t bytes_used;		/* Bytes in allocated blocks, including block headers */
+    size_t bytes_free;		/* Bytes available in free blocks */
+    size_t blocks_free;		/* Number of free blocks */
+    size_t largest_free;	/* Largest allocation which can currently be satisfied */
+    unsigned fragmentation;	/* Percentage of free bytes outside the largest free block */
+} mallocator_tlsf_stats_t;
+
+/**
+ * Create a root mallocator managing a pool of pool_size bytes. The pool is mapped and
+ * prefaulted on creation. Returns NULL if pool_size is too small for a block, or is
+ * MALLOCATOR_TLSF_POOL_MAX or more.
+ */
+mallocator_t *mallocator_tlsf_create(const char *name, size_t pool_size);
+
+/**
+ * Create a root mallocator managing a caller supplied pool of pool_size bytes. The pool must
+ * outlive the mallocator tree. pool_size is limited as for mallocator_tlsf_create.
+ */
+mallocator_t *mallocator_tlsf_create_in_place(const char *name, void *pool, size_t pool_size);
+
+/**
+ * Create TLSF implementations, for use as the innermost layer of a stack.
+ */
+mallocator_impl_t *mallocator_tlsf_impl_create(size_t pool_size);
+
+mallocator_impl_t *mallocator_tlsf_impl_create_in_place(void *pool, size_t pool_size);
+
+/**
+ * Return pool statistics for mallocator, which must be in a tree created by
+ * mallocator_tlsf_create or mallocator_tlsf_create_in_place, or with a TLSF layer.
+ */
+void mallocator_tlsf_stats(mallocator_t *mallocator, mallocator_tlsf_stats_t *stats);
+
+#endif // MALLOCATOR_TLSF_H
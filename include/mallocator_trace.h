@@ -0,0 +1,102 @@
+#ifndef MALLOCATOR_TRACE_H
+#define MALLOCATOR_TRACE_H
+
+#include "mallocator_tracer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Compact binary trace files of tracer events.
+ * - The writer is a tracer callback, so may be passed directly to mallocator_tracer_create or
+ *   mallocator_tracer_create_async
+ * - Names are replaced by node IDs and tracer stack IDs by file stack IDs, each defined once in
+ *   the stream
+ * - Timestamps, pointers and sizes are delta and/or varint encoded
+ * - Events are written to a file descriptor in blocks of up to block_size bytes, in which
+ *   deltas restart
+ *
+ * File layout (integers are unsigned LEB128 varints unless noted, deltas are zigzag encoded):
+ *   header:  "MALLTRC" '\0', u32 little endian version
+ *   block:   u32 little endian payload length, then records
+ *   NAME:    tag 0x01, node, length, bytes
+ *   STACK:   tag 0x02, stack, depth, depth x address delta from the previous frame
+ *   EVENT:   tag 0x10 | type, node, stack (0 for none), timestamp delta, ptr delta, tid delta,
+ *            cpu + 1 (0 for none), then
+ *            malloc/free: size; calloc: nmemb, size; realloc: old_ptr delta from ptr, old_size,
+ *            new_size; aligned_alloc: alignment, size
+ * Version 1 events have no tid or cpu, and are still read.
+ */
+
+enum
+{
+    MALLOCATOR_TRACE_VERSION = 2,
+    MALLOCATOR_TRACE_BLOCK_SIZE = 64 * 1024,	/* Default block size */
+};
+
+typedef struct mallocator_trace_writer mallocator_trace_writer_t;
+typedef struct mallocator_trace_reader mallocator_trace_reader_t;
+
+/**
+ * Decoded trace event.
+ */
+typedef struct
+{
+    uint64_t timestamp;			/* event.timestamp if captured, else CLOCK_MONOTONIC ns when
+					   written */
+    unsigned node;			/* Node ID of event.name */
+    unsigned stack;			/* Stack ID of event.backtrace, 0 for none */
+    mallocator_tracer_event_t event;	/* name, stack and backtrace are of the reader, and valid
+					   until it is destroyed */
+} mallocator_trace_record_t;
+
+/**
+ * Create a writer to fd, which is not closed by the writer. block_size is 0 for the default.
+ * Returns NULL if the header cannot be written.
+ */
+mallocator_trace_writer_t *mallocator_trace_writer_create(int fd, size_t block_size);
+
+/**
+ * Encode an event. Matches mallocator_tracer_fn, with the writer as arg. This may be called
+ * concurrently, but is cheapest from the single consumer thread of an asynchronous tracer.
+ */
+void mallocator_trace_writer_event(void *writer, const mallocator_tracer_event_t *event);
+
+/**
+ * Write the current block. Returns false if any write has failed.
+ */
+bool mallocator_trace_writer_flush(mallocator_trace_writer_t *writer);
+
+/**
+ * Return the number of bytes written to fd, and optionally the number of events encoded.
+ */
+size_t mallocator_trace_writer_bytes(mallocator_trace_writer_t *writer, size_t *events);
+
+/**
+ * Flush and destroy the writer. Returns false if any write has failed.
+ */
+bool mallocator_trace_writer_destroy(mallocator_trace_writer_t *writer);
+
+/**
+ * Create a reader from fd, which is not closed by the reader. Returns NULL if fd does not start
+ * with a trace header of a supported version.
+ */
+mallocator_trace_reader_t *mallocator_trace_reader_create(int fd);
+
+/**
+ * Decode the next event into record, returning false at the end of the trace or on error.
+ */
+bool mallocator_trace_reader_next(mallocator_trace_reader_t *reader, mallocator_trace_record_t *record);
+
+/**
+ * Return true if reading stopped because the trace is truncated or corrupt.
+ */
+bool mallocator_trace_reader_failed(mallocator_trace_reader_t *reader);
+
+/**
+ * Return the name of a node ID, or NULL if it has not been defined.
+ */
+const char *mallocator_trace_reader_name(mallocator_trace_reader_t *reader, unsigned node);
+
+void mallocator_trace_reader_destroy(mallocator_trace_reader_t *reader);
+
+#endif // MALLOCATOR_TRACE_H
@@ -2,16 +2,43 @@
 #define MALLOCATOR_TRACER_H
 
 #include "mallocator.h"
+#include "mallocator_impl.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * mallocator implementation which traces all memory allocation and frees.
- * This information is passed synchronously to a user supplied callback function, with the intent
- * that it is processed externally. This may be performed in a separate thread via an event queue,
- * in a separate process or even on a separate machine.
+ * This information is passed to a user supplied callback function, with the intent that it is
+ * processed externally. This may be performed in a separate thread via an event queue, in a
+ * separate process or even on a separate machine.
+ * - Synchronous tracers call the callback on the allocating thread
+ * - Asynchronous tracers copy each event into a lock free ring of the allocating thread, and call
+ *   the callback in batches from a consumer thread. Events are ordered within each thread only.
+ * - Sampling tracers only trace allocations picked with probability proportional to their size,
+ *   and the frees, reallocs and expansions of those blocks
+ * - Backtraces are walked via frame pointers within the stack of the calling thread, so callers
+ *   should be built with -fno-omit-frame-pointer. Each distinct backtrace is stored once in a
+ *   process wide table, and events refer to it by stack ID.
  */
 
-enum { MALLOCATOR_TRACER_BACKTRACE_MAX = 8 };
+enum
+{
+    MALLOCATOR_TRACER_BACKTRACE_MAX = 64,
+    MALLOCATOR_TRACER_BACKTRACE_DEPTH = 8,	/* Default backtrace depth */
+    MALLOCATOR_TRACER_STACKS_MAX = 8192,	/* Bound on distinct backtraces in the process */
+    MALLOCATOR_TRACER_SAMPLED_MAX = 16 * 1024,	/* Default bound on live sampled blocks */
+    MALLOCATOR_TRACER_BATCH_PERIOD_MS = 100,	/* Longest delay before a partial batch is delivered */
+};
+
+/**
+ * Context captured in each event, none by default.
+ */
+enum
+{
+    MALLOCATOR_TRACER_TIMESTAMP = 1 << 0,	/* CLOCK_MONOTONIC, read via the vDSO */
+    MALLOCATOR_TRACER_TID = 1 << 1,		/* Thread ID, cached per thread */
+    MALLOCATOR_TRACER_CPU = 1 << 2,		/* CPU number from sched_getcpu */
+};
 
 typedef enum
 {
@@ -19,6 +46,7 @@ typedef enum
     MALLOCATOR_TRACER_CALLOC,
     MALLOCATOR_TRACER_REALLOC,
     MALLOCATOR_TRACER_FREE,
+    MALLOCATOR_TRACER_ALIGNED_ALLOC,
 } mallocator_tracer_type_t;
 
 typedef struct
@@ -48,15 +76,139 @@ typedef struct
 	{
 	    size_t size;
 	} free;
+	struct
+	{
+	    size_t alignment;
+	    size_t size;
+	} aligned_alloc;
     } e;
-    void *backtrace[MALLOCATOR_TRACER_BACKTRACE_MAX];	/* Caller function backtrace */
+    uint32_t stack;		    /* Stack ID of backtrace, 0 for none */
+    const void *const *backtrace;   /* Caller function backtrace, valid for the process lifetime */
     size_t backtrace_len;
+    uint64_t timestamp;		    /* ns, 0 if not captured */
+    uint32_t tid;		    /* 0 if not captured */
+    int32_t cpu;		    /* -1 if not captured */
 } mallocator_tracer_event_t;
 
 typedef void (*mallocator_tracer_fn)(void *arg, const mallocator_tracer_event_t *event);
 
+/**
+ * Callback of batched tracers. events are valid only during the call.
+ */
+typedef void (*mallocator_tracer_batch_fn)(void *arg, const mallocator_tracer_event_t *events, size_t count);
+
+/**
+ * Runtime event filter of a tracer node. Filters are checked before an event is sampled or its
+ * backtrace is walked, so filtered events cost a load or two. Each event is filtered on its own, so
+ * e.g. the free of a traced block may be filtered.
+ */
+typedef struct
+{
+    bool enabled;		/* Trace events of the node */
+    unsigned types;		/* Mask of (1 << mallocator_tracer_type_t) traced, 0 for all */
+    size_t min_size;		/* Smallest size traced - the new size of reallocs, the total of callocs */
+    size_t max_size;		/* Largest size traced, 0 for no limit */
+} mallocator_tracer_filter_t;
+
+/**
+ * Behaviour of asynchronous tracers when the ring of a thread is full.
+ */
+typedef enum
+{
+    MALLOCATOR_TRACER_DROP,	/* Drop the event, counting it in mallocator_tracer_dropped */
+    MALLOCATOR_TRACER_BLOCK,	/* Wait for the consumer to make space */
+} mallocator_tracer_overflow_t;
+
+typedef struct
+{
+    size_t ring_events;			/* Events per thread ring, rounded up to a power of 2 */
+    unsigned period_ms;			/* Longest delay before events are delivered */
+    mallocator_tracer_overflow_t overflow;
+} mallocator_tracer_async_config_t;
+
 const char *mallocator_tracer_type_str(mallocator_tracer_type_t type);
 
 mallocator_t *mallocator_tracer_create(const char *name, mallocator_tracer_fn fn, void *arg);
 
+/**
+ * Create a tracer layer wrapping inner (NULL for stdlib), for use with mallocator_create_custom.
+ * Ownership of inner is taken, even on failure.
+ */
+mallocator_impl_t *mallocator_tracer_impl_create(const char *name, mallocator_tracer_fn fn, void *arg, mallocator_impl_t *inner);
+
+/**
+ * Create asynchronous tracers, as above. Event names remain valid until the tracer tree is
+ * destroyed. Events written before the tracer tree is destroyed are delivered before it completes.
+ */
+mallocator_t *mallocator_tracer_create_async(const char *name, mallocator_tracer_fn fn, void *arg,
+    const mallocator_tracer_async_config_t *config);
+
+mallocator_impl_t *mallocator_tracer_impl_create_async(const char *name, mallocator_tracer_fn fn, void *arg,
+    const mallocator_tracer_async_config_t *config, mallocator_impl_t *inner);
+
+/**
+ * Create batched tracers, which are asynchronous tracers delivering arrays of up to batch_size
+ * events of a thread, in order, from the consumer thread. A thread's events are delivered once
+ * batch_size are buffered, within MALLOCATOR_TRACER_BATCH_PERIOD_MS, and when the thread exits.
+ * Producers block if batches are not consumed in time, so no events are dropped.
+ */
+mallocator_t *mallocator_tracer_create_batched(const char *name, mallocator_tracer_batch_fn fn, void *arg,
+    size_t batch_size);
+
+mallocator_impl_t *mallocator_tracer_impl_create_batched(const char *name, mallocator_tracer_batch_fn fn, void *arg,
+    size_t batch_size, mallocator_impl_t *inner);
+
+/**
+ * Sample the allocations of the tracer of mallocator, and of children created afterwards, at a mean
+ * interval of interval bytes using a per-thread countdown. An allocation of size bytes is sampled
+ * with probability 1 - exp(-size / interval), so the bytes of sampled allocations should be
+ * weighted by size / (1 - exp(-size / interval)) to estimate the total. At most max_sampled
+ * (0 for MALLOCATOR_TRACER_SAMPLED_MAX) sampled blocks are tracked at a time, and sampled
+ * allocations beyond this are not traced.
+ * Returns false if sampling is already set or cannot be allocated.
+ * \note This should be set before children are created or anything is allocated.
+ */
+bool mallocator_tracer_set_sampling(mallocator_t *mallocator, size_t interval, size_t max_sampled);
+
+/**
+ * Set the backtrace depth of the tracer of mallocator, and of children created afterwards, up to
+ * MALLOCATOR_TRACER_BACKTRACE_MAX. 0 disables backtraces.
+ */
+void mallocator_tracer_set_backtrace_depth(mallocator_t *mallocator, size_t depth);
+
+/**
+ * Set the context captured in events of the tracer of mallocator, and of children created
+ * afterwards, as a mask of MALLOCATOR_TRACER_TIMESTAMP, MALLOCATOR_TRACER_TID and
+ * MALLOCATOR_TRACER_CPU. Events without context cost a single branch.
+ */
+void mallocator_tracer_set_context(mallocator_t *mallocator, unsigned context);
+
+/**
+ * Set the filter of the tracer of mallocator and all of its descendants, and of children created
+ * afterwards. This may be called at any time, e.g. to disable a tree then enable a subtree of it.
+ */
+void mallocator_tracer_set_filter(mallocator_t *mallocator, const mallocator_tracer_filter_t *filter);
+
+/**
+ * Return the filter of the tracer of mallocator.
+ */
+void mallocator_tracer_get_filter(mallocator_t *mallocator, mallocator_tracer_filter_t *filter);
+
+/**
+ * Return the backtrace of a stack ID and its depth, or NULL if stack is not defined. Once defined
+ * a stack ID is never reused.
+ */
+const void *const *mallocator_tracer_stack(uint32_t stack, size_t *depth);
+
+/**
+ * Wait for all events traced by mallocator before the call to be delivered. Returns immediately
+ * for synchronous tracers.
+ */
+void mallocator_tracer_flush(mallocator_t *mallocator);
+
+/**
+ * Return the number of events dropped by the tracer tree of mallocator because a ring was full.
+ */
+size_t mallocator_tracer_dropped(mallocator_t *mallocator);
+
 #endif // MALLOCATOR_TRACER_H
@@ -51,14 +51,54 @@ static inline void *module_mallocator_calloc(size_t nmem, size_t size)
     return mallocator_calloc(module_mallocator(), nmem, size);
 }
 
+static inline void *module_mallocator_malloc_at_least(size_t size, size_t *actual)
+{
+    return mallocator_malloc_at_least(module_mallocator(), size, actual);
+}
+
+static inline size_t module_mallocator_usable_size(void *ptr, size_t size)
+{
+    return mallocator_usable_size(module_mallocator(), ptr, size);
+}
+
+static inline void *module_mallocator_aligned_alloc(size_t alignment, size_t size)
+{
+    return mallocator_aligned_alloc(module_mallocator(), alignment, size);
+}
+
 static inline void *module_mallocator_realloc(void *ptr, size_t size, size_t new_size)
 {
     return mallocator_realloc(module_mallocator(), ptr, size, new_size);
 }
 
+static inline bool module_mallocator_try_expand(void *ptr, size_t size, size_t new_size)
+{
+    return mallocator_try_expand(module_mallocator(), ptr, size, new_size);
+}
+
 static inline void module_mallocator_free(void *ptr, size_t size)
 {
     mallocator_free(module_mallocator(), ptr, size);
 }
 
+static inline void module_mallocator_free_unsized(void *ptr)
+{
+    mallocator_free_unsized(module_mallocator(), ptr);
+}
+
+static inline void *module_mallocator_realloc_unsized(void *ptr, size_t new_size)
+{
+    return mallocator_realloc_unsized(module_mallocator(), ptr, new_size);
+}
+
+static inline size_t module_mallocator_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    return mallocator_malloc_batch(module_mallocator(), size, n, ptrs);
+}
+
+static inline void module_mallocator_free_batch(void **ptrs, size_t size, size_t n)
+{
+    mallocator_free_batch(module_mallocator(), ptrs, size, n);
+}
+
 #endif // MODULE_MALLOCATOR_H
@@ -1,25 +1,129 @@
+#define _GNU_SOURCE
+
 #include "mallocator.h"
 #include "mallocator_impl.h"
 
 #include "atomic.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
-#define __USE_XOPEN2K8
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
 #include <string.h>
 
 /* Define for lock free statistics accumulation */
 #define MALLOCATOR_STATS_ATOMIC
 
+/* Number of deferred free queues - threads are spread across them */
+#define MALLOCATOR_DEFER_SHARDS 16
+
+/* Default bound on pending deferred bytes per tree */
+#define MALLOCATOR_DEFER_LIMIT (16 << 20)
+
+/* Number of limit credit shards - threads are spread across them */
+#define MALLOCATOR_CREDIT_SHARDS 16
+
+/* Most limit taken at a time by a credit shard */
+#define MALLOCATOR_CREDIT_CHUNK (64 << 10)
+
+typedef struct mallocator_shrinker mallocator_shrinker_t;
+
+struct mallocator_shrinker
+{
+    mallocator_shrinker_t *next;
+    mallocator_shrinker_fn fn;
+    void *arg;
+};
+
+typedef struct mallocator_tree mallocator_tree_t;
+
+typedef struct
+{
+    pthread_t thread;				/* Thread running shrinkers */
+    pthread_mutex_t lock;			/* Lock for shrink synchronisation */
+    pthread_cond_t cond;			/* Signalled on the end of a pass */
+    sem_t wake;					/* Posted on request and stop, without locks */
+    mallocator_tree_t *tree;
+    unsigned requested;				/* Wake posted and not yet taken (atomic) */
+    bool running;				/* Shrinkers are being called */
+    bool stop;					/* Thread should exit */
+    bool detached;				/* Thread frees this on exit */
+} mallocator_shrink_t;
+
+/*
+ * Token bucket in virtual time (GCRA). The bucket is full when tat is in the past, and each unit
+ * advances tat by 1/rate seconds. Admission requires tat to be within tolerance of now.
+ */
+typedef struct
+{
+    uint64_t tat;				/* Theoretical arrival time in ns (atomic) */
+    uint64_t rate;				/* Units per second, 0 if unlimited (atomic) */
+    uint64_t tolerance;				/* Bucket size in ns (atomic) */
+} mallocator_bucket_t;
+
 typedef struct
+{
+    mallocator_bucket_t bytes;
+    mallocator_bucket_t ops;
+    unsigned policy;				/* mallocator_rate_policy_t (atomic) */
+    uint64_t max_delay;				/* Longest delay in ns (atomic) */
+} __attribute__((aligned(64))) mallocator_rate_t;
+
+/* Limit charged by a shard of threads and not yet allocated */
+typedef struct
+{
+    size_t bytes;				/* (atomic) */
+} __attribute__((aligned(64))) mallocator_credit_t;
+
+/* Pending deferred free, written over the block being freed */
+typedef struct mallocator_deferred mallocator_deferred_t;
+
+struct mallocator_deferred
+{
+    mallocator_deferred_t *next;
+    mallocator_t *mallocator;
+    size_t size;
+};
+
+/* Lock free stack of deferred frees, pushed individually and drained whole */
+typedef struct
+{
+    mallocator_deferred_t *head;		/* (atomic) */
+} __attribute__((aligned(64))) mallocator_defer_shard_t;
+
+typedef struct
+{
+    pthread_t thread;				/* Thread running maintenance passes */
+    pthread_mutex_t lock;			/* Lock for maintenance synchronisation */
+    pthread_cond_t cond;			/* Signalled on stop */
+    mallocator_maintenance_config_t config;
+    bool stop;					/* Protected by lock */
+    size_t heap_ops;				/* Tree operations when last changed */
+    uint64_t heap_idle_since;			/* Time of the last change of heap_ops */
+    bool heap_decayed;				/* The heap has been trimmed since the last change */
+} mallocator_maintenance_t;
+
+struct mallocator_tree
 {
     pthread_mutex_t lock;			/* Lock for tree synchronisation */
-    mallocator_t *root;				/* Root mallocator object */
+    mallocator_t *root;				/* Root mallocator object, NULL once destroyed */
     mallocator_leak_reporter_fn leak_fn;	/* Leak reporter function */
     void *leak_arg;				/* Leak reporter function argument */
-} mallocator_tree_t;
+    unsigned tracked;				/* Number of mallocators tracking live bytes (atomic) */
+    unsigned unsized;				/* Blocks have been freed unsized (atomic) */
+    mallocator_shrink_t *shrink;		/* Created with the first watermark (atomic) */
+    mallocator_maintenance_t *maintenance;	/* Protected by lock */
+    mallocator_t *graveyard;			/* Mallocators to be freed by maintenance, protected by lock */
+    size_t deferred_bytes;			/* Pending deferred bytes (atomic) */
+    size_t defer_limit;				/* Bound on deferred_bytes (atomic) */
+    mallocator_defer_shard_t defer[MALLOCATOR_DEFER_SHARDS];
+};
 
 #ifdef MALLOCATOR_STATS_ATOMIC
 typedef mallocator_stats_t mallocator_stats_coll_t;
@@ -41,6 +145,26 @@ struct mallocator
     mallocator_t *children;			/* Protected by tree->lock */
     mallocator_t *next_child;			/* Protected by tree->lock */
     mallocator_stats_coll_t stats;		/* Statistics collection */
+
+    /* Used by every tracked allocation, so in a cache line of their own */
+    _Alignas(64) unsigned tracked;		/* Subtree live bytes are tracked (atomic) */
+    size_t live;				/* Subtree live bytes and credit if tracked (atomic) */
+    size_t limit;				/* Limit on subtree live bytes, 0 if none (atomic) */
+    size_t low_watermark;			/* Target of shrinks (atomic) */
+    size_t high_watermark;			/* Shrink when crossed, 0 if none (atomic) */
+    mallocator_credit_t *credit;		/* Created with the first limit (atomic) */
+
+    _Alignas(64) unsigned shrink_pending;	/* Shrink requested and not yet run (atomic) */
+    mallocator_t *shrink_next;			/* Mallocators collected by the shrink thread */
+    mallocator_shrinker_t *shrinkers;		/* Protected by tree->lock */
+    mallocator_rate_t *rate;			/* Created with the first rate limit (atomic) */
+    unsigned rated;				/* Rate limits on the path to the root (atomic) */
+    mallocator_stats_t subtree_stats;		/* Aggregate refreshed by maintenance, protected by tree->lock */
+    size_t decay_ops;				/* Operations on the owned implementation when last changed, protected by tree->lock */
+    uint64_t decay_idle_since;			/* Time of the last change of decay_ops, protected by tree->lock */
+    bool decayed;				/* Trimmed since the last change, protected by tree->lock */
+    mallocator_t *decay_next;			/* Maintenance trim list, protected by tree->lock */
+    mallocator_deferred_t *cancelled;		/* Pending frees detached on destruction */
 };
 
 /**************************************************************************************************/
@@ -56,6 +180,10 @@ static inline void mallocator_stats_init(mallocator_stats_t *stats)
 	.bytes_allocated = 0,
 	.bytes_freed = 0,
 	.bytes_failed = 0,
+	.bytes_padding = 0,
+	.blocks_resized = 0,
+	.blocks_deferred = 0,
+	.bytes_deferred = 0,
     };
 }
 
@@ -70,22 +198,50 @@ static void mallocator_stats_coll_fini(mallocator_stats_coll_t *stats)
 {
 }
 
-static inline void mallocator_stats_allocated(mallocator_t *mallocator, size_t size)
+static inline void mallocator_stats_allocated_n(mallocator_t *mallocator, size_t blocks, size_t bytes)
 {
-    atomic_fetch_add(&mallocator->stats.blocks_allocated, 1);
-    atomic_fetch_add(&mallocator->stats.bytes_allocated, size);
+    atomic_fetch_add(&mallocator->stats.blocks_allocated, blocks);
+    atomic_fetch_add(&mallocator->stats.bytes_allocated, bytes);
 }
 
-static inline void mallocator_stats_freed(mallocator_t *mallocator, size_t size)
+static inline void mallocator_stats_freed_n(mallocator_t *mallocator, size_t blocks, size_t bytes)
 {
-    atomic_fetch_add(&mallocator->stats.blocks_freed, 1);
-    atomic_fetch_add(&mallocator->stats.bytes_freed, size);
+    atomic_fetch_add(&mallocator->stats.blocks_freed, blocks);
+    atomic_fetch_add(&mallocator->stats.bytes_freed, bytes);
 }
 
-static inline void mallocator_stats_failed(mallocator_t *mallocator, size_t size)
+static inline void mallocator_stats_failed_n(mallocator_t *mallocator, size_t blocks, size_t bytes)
+{
+    atomic_fetch_add(&mallocator->stats.blocks_failed, blocks);
+    atomic_fetch_add(&mallocator->stats.bytes_failed, bytes);
+}
+
+static inline void mallocator_stats_padded(mallocator_t *mallocator, size_t padding)
+{
+    atomic_fetch_add(&mallocator->stats.bytes_padding, padding);
+}
+
+static inline void mallocator_stats_resized(mallocator_t *mallocator, size_t growth)
+{
+    atomic_fetch_add(&mallocator->stats.blocks_resized, 1);
+    atomic_fetch_add(&mallocator->stats.bytes_allocated, growth);
+}
+
+static inline void mallocator_stats_deferred(mallocator_t *mallocator, size_t size)
+{
+    atomic_fetch_add(&mallocator->stats.blocks_deferred, 1);
+    atomic_fetch_add(&mallocator->stats.bytes_deferred, size);
+}
+
+static inline void mallocator_stats_undeferred(mallocator_t *mallocator, size_t size)
+{
+    atomic_fetch_sub(&mallocator->stats.bytes_deferred, size);
+    atomic_fetch_sub(&mallocator->stats.blocks_deferred, 1);
+}
+
+static inline size_t mallocator_stats_pending(mallocator_t *mallocator)
 {
-    atomic_fetch_add(&mallocator->stats.blocks_failed, 1);
-    atomic_fetch_add(&mallocator->stats.bytes_failed, size);
+    return atomic_load(&mallocator->stats.blocks_deferred);
 }
 
 static inline void mallocator_stats_get(mallocator_t *mallocator, mallocator_stats_t *stats)
@@ -96,13 +252,20 @@ static inline void mallocator_stats_get(mallocator_t *mallocator, mallocator_sta
     stats->bytes_freed = atomic_load(&mallocator->stats.bytes_freed);
     stats->blocks_failed = atomic_load(&mallocator->stats.blocks_failed);
     stats->bytes_failed = atomic_load(&mallocator->stats.bytes_failed);
+    stats->bytes_padding = atomic_load(&mallocator->stats.bytes_padding);
+    stats->blocks_resized = atomic_load(&mallocator->stats.blocks_resized);
+    stats->blocks_deferred = atomic_load(&mallocator->stats.blocks_deferred);
+    stats->bytes_deferred = atomic_load(&mallocator->stats.bytes_deferred);
 }
 
 static inline bool mallocator_stats_leak(mallocator_t *mallocator, size_t *blocks, size_t *bytes)
 {
+    const size_t bytes_allocated = atomic_load(&mallocator->stats.bytes_allocated);
+    const size_t bytes_freed = atomic_load(&mallocator->stats.bytes_freed);
     *blocks = atomic_load(&mallocator->stats.blocks_allocated) - atomic_load(&mallocator->stats.blocks_freed);
-    *bytes = atomic_load(&mallocator->stats.bytes_allocated) - atomic_load(&mallocator->stats.bytes_freed);
-    return *blocks > 0 || *bytes > 0;
+    *bytes = bytes_allocated - bytes_freed;
+    /* Unsized frees may account more bytes than were allocated */
+    return *blocks > 0 || bytes_allocated > bytes_freed;
 }
 
 #else
@@ -128,28 +291,67 @@ static inline void mallocator_stats_unlock(mallocator_t *mallocator)
     assert(pthread_mutex_unlock(&mallocator->stats.lock) == 0);
 }
 
-static inline void mallocator_stats_allocated(mallocator_t *mallocator, size_t size)
+static inline void mallocator_stats_allocated_n(mallocator_t *mallocator, size_t blocks, size_t bytes)
 {
     mallocator_stats_lock(mallocator);
-    mallocator->stats.blocks_allocated += 1;
-    mallocator->stats.bytes_allocated += size;
+    mallocator->stats.blocks_allocated += blocks;
+    mallocator->stats.bytes_allocated += bytes;
     mallocator_stats_unlock(mallocator);
 }
 
-static inline void mallocator_stats_freed(mallocator_t *mallocator, size_t size)
+static inline void mallocator_stats_freed_n(mallocator_t *mallocator, size_t blocks, size_t bytes)
 {
     mallocator_stats_lock(mallocator);
-    mallocator->stats.blocks_freed += 1;
-    mallocator->stats.bytes_freed += size;
+    mallocator->stats.blocks_freed += blocks;
+    mallocator->stats.bytes_freed += bytes;
     mallocator_stats_unlock(mallocator);
 }
 
-static inline void mallocator_stats_failed(mallocator_t *mallocator, size_t size)
+static inline void mallocator_stats_failed_n(mallocator_t *mallocator, size_t blocks, size_t bytes)
+{
+    mallocator_stats_lock(mallocator);
+    mallocator->stats.blocks_failed += blocks;
+    mallocator->stats.bytes_failed += bytes;
+    mallocator_stats_unlock(mallocator);
+}
+
+static inline void mallocator_stats_padded(mallocator_t *mallocator, size_t padding)
+{
+    mallocator_stats_lock(mallocator);
+    mallocator->stats.bytes_padding += padding;
+    mallocator_stats_unlock(mallocator);
+}
+
+static inline void mallocator_stats_resized(mallocator_t *mallocator, size_t growth)
+{
+    mallocator_stats_lock(mallocator);
+    mallocator->stats.blocks_resized += 1;
+    mallocator->stats.bytes_allocated += growth;
+    mallocator_stats_unlock(mallocator);
+}
+
+static inline void mallocator_stats_deferred(mallocator_t *mallocator, size_t size)
+{
+    mallocator_stats_lock(mallocator);
+    mallocator->stats.blocks_deferred += 1;
+    mallocator->stats.bytes_deferred += size;
+    mallocator_stats_unlock(mallocator);
+}
+
+static inline void mallocator_stats_undeferred(mallocator_t *mallocator, size_t size)
+{
+    mallocator_stats_lock(mallocator);
+    mallocator->stats.bytes_deferred -= size;
+    mallocator->stats.blocks_deferred -= 1;
+    mallocator_stats_unlock(mallocator);
+}
+
+static inline size_t mallocator_stats_pending(mallocator_t *mallocator)
 {
     mallocator_stats_lock(mallocator);
-    mallocator->stats.blocks_failed += 1;
-    mallocator->stats.bytes_failed += size;
+    const size_t pending = mallocator->stats.blocks_deferred;
     mallocator_stats_unlock(mallocator);
+    return pending;
 }
 
 static inline void mallocator_stats_get(mallocator_t *mallocator, mallocator_stats_t *stats)
@@ -159,499 +361,2134 @@ static inline void mallocator_stats_get(mallocator_t *mallocator, mallocator_sta
     mallocator_stats_unlock(mallocator);
 }
 
-static inline bool mallocator_stats_leak(mallocator_t *mallocator, size_t *blocks, size_t bytes)
+static inline bool mallocator_stats_leak(mallocator_t *mallocator, size_t *blocks, size_t *bytes)
 {
     mallocator_stats_lock(mallocator);
+    const bool leak = mallocator->stats.blocks_allocated > mallocator->stats.blocks_freed ||
+	mallocator->stats.bytes_allocated > mallocator->stats.bytes_freed;
     *blocks = mallocator->stats.blocks_allocated - mallocator->stats.blocks_freed;
     *bytes = mallocator->stats.bytes_allocated - mallocator->stats.bytes_freed;
     mallocator_stats_unlock(mallocator);
-    return *blocks > 0 || *bytes > 0;
+    return leak;
 }
 
 #endif
 
-/**************************************************************************************************/
-/* mallocator tree hierarchy */
-
-static mallocator_tree_t *mallocator_tree_create(mallocator_t *root)
+static inline void mallocator_stats_allocated(mallocator_t *mallocator, size_t size)
 {
-    mallocator_tree_t *tree = malloc(sizeof(*tree));
-    if (!tree) return NULL;
-    assert(pthread_mutex_init(&tree->lock, NULL) == 0);
-    tree->root = root;
-    tree->leak_fn = NULL;
-    tree->leak_arg = NULL;
-    return tree;
+    mallocator_stats_allocated_n(mallocator, 1, size);
 }
 
-static void mallocator_tree_destroy(mallocator_tree_t *tree)
+static inline void mallocator_stats_freed(mallocator_t *mallocator, size_t size)
 {
-    assert(pthread_mutex_destroy(&tree->lock) == 0);
-    tree->root = NULL;
-    tree->leak_fn = NULL;
-    tree->leak_arg = NULL;
-    free(tree);
+    mallocator_stats_freed_n(mallocator, 1, size);
 }
 
-static inline void mallocator_tree_lock(mallocator_tree_t *tree)
+static inline void mallocator_stats_failed(mallocator_t *mallocator, size_t size)
 {
-    assert(pthread_mutex_lock(&tree->lock) == 0);
+    mallocator_stats_failed_n(mallocator, 1, size);
 }
 
-static inline void mallocator_tree_unlock(mallocator_tree_t *tree)
+/**************************************************************************************************/
+/* Live byte tracking utilities */
+
+/*
+ * Subtree live bytes are tracked by mallocators with a limit or watermarks. Reservations are lock
+ * free - each tracked mallocator on the path to the root takes a single atomic add, which is
+ * rolled back if a limit is exceeded. Untracked mallocators cost a load, and trees without
+ * tracking skip the walk entirely.
+ *
+ * Limits without a high watermark are charged in chunks. Each shard of threads keeps the credit
+ * charged but not yet allocated in its own cache line, so most reservations and releases stay off
+ * live. Live counts the credit, so a limit is never exceeded, and the credit of all shards is
+ * taken back before a reservation fails.
+ */
+
+static void mallocator_shrink_request(mallocator_t *mallocator);
+
+/* Shard of the calling thread, assigned round robin on first use */
+static unsigned mallocator_next_shard;
+static _Thread_local unsigned mallocator_thread_shard_id;
+
+static inline unsigned mallocator_thread_shard(void)
 {
-    assert(pthread_mutex_unlock(&tree->lock) == 0);
+    if (!mallocator_thread_shard_id)
+	mallocator_thread_shard_id = atomic_fetch_add_explicit(&mallocator_next_shard, 1, memory_order_relaxed) + 1;
+    return mallocator_thread_shard_id;
 }
 
-/**************************************************************************************************/
-/* Private interface */
+static inline bool mallocator_tree_tracked(mallocator_t *mallocator)
+{
+    return atomic_load_explicit(&mallocator->tree->tracked, memory_order_relaxed) > 0;
+}
 
-static inline void mallocator_verify(const mallocator_t *mallocator)
+/* Request a shrink if charging bytes on top of live crossed the high watermark */
+static inline void mallocator_live_check(mallocator_t *mallocator, size_t live, size_t bytes)
 {
-    assert(mallocator);
-    assert(mallocator->ref_count > 0);
+    const size_t high = atomic_load_explicit(&mallocator->high_watermark, memory_order_relaxed);
+    if (high && live < high && bytes >= high - live)
+	mallocator_shrink_request(mallocator);
 }
 
-static void mallocator_init(mallocator_t *mallocator, mallocator_tree_t *tree, char *name, mallocator_impl_t *pimpl)
+/* Saturate - unsized frees may release more than was charged */
+static void mallocator_live_sub(mallocator_t *mallocator, size_t bytes)
 {
-    *mallocator = (mallocator_t)
+    size_t live = atomic_load_explicit(&mallocator->live, memory_order_relaxed);
+    size_t new_live;
+    do
     {
-	.tree = tree,
-	.pimpl = pimpl,
-	.ref_count = 1,
-	.name = name,
-	.parent = NULL,
-	.children = NULL,
-	.next_child = NULL,
-    };
-    mallocator_stats_coll_init(&mallocator->stats);
+	new_live = live > bytes ? live - bytes : 0;
+    }
+    while (!__atomic_compare_exchange_n(&mallocator->live, &live, new_live, true,
+	    memory_order_relaxed, memory_order_relaxed));
 }
 
-static void mallocator_fini(mallocator_t *mallocator)
+/* Return the credit chunk of mallocator, 0 if it is charged exactly */
+static inline size_t mallocator_credit_chunk(mallocator_t *mallocator)
 {
-    mallocator_stats_coll_fini(&mallocator->stats);
-    *mallocator = (mallocator_t)
-    {
-	.tree = NULL,
-	.pimpl = NULL,
-	.ref_count = 0,
-	.name = NULL,
-	.parent = NULL,
-	.children = NULL,
-	.next_child = NULL,
-    };
+    /* Watermark crossings are detected on live, which must then be exact */
+    if (atomic_load_explicit(&mallocator->high_watermark, memory_order_relaxed)) return 0;
+
+    /* Unsized frees may release more than was charged, which only saturates without credit */
+    if (atomic_load_explicit(&mallocator->tree->unsized, memory_order_relaxed)) return 0;
+
+    /* Shards hold at most a quarter of the limit between them */
+    const size_t chunk = atomic_load_explicit(&mallocator->limit, memory_order_relaxed) / (4 * MALLOCATOR_CREDIT_SHARDS);
+    return chunk < MALLOCATOR_CREDIT_CHUNK ? chunk : MALLOCATOR_CREDIT_CHUNK;
 }
 
-/* Return false if the child name exists */
-static bool mallocator_child_add(mallocator_t *parent, mallocator_t *child)
+/* Return the credit of the calling thread's shard */
+static inline mallocator_credit_t *mallocator_credit_shard(mallocator_t *mallocator)
 {
-    if (!parent->children || strcmp(child->name, parent->children->name) < 0)
+    mallocator_credit_t *credit = atomic_load_explicit(&mallocator->credit, memory_order_acquire);
+    return credit ? &credit[mallocator_thread_shard() % MALLOCATOR_CREDIT_SHARDS] : NULL;
+}
+
+static inline bool mallocator_credit_take(mallocator_credit_t *credit, size_t bytes)
+{
+    size_t avail = atomic_load_explicit(&credit->bytes, memory_order_relaxed);
+    do
     {
-	/* Front of list */
-	child->next_child = parent->children;
-	parent->children = child;
+	if (avail < bytes) return false;
     }
-    else
-    {
-	mallocator_t *curr = parent->children;
-	while (curr->next_child && strcmp(child->name, curr->next_child->name) > 0)
-	    curr = curr->next_child;
+    while (!__atomic_compare_exchange_n(&credit->bytes, &avail, avail - bytes, true,
+	    memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
 
-	/* Check for duplicate name */
-	if (strcmp(child->name, curr->name) == 0)
-	    return false;
+/* Add bytes to credit, returning all but a chunk to live once it holds two */
+static void mallocator_credit_give(mallocator_t *mallocator, mallocator_credit_t *credit, size_t bytes, size_t chunk)
+{
+    size_t avail = atomic_fetch_add_explicit(&credit->bytes, bytes, memory_order_relaxed) + bytes;
+    if (avail <= 2 * chunk) return;
 
-	/* Add after curr */
-	child->next_child = curr->next_child;
-	curr->next_child = child;
+    do
+    {
+	if (avail <= chunk) return;
     }
-    child->parent = parent;
-    return true;
+    while (!__atomic_compare_exchange_n(&credit->bytes, &avail, chunk, true,
+	    memory_order_relaxed, memory_order_relaxed));
+    mallocator_live_sub(mallocator, avail - chunk);
 }
 
-static void mallocator_child_remove(mallocator_t *parent, mallocator_t *child)
+/* Take back the credit of all shards, returning false if there was none */
+static bool mallocator_credit_reclaim(mallocator_t *mallocator)
 {
-    if (parent->children == child)
+    mallocator_credit_t *credit = atomic_load_explicit(&mallocator->credit, memory_order_acquire);
+    if (!credit) return false;
+
+    size_t bytes = 0;
+    for (unsigned i = 0; i < MALLOCATOR_CREDIT_SHARDS; i++)
+	bytes += atomic_exchange_explicit(&credit[i].bytes, 0, memory_order_relaxed);
+    if (bytes) mallocator_live_sub(mallocator, bytes);
+    return bytes > 0;
+}
+
+/* Return the subtree live bytes of a tracked mallocator, excluding credit */
+static size_t mallocator_live_used(mallocator_t *mallocator)
+{
+    size_t credited = 0;
+    mallocator_credit_t *credit = atomic_load_explicit(&mallocator->credit, memory_order_acquire);
+    for (unsigned i = 0; credit && i < MALLOCATOR_CREDIT_SHARDS; i++)
+	credited += atomic_load_explicit(&credit[i].bytes, memory_order_relaxed);
+
+    const size_t live = atomic_load(&mallocator->live);
+    return live > credited ? live - credited : 0;
+}
+
+static void mallocator_limit_release_one(mallocator_t *mallocator, size_t bytes)
+{
+    const size_t chunk = mallocator_credit_chunk(mallocator);
+    mallocator_credit_t *credit = chunk ? mallocator_credit_shard(mallocator) : NULL;
+    if (credit)
+	mallocator_credit_give(mallocator, credit, bytes, chunk);
+    else
+	mallocator_live_sub(mallocator, bytes);
+}
+
+static void mallocator_limit_release_to(mallocator_t *mallocator, mallocator_t *end, size_t bytes)
+{
+    for (mallocator_t *m = mallocator; m != end; m = m->parent)
     {
-	parent->children = child->next_child;
+	if (atomic_load_explicit(&m->tracked, memory_order_relaxed))
+	    mallocator_limit_release_one(m, bytes);
     }
-    else
+}
+
+static inline void mallocator_limit_release(mallocator_t *mallocator, size_t bytes)
+{
+    if (bytes == 0 || !mallocator_tree_tracked(mallocator)) return;
+    mallocator_limit_release_to(mallocator, NULL, bytes);
+}
+
+/* Charge bytes against the limit of a tracked mallocator, failing if it would be exceeded */
+static bool mallocator_limit_reserve_one(mallocator_t *mallocator, size_t bytes)
+{
+    const size_t chunk = mallocator_credit_chunk(mallocator);
+    mallocator_credit_t *credit = chunk ? mallocator_credit_shard(mallocator) : NULL;
+    if (credit && mallocator_credit_take(credit, bytes)) return true;
+
+    /* Refill the credit along with the charge, falling back to the exact charge */
+    const size_t limit = atomic_load_explicit(&mallocator->limit, memory_order_relaxed);
+    size_t charge = credit && bytes <= SIZE_MAX - chunk ? bytes + chunk : bytes;
+    bool reclaimed = false;
+    for (;;)
     {
-	for (mallocator_t *c = parent->children; c->next_child != NULL; c = c->next_child)
+	const size_t live = atomic_fetch_add_explicit(&mallocator->live, charge, memory_order_relaxed);
+	if (!limit || (charge <= limit && live <= limit - charge))
 	{
-	    if (c->next_child == child)
-	    {
-		c->next_child = child->next_child;
-		break;
-	    }
+	    if (charge > bytes) mallocator_credit_give(mallocator, credit, charge - bytes, chunk);
+	    mallocator_live_check(mallocator, live, bytes);
+	    return true;
 	}
+	atomic_fetch_sub_explicit(&mallocator->live, charge, memory_order_relaxed);
+
+	if (charge > bytes)
+	    charge = bytes;
+	else if (reclaimed || !mallocator_credit_reclaim(mallocator))
+	    return false;
+	else
+	    reclaimed = true;
     }
 }
 
-static mallocator_t *mallocator_create_int(const char *name, mallocator_impl_t *pimpl, mallocator_t *parent)
+/* Charge bytes against all limits on the path to the root, failing if any would be exceeded */
+static inline bool mallocator_limit_reserve(mallocator_t *mallocator, size_t bytes)
 {
-    mallocator_t *mallocator = malloc(sizeof(*mallocator));
-    if (!mallocator) return NULL;
+    if (bytes == 0 || !mallocator_tree_tracked(mallocator)) return true;
 
-    mallocator_tree_t *tree;
-    if (!parent)
+    for (mallocator_t *m = mallocator; m != NULL; m = m->parent)
     {
-	tree = mallocator_tree_create(mallocator);
-	if (!tree)
+	if (!atomic_load_explicit(&m->tracked, memory_order_relaxed)) continue;
+
+	if (!mallocator_limit_reserve_one(m, bytes))
 	{
-	    free(mallocator);
-	    return NULL;
+	    mallocator_limit_release_to(mallocator, m, bytes);
+	    return false;
 	}
     }
-    else
+    return true;
+}
+
+/* Charge bytes against all limits on the path to the root, regardless of the limits */
+static inline void mallocator_limit_charge(mallocator_t *mallocator, size_t bytes)
+{
+    if (bytes == 0 || !mallocator_tree_tracked(mallocator)) return;
+
+    for (mallocator_t *m = mallocator; m != NULL; m = m->parent)
     {
-	tree = parent->tree;
+	if (!atomic_load_explicit(&m->tracked, memory_order_relaxed)) continue;
+
+	const size_t live = atomic_fetch_add_explicit(&m->live, bytes, memory_order_relaxed);
+	mallocator_live_check(m, live, bytes);
     }
+}
 
-    char *name_copy = strdup(name);
-    if (!name_copy)
+static size_t mallocator_block_size(mallocator_t *mallocator, void *ptr)
+{
+    if (mallocator->pimpl)
     {
-	free(mallocator);
-	if (!parent) mallocator_tree_destroy(tree);
-	return NULL;
+	return mallocator_impl_block_size(mallocator->pimpl, ptr);
     }
-
-    bool valid = true;
-    mallocator_init(mallocator, tree, name_copy, pimpl);
-    mallocator_tree_lock(tree);
-    if (parent)	valid = mallocator_child_add(parent, mallocator);
-    mallocator_tree_unlock(tree);
-
-    /* Check for duplicate name */
-    if (!valid)
+    else
     {
-	free(mallocator->name);
-	mallocator_fini(mallocator);
-	free(mallocator);
-	if (!parent) mallocator_tree_destroy(tree);
-	return NULL;
+	return malloc_usable_size(ptr);
     }
-    return mallocator;
 }
 
-static bool mallocator_should_destroy(mallocator_t *mallocator)
+/*
+ * Unsized frees release the block size, which for most implementations is the usable size rather
+ * than the size charged. Once a tree frees blocks unsized, tracked trees charge and release block
+ * sizes instead, so that live bytes do not drift below what is allocated.
+ */
+static inline bool mallocator_limit_by_block(mallocator_t *mallocator)
 {
-    return mallocator->ref_count == 0 && !mallocator->children;
+    return mallocator_tree_tracked(mallocator) &&
+	atomic_load_explicit(&mallocator->tree->unsized, memory_order_relaxed);
 }
 
-static void mallocator_destroy(mallocator_t *mallocator)
+/* Return the bytes charged for a block of size bytes */
+static inline size_t mallocator_limit_size(mallocator_t *mallocator, void *ptr, size_t size)
 {
-    if (mallocator->parent)
-	mallocator_child_remove(mallocator->parent, mallocator);
-
-    if (mallocator->pimpl)
-    {
-	mallocator_impl_destroy(mallocator->pimpl);
-	mallocator->pimpl = NULL;
-    }
+    if (!ptr || !mallocator_limit_by_block(mallocator)) return size;
 
-    free(mallocator->name);
-    mallocator_fini(mallocator);
-    free(mallocator);
+    const size_t block_size = mallocator_block_size(mallocator, ptr);
+    return block_size != MALLOCATOR_BLOCK_SIZE_UNKNOWN && block_size > size ? block_size : size;
 }
 
-static void mallocator_report_leaks(mallocator_t *mallocator)
+/* Return the live bytes in the subtree of mallocator. Called with tree->lock held. */
+static size_t mallocator_subtree_live(mallocator_t *mallocator)
 {
-    if (!mallocator->tree->leak_fn) return;
-
-    size_t blocks_leaked, bytes_leaked;
-    if (!mallocator_stats_leak(mallocator, &blocks_leaked, &bytes_leaked)) return;
+    mallocator_stats_t stats;
+    mallocator_stats_get(mallocator, &stats);
+    size_t live = stats.bytes_allocated > stats.bytes_freed ? stats.bytes_allocated - stats.bytes_freed : 0;
 
-    mallocator->tree->leak_fn(mallocator->tree->leak_arg, mallocator->name, blocks_leaked, bytes_leaked);
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+	live += mallocator_subtree_live(child);
+    return live;
 }
 
-static mallocator_tree_t *mallocator_destroy_ancestors(mallocator_t *mallocator)
+/* Start or stop tracking live bytes after a limit or watermark change. Called with tree->lock held. */
+static void mallocator_update_tracked(mallocator_t *mallocator)
 {
-    mallocator_tree_t *tree = mallocator->tree;
-    mallocator_t *parent = mallocator->parent;
-    mallocator_report_leaks(mallocator);
+    const bool tracked = atomic_load(&mallocator->limit) || atomic_load(&mallocator->high_watermark);
+    if (tracked == (bool) atomic_load(&mallocator->tracked)) return;
+
+    if (tracked)
+    {
+	mallocator_credit_reclaim(mallocator);
+	atomic_store(&mallocator->live, mallocator_subtree_live(mallocator));
+	atomic_fetch_add(&mallocator->tree->tracked, 1);
+    }
+    else
+    {
+	atomic_fetch_sub(&mallocator->tree->tracked, 1);
+    }
+    atomic_store(&mallocator->tracked, tracked);
+}
+
+/**************************************************************************************************/
+/* Rate limit utilities */
+
+/*
+ * Buckets are refilled lazily - admission is a compare and swap of each bucket's virtual time on
+ * the path to the root, so there are no locks or timers. Each rate is in its own cache line, and
+ * mallocators without rate limits on that path skip the walk entirely.
+ */
+
+static inline uint64_t mallocator_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Return the time in ns for units at rate, saturating */
+static inline uint64_t mallocator_bucket_cost(uint64_t rate, uint64_t units)
+{
+    const unsigned __int128 cost = (unsigned __int128) units * 1000000000 / rate;
+    return cost > UINT64_MAX / 2 ? UINT64_MAX / 2 : (uint64_t) cost;
+}
+
+static void mallocator_bucket_set(mallocator_bucket_t *bucket, uint64_t rate, uint64_t burst)
+{
+    atomic_store(&bucket->rate, rate);
+    atomic_store(&bucket->tolerance, rate ? mallocator_bucket_cost(rate, burst ? burst : rate) : 0);
+    atomic_store(&bucket->tat, 0);
+}
+
+/*
+ * Take units from bucket, returning false if they would not be available within max_delay ns.
+ * Otherwise the units are taken and the delay until they are available is returned in delay.
+ */
+static bool mallocator_bucket_take(mallocator_bucket_t *bucket, uint64_t now, uint64_t units, uint64_t max_delay,
+    uint64_t *delay)
+{
+    const uint64_t rate = atomic_load_explicit(&bucket->rate, memory_order_relaxed);
+    if (!rate || !units) return true;
+
+    const uint64_t cost = mallocator_bucket_cost(rate, units);
+    const uint64_t tolerance = atomic_load_explicit(&bucket->tolerance, memory_order_relaxed);
+    uint64_t tat = atomic_load_explicit(&bucket->tat, memory_order_relaxed);
+    uint64_t new_tat;
+    uint64_t wait;
+    do
+    {
+	/* A full bucket admits requests larger than the bucket */
+	const uint64_t start = tat > now ? tat : now;
+	new_tat = start + cost;
+	wait = tat > now && new_tat - now > tolerance ? new_tat - now - tolerance : 0;
+	if (wait > max_delay) return false;
+    }
+    while (!__atomic_compare_exchange_n(&bucket->tat, &tat, new_tat, true,
+	    memory_order_relaxed, memory_order_relaxed));
+
+    if (wait > *delay) *delay = wait;
+    return true;
+}
+
+static inline void mallocator_bucket_return(mallocator_bucket_t *bucket, uint64_t units)
+{
+    const uint64_t rate = atomic_load_explicit(&bucket->rate, memory_order_relaxed);
+    if (!rate || !units) return;
+    atomic_fetch_sub_explicit(&bucket->tat, mallocator_bucket_cost(rate, units), memory_order_relaxed);
+}
+
+static inline bool mallocator_rate_enabled(mallocator_rate_t *rate)
+{
+    return atomic_load(&rate->bytes.rate) || atomic_load(&rate->ops.rate);
+}
+
+/* Count a rate limit enabled or disabled on the path of each mallocator of the subtree. Called with tree->lock held. */
+static void mallocator_rate_update_path(mallocator_t *mallocator, bool enabled)
+{
+    if (enabled) atomic_fetch_add(&mallocator->rated, 1);
+    else atomic_fetch_sub(&mallocator->rated, 1);
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+	mallocator_rate_update_path(child, enabled);
+}
+
+static void mallocator_rate_return_to(mallocator_t *mallocator, mallocator_t *end, size_t ops, size_t bytes)
+{
+    for (mallocator_t *m = mallocator; m != end; m = m->parent)
+    {
+	mallocator_rate_t *rate = atomic_load_explicit(&m->rate, memory_order_acquire);
+	if (!rate) continue;
+	mallocator_bucket_return(&rate->ops, ops);
+	mallocator_bucket_return(&rate->bytes, bytes);
+    }
+}
+
+static void mallocator_rate_delay(unsigned policy, uint64_t now, uint64_t delay)
+{
+    if (policy == MALLOCATOR_RATE_SPIN)
+    {
+	while (mallocator_now() - now < delay)
+	    ;
+    }
+    else
+    {
+	const struct timespec ts = { .tv_sec = delay / 1000000000, .tv_nsec = delay % 1000000000 };
+	nanosleep(&ts, NULL);
+    }
+}
+
+/* Take ops and bytes from all rate limits on the path to the root, failing or delaying per policy */
+static bool mallocator_rate_admit_slow(mallocator_t *mallocator, size_t ops, size_t bytes)
+{
+    const uint64_t now = mallocator_now();
+    uint64_t delay = 0;
+    unsigned policy = MALLOCATOR_RATE_FAIL;
+    for (mallocator_t *m = mallocator; m != NULL; m = m->parent)
+    {
+	mallocator_rate_t *rate = atomic_load_explicit(&m->rate, memory_order_acquire);
+	if (!rate) continue;
+
+	const unsigned m_policy = atomic_load_explicit(&rate->policy, memory_order_relaxed);
+	const uint64_t max_delay = m_policy == MALLOCATOR_RATE_FAIL ? 0 :
+	    atomic_load_explicit(&rate->max_delay, memory_order_relaxed);
+	if (!mallocator_bucket_take(&rate->ops, now, ops, max_delay, &delay))
+	{
+	    mallocator_rate_return_to(mallocator, m, ops, bytes);
+	    return false;
+	}
+	if (!mallocator_bucket_take(&rate->bytes, now, bytes, max_delay, &delay))
+	{
+	    mallocator_bucket_return(&rate->ops, ops);
+	    mallocator_rate_return_to(mallocator, m, ops, bytes);
+	    return false;
+	}
+	if (m_policy == MALLOCATOR_RATE_SPIN) policy = m_policy;
+	else if (m_policy == MALLOCATOR_RATE_SLEEP && policy == MALLOCATOR_RATE_FAIL) policy = m_policy;
+    }
+
+    if (delay) mallocator_rate_delay(policy, now, delay);
+    return true;
+}
+
+static inline bool mallocator_rate_admit(mallocator_t *mallocator, size_t ops, size_t bytes)
+{
+    if (!atomic_load_explicit(&mallocator->rated, memory_order_relaxed)) return true;
+    return mallocator_rate_admit_slow(mallocator, ops, bytes);
+}
+
+/**************************************************************************************************/
+/* Shrink thread utilities */
+
+static void *mallocator_shrink_thread(void *arg);
+static mallocator_deferred_t *mallocator_defer_detach(mallocator_t *mallocator);
+static void mallocator_defer_cancel(mallocator_t *mallocator);
+static void mallocator_free_block(mallocator_t *mallocator, void *ptr, size_t size);
+
+static inline void mallocator_shrink_lock(mallocator_shrink_t *shrink)
+{
+    assert(pthread_mutex_lock(&shrink->lock) == 0);
+}
+
+static inline void mallocator_shrink_unlock(mallocator_shrink_t *shrink)
+{
+    assert(pthread_mutex_unlock(&shrink->lock) == 0);
+}
+
+static void mallocator_shrink_free(mallocator_shrink_t *shrink)
+{
+    assert(sem_destroy(&shrink->wake) == 0);
+    assert(pthread_cond_destroy(&shrink->cond) == 0);
+    assert(pthread_mutex_destroy(&shrink->lock) == 0);
+    free(shrink);
+}
+
+static mallocator_shrink_t *mallocator_shrink_create(mallocator_tree_t *tree)
+{
+    mallocator_shrink_t *shrink = malloc(sizeof(*shrink));
+    if (!shrink) return NULL;
+
+    assert(pthread_mutex_init(&shrink->lock, NULL) == 0);
+    assert(pthread_cond_init(&shrink->cond, NULL) == 0);
+    assert(sem_init(&shrink->wake, 0, 0) == 0);
+    shrink->tree = tree;
+    shrink->requested = 0;
+    shrink->running = false;
+    shrink->stop = false;
+    shrink->detached = false;
+    if (pthread_create(&shrink->thread, NULL, mallocator_shrink_thread, shrink) != 0)
+    {
+	mallocator_shrink_free(shrink);
+	return NULL;
+    }
+    return shrink;
+}
+
+static void mallocator_shrink_destroy(mallocator_shrink_t *shrink)
+{
+    mallocator_shrink_lock(shrink);
+    shrink->stop = true;
+
+    /* The shrink thread may release the last reference to the tree */
+    const bool self = pthread_equal(pthread_self(), shrink->thread);
+    shrink->detached = self;
+    mallocator_shrink_unlock(shrink);
+    assert(sem_post(&shrink->wake) == 0);
+
+    if (self)
+    {
+	assert(pthread_detach(shrink->thread) == 0);
+    }
+    else
+    {
+	assert(pthread_join(shrink->thread, NULL) == 0);
+	mallocator_shrink_free(shrink);
+    }
+}
+
+/**************************************************************************************************/
+/* mallocator tree hierarchy */
+
+static mallocator_tree_t *mallocator_tree_create(mallocator_t *root)
+{
+    /* Aligned for the padding of the deferred free shards */
+    mallocator_tree_t *tree = aligned_alloc(64, sizeof(*tree));
+    if (!tree) return NULL;
+    assert(pthread_mutex_init(&tree->lock, NULL) == 0);
+    tree->root = root;
+    tree->leak_fn = NULL;
+    tree->leak_arg = NULL;
+    tree->tracked = 0;
+    tree->unsized = 0;
+    tree->shrink = NULL;
+    tree->maintenance = NULL;
+    tree->graveyard = NULL;
+    tree->deferred_bytes = 0;
+    tree->defer_limit = MALLOCATOR_DEFER_LIMIT;
+    for (unsigned i = 0; i < MALLOCATOR_DEFER_SHARDS; i++)
+	tree->defer[i].head = NULL;
+    return tree;
+}
+
+static void mallocator_tree_destroy(mallocator_tree_t *tree)
+{
+    assert(tree->deferred_bytes == 0);
+
+    /* Stopped first, as the shrink thread takes the tree lock */
+    if (tree->shrink)
+    {
+	mallocator_shrink_destroy(tree->shrink);
+	tree->shrink = NULL;
+    }
+    assert(pthread_mutex_destroy(&tree->lock) == 0);
+    tree->root = NULL;
+    tree->leak_fn = NULL;
+    tree->leak_arg = NULL;
+    tree->tracked = 0;
+    free(tree);
+}
+
+static inline void mallocator_tree_lock(mallocator_tree_t *tree)
+{
+    assert(pthread_mutex_lock(&tree->lock) == 0);
+}
+
+static inline void mallocator_tree_unlock(mallocator_tree_t *tree)
+{
+    assert(pthread_mutex_unlock(&tree->lock) == 0);
+}
+
+/**************************************************************************************************/
+/* Private interface */
+
+static inline void mallocator_verify(const mallocator_t *mallocator)
+{
+    assert(mallocator);
+    assert(mallocator->ref_count > 0);
+}
+
+static void mallocator_init(mallocator_t *mallocator, mallocator_tree_t *tree, char *name, mallocator_impl_t *pimpl)
+{
+    *mallocator = (mallocator_t)
+    {
+	.tree = tree,
+	.pimpl = pimpl,
+	.ref_count = 1,
+	.name = name,
+	.parent = NULL,
+	.children = NULL,
+	.next_child = NULL,
+	.tracked = 0,
+	.live = 0,
+	.limit = 0,
+	.low_watermark = 0,
+	.high_watermark = 0,
+	.credit = NULL,
+	.shrink_pending = 0,
+	.shrink_next = NULL,
+	.shrinkers = NULL,
+	.rate = NULL,
+	.rated = 0,
+	.decay_ops = 0,
+	.decay_idle_since = 0,
+	.decayed = false,
+	.decay_next = NULL,
+	.cancelled = NULL,
+    };
+    mallocator_stats_init(&mallocator->subtree_stats);
+    mallocator_stats_coll_init(&mallocator->stats);
+}
+
+static void mallocator_fini(mallocator_t *mallocator)
+{
+    mallocator_stats_coll_fini(&mallocator->stats);
+    *mallocator = (mallocator_t)
+    {
+	.tree = NULL,
+	.pimpl = NULL,
+	.ref_count = 0,
+	.name = NULL,
+	.parent = NULL,
+	.children = NULL,
+	.next_child = NULL,
+	.tracked = 0,
+	.live = 0,
+	.limit = 0,
+	.low_watermark = 0,
+	.high_watermark = 0,
+	.credit = NULL,
+	.shrink_pending = 0,
+	.shrink_next = NULL,
+	.shrinkers = NULL,
+	.rate = NULL,
+	.rated = 0,
+	.decay_ops = 0,
+	.decay_idle_since = 0,
+	.decayed = false,
+	.decay_next = NULL,
+	.cancelled = NULL,
+    };
+}
+
+/* Return false if the child name exists */
+static bool mallocator_child_add(mallocator_t *parent, mallocator_t *child)
+{
+    if (!parent->children || strcmp(child->name, parent->children->name) < 0)
+    {
+	/* Front of list */
+	child->next_child = parent->children;
+	parent->children = child;
+    }
+    else
+    {
+	mallocator_t *curr = parent->children;
+	while (curr->next_child && strcmp(child->name, curr->next_child->name) > 0)
+	    curr = curr->next_child;
+
+	/* Check for duplicate name */
+	if (strcmp(child->name, curr->name) == 0)
+	    return false;
+
+	/* Add after curr */
+	child->next_child = curr->next_child;
+	curr->next_child = child;
+    }
+    child->parent = parent;
+    atomic_store(&child->rated, atomic_load(&parent->rated));
+    return true;
+}
+
+static void mallocator_child_remove(mallocator_t *parent, mallocator_t *child)
+{
+    if (parent->children == child)
+    {
+	parent->children = child->next_child;
+    }
+    else
+    {
+	for (mallocator_t *c = parent->children; c->next_child != NULL; c = c->next_child)
+	{
+	    if (c->next_child == child)
+	    {
+		c->next_child = child->next_child;
+		break;
+	    }
+	}
+    }
+}
+
+static mallocator_t *mallocator_create_int(const char *name, mallocator_impl_t *pimpl, mallocator_t *parent)
+{
+    mallocator_t *mallocator = aligned_alloc(_Alignof(mallocator_t), sizeof(*mallocator));
+    if (!mallocator) return NULL;
+
+    mallocator_tree_t *tree;
+    if (!parent)
+    {
+	tree = mallocator_tree_create(mallocator);
+	if (!tree)
+	{
+	    free(mallocator);
+	    return NULL;
+	}
+    }
+    else
+    {
+	tree = parent->tree;
+    }
+
+    char *name_copy = strdup(name);
+    if (!name_copy)
+    {
+	free(mallocator);
+	if (!parent) mallocator_tree_destroy(tree);
+	return NULL;
+    }
+
+    bool valid = true;
+    mallocator_init(mallocator, tree, name_copy, pimpl);
+    mallocator_tree_lock(tree);
+    if (parent)	valid = mallocator_child_add(parent, mallocator);
+    mallocator_tree_unlock(tree);
+
+    /* Check for duplicate name */
+    if (!valid)
+    {
+	free(mallocator->name);
+	mallocator_fini(mallocator);
+	free(mallocator);
+	if (!parent) mallocator_tree_destroy(tree);
+	return NULL;
+    }
+    return mallocator;
+}
+
+static bool mallocator_should_destroy(mallocator_t *mallocator)
+{
+    return mallocator->ref_count == 0 && !mallocator->children;
+}
+
+/* Free a mallocator removed from its tree */
+static void mallocator_free_int(mallocator_t *mallocator)
+{
+    free(mallocator->rate);
+    free(mallocator->credit);
+    while (mallocator->shrinkers)
+    {
+	mallocator_shrinker_t *shrinker = mallocator->shrinkers;
+	mallocator->shrinkers = shrinker->next;
+	free(shrinker);
+    }
+
+    if (mallocator->pimpl)
+    {
+	mallocator_impl_destroy(mallocator->pimpl);
+	mallocator->pimpl = NULL;
+    }
+
+    free(mallocator->name);
+    mallocator_fini(mallocator);
+    free(mallocator);
+}
+
+static void mallocator_reference_int(mallocator_t *mallocator)
+{
+    mallocator->ref_count++;
+}
+
+static void mallocator_destroy(mallocator_t *mallocator)
+{
+    mallocator_tree_t *tree = mallocator->tree;
+    if (mallocator->parent)
+	mallocator_child_remove(mallocator->parent, mallocator);
+    else
+	tree->root = NULL;
+    if (mallocator->tracked)
+	atomic_fetch_sub(&tree->tracked, 1);
+
+    /* Pending deferred frees refer to the mallocator, so are freed by mallocator_reap first */
+    mallocator->cancelled = mallocator_defer_detach(mallocator);
+
+    /* Their limits are released up the tree, so the parent is kept until then */
+    if (mallocator->parent) mallocator_reference_int(mallocator->parent);
+}
+
+static void mallocator_report_leaks(mallocator_t *mallocator)
+{
+    if (!mallocator->tree->leak_fn) return;
+
+    size_t blocks_leaked, bytes_leaked;
+    if (!mallocator_stats_leak(mallocator, &blocks_leaked, &bytes_leaked)) return;
+
+    mallocator->tree->leak_fn(mallocator->tree->leak_arg, mallocator->name, blocks_leaked, bytes_leaked);
+}
+
+/* Returns the mallocator if destroyed, to be passed to mallocator_reap once tree->lock is dropped */
+static mallocator_t *mallocator_dereference_int(mallocator_t *mallocator)
+{
+    mallocator->ref_count--;
+    if (!mallocator_should_destroy(mallocator)) return NULL;
+
+    mallocator_report_leaks(mallocator);
     mallocator_destroy(mallocator);
+    return mallocator;
+}
+
+/*
+ * Free a destroyed mallocator once its pending frees are done, then the ancestors only alive to own
+ * it, and the tree with the root. Called without tree->lock, as frees call into the implementation.
+ */
+static void mallocator_reap(mallocator_t *mallocator)
+{
+    while (mallocator)
+    {
+	mallocator_tree_t *tree = mallocator->tree;
+	mallocator_t *parent = mallocator->parent;
+	mallocator_defer_cancel(mallocator);
+
+	mallocator_tree_lock(tree);
+	mallocator_t *destroyed = parent ? mallocator_dereference_int(parent) : NULL;
+
+	/* Defer freeing, including implementation destruction, to the maintenance thread */
+	const bool graveyard = tree->maintenance != NULL;
+	if (graveyard)
+	{
+	    mallocator->next_child = tree->graveyard;
+	    tree->graveyard = mallocator;
+	}
+	mallocator_tree_unlock(tree);
+
+	if (!graveyard) mallocator_free_int(mallocator);
+	if (!parent) mallocator_tree_destroy(tree);
+	mallocator = destroyed;
+    }
+}
+
+/**************************************************************************************************/
+/* Shrinking */
+
+/*
+ * Request the shrink thread to call the shrinkers of the subtree of mallocator. Called while
+ * allocating, so takes no locks - the request is flagged on mallocator, and the shrink thread
+ * collects flagged mallocators from the tree.
+ */
+static void mallocator_shrink_request(mallocator_t *mallocator)
+{
+    if (atomic_exchange(&mallocator->shrink_pending, 1)) return;
+
+    mallocator_shrink_t *shrink = atomic_load_explicit(&mallocator->tree->shrink, memory_order_acquire);
+    if (!atomic_exchange(&shrink->requested, 1)) assert(sem_post(&shrink->wake) == 0);
+}
+
+/* Collect and reference the mallocators of the subtree requesting a shrink. Called with tree->lock held. */
+static mallocator_t *mallocator_shrink_collect(mallocator_t *mallocator, mallocator_t *list)
+{
+    if (atomic_load(&mallocator->shrink_pending))
+    {
+	mallocator_reference_int(mallocator);
+	mallocator->shrink_next = list;
+	list = mallocator;
+    }
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+	list = mallocator_shrink_collect(child, list);
+    return list;
+}
+
+/* Count or collect the shrinkers in the subtree of mallocator. Called with tree->lock held. */
+static size_t mallocator_shrinkers_collect(mallocator_t *mallocator, mallocator_shrinker_t *shrinkers)
+{
+    size_t n = 0;
+    for (mallocator_shrinker_t *shrinker = mallocator->shrinkers; shrinker != NULL; shrinker = shrinker->next)
+    {
+	if (shrinkers) shrinkers[n] = *shrinker;
+	n++;
+    }
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+	n += mallocator_shrinkers_collect(child, shrinkers ? shrinkers + n : NULL);
+    return n;
+}
+
+/* Call the shrinkers in the subtree of mallocator until live bytes would reach the low watermark */
+static void mallocator_shrink_run(mallocator_shrink_t *shrink, mallocator_t *mallocator)
+{
+    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_lock(tree);
+    const size_t live = mallocator_live_used(mallocator);
+    const size_t low = atomic_load(&mallocator->low_watermark);
+    const size_t target = live > low ? live - low : 0;
+
+    /* Copy the shrinkers so that they are called without the tree lock */
+    const size_t n = target ? mallocator_shrinkers_collect(mallocator, NULL) : 0;
+    mallocator_shrinker_t *shrinkers = n ? malloc(n * sizeof(*shrinkers)) : NULL;
+    if (shrinkers) mallocator_shrinkers_collect(mallocator, shrinkers);
+
+    /* Set while holding the tree lock so that removed shrinkers wait for this pass */
+    mallocator_shrink_lock(shrink);
+    shrink->running = true;
+    mallocator_shrink_unlock(shrink);
+    mallocator_tree_unlock(tree);
+
+    size_t released = 0;
+    for (size_t i = 0; shrinkers && i < n && released < target; i++)
+	released += shrinkers[i].fn(shrinkers[i].arg, mallocator, target - released);
+    free(shrinkers);
+
+    mallocator_shrink_lock(shrink);
+    shrink->running = false;
+    assert(pthread_cond_broadcast(&shrink->cond) == 0);
+    mallocator_shrink_unlock(shrink);
+
+    /* Rearm - the high watermark must be crossed again for another shrink */
+    atomic_store(&mallocator->shrink_pending, 0);
+
+    mallocator_tree_lock(tree);
+    mallocator_t *destroyed = mallocator_dereference_int(mallocator);
+    mallocator_tree_unlock(tree);
+
+    mallocator_reap(destroyed);
+}
+
+static void *mallocator_shrink_thread(void *arg)
+{
+    mallocator_shrink_t *shrink = arg;
+    for (;;)
+    {
+	while (sem_wait(&shrink->wake) != 0)
+	    assert(errno == EINTR);
+
+	mallocator_shrink_lock(shrink);
+	const bool stop = shrink->stop;
+	mallocator_shrink_unlock(shrink);
+	if (stop) break;
+
+	/* Requests flagged after this are seen by this collection, or post again */
+	atomic_store(&shrink->requested, 0);
+	mallocator_tree_t *tree = shrink->tree;
+	mallocator_tree_lock(tree);
+	mallocator_t *list = tree->root ? mallocator_shrink_collect(tree->root, NULL) : NULL;
+	mallocator_tree_unlock(tree);
+
+	while (list)
+	{
+	    mallocator_t *mallocator = list;
+	    list = mallocator->shrink_next;
+	    mallocator->shrink_next = NULL;
+	    mallocator_shrink_run(shrink, mallocator);
+	}
+    }
+    mallocator_shrink_lock(shrink);
+    const bool detached = shrink->detached;
+    mallocator_shrink_unlock(shrink);
+
+    if (detached) mallocator_shrink_free(shrink);
+    return NULL;
+}
+
+/**************************************************************************************************/
+/* Deferred free */
+
+static inline mallocator_defer_shard_t *mallocator_defer_shard(mallocator_tree_t *tree)
+{
+    return &tree->defer[mallocator_thread_shard() % MALLOCATOR_DEFER_SHARDS];
+}
+
+/* Queue a free, returning false if it must be made synchronously */
+static bool mallocator_defer_push(mallocator_t *mallocator, void *ptr, size_t size)
+{
+    mallocator_tree_t *tree = mallocator->tree;
+    if (size < sizeof(mallocator_deferred_t)) return false;
+
+    const size_t limit = atomic_load_explicit(&tree->defer_limit, memory_order_relaxed);
+    const size_t pending = atomic_fetch_add_explicit(&tree->deferred_bytes, size, memory_order_relaxed);
+    if (size > limit || pending > limit - size)
+    {
+	atomic_fetch_sub_explicit(&tree->deferred_bytes, size, memory_order_relaxed);
+	return false;
+    }
+    mallocator_stats_deferred(mallocator, size);
+
+    mallocator_deferred_t *deferred = ptr;
+    deferred->mallocator = mallocator;
+    deferred->size = size;
+    mallocator_defer_shard_t *shard = mallocator_defer_shard(tree);
+    deferred->next = atomic_load_explicit(&shard->head, memory_order_relaxed);
+    while (!__atomic_compare_exchange_n(&shard->head, &deferred->next, deferred, true,
+	    memory_order_release, memory_order_relaxed))
+	;
+    return true;
+}
+
+/* Free all pending deferred frees of the tree, returning the bytes freed */
+static size_t mallocator_defer_drain(mallocator_tree_t *tree)
+{
+    size_t freed = 0;
+    for (unsigned i = 0; i < MALLOCATOR_DEFER_SHARDS; i++)
+    {
+	/* Taking the whole stack avoids ABA on pop */
+	mallocator_deferred_t *deferred = NULL;
+	if (atomic_load_explicit(&tree->defer[i].head, memory_order_relaxed))
+	    deferred = atomic_exchange_explicit(&tree->defer[i].head, NULL, memory_order_acquire);
+
+	while (deferred)
+	{
+	    mallocator_deferred_t *next = deferred->next;
+	    mallocator_t *mallocator = deferred->mallocator;
+	    const size_t size = deferred->size;
+	    mallocator_free_block(mallocator, deferred, size);
+
+	    /* The mallocator may be destroyed once it has no pending frees */
+	    atomic_fetch_sub_explicit(&tree->deferred_bytes, size, memory_order_relaxed);
+	    mallocator_stats_undeferred(mallocator, size);
+	    freed += size;
+	    deferred = next;
+	}
+    }
+    return freed;
+}
+
+/*
+ * Detach the queued frees of a mallocator being destroyed, pushing back those of others. Called
+ * with tree->lock held, so only unlinks - mallocator_defer_cancel makes the frees.
+ */
+static mallocator_deferred_t *mallocator_defer_detach(mallocator_t *mallocator)
+{
+    mallocator_tree_t *tree = mallocator->tree;
+    if (!mallocator_stats_pending(mallocator)) return NULL;
+
+    mallocator_deferred_t *detached = NULL;
+    for (unsigned i = 0; i < MALLOCATOR_DEFER_SHARDS; i++)
+    {
+	mallocator_deferred_t *deferred = NULL;
+	if (atomic_load_explicit(&tree->defer[i].head, memory_order_relaxed))
+	    deferred = atomic_exchange_explicit(&tree->defer[i].head, NULL, memory_order_acquire);
+
+	mallocator_deferred_t *keep = NULL, *keep_tail = NULL;
+	while (deferred)
+	{
+	    mallocator_deferred_t *next = deferred->next;
+	    if (deferred->mallocator == mallocator)
+	    {
+		deferred->next = detached;
+		detached = deferred;
+	    }
+	    else
+	    {
+		if (!keep) keep_tail = deferred;
+		deferred->next = keep;
+		keep = deferred;
+	    }
+	    deferred = next;
+	}
+	if (keep)
+	{
+	    keep_tail->next = atomic_load_explicit(&tree->defer[i].head, memory_order_relaxed);
+	    while (!__atomic_compare_exchange_n(&tree->defer[i].head, &keep_tail->next, keep, true,
+		    memory_order_release, memory_order_relaxed))
+		;
+	}
+    }
+    return detached;
+}
+
+/* Free the frees detached from a destroyed mallocator, and wait for any popped by a concurrent drain */
+static void mallocator_defer_cancel(mallocator_t *mallocator)
+{
+    mallocator_tree_t *tree = mallocator->tree;
+    while (mallocator->cancelled)
+    {
+	mallocator_deferred_t *deferred = mallocator->cancelled;
+	mallocator->cancelled = deferred->next;
+	const size_t size = deferred->size;
+	mallocator_free_block(mallocator, deferred, size);
+	atomic_fetch_sub_explicit(&tree->deferred_bytes, size, memory_order_relaxed);
+	mallocator_stats_undeferred(mallocator, size);
+    }
+
+    while (mallocator_stats_pending(mallocator))
+	sched_yield();
+}
+
+/**************************************************************************************************/
+/* Maintenance */
+
+/* Free the mallocators of a graveyard in the order they were destroyed, children before parents */
+static void mallocator_graveyard_free(mallocator_t *graveyard)
+{
+    mallocator_t *ordered = NULL;
+    while (graveyard)
+    {
+	mallocator_t *mallocator = graveyard;
+	graveyard = mallocator->next_child;
+	mallocator->next_child = ordered;
+	ordered = mallocator;
+    }
+
+    while (ordered)
+    {
+	mallocator_t *mallocator = ordered;
+	ordered = mallocator->next_child;
+	mallocator_free_int(mallocator);
+    }
+}
+
+/*
+ * Innermost layer of an implementation, which layers forward trims to. Children of mmap and TLSF
+ * share the implementation of their parent, so each is trimmed on the node owning it.
+ */
+static mallocator_impl_t *mallocator_impl_innermost(mallocator_impl_t *impl)
+{
+    while (impl && impl->inner)
+	impl = impl->inner;
+    return impl;
+}
+
+/* Trim the process wide stdlib heap. Only heap shrinkage is visible in the bytes released. */
+static size_t mallocator_trim_heap(void)
+{
+    const size_t arena = mallinfo2().arena;
+    malloc_trim(0);
+    const size_t trimmed_arena = mallinfo2().arena;
+    return trimmed_arena < arena ? arena - trimmed_arena : 0;
+}
+
+static inline void mallocator_maintenance_lock(mallocator_maintenance_t *maintenance)
+{
+    assert(pthread_mutex_lock(&maintenance->lock) == 0);
+}
+
+static inline void mallocator_maintenance_unlock(mallocator_maintenance_t *maintenance)
+{
+    assert(pthread_mutex_unlock(&maintenance->lock) == 0);
+}
+
+static inline void mallocator_stats_add(mallocator_stats_t *stats, const mallocator_stats_t *add)
+{
+    stats->blocks_allocated += add->blocks_allocated;
+    stats->blocks_freed += add->blocks_freed;
+    stats->blocks_failed += add->blocks_failed;
+    stats->bytes_allocated += add->bytes_allocated;
+    stats->bytes_freed += add->bytes_freed;
+    stats->bytes_failed += add->bytes_failed;
+    stats->bytes_padding += add->bytes_padding;
+    stats->blocks_resized += add->blocks_resized;
+    stats->blocks_deferred += add->blocks_deferred;
+    stats->bytes_deferred += add->bytes_deferred;
+}
+
+/* Sum the stats of the subtree of mallocator. Called with tree->lock held. */
+static void mallocator_subtree_stats_int(mallocator_t *mallocator, mallocator_stats_t *stats)
+{
+    mallocator_stats_get(mallocator, stats);
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+    {
+	mallocator_stats_t child_stats;
+	mallocator_subtree_stats_int(child, &child_stats);
+	mallocator_stats_add(stats, &child_stats);
+    }
+}
+
+/*
+ * Refresh the subtree aggregates of mallocator, and add referenced mallocators with
+ * implementations which have been idle for decay ns to the trim list. Called with tree->lock held.
+ */
+/*
+ * Refresh the subtree aggregates of mallocator, adding implementations idle for decay ns to
+ * trim_list. Implementations shared with children are idle only when all their users are, so
+ * idleness is tracked on the node owning each, over the operations of all nodes sharing it.
+ * Returns the operations of mallocator and its descendants on parent_impl, if it is shared.
+ */
+static size_t mallocator_maintain(mallocator_t *mallocator, mallocator_impl_t *parent_impl, uint64_t now,
+    uint64_t decay, mallocator_t **trim_list)
+{
+    mallocator_stats_t stats;
+    mallocator_stats_get(mallocator, &stats);
+    mallocator_impl_t *impl = mallocator_impl_innermost(mallocator->pimpl);
+    size_t ops = stats.blocks_allocated + stats.blocks_freed;
+
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+    {
+	ops += mallocator_maintain(child, impl, now, decay, trim_list);
+	mallocator_stats_add(&stats, &child->subtree_stats);
+    }
+    mallocator->subtree_stats = stats;
+
+    if (!impl) return 0;
+    if (impl == parent_impl) return ops;
+
+    if (ops != mallocator->decay_ops)
+    {
+	mallocator->decay_ops = ops;
+	mallocator->decay_idle_since = now;
+	mallocator->decayed = false;
+    }
+    else if (decay && !mallocator->decayed && now - mallocator->decay_idle_since >= decay)
+    {
+	mallocator->decayed = true;
+	mallocator_reference_int(mallocator);
+	mallocator->decay_next = *trim_list;
+	*trim_list = mallocator;
+    }
+    return 0;
+}
+
+static void mallocator_maintenance_pass(mallocator_maintenance_t *maintenance, mallocator_t *root)
+{
+    mallocator_tree_t *tree = root->tree;
+    const uint64_t now = mallocator_now();
+    const uint64_t decay = (uint64_t) maintenance->config.decay_ms * 1000000;
+    mallocator_t *trim_list = NULL;
+
+    mallocator_tree_lock(tree);
+    mallocator_t *graveyard = tree->graveyard;
+    tree->graveyard = NULL;
+    mallocator_maintain(root, NULL, now, decay, &trim_list);
+    const size_t heap_ops = root->subtree_stats.blocks_allocated + root->subtree_stats.blocks_freed;
+    mallocator_tree_unlock(tree);
+
+    /* Make the frees deferred since the last pass */
+    mallocator_defer_drain(tree);
+
+    mallocator_graveyard_free(graveyard);
+
+    while (trim_list)
+    {
+	mallocator_t *mallocator = trim_list;
+	trim_list = mallocator->decay_next;
+	mallocator_impl_trim(mallocator->pimpl, maintenance->config.trim_flags);
+
+	/* The root is referenced by maintenance, so this cannot destroy the tree */
+	mallocator_tree_lock(tree);
+	mallocator->decay_next = NULL;
+	mallocator_t *destroyed = mallocator_dereference_int(mallocator);
+	mallocator_tree_unlock(tree);
+
+	mallocator_reap(destroyed);
+    }
+
+    /* The heap is shared by the whole tree, so is trimmed when the whole tree is idle */
+    if (heap_ops != maintenance->heap_ops)
+    {
+	maintenance->heap_ops = heap_ops;
+	maintenance->heap_idle_since = now;
+	maintenance->heap_decayed = false;
+    }
+    else if (decay && !maintenance->heap_decayed && now - maintenance->heap_idle_since >= decay)
+    {
+	maintenance->heap_decayed = true;
+	mallocator_trim_heap();
+    }
+}
+
+typedef struct
+{
+    mallocator_maintenance_t *maintenance;
+    mallocator_t *root;
+} mallocator_maintenance_arg_t;
+
+static void *mallocator_maintenance_thread(void *arg)
+{
+    mallocator_maintenance_t *maintenance = ((mallocator_maintenance_arg_t *) arg)->maintenance;
+    mallocator_t *root = ((mallocator_maintenance_arg_t *) arg)->root;
+    free(arg);
+
+    const uint64_t period = (uint64_t) maintenance->config.period_ms * 1000000;
+    mallocator_maintenance_lock(maintenance);
+    while (!maintenance->stop)
+    {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	const uint64_t nsec = deadline.tv_nsec + period;
+	deadline.tv_sec += nsec / 1000000000;
+	deadline.tv_nsec = nsec % 1000000000;
+	while (!maintenance->stop &&
+	    pthread_cond_timedwait(&maintenance->cond, &maintenance->lock, &deadline) == 0)
+	    ;
+	if (maintenance->stop) break;
+
+	mallocator_maintenance_unlock(maintenance);
+	mallocator_maintenance_pass(maintenance, root);
+	mallocator_maintenance_lock(maintenance);
+    }
+    mallocator_maintenance_unlock(maintenance);
+    return NULL;
+}
+
+static void mallocator_maintenance_free(mallocator_maintenance_t *maintenance)
+{
+    assert(pthread_cond_destroy(&maintenance->cond) == 0);
+    assert(pthread_mutex_destroy(&maintenance->lock) == 0);
+    free(maintenance);
+}
+
+static mallocator_maintenance_t *mallocator_maintenance_create(mallocator_t *root,
+    const mallocator_maintenance_config_t *config)
+{
+    mallocator_maintenance_t *maintenance = malloc(sizeof(*maintenance));
+    mallocator_maintenance_arg_t *arg = malloc(sizeof(*arg));
+    if (!maintenance || !arg)
+    {
+	free(maintenance);
+	free(arg);
+	return NULL;
+    }
+
+    pthread_condattr_t condattr;
+    assert(pthread_condattr_init(&condattr) == 0);
+    assert(pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC) == 0);
+    assert(pthread_mutex_init(&maintenance->lock, NULL) == 0);
+    assert(pthread_cond_init(&maintenance->cond, &condattr) == 0);
+    assert(pthread_condattr_destroy(&condattr) == 0);
+    maintenance->config = *config;
+    maintenance->stop = false;
+    maintenance->heap_ops = 0;
+    maintenance->heap_idle_since = mallocator_now();
+    maintenance->heap_decayed = false;
+    *arg = (mallocator_maintenance_arg_t) { .maintenance = maintenance, .root = root };
+
+    pthread_attr_t attr;
+    assert(pthread_attr_init(&attr) == 0);
+    bool valid = true;
+    if (config->cpu >= 0)
+    {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(config->cpu, &cpus);
+	valid = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) == 0;
+    }
+    valid = valid && pthread_create(&maintenance->thread, &attr, mallocator_maintenance_thread, arg) == 0;
+    assert(pthread_attr_destroy(&attr) == 0);
+
+    if (!valid)
+    {
+	free(arg);
+	mallocator_maintenance_free(maintenance);
+	return NULL;
+    }
+    return maintenance;
+}
+
+/**************************************************************************************************/
+/* Public interface */
+
+mallocator_t *mallocator_create(const char *name)
+{
+    return mallocator_create_int(name, NULL, NULL);
+}
+
+mallocator_t *mallocator_create_custom(const char *name, mallocator_impl_t *pimpl)
+{
+    return mallocator_create_int(name, pimpl, NULL);
+}
+
+mallocator_impl_t *mallocator_get_impl(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+    return mallocator->pimpl;
+}
+
+mallocator_t *mallocator_create_child(mallocator_t *parent, const char *name)
+{
+    mallocator_verify(parent);
+
+    mallocator_impl_t *child_pimpl = NULL;
+    if (parent->pimpl)
+    {
+	child_pimpl = mallocator_impl_create_child(parent->pimpl, name);
+	if (!child_pimpl)
+	    return NULL;
+    }
+
+    mallocator_t *child = mallocator_create_int(name, child_pimpl, parent);
+    if (!child)
+    {
+	if (child_pimpl)
+	    mallocator_impl_destroy(child_pimpl);
+	return NULL;
+    }
+    return child;
+}
+
+mallocator_t *mallocator_create_child_custom(mallocator_t *parent, const char *name, mallocator_impl_t *pimpl)
+{
+    mallocator_verify(parent);
+    return mallocator_create_int(name, pimpl, parent);
+}
+
+void mallocator_reference(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_tree_lock(mallocator->tree);
+    mallocator_reference_int(mallocator);
+    mallocator_tree_unlock(mallocator->tree);
+}
+
+void mallocator_dereference(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_lock(tree);
+    mallocator_t *destroyed = mallocator_dereference_int(mallocator);
+    mallocator_tree_unlock(tree);
+
+    mallocator_reap(destroyed);
+}
+
+const char *mallocator_name(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+    return mallocator->name;
+}
+
+const char *mallocator_full_name(mallocator_t *mallocator, char *buf, size_t buf_len)
+{
+    mallocator_verify(mallocator);
+    if (mallocator->parent)
+    {
+	mallocator_full_name(mallocator->parent, buf, buf_len);
+	strcat(buf, ".");
+	strcat(buf, mallocator->name);
+    }
+    else
+    {
+	strcpy(buf, mallocator->name);
+    }
+    return buf;
+}
+
+mallocator_t *mallocator_parent(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+
+    /* parent->ref_count may be 0 - use internal reference to avoid assertion */
+    mallocator_tree_lock(mallocator->tree);
+    if (mallocator->parent) mallocator_reference_int(mallocator->parent);
+    mallocator_tree_unlock(mallocator->tree);
+    return mallocator->parent;
+}
+
+mallocator_t *mallocator_child_begin(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_tree_lock(mallocator->tree);
+    mallocator_t *child = mallocator->children;
+    if (child) mallocator_reference_int(child);
+    mallocator_tree_unlock(mallocator->tree);
+    return child;
+}
+
+mallocator_t *mallocator_child_next(mallocator_t *mallocator)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_lock(tree);
+    mallocator_t *next = mallocator->next_child;
+    if (next) mallocator_reference_int(next);
+    mallocator_t *destroyed = mallocator_dereference_int(mallocator);
+    mallocator_tree_unlock(tree);
+
+    mallocator_reap(destroyed);
+    return next;
+}
+
+mallocator_t *mallocator_child_lookup(mallocator_t *mallocator, const char *name)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_t *lookup = NULL;
+    mallocator_tree_lock(mallocator->tree);
+    for (mallocator_t *child = mallocator->children;
+	 child != NULL;
+	 child = child->next_child)
+    {
+	const int res = strcmp(child->name, name);
+	if (res == 0)
+	{
+	    lookup = child;
+	    mallocator_reference_int(child);
+	    break;
+	}
+	else if (res > 0)
+	{
+	    break;
+	}
+    }
+    mallocator_tree_unlock(mallocator->tree);
+    return lookup;
+}
+
+void mallocator_iterate(mallocator_t *mallocator, mallocator_iter_fn fn, void *arg)
+{
+    mallocator_verify(mallocator);
+
+    for (mallocator_t *child = mallocator_child_begin(mallocator);
+	 child != NULL;
+	 child = mallocator_child_next(child))
+    {
+	fn(arg, child);
+    }
+}
+
+void mallocator_stats(mallocator_t *mallocator, mallocator_stats_t *stats)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_stats_get(mallocator, stats);
+}
+
+void mallocator_subtree_stats(mallocator_t *mallocator, mallocator_stats_t *stats)
+{
+    mallocator_verify(mallocator);
+
+    mallocator_tree_lock(mallocator->tree);
+    if (mallocator->tree->maintenance)
+	*stats = mallocator->subtree_stats;
+    else
+	mallocator_subtree_stats_int(mallocator, stats);
+    mallocator_tree_unlock(mallocator->tree);
+}
+
+void *mallocator_malloc(mallocator_t *mallocator, size_t size)
+{
+    mallocator_verify(mallocator);
+
+    void *ptr = NULL;
+    if (mallocator_rate_admit(mallocator, 1, size) && mallocator_limit_reserve(mallocator, size))
+    {
+	if (mallocator->pimpl)
+	{
+	    ptr = mallocator_impl_malloc(mallocator->pimpl, size);
+	}
+	else
+	{
+	    ptr = malloc(size);
+	}
+	if (!ptr) mallocator_limit_release(mallocator, size);
+    }
+
+    if (ptr)
+    {
+	mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, ptr, size) - size);
+	mallocator_stats_allocated(mallocator, size);
+    }
+    else
+    {
+	mallocator_stats_failed(mallocator, size);
+    }
+    return ptr;
+}
+
+void *mallocator_calloc(mallocator_t *mallocator, size_t nmemb, size_t size)
+{
+    mallocator_verify(mallocator);
+
+    void *ptr = NULL;
+    if (mallocator_rate_admit(mallocator, 1, nmemb * size) && mallocator_limit_reserve(mallocator, nmemb * size))
+    {
+	if (mallocator->pimpl)
+	{
+	    ptr = mallocator_impl_calloc(mallocator->pimpl, nmemb, size);
+	}
+	else
+	{
+	    ptr = calloc(nmemb, size);
+	}
+	if (!ptr) mallocator_limit_release(mallocator, nmemb * size);
+    }
+
+    if (ptr)
+    {
+	mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, ptr, nmemb * size) - nmemb * size);
+	mallocator_stats_allocated(mallocator, nmemb * size);
+    }
+    else
+    {
+	mallocator_stats_failed(mallocator, nmemb * size);
+    }
+    return ptr;
+}
+
+void *mallocator_malloc_at_least(mallocator_t *mallocator, size_t size, size_t *actual)
+{
+    mallocator_verify(mallocator);
+
+    void *ptr = NULL;
+    if (mallocator_rate_admit(mallocator, 1, size) && mallocator_limit_reserve(mallocator, size))
+    {
+	if (mallocator->pimpl)
+	{
+	    ptr = mallocator_impl_malloc_at_least(mallocator->pimpl, size, actual);
+	}
+	else
+	{
+	    ptr = malloc(size);
+	    *actual = ptr ? malloc_usable_size(ptr) : 0;
+	}
+	if (!ptr) mallocator_limit_release(mallocator, size);
+    }
+
+    if (ptr)
+    {
+	/* Slack is charged unconditionally, as it is counted as allocated */
+	mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, ptr, *actual) - size);
+	mallocator_stats_allocated(mallocator, *actual);
+    }
+    else
+    {
+	*actual = 0;
+	mallocator_stats_failed(mallocator, size);
+    }
+    return ptr;
+}
+
+size_t mallocator_usable_size(mallocator_t *mallocator, void *ptr, size_t size)
+{
+    mallocator_verify(mallocator);
+
+    if (!ptr) return 0;
+    if (mallocator->pimpl)
+    {
+	return mallocator_impl_usable_size(mallocator->pimpl, ptr, size);
+    }
+    else
+    {
+	return malloc_usable_size(ptr);
+    }
+}
+
+void *mallocator_aligned_alloc(mallocator_t *mallocator, size_t alignment, size_t size)
+{
+    mallocator_verify(mallocator);
+
+    void *ptr = NULL;
+    if (alignment > 0 && (alignment & (alignment - 1)) == 0 &&
+	mallocator_rate_admit(mallocator, 1, size) && mallocator_limit_reserve(mallocator, size))
+    {
+	if (mallocator->pimpl)
+	{
+	    ptr = mallocator_impl_aligned_alloc(mallocator->pimpl, alignment, size);
+	}
+	else
+	{
+	    ptr = aligned_alloc(alignment, size);
+	}
+	if (!ptr) mallocator_limit_release(mallocator, size);
+    }
+
+    if (ptr)
+    {
+	mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, ptr, size) - size);
+	mallocator_stats_allocated(mallocator, size);
+	mallocator_stats_padded(mallocator, mallocator_usable_size(mallocator, ptr, size) - size);
+    }
+    else
+    {
+	mallocator_stats_failed(mallocator, size);
+    }
+    return ptr;
+}
+
+void *mallocator_realloc(mallocator_t *mallocator, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_verify(mallocator);
+
+    /* Only growth is reserved - the old block remains charged on failure */
+    const size_t growth = new_size > size ? new_size - size : 0;
+    void *new_ptr = NULL;
+    if (mallocator_rate_admit(mallocator, new_size ? 1 : 0, new_size) && mallocator_limit_reserve(mallocator, growth))
+    {
+	const size_t charged = mallocator_limit_size(mallocator, ptr, size);
+	if (mallocator->pimpl)
+	{
+	    new_ptr = mallocator_impl_realloc(mallocator->pimpl, ptr, size, new_size);
+	}
+	else
+	{
+	    new_ptr = realloc(ptr, new_size);
+	}
+
+	if (new_ptr || new_size == 0)
+	{
+	    mallocator_limit_release(mallocator, charged - (new_size - growth));
+	    mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, new_ptr, new_size) - new_size);
+	}
+	else
+	{
+	    mallocator_limit_release(mallocator, growth);
+	}
+    }
+
+    if ((!new_ptr || new_size > 0) && size > 0)
+    {
+	mallocator_stats_freed(mallocator, size);
+    }
+    if (new_size > 0)
+    {
+	if (new_ptr)
+	{
+	    mallocator_stats_allocated(mallocator, new_size);
+	}
+	else
+	{
+	    mallocator_stats_failed(mallocator, new_size);
+	}
+    }
+    return new_ptr;
+}
 
-    /* Root node - return the tree for destruction */
-    if (!parent) return tree;
+bool mallocator_try_expand(mallocator_t *mallocator, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_verify(mallocator);
+    assert(ptr);
+    assert(new_size >= size);
 
-    /* Is this parent only alive to own this child? */
-    if (!mallocator_should_destroy(parent)) return NULL;
+    bool expanded = false;
+    if (mallocator_rate_admit(mallocator, 1, new_size - size) && mallocator_limit_reserve(mallocator, new_size - size))
+    {
+	const size_t charged = mallocator_limit_size(mallocator, ptr, size);
+	if (mallocator->pimpl)
+	{
+	    expanded = mallocator_impl_try_expand(mallocator->pimpl, ptr, size, new_size);
+	}
+	else
+	{
+	    expanded = malloc_usable_size(ptr) >= new_size;
+	}
+	if (expanded)
+	{
+	    mallocator_limit_release(mallocator, charged - size);
+	    mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, ptr, new_size) - new_size);
+	}
+	else
+	{
+	    mallocator_limit_release(mallocator, new_size - size);
+	}
+    }
 
-    /* Destroy all ancestors */
-    return mallocator_destroy_ancestors(parent);
+    if (expanded)
+    {
+	mallocator_stats_resized(mallocator, new_size - size);
+    }
+    return expanded;
 }
 
-static void mallocator_reference_int(mallocator_t *mallocator)
+void mallocator_free(mallocator_t *mallocator, void *ptr, size_t size)
 {
-    mallocator->ref_count++;
+    mallocator_verify(mallocator);
+    mallocator_free_block(mallocator, ptr, size);
 }
 
-static mallocator_tree_t *mallocator_dereference_int(mallocator_t *mallocator)
+static void mallocator_free_block(mallocator_t *mallocator, void *ptr, size_t size)
 {
-    mallocator->ref_count--;
-    if (!mallocator_should_destroy(mallocator)) return NULL;
+    /* Nothing was charged for a failed allocation */
+    const size_t charged = ptr ? mallocator_limit_size(mallocator, ptr, size) : 0;
+    if (mallocator->pimpl)
+    {
+	mallocator_impl_free(mallocator->pimpl, ptr, size);
+    }
+    else
+    {
+	free(ptr);
+    }
 
-    /* Destroy all ancestors */
-    return mallocator_destroy_ancestors(mallocator);
+    mallocator_limit_release(mallocator, charged);
+    mallocator_stats_freed(mallocator, size);
 }
 
-/**************************************************************************************************/
-/* Public interface */
+void mallocator_free_deferred(mallocator_t *mallocator, void *ptr, size_t size)
+{
+    mallocator_verify(mallocator);
+    if (!ptr) return;
 
-mallocator_t *mallocator_create(const char *name)
+    if (!mallocator_defer_push(mallocator, ptr, size))
+	mallocator_free(mallocator, ptr, size);
+}
+
+size_t mallocator_drain_deferred(mallocator_t *mallocator)
 {
-    return mallocator_create_int(name, NULL, NULL);
+    mallocator_verify(mallocator);
+    return mallocator_defer_drain(mallocator->tree);
 }
 
-mallocator_t *mallocator_create_custom(const char *name, mallocator_impl_t *pimpl)
+void mallocator_set_defer_limit(mallocator_t *mallocator, size_t limit)
 {
-    return mallocator_create_int(name, pimpl, NULL);
+    mallocator_verify(mallocator);
+    atomic_store(&mallocator->tree->defer_limit, limit);
 }
 
-mallocator_t *mallocator_create_child(mallocator_t *parent, const char *name)
+/* Return the bytes of n blocks of size bytes, saturating at SIZE_MAX */
+static inline size_t mallocator_batch_bytes(size_t size, size_t n)
 {
-    mallocator_verify(parent);
+    return size && n > SIZE_MAX / size ? SIZE_MAX : n * size;
+}
 
-    mallocator_impl_t *child_pimpl = NULL;
-    if (parent->pimpl)
+size_t mallocator_malloc_batch(mallocator_t *mallocator, size_t size, size_t n, void **ptrs)
+{
+    mallocator_verify(mallocator);
+
+    /* The whole batch is reserved up front, so fails if it does not fit within the limits */
+    const size_t bytes = mallocator_batch_bytes(size, n);
+    size_t allocated = 0;
+    if (bytes < SIZE_MAX && mallocator_rate_admit(mallocator, n, bytes) && mallocator_limit_reserve(mallocator, bytes))
     {
-	child_pimpl = mallocator_impl_create_child(parent->pimpl, name);
-	if (!child_pimpl)
-	    return NULL;
+	if (mallocator->pimpl)
+	{
+	    allocated = mallocator_impl_malloc_batch(mallocator->pimpl, size, n, ptrs);
+	}
+	else
+	{
+	    for (allocated = 0; allocated < n; allocated++)
+	    {
+		ptrs[allocated] = malloc(size);
+		if (!ptrs[allocated]) break;
+	    }
+	}
+	mallocator_limit_release(mallocator, (n - allocated) * size);
+	if (mallocator_limit_by_block(mallocator))
+	{
+	    for (size_t i = 0; i < allocated; i++)
+		mallocator_limit_charge(mallocator, mallocator_limit_size(mallocator, ptrs[i], size) - size);
+	}
     }
 
-    mallocator_t *child = mallocator_create_int(name, child_pimpl, parent);
-    if (!child)
+    if (allocated > 0)
     {
-	if (child_pimpl)
-	    mallocator_impl_destroy(child_pimpl);
-	return NULL;
+	mallocator_stats_allocated_n(mallocator, allocated, allocated * size);
     }
-    return child;
+    if (allocated < n)
+    {
+	mallocator_stats_failed_n(mallocator, n - allocated, mallocator_batch_bytes(size, n - allocated));
+    }
+    return allocated;
 }
 
-void mallocator_reference(mallocator_t *mallocator)
+void mallocator_free_batch(mallocator_t *mallocator, void **ptrs, size_t size, size_t n)
 {
     mallocator_verify(mallocator);
 
-    mallocator_tree_lock(mallocator->tree);
-    mallocator_reference_int(mallocator);
-    mallocator_tree_unlock(mallocator->tree);
+    /* A batch which could have been allocated */
+    const size_t bytes = mallocator_batch_bytes(size, n);
+    assert(bytes < SIZE_MAX);
+    size_t charged = bytes;
+    if (mallocator_limit_by_block(mallocator))
+    {
+	for (size_t i = 0; i < n; i++)
+	    charged += mallocator_limit_size(mallocator, ptrs[i], size) - size;
+    }
+    if (mallocator->pimpl)
+    {
+	mallocator_impl_free_batch(mallocator->pimpl, ptrs, size, n);
+    }
+    else
+    {
+	for (size_t i = 0; i < n; i++)
+	{
+	    free(ptrs[i]);
+	}
+    }
+
+    mallocator_limit_release(mallocator, charged);
+    mallocator_stats_freed_n(mallocator, n, bytes);
 }
 
-void mallocator_dereference(mallocator_t *mallocator)
+/* Take back the credit of the subtree of mallocator. Called with tree->lock held. */
+static void mallocator_credit_reclaim_subtree(mallocator_t *mallocator)
 {
-    mallocator_verify(mallocator);
+    mallocator_credit_reclaim(mallocator);
+    for (mallocator_t *child = mallocator->children; child != NULL; child = child->next_child)
+	mallocator_credit_reclaim_subtree(child);
+}
 
+/* Return the size of a block to be freed unsized, switching the tree to charge block sizes */
+static size_t mallocator_unsized(mallocator_t *mallocator, void *ptr)
+{
     mallocator_tree_t *tree = mallocator->tree;
-    mallocator_tree_lock(tree);
-    mallocator_tree_t *destroy_tree = mallocator_dereference_int(mallocator);
-    mallocator_tree_unlock(tree);
-
-    if (destroy_tree) mallocator_tree_destroy(destroy_tree);
+    const size_t size = mallocator_block_size(mallocator, ptr);
+    if (size != MALLOCATOR_BLOCK_SIZE_UNKNOWN && !atomic_load_explicit(&tree->unsized, memory_order_relaxed) &&
+	!atomic_exchange(&tree->unsized, 1) && atomic_load(&tree->tracked))
+    {
+	/* Limits are charged exactly from now on */
+	mallocator_tree_lock(tree);
+	if (tree->root) mallocator_credit_reclaim_subtree(tree->root);
+	mallocator_tree_unlock(tree);
+    }
+    return size;
 }
 
-const char *mallocator_name(mallocator_t *mallocator)
+bool mallocator_free_unsized(mallocator_t *mallocator, void *ptr)
 {
     mallocator_verify(mallocator);
-    return mallocator->name;
+
+    if (!ptr) return true;
+    const size_t size = mallocator_unsized(mallocator, ptr);
+    if (size == MALLOCATOR_BLOCK_SIZE_UNKNOWN) return false;
+    mallocator_free(mallocator, ptr, size);
+    return true;
 }
 
-const char *mallocator_full_name(mallocator_t *mallocator, char *buf, size_t buf_len)
+void *mallocator_realloc_unsized(mallocator_t *mallocator, void *ptr, size_t new_size)
 {
     mallocator_verify(mallocator);
-    if (mallocator->parent)
-    {
-	mallocator_full_name(mallocator->parent, buf, buf_len);
-	strcat(buf, ".");
-	strcat(buf, mallocator->name);
-    }
-    else
+
+    const size_t size = ptr ? mallocator_unsized(mallocator, ptr) : 0;
+    if (size == MALLOCATOR_BLOCK_SIZE_UNKNOWN) return NULL;
+    return mallocator_realloc(mallocator, ptr, size, new_size);
+}
+
+static size_t mallocator_trim_subtree(mallocator_t *mallocator, mallocator_impl_t *parent_impl, unsigned flags)
+{
+    mallocator_impl_t *impl = mallocator_impl_innermost(mallocator->pimpl);
+    size_t released = impl && impl != parent_impl ? mallocator_impl_trim(mallocator->pimpl, flags) : 0;
+    for (mallocator_t *child = mallocator_child_begin(mallocator);
+	 child != NULL;
+	 child = mallocator_child_next(child))
     {
-	strcpy(buf, mallocator->name);
+	released += mallocator_trim_subtree(child, impl, flags);
     }
-    return buf;
+    return released;
 }
 
-mallocator_t *mallocator_parent(mallocator_t *mallocator)
+size_t mallocator_trim(mallocator_t *mallocator, unsigned flags)
 {
     mallocator_verify(mallocator);
 
-    /* parent->ref_count may be 0 - use internal reference to avoid assertion */
-    mallocator_tree_lock(mallocator->tree);
-    if (mallocator->parent) mallocator_reference_int(mallocator->parent);
-    mallocator_tree_unlock(mallocator->tree);
-    return mallocator->parent;
+    return mallocator_trim_subtree(mallocator, NULL, flags) + mallocator_trim_heap();
 }
 
-mallocator_t *mallocator_child_begin(mallocator_t *mallocator)
+bool mallocator_maintenance_start(mallocator_t *root, const mallocator_maintenance_config_t *config)
 {
-    mallocator_verify(mallocator);
+    mallocator_verify(root);
+    assert(!root->parent);
+    assert(config && config->period_ms > 0);
 
-    mallocator_tree_lock(mallocator->tree);
-    mallocator_t *child = mallocator->children;
-    if (child) mallocator_reference_int(child);
-    mallocator_tree_unlock(mallocator->tree);
-    return child;
+    mallocator_tree_t *tree = root->tree;
+    mallocator_tree_lock(tree);
+    bool started = false;
+    if (!tree->maintenance)
+    {
+	/* Aggregates are valid from the start, and the thread's first pass waits for the lock */
+	mallocator_maintain(root, NULL, mallocator_now(), 0, NULL);
+	tree->maintenance = mallocator_maintenance_create(root, config);
+	started = tree->maintenance != NULL;
+	if (started) mallocator_reference_int(root);
+    }
+    mallocator_tree_unlock(tree);
+    return started;
 }
 
-mallocator_t *mallocator_child_next(mallocator_t *mallocator)
+void mallocator_maintenance_stop(mallocator_t *root)
 {
-    mallocator_verify(mallocator);
+    mallocator_verify(root);
 
-    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_t *tree = root->tree;
     mallocator_tree_lock(tree);
-    mallocator_t *next = mallocator->next_child;
-    if (next) mallocator_reference_int(next);
-    mallocator_tree_t *destroy_tree = mallocator_dereference_int(mallocator);
+    mallocator_maintenance_t *maintenance = tree->maintenance;
+    tree->maintenance = NULL;
+    mallocator_t *graveyard = tree->graveyard;
+    tree->graveyard = NULL;
     mallocator_tree_unlock(tree);
+    if (!maintenance) return;
 
-    if (destroy_tree) mallocator_tree_destroy(destroy_tree);
-    return next;
+    mallocator_maintenance_lock(maintenance);
+    maintenance->stop = true;
+    assert(pthread_cond_broadcast(&maintenance->cond) == 0);
+    mallocator_maintenance_unlock(maintenance);
+    assert(pthread_join(maintenance->thread, NULL) == 0);
+    mallocator_maintenance_free(maintenance);
+
+    mallocator_graveyard_free(graveyard);
+
+    mallocator_dereference(root);
 }
 
-mallocator_t *mallocator_child_lookup(mallocator_t *mallocator, const char *name)
+void mallocator_set_limit(mallocator_t *mallocator, size_t limit)
 {
     mallocator_verify(mallocator);
 
-    mallocator_t *lookup = NULL;
     mallocator_tree_lock(mallocator->tree);
-    for (mallocator_t *child = mallocator->children;
-	 child != NULL;
-	 child = child->next_child)
+
+    /*
+     * Credit is kept until mallocator is destroyed, as it may be in use without the tree lock.
+     * Without it, the limit is charged exactly.
+     */
+    if (limit && !mallocator->credit)
     {
-	const int res = strcmp(child->name, name);
-	if (res == 0)
-	{
-	    lookup = child;
-	    mallocator_reference_int(child);
-	    break;
-	}
-	else if (res > 0)
+	mallocator_credit_t *credit = aligned_alloc(_Alignof(mallocator_credit_t), MALLOCATOR_CREDIT_SHARDS * sizeof(*credit));
+	if (credit)
 	{
-	    break;
+	    for (unsigned i = 0; i < MALLOCATOR_CREDIT_SHARDS; i++)
+		credit[i] = (mallocator_credit_t) { .bytes = 0 };
+	    atomic_store_explicit(&mallocator->credit, credit, memory_order_release);
 	}
     }
+    atomic_store(&mallocator->limit, limit);
+    mallocator_update_tracked(mallocator);
     mallocator_tree_unlock(mallocator->tree);
-    return lookup;
 }
 
-void mallocator_iterate(mallocator_t *mallocator, mallocator_iter_fn fn, void *arg)
+size_t mallocator_limit(mallocator_t *mallocator, size_t *used)
 {
     mallocator_verify(mallocator);
 
-    for (mallocator_t *child = mallocator_child_begin(mallocator);
-	 child != NULL;
-	 child = mallocator_child_next(child))
-    {
-	fn(arg, child);
-    }
+    const size_t limit = atomic_load(&mallocator->limit);
+    if (used) *used = limit ? mallocator_live_used(mallocator) : 0;
+    return limit;
 }
 
-void mallocator_stats(mallocator_t *mallocator, mallocator_stats_t *stats)
+bool mallocator_set_watermarks(mallocator_t *mallocator, size_t low, size_t high)
 {
     mallocator_verify(mallocator);
+    assert(low <= high);
 
-    mallocator_stats_get(mallocator, stats);
+    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_lock(tree);
+    if (high && !tree->shrink)
+    {
+	mallocator_shrink_t *shrink = mallocator_shrink_create(tree);
+	if (!shrink)
+	{
+	    mallocator_tree_unlock(tree);
+	    return false;
+	}
+	atomic_store_explicit(&tree->shrink, shrink, memory_order_release);
+    }
+    atomic_store(&mallocator->low_watermark, low);
+    atomic_store(&mallocator->high_watermark, high);
+    mallocator_update_tracked(mallocator);
+
+    /* Watermarks are checked on live, so it no longer includes credit */
+    if (high) mallocator_credit_reclaim(mallocator);
+    const bool above = high && atomic_load(&mallocator->live) >= high;
+    mallocator_tree_unlock(tree);
+
+    if (above) mallocator_shrink_request(mallocator);
+    return true;
 }
 
-void *mallocator_malloc(mallocator_t *mallocator, size_t size)
+bool mallocator_add_shrinker(mallocator_t *mallocator, mallocator_shrinker_fn fn, void *arg)
 {
     mallocator_verify(mallocator);
 
-    void *ptr;
-    if (mallocator->pimpl)
-    {
-	ptr = mallocator_impl_malloc(mallocator->pimpl, size);
-    }
-    else
-    {
-	ptr = malloc(size);
-    }
+    mallocator_shrinker_t *shrinker = malloc(sizeof(*shrinker));
+    if (!shrinker) return false;
 
-    if (ptr)
-    {
-	mallocator_stats_allocated(mallocator, size);
-    }
-    else
-    {
-	mallocator_stats_failed(mallocator, size);
-    }
-    return ptr;
+    mallocator_tree_lock(mallocator->tree);
+    *shrinker = (mallocator_shrinker_t) { .next = mallocator->shrinkers, .fn = fn, .arg = arg };
+    mallocator->shrinkers = shrinker;
+    mallocator_tree_unlock(mallocator->tree);
+    return true;
 }
 
-void *mallocator_calloc(mallocator_t *mallocator, size_t nmemb, size_t size)
+void mallocator_remove_shrinker(mallocator_t *mallocator, mallocator_shrinker_fn fn, void *arg)
 {
     mallocator_verify(mallocator);
 
-    void *ptr;
-    if (mallocator->pimpl)
-    {
-	ptr = mallocator_impl_calloc(mallocator->pimpl, nmemb, size);
-    }
-    else
+    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_lock(tree);
+    for (mallocator_shrinker_t **p = &mallocator->shrinkers; *p != NULL; p = &(*p)->next)
     {
-	ptr = calloc(nmemb, size);
+	mallocator_shrinker_t *shrinker = *p;
+	if (shrinker->fn == fn && shrinker->arg == arg)
+	{
+	    *p = shrinker->next;
+	    free(shrinker);
+	    break;
+	}
     }
+    mallocator_shrink_t *shrink = tree->shrink;
+    mallocator_tree_unlock(tree);
 
-    if (ptr)
-    {
-	mallocator_stats_allocated(mallocator, nmemb * size);
-    }
-    else
+    /* Wait for a pass which may be calling the shrinker, unless called from that pass */
+    if (shrink && !pthread_equal(pthread_self(), shrink->thread))
     {
-	mallocator_stats_failed(mallocator, nmemb * size);
+	mallocator_shrink_lock(shrink);
+	while (shrink->running)
+	    assert(pthread_cond_wait(&shrink->cond, &shrink->lock) == 0);
+	mallocator_shrink_unlock(shrink);
     }
-    return ptr;
 }
 
-void *mallocator_realloc(mallocator_t *mallocator, void *ptr, size_t size, size_t new_size)
+bool mallocator_set_rate_limit(mallocator_t *mallocator, const mallocator_rate_limit_t *rate_limit)
 {
     mallocator_verify(mallocator);
 
-    void *new_ptr;
-    if (mallocator->pimpl)
-    {
-	new_ptr = mallocator_impl_realloc(mallocator->pimpl, ptr, size, new_size);
-    }
-    else
-    {
-	new_ptr = realloc(ptr, new_size);
-    }
-
-    if ((!new_ptr || new_size > 0) && size > 0)
-    {
-	mallocator_stats_freed(mallocator, size);
-    }
-    if (new_size > 0)
+    mallocator_tree_t *tree = mallocator->tree;
+    mallocator_tree_lock(tree);
+    mallocator_rate_t *rate = mallocator->rate;
+    if (!rate)
     {
-	if (new_ptr)
+	if (!rate_limit)
 	{
-	    mallocator_stats_allocated(mallocator, new_size);
+	    mallocator_tree_unlock(tree);
+	    return true;
 	}
-	else
+	rate = aligned_alloc(_Alignof(mallocator_rate_t), sizeof(*rate));
+	if (!rate)
 	{
-	    mallocator_stats_failed(mallocator, new_size);
+	    mallocator_tree_unlock(tree);
+	    return false;
 	}
+	*rate = (mallocator_rate_t) { .policy = MALLOCATOR_RATE_FAIL };
+	atomic_store_explicit(&mallocator->rate, rate, memory_order_release);
     }
-    return new_ptr;
-}
-
-void mallocator_free(mallocator_t *mallocator, void *ptr, size_t size)
-{
-    mallocator_verify(mallocator);
 
-    if (mallocator->pimpl)
+    /* The rate is kept until mallocator is destroyed, as it may be in use without the tree lock */
+    const bool was_enabled = mallocator_rate_enabled(rate);
+    if (rate_limit)
     {
-	mallocator_impl_free(mallocator->pimpl, ptr, size);
+	atomic_store(&rate->policy, rate_limit->policy);
+	atomic_store(&rate->max_delay, rate_limit->max_delay_ns);
+	mallocator_bucket_set(&rate->bytes, rate_limit->bytes_per_sec, rate_limit->burst_bytes);
+	mallocator_bucket_set(&rate->ops, rate_limit->ops_per_sec, rate_limit->burst_ops);
     }
     else
     {
-	free(ptr);
+	mallocator_bucket_set(&rate->bytes, 0, 0);
+	mallocator_bucket_set(&rate->ops, 0, 0);
     }
 
-    mallocator_stats_freed(mallocator, size);
+    const bool enabled = mallocator_rate_enabled(rate);
+    if (enabled != was_enabled) mallocator_rate_update_path(mallocator, enabled);
+    mallocator_tree_unlock(tree);
+    return true;
 }
 
 void mallocator_set_leak_reporter(mallocator_t *mallocator, mallocator_leak_reporter_fn fn, void *arg)
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+
+#include "mallocator_header.h"
+#include "mallocator.h"
+#include "mallocator_impl.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef struct
+{
+    size_t size;		/* Allocated size */
+    size_t offset;		/* Offset of the header within the underlying block */
+} mallocator_header_block_t;
+
+_Static_assert(sizeof(mallocator_header_block_t) == MALLOCATOR_HEADER_SIZE, "header size");
+
+typedef struct
+{
+    mallocator_impl_t impl;
+} mallocator_header_t;
+
+/**************************************************************************************************/
+/* mallocator_t interface */
+
+static mallocator_impl_t *mallocator_header_create_child(void *parent_obj, const char *name);
+static void mallocator_header_destroy(void *obj);
+static void *mallocator_header_malloc(void *obj, size_t size);
+static void *mallocator_header_calloc(void *obj, size_t nmemb, size_t size);
+static void *mallocator_header_realloc(void *obj, void *ptr, size_t size, size_t new_size);
+static void mallocator_header_free(void *obj, void *p, size_t size);
+static void *mallocator_header_aligned_alloc(void *obj, size_t alignment, size_t size);
+static size_t mallocator_header_usable_size(void *obj, void *ptr, size_t size);
+static void *mallocator_header_malloc_at_least(void *obj, size_t size, size_t *actual);
+static bool mallocator_header_try_expand(void *obj, void *ptr, size_t size, size_t new_size);
+static size_t mallocator_header_block_size(void *obj, void *ptr);
+static size_t mallocator_header_trim(void *obj, unsigned flags);
+
+static mallocator_interface_t mallocator_header_interface =
+{
+    .create_child = mallocator_header_create_child,
+    .destroy = mallocator_header_destroy,
+    .malloc = mallocator_header_malloc,
+    .calloc = mallocator_header_calloc,
+    .realloc = mallocator_header_realloc,
+    .free = mallocator_header_free,
+    .aligned_alloc = mallocator_header_aligned_alloc,
+    .usable_size = mallocator_header_usable_size,
+    .malloc_at_least = mallocator_header_malloc_at_least,
+    .try_expand = mallocator_header_try_expand,
+    .block_size = mallocator_header_block_size,
+    .trim = mallocator_header_trim,
+};
+
+/**************************************************************************************************/
+/* Block utils */
+
+static inline mallocator_header_block_t *mallocator_header_block(void *ptr)
+{
+    return (mallocator_header_block_t *) ptr - 1;
+}
+
+static inline void *mallocator_header_base(mallocator_header_block_t *header)
+{
+    return (char *) header - header->offset;
+}
+
+/* Write a header at offset within base, returning the payload */
+static inline void *mallocator_header_wrap(void *base, size_t offset, size_t size)
+{
+    if (!base) return NULL;
+
+    mallocator_header_block_t *header = (mallocator_header_block_t *) ((char *) base + offset);
+    header->size = size;
+    header->offset = offset;
+    return header + 1;
+}
+
+static inline bool mallocator_header_overflows(size_t size)
+{
+    return size > SIZE_MAX - MALLOCATOR_HEADER_SIZE;
+}
+
+/**************************************************************************************************/
+
+static inline mallocator_header_t *mallocator_header_verify(void *obj)
+{
+    mallocator_header_t *mallocator = obj;
+    assert(mallocator);
+    assert(mallocator->impl.obj == mallocator);
+    return mallocator;
+}
+
+static void mallocator_header_init(mallocator_header_t *mallocator, mallocator_impl_t *inner)
+{
+    *mallocator = (mallocator_header_t)
+    {
+	.impl =
+	{
+	    .obj = mallocator,
+	    .interface = &mallocator_header_interface,
+	    .inner = inner,
+	},
+    };
+}
+
+static void mallocator_header_fini(mallocator_header_t *mallocator)
+{
+    *mallocator = (mallocator_header_t)
+    {
+	.impl =
+	{
+	    .obj = NULL,
+	    .interface = NULL,
+	    .inner = NULL,
+	},
+    };
+}
+
+static mallocator_header_t *mallocator_header_create_int(mallocator_impl_t *inner)
+{
+    mallocator_header_t *mallocator = malloc(sizeof(*mallocator));
+    if (!mallocator) return NULL;
+
+    mallocator_header_init(mallocator, inner);
+    return mallocator;
+}
+
+static mallocator_impl_t *mallocator_header_create_child(void *parent_obj, const char *name)
+{
+    mallocator_header_t *parent = mallocator_header_verify(parent_obj);
+    mallocator_impl_t *inner = mallocator_impl_next_create_child(&parent->impl, name);
+    if (parent->impl.inner && !inner) return NULL;
+
+    mallocator_header_t *child = mallocator_header_create_int(inner);
+    if (!child)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &child->impl;
+}
+
+static void mallocator_header_destroy(void *obj)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    mallocator_impl_next_destroy(&mallocator->impl);
+    mallocator_header_fini(mallocator);
+    free(mallocator);
+}
+
+/* Size of the underlying block passed to the inner implementation */
+static inline size_t mallocator_header_inner_size(mallocator_header_block_t *header)
+{
+    return header->offset + MALLOCATOR_HEADER_SIZE + header->size;
+}
+
+static void *mallocator_header_malloc(void *obj, size_t size)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    if (mallocator_header_overflows(size)) return NULL;
+
+    void *base = mallocator_impl_next_malloc(&mallocator->impl, MALLOCATOR_HEADER_SIZE + size);
+    return mallocator_header_wrap(base, 0, size);
+}
+
+static void *mallocator_header_calloc(void *obj, size_t nmemb, size_t size)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total) || mallocator_header_overflows(total))
+	return NULL;
+
+    void *base = mallocator_impl_next_calloc(&mallocator->impl, 1, MALLOCATOR_HEADER_SIZE + total);
+    return mallocator_header_wrap(base, 0, total);
+}
+
+static void *mallocator_header_realloc(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    if (!ptr)
+	return mallocator_header_malloc(obj, new_size);
+
+    if (new_size == 0)
+    {
+	mallocator_header_free(obj, ptr, size);
+	return NULL;
+    }
+
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    if (mallocator_header_overflows(new_size)) return NULL;
+
+    mallocator_header_block_t *header = mallocator_header_block(ptr);
+    if (header->offset == 0)
+    {
+	void *base = mallocator_impl_next_realloc(&mallocator->impl, header, mallocator_header_inner_size(header),
+	    MALLOCATOR_HEADER_SIZE + new_size);
+	return mallocator_header_wrap(base, 0, new_size);
+    }
+
+    /* Aligned blocks cannot be passed to realloc */
+    void *new_ptr = mallocator_header_malloc(obj, new_size);
+    if (!new_ptr) return NULL;
+
+    memcpy(new_ptr, ptr, header->size < new_size ? header->size : new_size);
+    mallocator_header_free(obj, ptr, size);
+    return new_ptr;
+}
+
+static void mallocator_header_free(void *obj, void *ptr, size_t size)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    if (!ptr) return;
+
+    mallocator_header_block_t *header = mallocator_header_block(ptr);
+    mallocator_impl_next_free(&mallocator->impl, mallocator_header_base(header), mallocator_header_inner_size(header));
+}
+
+static void *mallocator_header_aligned_alloc(void *obj, size_t alignment, size_t size)
+{
+    if (alignment <= MALLOCATOR_HEADER_SIZE)
+	return mallocator_header_malloc(obj, size);
+
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    if (size > SIZE_MAX - alignment) return NULL;
+
+    /* Place the header at the end of the first aligned unit */
+    void *base = mallocator_impl_next_aligned_alloc(&mallocator->impl, alignment, alignment + size);
+    return mallocator_header_wrap(base, alignment - MALLOCATOR_HEADER_SIZE, size);
+}
+
+static size_t mallocator_header_usable_size(void *obj, void *ptr, size_t size)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    mallocator_header_block_t *header = mallocator_header_block(ptr);
+    const size_t usable = mallocator_impl_next_usable_size(&mallocator->impl, mallocator_header_base(header),
+	mallocator_header_inner_size(header));
+    return usable - header->offset - MALLOCATOR_HEADER_SIZE;
+}
+
+static void *mallocator_header_malloc_at_least(void *obj, size_t size, size_t *actual)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    *actual = 0;
+    if (mallocator_header_overflows(size)) return NULL;
+
+    size_t inner_actual;
+    void *base = mallocator_impl_next_malloc_at_least(&mallocator->impl, MALLOCATOR_HEADER_SIZE + size, &inner_actual);
+    if (!base) return NULL;
+
+    *actual = inner_actual - MALLOCATOR_HEADER_SIZE;
+    return mallocator_header_wrap(base, 0, *actual);
+}
+
+static bool mallocator_header_try_expand(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    mallocator_header_block_t *header = mallocator_header_block(ptr);
+    if (mallocator_header_overflows(header->offset + new_size)) return false;
+
+    const size_t inner_size = mallocator_header_inner_size(header);
+    const size_t new_inner_size = header->offset + MALLOCATOR_HEADER_SIZE + new_size;
+    if (!mallocator_impl_next_try_expand(&mallocator->impl, mallocator_header_base(header), inner_size, new_inner_size))
+	return false;
+
+    header->size = new_size;
+    return true;
+}
+
+static size_t mallocator_header_block_size(void *obj, void *ptr)
+{
+    (void) mallocator_header_verify(obj);
+    return mallocator_header_block(ptr)->size;
+}
+
+static size_t mallocator_header_trim(void *obj, unsigned flags)
+{
+    mallocator_header_t *mallocator = mallocator_header_verify(obj);
+    return mallocator_impl_next_trim(&mallocator->impl, flags);
+}
+
+/**************************************************************************************************/
+/* Public interface */
+
+mallocator_t *mallocator_header_create(const char *name)
+{
+    mallocator_impl_t *impl = mallocator_header_impl_create(NULL);
+    if (!impl) return NULL;
+
+    mallocator_t *m = mallocator_create_custom(name, impl);
+    if (!m)
+    {
+	mallocator_impl_destroy(impl);
+	return NULL;
+    }
+    return m;
+}
+
+mallocator_impl_t *mallocator_header_impl_create(mallocator_impl_t *inner)
+{
+    mallocator_header_t *mallocator = mallocator_header_create_int(inner);
+    if (!mallocator)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &mallocator->impl;
+}
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+
+#include "mallocator_heap_profile.h"
+#include "mallocator_tracer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+enum
+{
+    MALLOCATOR_HEAP_PROFILE_SHARDS = 64,	/* A power of 2 */
+    MALLOCATOR_HEAP_PROFILE_SHARD_BLOCKS = 64,	/* Initial blocks capacity of each shard */
+};
+
+typedef struct mallocator_heap_profile_node mallocator_heap_profile_node_t;
+
+/* Node names are copied, as a name may be freed with its tracer while its blocks are live */
+struct mallocator_heap_profile_node
+{
+    mallocator_heap_profile_node_t *next;
+    uint64_t hash;
+    char name[];
+};
+
+typedef struct
+{
+    void *ptr;					/* NULL if unused */
+    size_t size;
+    uint32_t stack;
+    const char *node;
+} mallocator_heap_profile_block_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;			/* Lock for this shard */
+    mallocator_heap_profile_block_t *blocks;	/* Open addressed by ptr */
+    size_t capacity;				/* A power of 2 */
+    size_t count;
+    size_t bytes;
+    mallocator_heap_profile_node_t *nodes;
+} __attribute__((aligned(64))) mallocator_heap_profile_shard_t;
+
+/* Live blocks of a stack and node, when writing */
+typedef struct
+{
+    const char *node;				/* NULL if unused */
+    uint64_t hash;
+    uint32_t stack;
+    size_t count;
+    size_t bytes;
+    double estimated_bytes;
+} mallocator_heap_profile_group_t;
+
+struct mallocator_heap_profile
+{
+    size_t sample_interval;
+    mallocator_heap_profile_shard_t shards[MALLOCATOR_HEAP_PROFILE_SHARDS];
+};
+
+/**************************************************************************************************/
+/* Utils */
+
+static inline uint64_t mallocator_heap_profile_hash_ptr(const void *ptr)
+{
+    uint64_t hash = ((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ull;
+    return hash ^ (hash >> 32);
+}
+
+static inline uint64_t mallocator_heap_profile_hash_str(const char *str)
+{
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (; *str; str++)
+	hash = (hash ^ (uint8_t) *str) * 0x100000001b3ull;
+    return hash;
+}
+
+/* Return the probability that an allocation of size bytes is sampled, 1 - exp(-size / interval) */
+static double mallocator_heap_profile_sample_probability(size_t size, size_t interval)
+{
+    if (!interval) return 1;
+
+    const double x = (double) size / (double) interval;
+    if (x > 40) return 1;
+    if (x < 1e-4) return x - x * x / 2;
+
+    /* exp(-x) = 2^-k exp(-r), with r = x - k ln 2 in [0, ln 2) */
+    const double ln2 = 0.69314718055994531;
+    const unsigned k = (unsigned) (x / ln2);
+    const double r = x - k * ln2;
+    double term = 1, exp_r = 1;
+    for (unsigned n = 1; n < 16; n++)
+    {
+	term *= -r / n;
+	exp_r += term;
+    }
+    return 1 - exp_r / (double) (1ull << k);
+}
+
+/**************************************************************************************************/
+/* Shards */
+
+static inline mallocator_heap_profile_shard_t *mallocator_heap_profile_shard(mallocator_heap_profile_t *profile, uint64_t hash)
+{
+    return &profile->shards[hash >> 58 & (MALLOCATOR_HEAP_PROFILE_SHARDS - 1)];
+}
+
+static inline void mallocator_heap_profile_lock(mallocator_heap_profile_shard_t *shard)
+{
+    assert(pthread_mutex_lock(&shard->lock) == 0);
+}
+
+static inline void mallocator_heap_profile_unlock(mallocator_heap_profile_shard_t *shard)
+{
+    assert(pthread_mutex_unlock(&shard->lock) == 0);
+}
+
+/* Return the copy of a node name in shard, called with shard->lock held */
+static const char *mallocator_heap_profile_node(mallocator_heap_profile_shard_t *shard, const char *name)
+{
+    const uint64_t hash = mallocator_heap_profile_hash_str(name);
+    for (mallocator_heap_profile_node_t *node = shard->nodes; node; node = node->next)
+    {
+	if (node->hash == hash && strcmp(node->name, name) == 0) return node->name;
+    }
+
+    mallocator_heap_profile_node_t *node = malloc(sizeof(*node) + strlen(name) + 1);
+    if (!node) return NULL;
+    node->hash = hash;
+    strcpy(node->name, name);
+    node->next = shard->nodes;
+    shard->nodes = node;
+    return node->name;
+}
+
+/* Double the blocks capacity of shard, called with shard->lock held */
+static bool mallocator_heap_profile_grow(mallocator_heap_profile_shard_t *shard)
+{
+    const size_t capacity = shard->capacity * 2;
+    mallocator_heap_profile_block_t *blocks = calloc(capacity, sizeof(*blocks));
+    if (!blocks) return false;
+
+    for (size_t i = 0; i < shard->capacity; i++)
+    {
+	if (!shard->blocks[i].ptr) continue;
+	size_t j = mallocator_heap_profile_hash_ptr(shard->blocks[i].ptr) & (capacity - 1);
+	while (blocks[j].ptr) j = (j + 1) & (capacity - 1);
+	blocks[j] = shard->blocks[i];
+    }
+    free(shard->blocks);
+    shard->blocks = blocks;
+    shard->capacity = capacity;
+    return true;
+}
+
+static void mallocator_heap_profile_insert(mallocator_heap_profile_t *profile, void *ptr, size_t size,
+    const mallocator_tracer_event_t *event)
+{
+    const uint64_t hash = mallocator_heap_profile_hash_ptr(ptr);
+    mallocator_heap_profile_shard_t *shard = mallocator_heap_profile_shard(profile, hash);
+    mallocator_heap_profile_lock(shard);
+
+    /* Grow at half full, or keep going until nearly full if that fails */
+    if ((shard->count + 1) * 2 > shard->capacity && !mallocator_heap_profile_grow(shard) &&
+	shard->count + 1 >= shard->capacity)
+    {
+	mallocator_heap_profile_unlock(shard);
+	return;
+    }
+
+    const char *node = mallocator_heap_profile_node(shard, event->name ? event->name : "");
+    if (node)
+    {
+	size_t i = hash & (shard->capacity - 1);
+	while (shard->blocks[i].ptr && shard->blocks[i].ptr != ptr)
+	    i = (i + 1) & (shard->capacity - 1);
+	if (shard->blocks[i].ptr)
+	{
+	    /* Already live, e.g. its free was dropped */
+	    shard->bytes -= shard->blocks[i].size;
+	}
+	else
+	{
+	    shard->count++;
+	}
+	shard->blocks[i] = (mallocator_heap_profile_block_t) { .ptr = ptr, .size = size, .stack = event->stack, .node = node };
+	shard->bytes += size;
+    }
+    mallocator_heap_profile_unlock(shard);
+}
+
+static void mallocator_heap_profile_remove(mallocator_heap_profile_t *profile, void *ptr)
+{
+    const uint64_t hash = mallocator_heap_profile_hash_ptr(ptr);
+    mallocator_heap_profile_shard_t *shard = mallocator_heap_profile_shard(profile, hash);
+    mallocator_heap_profile_lock(shard);
+
+    const size_t mask = shard->capacity - 1;
+    size_t i = hash & mask;
+    while (shard->blocks[i].ptr && shard->blocks[i].ptr != ptr)
+	i = (i + 1) & mask;
+    if (shard->blocks[i].ptr)
+    {
+	shard->count--;
+	shard->bytes -= shard->blocks[i].size;
+
+	/* Shift back later blocks of the probe sequence, so that no tombstones are needed */
+	for (size_t j = (i + 1) & mask; shard->blocks[j].ptr; j = (j + 1) & mask)
+	{
+	    const size_t home = mallocator_heap_profile_hash_ptr(shard->blocks[j].ptr) & mask;
+	    if (((j - home) & mask) >= ((j - i) & mask))
+	    {
+		shard->blocks[i] = shard->blocks[j];
+		i = j;
+	    }
+	}
+	shard->blocks[i].ptr = NULL;
+    }
+    mallocator_heap_profile_unlock(shard);
+}
+
+/**************************************************************************************************/
+/* Groups */
+
+typedef struct
+{
+    mallocator_heap_profile_group_t *groups;	/* Open addressed by stack and node */
+    size_t capacity;
+    size_t count;
+} mallocator_heap_profile_groups_t;
+
+static mallocator_heap_profile_group_t *mallocator_heap_profile_group(mallocator_heap_profile_groups_t *groups,
+    uint32_t stack, const char *node)
+{
+    if ((groups->count + 1) * 2 > groups->capacity)
+    {
+	const size_t capacity = groups->capacity * 2;
+	mallocator_heap_profile_group_t *new_groups = calloc(capacity, sizeof(*new_groups));
+	if (!new_groups) return NULL;
+	for (size_t i = 0; i < groups->capacity; i++)
+	{
+	    if (!groups->groups[i].node) continue;
+	    size_t j = groups->groups[i].hash & (capacity - 1);
+	    while (new_groups[j].node) j = (j + 1) & (capacity - 1);
+	    new_groups[j] = groups->groups[i];
+	}
+	free(groups->groups);
+	groups->groups = new_groups;
+	groups->capacity = capacity;
+    }
+
+    /* Node names are copied per shard, so are compared by value */
+    const uint64_t hash = mallocator_heap_profile_hash_str(node) ^ (stack * 0x9e3779b97f4a7c15ull);
+    size_t i = hash & (groups->capacity - 1);
+    for (; groups->groups[i].node; i = (i + 1) & (groups->capacity - 1))
+    {
+	mallocator_heap_profile_group_t *group = &groups->groups[i];
+	if (group->hash == hash && group->stack == stack && strcmp(group->node, node) == 0) return group;
+    }
+    groups->count++;
+    groups->groups[i] = (mallocator_heap_profile_group_t) { .node = node, .hash = hash, .stack = stack };
+    return &groups->groups[i];
+}
+
+/* Group the live blocks of profile by stack and node */
+static bool mallocator_heap_profile_groups(mallocator_heap_profile_t *profile, mallocator_heap_profile_groups_t *groups)
+{
+    *groups = (mallocator_heap_profile_groups_t)
+    {
+	.groups = calloc(64, sizeof(mallocator_heap_profile_group_t)),
+	.capacity = 64,
+	.count = 0,
+    };
+    if (!groups->groups) return false;
+
+    bool ok = true;
+    for (unsigned s = 0; s < MALLOCATOR_HEAP_PROFILE_SHARDS && ok; s++)
+    {
+	mallocator_heap_profile_shard_t *shard = &profile->shards[s];
+	mallocator_heap_profile_lock(shard);
+	for (size_t i = 0; i < shard->capacity && ok; i++)
+	{
+	    const mallocator_heap_profile_block_t *block = &shard->blocks[i];
+	    if (!block->ptr) continue;
+
+	    mallocator_heap_profile_group_t *group = mallocator_heap_profile_group(groups, block->stack, block->node);
+	    if (!group)
+	    {
+		ok = false;
+		break;
+	    }
+	    group->count++;
+	    group->bytes += block->size;
+	    group->estimated_bytes += block->size /
+		mallocator_heap_profile_sample_probability(block->size, profile->sample_interval);
+	}
+	mallocator_heap_profile_unlock(shard);
+    }
+    return ok;
+}
+
+/**************************************************************************************************/
+/* Output */
+
+static void mallocator_heap_profile_write_pprof(mallocator_heap_profile_t *profile,
+    const mallocator_heap_profile_groups_t *groups, FILE *file)
+{
+    size_t count = 0, bytes = 0;
+    for (size_t i = 0; i < groups->capacity; i++)
+    {
+	count += groups->groups[i].count;
+	bytes += groups->groups[i].bytes;
+    }
+
+    /* Cumulative allocations are not recorded, so are written as 0 */
+    fprintf(file, "heap profile: %zu: %zu [0: 0] @ ", count, bytes);
+    if (profile->sample_interval)
+	fprintf(file, "heap_v2/%zu\n", profile->sample_interval);
+    else
+	fprintf(file, "heapprofile\n");
+
+    for (size_t i = 0; i < groups->capacity; i++)
+    {
+	const mallocator_heap_profile_group_t *group = &groups->groups[i];
+	if (!group->node) continue;
+
+	fprintf(file, "%zu: %zu [0: 0] @", group->count, group->bytes);
+	size_t depth = 0;
+	const void *const *frames = mallocator_tracer_stack(group->stack, &depth);
+	for (size_t j = 0; frames && j < depth; j++)
+	    fprintf(file, " %p", frames[j]);
+	fprintf(file, "\n");
+    }
+
+    /* Mappings allow pprof to symbolize the addresses */
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps)
+    {
+	fprintf(file, "\nMAPPED_LIBRARIES:\n");
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+	    fwrite(buffer, 1, n, file);
+	fclose(maps);
+    }
+}
+
+static void mallocator_heap_profile_write_folded(const mallocator_heap_profile_groups_t *groups, FILE *file)
+{
+    for (size_t i = 0; i < groups->capacity; i++)
+    {
+	const mallocator_heap_profile_group_t *group = &groups->groups[i];
+	if (!group->node) continue;
+
+	fprintf(file, "%s", group->node);
+	size_t depth = 0;
+	const void *const *frames = mallocator_tracer_stack(group->stack, &depth);
+	for (size_t j = depth; frames && j > 0; j--)
+	    fprintf(file, ";%p", frames[j - 1]);
+	fprintf(file, " %.0f\n", group->estimated_bytes);
+    }
+}
+
+/**************************************************************************************************/
+/* Public interface */
+
+mallocator_heap_profile_t *mallocator_heap_profile_create(size_t sample_interval)
+{
+    mallocator_heap_profile_t *profile = aligned_alloc(64, sizeof(*profile));
+    if (!profile) return NULL;
+
+    profile->sample_interval = sample_interval;
+    for (unsigned s = 0; s < MALLOCATOR_HEAP_PROFILE_SHARDS; s++)
+    {
+	mallocator_heap_profile_shard_t *shard = &profile->shards[s];
+	shard->blocks = calloc(MALLOCATOR_HEAP_PROFILE_SHARD_BLOCKS, sizeof(*shard->blocks));
+	shard->capacity = MALLOCATOR_HEAP_PROFILE_SHARD_BLOCKS;
+	shard->count = 0;
+	shard->bytes = 0;
+	shard->nodes = NULL;
+	assert(pthread_mutex_init(&shard->lock, NULL) == 0);
+	if (!shard->blocks)
+	{
+	    for (unsigned i = 0; i <= s; i++)
+	    {
+		free(profile->shards[i].blocks);
+		assert(pthread_mutex_destroy(&profile->shards[i].lock) == 0);
+	    }
+	    free(profile);
+	    return NULL;
+	}
+    }
+    return profile;
+}
+
+void mallocator_heap_profile_event(void *arg, const mallocator_tracer_event_t *event)
+{
+    mallocator_heap_profile_t *profile = arg;
+    assert(profile);
+
+    switch (event->type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	    if (event->ptr) mallocator_heap_profile_insert(profile, event->ptr, event->e.malloc.size, event);
+	    break;
+	case MALLOCATOR_TRACER_CALLOC:
+	    if (event->ptr)
+		mallocator_heap_profile_insert(profile, event->ptr, event->e.calloc.nmemb * event->e.calloc.size, event);
+	    break;
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    if (event->ptr) mallocator_heap_profile_insert(profile, event->ptr, event->e.aligned_alloc.size, event);
+	    break;
+	case MALLOCATOR_TRACER_REALLOC:
+	    /* A failed realloc leaves the old block live */
+	    if (!event->ptr && event->e.realloc.new_size) break;
+	    if (event->e.realloc.old_ptr) mallocator_heap_profile_remove(profile, event->e.realloc.old_ptr);
+	    if (event->ptr) mallocator_heap_profile_insert(profile, event->ptr, event->e.realloc.new_size, event);
+	    break;
+	case MALLOCATOR_TRACER_FREE:
+	    if (event->ptr) mallocator_heap_profile_remove(profile, event->ptr);
+	    break;
+    }
+}
+
+size_t mallocator_heap_profile_live(mallocator_heap_profile_t *profile, size_t *bytes)
+{
+    size_t count = 0, total = 0;
+    for (unsigned s = 0; s < MALLOCATOR_HEAP_PROFILE_SHARDS; s++)
+    {
+	mallocator_heap_profile_shard_t *shard = &profile->shards[s];
+	mallocator_heap_profile_lock(shard);
+	count += shard->count;
+	total += shard->bytes;
+	mallocator_heap_profile_unlock(shard);
+    }
+    if (bytes) *bytes = total;
+    return count;
+}
+
+bool mallocator_heap_profile_write(mallocator_heap_profile_t *profile, FILE *file, mallocator_heap_profile_format_t format)
+{
+    mallocator_heap_profile_groups_t groups;
+    const bool ok = mallocator_heap_profile_groups(profile, &groups);
+    if (ok)
+    {
+	if (format == MALLOCATOR_HEAP_PROFILE_PPROF)
+	    mallocator_heap_profile_write_pprof(profile, &groups, file);
+	else
+	    mallocator_heap_profile_write_folded(&groups, file);
+    }
+    free(groups.groups);
+    return ok && fflush(file) == 0 && !ferror(file);
+}
+
+void mallocator_heap_profile_destroy(mallocator_heap_profile_t *profile)
+{
+    for (unsigned s = 0; s < MALLOCATOR_HEAP_PROFILE_SHARDS; s++)
+    {
+	mallocator_heap_profile_shard_t *shard = &profile->shards[s];
+	while (shard->nodes)
+	{
+	    mallocator_heap_profile_node_t *node = shard->nodes;
+	    shard->nodes = node->next;
+	    free(node);
+	}
+	free(shard->blocks);
+	assert(pthread_mutex_destroy(&shard->lock) == 0);
+    }
+    free(profile);
+}
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include "mallocator_mmap.h"
+#include "mallocator.h"
+#include "mallocator_impl.h"
+
+#include "atomic.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef struct
+{
+    mallocator_impl_t impl;
+    pthread_mutex_t lock;
+    unsigned ref_count;		/* Protected by lock */
+    size_t threshold;		/* Minimum size of a mapped block */
+    size_t page_size;
+    mallocator_mmap_stats_t stats;	/* Updated atomically */
+} mallocator_mmap_t;
+
+/**************************************************************************************************/
+/* mallocator_t interface */
+
+static mallocator_impl_t *mallocator_mmap_create_child(void *parent_obj, const char *name);
+static void mallocator_mmap_destroy(void *obj);
+static void *mallocator_mmap_malloc(void *obj, size_t size);
+static void *mallocator_mmap_calloc(void *obj, size_t nmemb, size_t size);
+static void *mallocator_mmap_realloc(void *obj, void *ptr, size_t size, size_t new_size);
+static void mallocator_mmap_free(void *obj, void *p, size_t size);
+static void *mallocator_mmap_aligned_alloc(void *obj, size_t alignment, size_t size);
+static size_t mallocator_mmap_usable_size(void *obj, void *ptr, size_t size);
+static void *mallocator_mmap_malloc_at_least(void *obj, size_t size, size_t *actual);
+static bool mallocator_mmap_try_expand(void *obj, void *ptr, size_t size, size_t new_size);
+
+static mallocator_interface_t mallocator_mmap_interface =
+{
+    .create_child = mallocator_mmap_create_child,
+    .destroy = mallocator_mmap_destroy,
+    .malloc = mallocator_mmap_malloc,
+    .calloc = mallocator_mmap_calloc,
+    .realloc = mallocator_mmap_realloc,
+    .free = mallocator_mmap_free,
+    .aligned_alloc = mallocator_mmap_aligned_alloc,
+    .usable_size = mallocator_mmap_usable_size,
+    .malloc_at_least = mallocator_mmap_malloc_at_least,
+    .try_expand = mallocator_mmap_try_expand,
+};
+
+/**************************************************************************************************/
+
+static inline mallocator_mmap_t *mallocator_mmap_verify(void *obj)
+{
+    mallocator_mmap_t *mallocator = obj;
+    assert(mallocator);
+    assert(mallocator->ref_count > 0);
+    return mallocator;
+}
+
+static void mallocator_mmap_init(mallocator_mmap_t *mallocator, size_t threshold)
+{
+    *mallocator = (mallocator_mmap_t)
+    {
+	.impl =
+	{
+	    .obj = mallocator,
+	    .interface = &mallocator_mmap_interface,
+	},
+	.ref_count = 1,
+	.threshold = threshold,
+	.page_size = sysconf(_SC_PAGESIZE),
+    };
+    assert(pthread_mutex_init(&mallocator->lock, NULL) == 0);
+}
+
+static void mallocator_mmap_fini(mallocator_mmap_t *mallocator)
+{
+    assert(pthread_mutex_destroy(&mallocator->lock) == 0);
+    *mallocator = (mallocator_mmap_t)
+    {
+	.impl =
+	{
+	    .obj = NULL,
+	    .interface = NULL,
+	},
+	.ref_count = 0,
+	.threshold = 0,
+	.page_size = 0,
+    };
+}
+
+static inline void mallocator_mmap_lock(mallocator_mmap_t *mallocator)
+{
+    assert(pthread_mutex_lock(&mallocator->lock) == 0);
+}
+
+static inline void mallocator_mmap_unlock(mallocator_mmap_t *mallocator)
+{
+    assert(pthread_mutex_unlock(&mallocator->lock) == 0);
+}
+
+static mallocator_mmap_t *mallocator_mmap_create_int(size_t threshold)
+{
+    mallocator_mmap_t *mallocator = malloc(sizeof(*mallocator));
+    if (!mallocator) return NULL;
+
+    mallocator_mmap_init(mallocator, threshold);
+    return mallocator;
+}
+
+static void mallocator_mmap_reference(mallocator_mmap_t *mallocator)
+{
+    mallocator_mmap_lock(mallocator);
+    mallocator->ref_count++;
+    mallocator_mmap_unlock(mallocator);
+}
+
+static void mallocator_mmap_dereference(mallocator_mmap_t *mallocator)
+{
+    mallocator_mmap_lock(mallocator);
+    mallocator->ref_count--;
+    const bool destroy = mallocator->ref_count == 0;
+    mallocator_mmap_unlock(mallocator);
+
+    if (destroy)
+    {
+	mallocator_mmap_fini(mallocator);
+	free(mallocator);
+    }
+}
+
+static mallocator_impl_t *mallocator_mmap_create_child(void *parent_obj, const char *name)
+{
+    mallocator_mmap_t *parent = mallocator_mmap_verify(parent_obj);
+    mallocator_mmap_reference(parent);
+    return &parent->impl;
+}
+
+static void mallocator_mmap_destroy(void *obj)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    mallocator_mmap_dereference(mallocator);
+}
+
+/**************************************************************************************************/
+/* Mapped blocks */
+
+static inline bool mallocator_mmap_is_mapped(mallocator_mmap_t *mallocator, size_t size)
+{
+    return size >= mallocator->threshold;
+}
+
+static inline size_t mallocator_mmap_length(mallocator_mmap_t *mallocator, size_t size)
+{
+    return (size + mallocator->page_size - 1) & ~(mallocator->page_size - 1);
+}
+
+static inline void mallocator_mmap_advise(void *ptr, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+    if (len >= MALLOCATOR_MMAP_HUGE_PAGE_SIZE)
+	(void) madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * Map len bytes aligned to alignment, and huge page aligned if the mapping is large enough to
+ * use a huge page
+ */
+static void *mallocator_mmap_map_aligned(mallocator_mmap_t *mallocator, size_t len, size_t alignment)
+{
+    if (len >= MALLOCATOR_MMAP_HUGE_PAGE_SIZE && alignment < MALLOCATOR_MMAP_HUGE_PAGE_SIZE)
+	alignment = MALLOCATOR_MMAP_HUGE_PAGE_SIZE;
+
+    if (alignment <= mallocator->page_size)
+    {
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    /* Over-map then trim the unaligned head and tail */
+    const size_t reserve_len = len + alignment - mallocator->page_size;
+    void *reserve = mmap(NULL, reserve_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserve == MAP_FAILED) return NULL;
+
+    const uintptr_t start = (uintptr_t) reserve;
+    const uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    const size_t head = aligned - start;
+    const size_t tail = reserve_len - head - len;
+    if (head > 0) munmap(reserve, head);
+    if (tail > 0) munmap((void *) (aligned + len), tail);
+
+    void *ptr = (void *) aligned;
+    mallocator_mmap_advise(ptr, len);
+    return ptr;
+}
+
+static void *mallocator_mmap_map(mallocator_mmap_t *mallocator, size_t size, size_t alignment)
+{
+    const size_t len = mallocator_mmap_length(mallocator, size);
+    void *ptr = mallocator_mmap_map_aligned(mallocator, len, alignment);
+    if (!ptr) return NULL;
+
+    atomic_fetch_add(&mallocator->stats.blocks_mapped, 1);
+    atomic_fetch_add(&mallocator->stats.bytes_mapped, len);
+    atomic_fetch_add(&mallocator->stats.bytes_requested, size);
+    atomic_fetch_add(&mallocator->stats.maps, 1);
+    return ptr;
+}
+
+static void mallocator_mmap_unmap(mallocator_mmap_t *mallocator, void *ptr, size_t size)
+{
+    const size_t len = mallocator_mmap_length(mallocator, size);
+    assert(munmap(ptr, len) == 0);
+
+    atomic_fetch_sub(&mallocator->stats.blocks_mapped, 1);
+    atomic_fetch_sub(&mallocator->stats.bytes_mapped, len);
+    atomic_fetch_sub(&mallocator->stats.bytes_requested, size);
+}
+
+/* Resize a mapped block to a mapped size */
+static void *mallocator_mmap_remap(mallocator_mmap_t *mallocator, void *ptr, size_t size, size_t new_size)
+{
+    const size_t len = mallocator_mmap_length(mallocator, size);
+    const size_t new_len = mallocator_mmap_length(mallocator, new_size);
+    void *new_ptr = ptr;
+    if (new_len != len)
+    {
+	/* Shrink, or grow in place if the following address space is free */
+	new_ptr = mremap(ptr, len, new_len, 0);
+	if (new_ptr == MAP_FAILED)
+	{
+	    /* Move the pages into a fresh aligned mapping rather than copying them */
+	    void *dest = mallocator_mmap_map_aligned(mallocator, new_len, mallocator->page_size);
+	    if (!dest) return NULL;
+
+	    new_ptr = mremap(ptr, len, new_len, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+	    if (new_ptr == MAP_FAILED)
+	    {
+		munmap(dest, new_len);
+		return NULL;
+	    }
+	}
+	mallocator_mmap_advise(new_ptr, new_len);
+	atomic_fetch_add(&mallocator->stats.remaps, 1);
+    }
+
+    atomic_fetch_add(&mallocator->stats.bytes_mapped, new_len - len);
+    atomic_fetch_add(&mallocator->stats.bytes_requested, new_size - size);
+    return new_ptr;
+}
+
+/**************************************************************************************************/
+
+static void *mallocator_mmap_malloc(void *obj, size_t size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    if (!mallocator_mmap_is_mapped(mallocator, size))
+	return malloc(size);
+
+    return mallocator_mmap_map(mallocator, size, mallocator->page_size);
+}
+
+static void *mallocator_mmap_calloc(void *obj, size_t nmemb, size_t size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+	return NULL;
+
+    if (!mallocator_mmap_is_mapped(mallocator, total))
+	return calloc(nmemb, size);
+
+    /* Anonymous mappings are zero filled */
+    return mallocator_mmap_map(mallocator, total, mallocator->page_size);
+}
+
+static void *mallocator_mmap_realloc(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    const bool mapped = ptr && mallocator_mmap_is_mapped(mallocator, size);
+    const bool new_mapped = new_size > 0 && mallocator_mmap_is_mapped(mallocator, new_size);
+
+    if (!mapped && !new_mapped)
+	return realloc(ptr, new_size);
+
+    if (mapped && new_mapped)
+	return mallocator_mmap_remap(mallocator, ptr, size, new_size);
+
+    if (new_size == 0)
+    {
+	mallocator_mmap_unmap(mallocator, ptr, size);
+	return NULL;
+    }
+
+    /* Crossing the threshold - move between the heap and a mapping */
+    void *new_ptr = new_mapped ? mallocator_mmap_map(mallocator, new_size, mallocator->page_size) : malloc(new_size);
+    if (!new_ptr) return NULL;
+
+    if (ptr)
+    {
+	memcpy(new_ptr, ptr, size < new_size ? size : new_size);
+	if (mapped) mallocator_mmap_unmap(mallocator, ptr, size);
+	else free(ptr);
+    }
+    return new_ptr;
+}
+
+static void mallocator_mmap_free(void *obj, void *ptr, size_t size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    if (ptr && mallocator_mmap_is_mapped(mallocator, size))
+	mallocator_mmap_unmap(mallocator, ptr, size);
+    else
+	free(ptr);
+}
+
+static void *mallocator_mmap_aligned_alloc(void *obj, size_t alignment, size_t size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    if (!mallocator_mmap_is_mapped(mallocator, size))
+	return aligned_alloc(alignment, size);
+
+    return mallocator_mmap_map(mallocator, size, alignment);
+}
+
+static size_t mallocator_mmap_usable_size(void *obj, void *ptr, size_t size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    if (mallocator_mmap_is_mapped(mallocator, size))
+	return mallocator_mmap_length(mallocator, size);
+
+    /* Heap slack must not push the block over the threshold, as it is freed by size */
+    const size_t usable = malloc_usable_size(ptr);
+    return usable < mallocator->threshold ? usable : mallocator->threshold - 1;
+}
+
+static void *mallocator_mmap_malloc_at_least(void *obj, size_t size, size_t *actual)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    if (!mallocator_mmap_is_mapped(mallocator, size))
+    {
+	void *ptr = malloc(size);
+	*actual = ptr ? mallocator_mmap_usable_size(obj, ptr, size) : 0;
+	return ptr;
+    }
+
+    /* Request the whole of the last page */
+    const size_t len = mallocator_mmap_length(mallocator, size);
+    void *ptr = mallocator_mmap_map(mallocator, len, mallocator->page_size);
+    *actual = ptr ? len : 0;
+    return ptr;
+}
+
+static bool mallocator_mmap_try_expand(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(obj);
+    const bool mapped = mallocator_mmap_is_mapped(mallocator, size);
+    const bool new_mapped = mallocator_mmap_is_mapped(mallocator, new_size);
+    if (!mapped)
+	return !new_mapped && malloc_usable_size(ptr) >= new_size;
+
+    /* Grow the mapping only if the following address space is free */
+    const size_t len = mallocator_mmap_length(mallocator, size);
+    const size_t new_len = mallocator_mmap_length(mallocator, new_size);
+    if (new_len != len)
+    {
+	if (mremap(ptr, len, new_len, 0) == MAP_FAILED)
+	    return false;
+	mallocator_mmap_advise(ptr, new_len);
+	atomic_fetch_add(&mallocator->stats.remaps, 1);
+    }
+    atomic_fetch_add(&mallocator->stats.bytes_mapped, new_len - len);
+    atomic_fetch_add(&mallocator->stats.bytes_requested, new_size - size);
+    return true;
+}
+
+/**************************************************************************************************/
+/* Public interface */
+
+mallocator_t *mallocator_mmap_create(const char *name, size_t threshold)
+{
+    mallocator_impl_t *impl = mallocator_mmap_impl_create(threshold);
+    if (!impl) return NULL;
+
+    mallocator_t *m = mallocator_create_custom(name, impl);
+    if (!m)
+    {
+	mallocator_impl_destroy(impl);
+	return NULL;
+    }
+    return m;
+}
+
+mallocator_impl_t *mallocator_mmap_impl_create(size_t threshold)
+{
+    /* A zero sized block cannot be mapped */
+    if (threshold == 0) threshold = 1;
+
+    mallocator_mmap_t *mallocator = mallocator_mmap_create_int(threshold);
+    if (!mallocator) return NULL;
+    return &mallocator->impl;
+}
+
+void mallocator_mmap_stats(mallocator_t *m, mallocator_mmap_stats_t *stats)
+{
+    mallocator_impl_t *impl = mallocator_impl_find(mallocator_get_impl(m), &mallocator_mmap_interface);
+    assert(impl);
+    mallocator_mmap_t *mallocator = mallocator_mmap_verify(impl->obj);
+
+    stats->blocks_mapped = atomic_load(&mallocator->stats.blocks_mapped);
+    stats->bytes_mapped = atomic_load(&mallocator->stats.bytes_mapped);
+    stats->bytes_requested = atomic_load(&mallocator->stats.bytes_requested);
+    stats->maps = atomic_load(&mallocator->stats.maps);
+    stats->remaps = atomic_load(&mallocator->stats.remaps);
+}
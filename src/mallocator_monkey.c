@@ -24,9 +24,9 @@ typedef struct
     bool failed;	    /* Protected by lock */
 } mallocator_monkey_step_t;
 
+/* Failure state shared by all layers in a tree */
 typedef struct
 {
-    mallocator_impl_t impl;
     pthread_mutex_t lock;
     unsigned ref_count;	    /* Protected by lock */
     mallocator_monkey_fail_fn fn;
@@ -38,6 +38,12 @@ typedef struct
     } chaos;
 } mallocator_monkey_t;
 
+typedef struct
+{
+    mallocator_impl_t impl;
+    mallocator_monkey_t *monkey;
+} mallocator_monkey_layer_t;
+
 /**************************************************************************************************/
 /* mallocator_t interface */
 
@@ -47,6 +53,11 @@ static void *mallocator_monkey_malloc(void *obj, size_t size);
 static void *mallocator_monkey_calloc(void *obj, size_t nmemb, size_t size);
 static void *mallocator_monkey_realloc(void *obj, void *ptr, size_t size, size_t new_size);
 static void mallocator_monkey_free(void *obj, void *p, size_t size);
+static void *mallocator_monkey_aligned_alloc(void *obj, size_t alignment, size_t size);
+static size_t mallocator_monkey_usable_size(void *obj, void *ptr, size_t size);
+static size_t mallocator_monkey_block_size(void *obj, void *ptr);
+static size_t mallocator_monkey_trim(void *obj, unsigned flags);
+static bool mallocator_monkey_try_expand(void *obj, void *ptr, size_t size, size_t new_size);
 
 static mallocator_interface_t mallocator_monkey_interface =
 {
@@ -56,27 +67,28 @@ static mallocator_interface_t mallocator_monkey_interface =
     .calloc = mallocator_monkey_calloc,
     .realloc = mallocator_monkey_realloc,
     .free = mallocator_monkey_free,
+    .aligned_alloc = mallocator_monkey_aligned_alloc,
+    .usable_size = mallocator_monkey_usable_size,
+    .block_size = mallocator_monkey_block_size,
+    .trim = mallocator_monkey_trim,
+    .try_expand = mallocator_monkey_try_expand,
 };
 
 /**************************************************************************************************/
 
-static inline mallocator_monkey_t *mallocator_monkey_verify(void *obj)
+static inline mallocator_monkey_layer_t *mallocator_monkey_verify(void *obj)
 {
-    mallocator_monkey_t *mallocator = obj;
-    assert(mallocator);
-    assert(mallocator->ref_count > 0);
-    return mallocator;
+    mallocator_monkey_layer_t *layer = obj;
+    assert(layer);
+    assert(layer->monkey);
+    assert(layer->monkey->ref_count > 0);
+    return layer;
 }
 
 static void mallocator_monkey_init(mallocator_monkey_t *mallocator)
 {
     *mallocator = (mallocator_monkey_t)
     {
-	.impl =
-	{
-	    .obj = mallocator,
-	    .interface = &mallocator_monkey_interface,
-	},
 	.ref_count = 1,
 	.fn = NULL,
 	.arg = NULL,
@@ -89,11 +101,6 @@ static void mallocator_monkey_fini(mallocator_monkey_t *mallocator)
     assert(pthread_mutex_destroy(&mallocator->lock) == 0);
     *mallocator = (mallocator_monkey_t)
     {
-	.impl =
-	{
-	    .obj = NULL,
-	    .interface = NULL,
-	},
 	.ref_count = 0,
 	.fn = NULL,
 	.arg = NULL,
@@ -140,17 +147,47 @@ static void mallocator_monkey_dereference(mallocator_monkey_t *mallocator)
     }
 }
 
+/* Create a layer sharing the failure state of monkey, wrapping inner */
+static mallocator_monkey_layer_t *mallocator_monkey_layer_create(mallocator_monkey_t *monkey, mallocator_impl_t *inner)
+{
+    mallocator_monkey_layer_t *layer = malloc(sizeof(*layer));
+    if (!layer) return NULL;
+
+    mallocator_monkey_reference(monkey);
+    *layer = (mallocator_monkey_layer_t)
+    {
+	.impl =
+	{
+	    .obj = layer,
+	    .interface = &mallocator_monkey_interface,
+	    .inner = inner,
+	},
+	.monkey = monkey,
+    };
+    return layer;
+}
+
 static mallocator_impl_t *mallocator_monkey_create_child(void *parent_obj, const char *name)
 {
-    mallocator_monkey_t *parent = mallocator_monkey_verify(parent_obj);
-    mallocator_monkey_reference(parent);
-    return &parent->impl;
+    mallocator_monkey_layer_t *parent = mallocator_monkey_verify(parent_obj);
+    mallocator_impl_t *inner = mallocator_impl_next_create_child(&parent->impl, name);
+    if (parent->impl.inner && !inner) return NULL;
+
+    mallocator_monkey_layer_t *child = mallocator_monkey_layer_create(parent->monkey, inner);
+    if (!child)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &child->impl;
 }
 
 static void mallocator_monkey_destroy(void *obj)
 {
-    mallocator_monkey_t *mallocator = mallocator_monkey_verify(obj);
-    mallocator_monkey_dereference(mallocator);
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    mallocator_impl_next_destroy(&layer->impl);
+    mallocator_monkey_dereference(layer->monkey);
+    free(layer);
 }
 
 static bool mallocator_monkey_fail_random(void *arg)
@@ -194,8 +231,9 @@ static bool mallocator_monkey_fail_step(void *arg)
     return step->failing;
 }
 
-static inline bool mallocator_monkey_fail(mallocator_monkey_t *mallocator)
+static inline bool mallocator_monkey_fail(mallocator_monkey_layer_t *layer)
 {
+    mallocator_monkey_t *mallocator = layer->monkey;
     mallocator_monkey_lock(mallocator);
     const bool fail = mallocator->fn(mallocator->arg);
     mallocator_monkey_unlock(mallocator);
@@ -204,66 +242,130 @@ static inline bool mallocator_monkey_fail(mallocator_monkey_t *mallocator)
 
 static void *mallocator_monkey_malloc(void *obj, size_t size)
 {
-    mallocator_monkey_t *mallocator = mallocator_monkey_verify(obj);
-    if (mallocator_monkey_fail(mallocator))
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    if (mallocator_monkey_fail(layer))
 	return NULL;
 
-    return malloc(size);
+    return mallocator_impl_next_malloc(&layer->impl, size);
 }
 
 static void *mallocator_monkey_calloc(void *obj, size_t nmemb, size_t size)
 {
-    mallocator_monkey_t *mallocator = mallocator_monkey_verify(obj);
-    if (mallocator_monkey_fail(mallocator))
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    if (mallocator_monkey_fail(layer))
 	return NULL;
 
-    return calloc(nmemb, size);
+    return mallocator_impl_next_calloc(&layer->impl, nmemb, size);
 }
 
 static void *mallocator_monkey_realloc(void *obj, void *ptr, size_t size, size_t new_size)
 {
-    mallocator_monkey_t *mallocator = mallocator_monkey_verify(obj);
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
     /* Don't count resize to zero 'free' as an allocation */
     if (new_size == 0)
-	return realloc(ptr, new_size);
+	return mallocator_impl_next_realloc(&layer->impl, ptr, size, new_size);
 
-    if (mallocator_monkey_fail(mallocator))
+    if (mallocator_monkey_fail(layer))
 	return NULL;
 
-    return realloc(ptr, new_size);
+    return mallocator_impl_next_realloc(&layer->impl, ptr, size, new_size);
 }
 
 static void mallocator_monkey_free(void *obj, void *ptr, size_t size)
 {
-    (void) mallocator_monkey_verify(obj);
-    free(ptr);
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    mallocator_impl_next_free(&layer->impl, ptr, size);
+}
+
+static void *mallocator_monkey_aligned_alloc(void *obj, size_t alignment, size_t size)
+{
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    if (mallocator_monkey_fail(layer))
+	return NULL;
+
+    return mallocator_impl_next_aligned_alloc(&layer->impl, alignment, size);
+}
+
+static size_t mallocator_monkey_usable_size(void *obj, void *ptr, size_t size)
+{
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    return mallocator_impl_next_usable_size(&layer->impl, ptr, size);
+}
+
+static size_t mallocator_monkey_block_size(void *obj, void *ptr)
+{
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    return mallocator_impl_next_block_size(&layer->impl, ptr);
+}
+
+static size_t mallocator_monkey_trim(void *obj, unsigned flags)
+{
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    return mallocator_impl_next_trim(&layer->impl, flags);
+}
+
+static bool mallocator_monkey_try_expand(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_monkey_layer_t *layer = mallocator_monkey_verify(obj);
+    if (mallocator_monkey_fail(layer))
+	return false;
+
+    return mallocator_impl_next_try_expand(&layer->impl, ptr, size, new_size);
 }
 
 /**************************************************************************************************/
 /* Public interface */
 
-mallocator_t *mallocator_monkey_create_random(const char *name, float p_failure, float p_recovery)
+/* Create the first layer of a tree, consuming the creation reference to monkey */
+static mallocator_impl_t *mallocator_monkey_impl_create_int(mallocator_monkey_t *monkey, mallocator_impl_t *inner)
+{
+    mallocator_monkey_layer_t *layer = mallocator_monkey_layer_create(monkey, inner);
+    mallocator_monkey_dereference(monkey);
+    if (!layer)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &layer->impl;
+}
+
+static mallocator_t *mallocator_monkey_create_mallocator(const char *name, mallocator_impl_t *impl)
+{
+    if (!impl) return NULL;
+
+    mallocator_t *m = mallocator_create_custom(name, impl);
+    if (!m)
+    {
+	mallocator_impl_destroy(impl);
+	return NULL;
+    }
+    return m;
+}
+
+mallocator_impl_t *mallocator_monkey_impl_create_random(float p_failure, float p_recovery, mallocator_impl_t *inner)
 {
     mallocator_monkey_t *mallocator = mallocator_monkey_create_int();
-    if (!mallocator) return NULL;
+    if (!mallocator)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
     mallocator->chaos.random.p_failure = p_failure;
     mallocator->chaos.random.p_recovery = p_recovery;
     mallocator->chaos.random.failing = false;
     mallocator->fn = mallocator_monkey_fail_random;
     mallocator->arg = &mallocator->chaos.random;
-    mallocator_t *m = mallocator_create_custom(name, &mallocator->impl);
-    if (!m)
-    {
-	mallocator_monkey_destroy(&mallocator->impl);
-	return NULL;
-    }
-    return m;
+    return mallocator_monkey_impl_create_int(mallocator, inner);
 }
 
-mallocator_t *mallocator_monkey_create_step(const char *name, unsigned num_success, unsigned num_failure, bool repeat)
+mallocator_impl_t *mallocator_monkey_impl_create_step(unsigned num_success, unsigned num_failure, bool repeat, mallocator_impl_t *inner)
 {
     mallocator_monkey_t *mallocator = mallocator_monkey_create_int();
-    if (!mallocator) return NULL;
+    if (!mallocator)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
     mallocator->chaos.step.num_success = num_success;
     mallocator->chaos.step.num_failure = num_failure;
     mallocator->chaos.step.repeat = repeat;
@@ -272,26 +374,33 @@ mallocator_t *mallocator_monkey_create_step(const char *name, unsigned num_succe
     mallocator->chaos.step.failed = false;
     mallocator->fn = mallocator_monkey_fail_step;
     mallocator->arg = &mallocator->chaos.step;
-    mallocator_t *m = mallocator_create_custom(name, &mallocator->impl);
-    if (!m)
-    {
-	mallocator_monkey_destroy(&mallocator->impl);
-	return NULL;
-    }
-    return m;
+    return mallocator_monkey_impl_create_int(mallocator, inner);
 }
 
-mallocator_t *mallocator_monkey_create_custom(const char *name, mallocator_monkey_fail_fn fn, void *arg)
+mallocator_impl_t *mallocator_monkey_impl_create_custom(mallocator_monkey_fail_fn fn, void *arg, mallocator_impl_t *inner)
 {
     mallocator_monkey_t *mallocator = mallocator_monkey_create_int();
-    if (!mallocator) return NULL;
-    mallocator->fn = fn;
-    mallocator->arg = arg;
-    mallocator_t *m = mallocator_create_custom(name, &mallocator->impl);
-    if (!m)
+    if (!mallocator)
     {
-	mallocator_monkey_destroy(&mallocator->impl);
+	if (inner) mallocator_impl_destroy(inner);
 	return NULL;
     }
-    return m;
+    mallocator->fn = fn;
+    mallocator->arg = arg;
+    return mallocator_monkey_impl_create_int(mallocator, inner);
+}
+
+mallocator_t *mallocator_monkey_create_random(const char *name, float p_failure, float p_recovery)
+{
+    return mallocator_monkey_create_mallocator(name, mallocator_monkey_impl_create_random(p_failure, p_recovery, NULL));
+}
+
+mallocator_t *mallocator_monkey_create_step(const char *name, unsigned num_success, unsigned num_failure, bool repeat)
+{
+    return mallocator_monkey_create_mallocator(name, mallocator_monkey_impl_create_step(num_success, num_failure, repeat, NULL));
+}
+
+mallocator_t *mallocator_monkey_create_custom(const char *name, mallocator_monkey_fail_fn fn, void *arg)
+{
+    return mallocator_monkey_create_mallocator(name, mallocator_monkey_impl_create_custom(fn, arg, NULL));
 }
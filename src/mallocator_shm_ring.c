@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+
+#include "mallocator_shm_ring.h"
+#include "mallocator_tracer.h"
+
+#include "atomic.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char mallocator_shm_ring_magic[8] = "MALLRNG";
+
+enum
+{
+    MALLOCATOR_SHM_RING_RECORD_MAX = sizeof(mallocator_shm_ring_record_t) +
+	MALLOCATOR_TRACER_BACKTRACE_MAX * sizeof(uint64_t) + ((MALLOCATOR_SHM_RING_NAME_MAX + 7) & ~7),
+};
+
+_Static_assert(sizeof(mallocator_shm_ring_header_t) == MALLOCATOR_SHM_RING_HEADER_SIZE, "shm ring header layout");
+_Static_assert(sizeof(mallocator_shm_ring_record_t) % 8 == 0, "shm ring record layout");
+
+struct mallocator_shm_ring
+{
+    mallocator_shm_ring_header_t *header;
+    uint8_t *data;
+    size_t capacity;
+    size_t map_size;
+    int fd;					/* -1 if opened */
+    char *name;					/* Shared memory object to unlink, or NULL */
+    bool failed;
+    /* Last record read */
+    uint64_t record[MALLOCATOR_SHM_RING_RECORD_MAX / sizeof(uint64_t)];
+    const void *frames[MALLOCATOR_TRACER_BACKTRACE_MAX];
+    char event_name[MALLOCATOR_SHM_RING_NAME_MAX + 1];
+};
+
+static mallocator_shm_ring_t *mallocator_shm_ring_map(int fd, size_t map_size)
+{
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    mallocator_shm_ring_t *ring = malloc(sizeof(*ring));
+    if (!ring)
+    {
+	munmap(map, map_size);
+	return NULL;
+    }
+    ring->header = map;
+    ring->data = (uint8_t *) map + MALLOCATOR_SHM_RING_HEADER_SIZE;
+    ring->capacity = map_size - MALLOCATOR_SHM_RING_HEADER_SIZE;
+    ring->map_size = map_size;
+    ring->fd = -1;
+    ring->name = NULL;
+    ring->failed = false;
+    return ring;
+}
+
+mallocator_shm_ring_t *mallocator_shm_ring_create(const char *name, size_t capacity)
+{
+    size_t data_size = MALLOCATOR_SHM_RING_CAPACITY_MIN;
+    if (capacity == 0) capacity = MALLOCATOR_SHM_RING_CAPACITY;
+    while (data_size < capacity)
+	data_size *= 2;
+    const size_t map_size = MALLOCATOR_SHM_RING_HEADER_SIZE + data_size;
+
+    const int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600) : memfd_create("mallocator_shm_ring", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+    mallocator_shm_ring_t *ring = ftruncate(fd, map_size) == 0 ? mallocator_shm_ring_map(fd, map_size) : NULL;
+    if (ring && name) ring->name = strdup(name);
+    if (!ring || (name && !ring->name))
+    {
+	if (ring) mallocator_shm_ring_destroy(ring);
+	if (name) shm_unlink(name);
+	close(fd);
+	return NULL;
+    }
+    ring->fd = fd;
+
+    /* The mapping is zeroed, so no records are written and head and tail are 0 */
+    mallocator_shm_ring_header_t *header = ring->header;
+    header->version = MALLOCATOR_SHM_RING_VERSION;
+    header->header_size = MALLOCATOR_SHM_RING_HEADER_SIZE;
+    header->capacity = data_size;
+    header->pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, mallocator_shm_ring_magic, sizeof(mallocator_shm_ring_magic));
+    return ring;
+}
+
+mallocator_shm_ring_t *mallocator_shm_ring_open(int fd)
+{
+    mallocator_shm_ring_header_t header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) return NULL;
+    if (memcmp(header.magic, mallocator_shm_ring_magic, sizeof(mallocator_shm_ring_magic)) != 0 ||
+	header.version != MALLOCATOR_SHM_RING_VERSION || header.header_size != MALLOCATOR_SHM_RING_HEADER_SIZE ||
+	header.capacity < MALLOCATOR_SHM_RING_CAPACITY_MIN || (header.capacity & (header.capacity - 1)) != 0)
+	return NULL;
+
+    /* Check the file is as large as the header claims, as the mapping would fault otherwise */
+    struct stat st;
+    const size_t map_size = MALLOCATOR_SHM_RING_HEADER_SIZE + header.capacity;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < map_size) return NULL;
+    return mallocator_shm_ring_map(fd, map_size);
+}
+
+int mallocator_shm_ring_fd(mallocator_shm_ring_t *ring)
+{
+    return ring->fd;
+}
+
+/* Copy n bytes to or from data at pos, wrapping around the end */
+static void mallocator_shm_ring_copy_in(mallocator_shm_ring_t *ring, uint64_t pos, const void *src, size_t n)
+{
+    const size_t offset = pos & (ring->capacity - 1);
+    const size_t first = ring->capacity - offset < n ? ring->capacity - offset : n;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const uint8_t *) src + first, n - first);
+}
+
+static void mallocator_shm_ring_copy_out(mallocator_shm_ring_t *ring, uint64_t pos, void *dst, size_t n)
+{
+    const size_t offset = pos & (ring->capacity - 1);
+    const size_t first = ring->capacity - offset < n ? ring->capacity - offset : n;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((uint8_t *) dst + first, ring->data, n - first);
+    memset(ring->data + offset, 0, first);
+    memset(ring->data, 0, n - first);
+}
+
+void mallocator_shm_ring_event(void *arg, const mallocator_tracer_event_t *event)
+{
+    mallocator_shm_ring_t *ring = arg;
+    mallocator_shm_ring_header_t *header = ring->header;
+
+    const size_t name_len = strnlen(event->name, MALLOCATOR_SHM_RING_NAME_MAX);
+    const size_t depth = event->backtrace_len < MALLOCATOR_TRACER_BACKTRACE_MAX ? event->backtrace_len : MALLOCATOR_TRACER_BACKTRACE_MAX;
+    const size_t size = sizeof(mallocator_shm_ring_record_t) + depth * sizeof(uint64_t) + ((name_len + 7) & ~7);
+
+    /* Reserve the record, or drop the event if the reader has not made room for it */
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    do
+    {
+	const uint64_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+	if (head + size - tail > ring->capacity)
+	{
+	    atomic_fetch_add_explicit(&header->lost, 1, memory_order_relaxed);
+	    return;
+	}
+    }
+    while (!__atomic_compare_exchange_n(&header->head, &head, head + size, true,
+	memory_order_relaxed, memory_order_relaxed));
+
+    uint64_t buffer[MALLOCATOR_SHM_RING_RECORD_MAX / sizeof(uint64_t)];
+    mallocator_shm_ring_record_t *record = (mallocator_shm_ring_record_t *) buffer;
+    *record = (mallocator_shm_ring_record_t)
+    {
+	.size = 0,
+	.type = event->type,
+	.name_len = name_len,
+	.stack = depth ? event->stack : 0,
+	.depth = depth,
+	.tid = event->tid,
+	.cpu = event->cpu,
+	.timestamp = event->timestamp,
+	.ptr = (uintptr_t) event->ptr,
+    };
+    if (!record->timestamp)
+    {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record->timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+    switch (event->type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	    record->args[0] = event->e.malloc.size;
+	    break;
+	case MALLOCATOR_TRACER_CALLOC:
+	    record->args[0] = event->e.calloc.nmemb;
+	    record->args[1] = event->e.calloc.size;
+	    break;
+	case MALLOCATOR_TRACER_REALLOC:
+	    record->args[0] = (uintptr_t) event->e.realloc.old_ptr;
+	    record->args[1] = event->e.realloc.old_size;
+	    record->args[2] = event->e.realloc.new_size;
+	    break;
+	case MALLOCATOR_TRACER_FREE:
+	    record->args[0] = event->e.free.size;
+	    break;
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    record->args[0] = event->e.aligned_alloc.alignment;
+	    record->args[1] = event->e.aligned_alloc.size;
+	    break;
+    }
+    uint64_t *frames = buffer + sizeof(*record) / sizeof(uint64_t);
+    for (size_t i = 0; i < depth; i++)
+	frames[i] = (uintptr_t) event->backtrace[i];
+    char *name = (char *) (frames + depth);
+    memcpy(name, event->name, name_len);
+    memset(name + name_len, 0, ((name_len + 7) & ~7) - name_len);
+
+    /* Records are aligned to 8 bytes, so the size never wraps and is stored last */
+    mallocator_shm_ring_copy_in(ring, head + sizeof(record->size), (const uint8_t *) buffer + sizeof(record->size),
+	size - sizeof(record->size));
+    atomic_store_explicit((uint32_t *) (ring->data + (head & (ring->capacity - 1))), size, memory_order_release);
+    atomic_fetch_add_explicit(&header->events, 1, memory_order_relaxed);
+}
+
+/* Decode the last record read into event */
+static bool mallocator_shm_ring_decode(mallocator_shm_ring_t *ring, size_t size, mallocator_tracer_event_t *event)
+{
+    const mallocator_shm_ring_record_t *record = (const mallocator_shm_ring_record_t *) ring->record;
+    if (record->depth > MALLOCATOR_TRACER_BACKTRACE_MAX || record->name_len > MALLOCATOR_SHM_RING_NAME_MAX ||
+	record->type > MALLOCATOR_TRACER_ALIGNED_ALLOC ||
+	size != sizeof(*record) + record->depth * sizeof(uint64_t) + ((record->name_len + 7) & ~7))
+	return false;
+
+    const uint64_t *frames = ring->record + sizeof(*record) / sizeof(uint64_t);
+    for (size_t i = 0; i < record->depth; i++)
+	ring->frames[i] = (const void *) (uintptr_t) frames[i];
+    memcpy(ring->event_name, frames + record->depth, record->name_len);
+    ring->event_name[record->name_len] = '\0';
+
+    memset(event, 0, sizeof(*event));
+    event->name = ring->event_name;
+    event->type = record->type;
+    event->ptr = (void *) (uintptr_t) record->ptr;
+    event->stack = record->stack;
+    event->backtrace = record->depth ? ring->frames : NULL;
+    event->backtrace_len = record->depth;
+    event->timestamp = record->timestamp;
+    event->tid = record->tid;
+    event->cpu = record->cpu;
+    switch (event->type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	    event->e.malloc.size = record->args[0];
+	    break;
+	case MALLOCATOR_TRACER_CALLOC:
+	    event->e.calloc.nmemb = record->args[0];
+	    event->e.calloc.size = record->args[1];
+	    break;
+	case MALLOCATOR_TRACER_REALLOC:
+	    event->e.realloc.old_ptr = (void *) (uintptr_t) record->args[0];
+	    event->e.realloc.old_size = record->args[1];
+	    event->e.realloc.new_size = record->args[2];
+	    break;
+	case MALLOCATOR_TRACER_FREE:
+	    event->e.free.size = record->args[0];
+	    break;
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    event->e.aligned_alloc.alignment = record->args[0];
+	    event->e.aligned_alloc.size = record->args[1];
+	    break;
+    }
+    return true;
+}
+
+bool mallocator_shm_ring_read(mallocator_shm_ring_t *ring, mallocator_tracer_event_t *event)
+{
+    if (ring->failed) return false;
+
+    mallocator_shm_ring_header_t *header = ring->header;
+    const uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    const uint32_t size = atomic_load_explicit((uint32_t *) (ring->data + (tail & (ring->capacity - 1))), memory_order_acquire);
+    if (size == 0) return false;
+    if (size % 8 != 0 || size < sizeof(mallocator_shm_ring_record_t) || size > MALLOCATOR_SHM_RING_RECORD_MAX)
+    {
+	ring->failed = true;
+	return false;
+    }
+
+    /* Zero the record so its bytes read as unwritten when producers reuse them */
+    mallocator_shm_ring_copy_out(ring, tail, ring->record, size);
+    atomic_store_explicit(&header->tail, tail + size, memory_order_release);
+
+    ring->failed = !mallocator_shm_ring_decode(ring, size, event);
+    return !ring->failed;
+}
+
+bool mallocator_shm_ring_failed(mallocator_shm_ring_t *ring)
+{
+    return ring->failed;
+}
+
+size_t mallocator_shm_ring_lost(mallocator_shm_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->header->lost, memory_order_relaxed);
+}
+
+int mallocator_shm_ring_pid(mallocator_shm_ring_t *ring)
+{
+    return ring->header->pid;
+}
+
+void mallocator_shm_ring_destroy(mallocator_shm_ring_t *ring)
+{
+    assert(munmap(ring->header, ring->map_size) == 0);
+    if (ring->name)
+    {
+	shm_unlink(ring->name);
+	free(ring->name);
+    }
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
+}
@@ -0,0 +1,900 @@
+#define _GNU_SOURCE
+
+#include "mallocator_tlsf.h"
+#include "mallocator.h"
+#include "mallocator_impl.h"
+
+#include "atomic.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Free blocks are kept in segregated lists indexed by a first level (power of two size class)
+ * and a second level (linear subdivision of the size class). Bitmaps of non-empty lists allow
+ * a suitable list to be found with two find-first-set operations.
+ */
+enum
+{
+    TLSF_ALIGN_LOG2 = 4,
+    TLSF_ALIGN = 1 << TLSF_ALIGN_LOG2,
+    TLSF_SL_COUNT_LOG2 = 5,
+    TLSF_SL_COUNT = 1 << TLSF_SL_COUNT_LOG2,
+    TLSF_FL_SHIFT = TLSF_SL_COUNT_LOG2 + TLSF_ALIGN_LOG2,
+    TLSF_FL_MAX = 40,
+    TLSF_FL_COUNT = TLSF_FL_MAX - TLSF_FL_SHIFT + 1,
+    TLSF_SMALL_BLOCK = 1 << TLSF_FL_SHIFT,
+    TLSF_PURGE_CHUNK = 256 * 1024,	/* Most bytes taken out of the free lists at once while purging */
+    TLSF_PURGE_WALK = 64,		/* Most free blocks visited per pool lock hold while purging */
+};
+
+_Static_assert(MALLOCATOR_TLSF_POOL_MAX == (size_t) 1 << TLSF_FL_MAX, "TLSF pool limit");
+
+/* Block size flags, stored in the low bits of the size */
+enum
+{
+    TLSF_BLOCK_FREE = 1 << 0,
+    TLSF_BLOCK_PURGED = 1 << 1,		/* Free block purged, cleared when it leaves the free lists */
+    TLSF_BLOCK_FLAGS = TLSF_BLOCK_FREE | TLSF_BLOCK_PURGED,
+};
+
+typedef struct mallocator_tlsf_block mallocator_tlsf_block_t;
+
+struct mallocator_tlsf_block
+{
+    mallocator_tlsf_block_t *prev_phys;	/* Physically previous block (NULL for the first) */
+    size_t size;			/* Payload size and flags */
+    mallocator_tlsf_block_t *next_free;	/* Free list links - overlay the payload */
+    mallocator_tlsf_block_t *prev_free;
+};
+
+enum
+{
+    TLSF_BLOCK_HEADER = offsetof(mallocator_tlsf_block_t, next_free),
+    TLSF_BLOCK_MIN = sizeof(mallocator_tlsf_block_t) - TLSF_BLOCK_HEADER,
+};
+
+typedef struct
+{
+    mallocator_impl_t impl;
+    pthread_mutex_t lock;
+    unsigned ref_count;		/* Protected by lock */
+    atomic_flag pool_lock;	/* Spin lock protecting the pool */
+    void *pool;			/* Start of the managed pool */
+    size_t pool_size;
+    bool pool_mapped;		/* Whether the pool should be unmapped on destruction */
+    size_t bytes_free;		/* Protected by pool_lock */
+    size_t blocks_free;		/* Protected by pool_lock */
+    uint32_t fl_bitmap;		/* Protected by pool_lock */
+    uint32_t sl_bitmap[TLSF_FL_COUNT];	/* Protected by pool_lock */
+    mallocator_tlsf_block_t *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];	/* Protected by pool_lock */
+    mallocator_tlsf_block_t *purge_block;	/* Free block at the purge position, cleared if it leaves the
+					   free lists. Protected by pool_lock */
+} mallocator_tlsf_t;
+
+/**************************************************************************************************/
+/* mallocator_t interface */
+
+static mallocator_impl_t *mallocator_tlsf_create_child(void *parent_obj, const char *name);
+static void mallocator_tlsf_destroy(void *obj);
+static void *mallocator_tlsf_malloc(void *obj, size_t size);
+static void *mallocator_tlsf_calloc(void *obj, size_t nmemb, size_t size);
+static void *mallocator_tlsf_realloc(void *obj, void *ptr, size_t size, size_t new_size);
+static void mallocator_tlsf_free(void *obj, void *p, size_t size);
+static void *mallocator_tlsf_aligned_alloc(void *obj, size_t alignment, size_t size);
+static size_t mallocator_tlsf_malloc_batch(void *obj, size_t size, size_t n, void **ptrs);
+static void mallocator_tlsf_free_batch(void *obj, void **ptrs, size_t size, size_t n);
+static size_t mallocator_tlsf_usable_size(void *obj, void *ptr, size_t size);
+static size_t mallocator_tlsf_block_size(void *obj, void *ptr);
+static bool mallocator_tlsf_try_expand(void *obj, void *ptr, size_t size, size_t new_size);
+static size_t mallocator_tlsf_trim(void *obj, unsigned flags);
+
+static mallocator_interface_t mallocator_tlsf_interface =
+{
+    .create_child = mallocator_tlsf_create_child,
+    .destroy = mallocator_tlsf_destroy,
+    .malloc = mallocator_tlsf_malloc,
+    .calloc = mallocator_tlsf_calloc,
+    .realloc = mallocator_tlsf_realloc,
+    .free = mallocator_tlsf_free,
+    .aligned_alloc = mallocator_tlsf_aligned_alloc,
+    .malloc_batch = mallocator_tlsf_malloc_batch,
+    .free_batch = mallocator_tlsf_free_batch,
+    .usable_size = mallocator_tlsf_usable_size,
+    .block_size = mallocator_tlsf_block_size,
+    .try_expand = mallocator_tlsf_try_expand,
+    .trim = mallocator_tlsf_trim,
+};
+
+/**************************************************************************************************/
+/* Block utils */
+
+static inline size_t tlsf_block_size(const mallocator_tlsf_block_t *block)
+{
+    return block->size & ~(size_t) TLSF_BLOCK_FLAGS;
+}
+
+static inline void tlsf_block_set_size(mallocator_tlsf_block_t *block, size_t size)
+{
+    block->size = size | (block->size & TLSF_BLOCK_FLAGS);
+}
+
+static inline bool tlsf_block_is_free(const mallocator_tlsf_block_t *block)
+{
+    return block->size & TLSF_BLOCK_FREE;
+}
+
+static inline void tlsf_block_set_free(mallocator_tlsf_block_t *block, bool free)
+{
+    if (free) block->size |= TLSF_BLOCK_FREE;
+    else block->size &= ~(size_t) TLSF_BLOCK_FREE;
+}
+
+static inline void *tlsf_block_to_ptr(mallocator_tlsf_block_t *block)
+{
+    return (char *) block + TLSF_BLOCK_HEADER;
+}
+
+static inline mallocator_tlsf_block_t *tlsf_block_from_ptr(void *ptr)
+{
+    return (mallocator_tlsf_block_t *) ((char *) ptr - TLSF_BLOCK_HEADER);
+}
+
+static inline mallocator_tlsf_block_t *tlsf_block_next(mallocator_tlsf_block_t *block)
+{
+    return (mallocator_tlsf_block_t *) ((char *) tlsf_block_to_ptr(block) + tlsf_block_size(block));
+}
+
+static inline size_t tlsf_align_up(size_t size)
+{
+    return (size + TLSF_ALIGN - 1) & ~(size_t) (TLSF_ALIGN - 1);
+}
+
+/* Return the block payload size for a request, or 0 if the request is too large */
+static inline size_t tlsf_adjust_size(size_t size)
+{
+    if (size > ((size_t) 1 << TLSF_FL_MAX) - TLSF_ALIGN) return 0;
+    const size_t adjusted = tlsf_align_up(size);
+    return adjusted < TLSF_BLOCK_MIN ? TLSF_BLOCK_MIN : adjusted;
+}
+
+/* Index of the most significant set bit */
+static inline unsigned tlsf_fls(size_t x)
+{
+    return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(x);
+}
+
+static inline unsigned tlsf_ffs(uint32_t x)
+{
+    return __builtin_ctz(x);
+}
+
+static inline void tlsf_mapping_insert(size_t size, unsigned *fl, unsigned *sl)
+{
+    if (size < TLSF_SMALL_BLOCK)
+    {
+	*fl = 0;
+	*sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+    }
+    else
+    {
+	const unsigned f = tlsf_fls(size);
+	*sl = (size >> (f - TLSF_SL_COUNT_LOG2)) ^ TLSF_SL_COUNT;
+	*fl = f - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+/* Round the size up to the next list so that any block in that list is large enough */
+static inline void tlsf_mapping_search(size_t size, unsigned *fl, unsigned *sl)
+{
+    if (size >= TLSF_SMALL_BLOCK)
+	size += ((size_t) 1 << (tlsf_fls(size) - TLSF_SL_COUNT_LOG2)) - 1;
+    tlsf_mapping_insert(size, fl, sl);
+}
+
+/**************************************************************************************************/
+/* Pool management - all called with the pool lock held */
+
+static void tlsf_remove_free(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block, unsigned fl, unsigned sl)
+{
+    block->size &= ~(size_t) TLSF_BLOCK_PURGED;
+    if (tlsf->purge_block == block) tlsf->purge_block = NULL;
+
+    mallocator_tlsf_block_t *prev = block->prev_free;
+    mallocator_tlsf_block_t *next = block->next_free;
+    if (next) next->prev_free = prev;
+    if (prev) prev->next_free = next;
+
+    if (tlsf->blocks[fl][sl] == block)
+    {
+	tlsf->blocks[fl][sl] = next;
+	if (!next)
+	{
+	    tlsf->sl_bitmap[fl] &= ~(1U << sl);
+	    if (!tlsf->sl_bitmap[fl])
+		tlsf->fl_bitmap &= ~(1U << fl);
+	}
+    }
+    tlsf->bytes_free -= tlsf_block_size(block);
+    tlsf->blocks_free--;
+}
+
+static void tlsf_remove_block(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block)
+{
+    unsigned fl, sl;
+    tlsf_mapping_insert(tlsf_block_size(block), &fl, &sl);
+    tlsf_remove_free(tlsf, block, fl, sl);
+}
+
+static void tlsf_insert_block(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block)
+{
+    unsigned fl, sl;
+    tlsf_mapping_insert(tlsf_block_size(block), &fl, &sl);
+    mallocator_tlsf_block_t *head = tlsf->blocks[fl][sl];
+    block->next_free = head;
+    block->prev_free = NULL;
+    if (head) head->prev_free = block;
+    tlsf->blocks[fl][sl] = block;
+    tlsf->fl_bitmap |= 1U << fl;
+    tlsf->sl_bitmap[fl] |= 1U << sl;
+    tlsf->bytes_free += tlsf_block_size(block);
+    tlsf->blocks_free++;
+}
+
+static mallocator_tlsf_block_t *tlsf_search_block(mallocator_tlsf_t *tlsf, unsigned *fl, unsigned *sl)
+{
+    if (*fl >= TLSF_FL_COUNT) return NULL;
+
+    uint32_t sl_map = tlsf->sl_bitmap[*fl] & (~0U << *sl);
+    if (!sl_map)
+    {
+	const uint32_t fl_map = *fl + 1 < TLSF_FL_COUNT ? tlsf->fl_bitmap & (~0U << (*fl + 1)) : 0;
+	if (!fl_map) return NULL;
+	*fl = tlsf_ffs(fl_map);
+	sl_map = tlsf->sl_bitmap[*fl];
+    }
+    *sl = tlsf_ffs(sl_map);
+    return tlsf->blocks[*fl][*sl];
+}
+
+/* Split the tail off a block if it is large enough to form a new block, returning the tail */
+static mallocator_tlsf_block_t *tlsf_split(mallocator_tlsf_block_t *block, size_t size)
+{
+    const size_t block_size = tlsf_block_size(block);
+    if (block_size < size + TLSF_BLOCK_HEADER + TLSF_BLOCK_MIN) return NULL;
+
+    mallocator_tlsf_block_t *tail = (mallocator_tlsf_block_t *) ((char *) tlsf_block_to_ptr(block) + size);
+    tail->prev_phys = block;
+    tail->size = block_size - size - TLSF_BLOCK_HEADER;
+    tlsf_block_next(tail)->prev_phys = tail;
+    tlsf_block_set_size(block, size);
+    return tail;
+}
+
+/* Absorb the physically next block into block */
+static void tlsf_absorb(mallocator_tlsf_block_t *block, mallocator_tlsf_block_t *next)
+{
+    tlsf_block_set_size(block, tlsf_block_size(block) + TLSF_BLOCK_HEADER + tlsf_block_size(next));
+    tlsf_block_next(block)->prev_phys = block;
+}
+
+/*
+ * Mark a block free, coalesce it with its free neighbours and insert it into the free lists,
+ * returning the block inserted
+ */
+static mallocator_tlsf_block_t *tlsf_release(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block)
+{
+    tlsf_block_set_free(block, true);
+
+    mallocator_tlsf_block_t *next = tlsf_block_next(block);
+    if (tlsf_block_is_free(next))
+    {
+	tlsf_remove_block(tlsf, next);
+	tlsf_absorb(block, next);
+    }
+
+    mallocator_tlsf_block_t *prev = block->prev_phys;
+    if (prev && tlsf_block_is_free(prev))
+    {
+	tlsf_remove_block(tlsf, prev);
+	tlsf_absorb(prev, block);
+	block = prev;
+    }
+
+    tlsf_insert_block(tlsf, block);
+    return block;
+}
+
+/* Trim a used block down to size, returning the tail to the pool */
+static void tlsf_trim_used(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block, size_t size)
+{
+    mallocator_tlsf_block_t *tail = tlsf_split(block, size);
+    if (tail) tlsf_release(tlsf, tail);
+}
+
+static void *tlsf_malloc(mallocator_tlsf_t *tlsf, size_t size)
+{
+    const size_t adjusted = tlsf_adjust_size(size);
+    if (!adjusted) return NULL;
+
+    unsigned fl, sl;
+    tlsf_mapping_search(adjusted, &fl, &sl);
+    mallocator_tlsf_block_t *block = tlsf_search_block(tlsf, &fl, &sl);
+    if (!block) return NULL;
+
+    tlsf_remove_free(tlsf, block, fl, sl);
+    tlsf_block_set_free(block, false);
+    tlsf_trim_used(tlsf, block, adjusted);
+    return tlsf_block_to_ptr(block);
+}
+
+static void *tlsf_aligned_alloc(mallocator_tlsf_t *tlsf, size_t alignment, size_t size)
+{
+    if (alignment <= TLSF_ALIGN) return tlsf_malloc(tlsf, size);
+
+    const size_t adjusted = tlsf_adjust_size(size);
+    if (!adjusted) return NULL;
+
+    /* Search for enough space to leave a free block in front of an aligned payload */
+    const size_t gap_min = TLSF_BLOCK_HEADER + TLSF_BLOCK_MIN;
+    if (adjusted > SIZE_MAX - alignment - gap_min) return NULL;
+    const size_t search = tlsf_adjust_size(adjusted + alignment + gap_min);
+    if (!search) return NULL;
+
+    unsigned fl, sl;
+    tlsf_mapping_search(search, &fl, &sl);
+    mallocator_tlsf_block_t *block = tlsf_search_block(tlsf, &fl, &sl);
+    if (!block) return NULL;
+
+    tlsf_remove_free(tlsf, block, fl, sl);
+    tlsf_block_set_free(block, false);
+
+    const uintptr_t ptr = (uintptr_t) tlsf_block_to_ptr(block);
+    if (ptr & (alignment - 1))
+    {
+	/* Split off the front of the block, leaving room for at least a minimum block */
+	const uintptr_t aligned = (ptr + gap_min + alignment - 1) & ~(uintptr_t) (alignment - 1);
+	mallocator_tlsf_block_t *aligned_block = tlsf_split(block, aligned - ptr - TLSF_BLOCK_HEADER);
+	assert(aligned_block && tlsf_block_to_ptr(aligned_block) == (void *) aligned);
+	tlsf_release(tlsf, block);
+	block = aligned_block;
+    }
+    tlsf_trim_used(tlsf, block, adjusted);
+    return tlsf_block_to_ptr(block);
+}
+
+/* Carve n blocks from a single free block (slab), returning false if no block is large enough */
+static bool tlsf_malloc_slab(mallocator_tlsf_t *tlsf, size_t size, size_t n, void **ptrs)
+{
+    const size_t adjusted = tlsf_adjust_size(size);
+    if (!adjusted || n > (((size_t) 1 << TLSF_FL_MAX) + TLSF_BLOCK_HEADER) / (adjusted + TLSF_BLOCK_HEADER))
+	return false;
+
+    const size_t slab = tlsf_adjust_size(n * (adjusted + TLSF_BLOCK_HEADER) - TLSF_BLOCK_HEADER);
+    if (!slab) return false;
+
+    unsigned fl, sl;
+    tlsf_mapping_search(slab, &fl, &sl);
+    mallocator_tlsf_block_t *block = tlsf_search_block(tlsf, &fl, &sl);
+    if (!block) return false;
+
+    tlsf_remove_free(tlsf, block, fl, sl);
+    tlsf_block_set_free(block, false);
+    for (size_t i = 0; i < n - 1; i++)
+    {
+	ptrs[i] = tlsf_block_to_ptr(block);
+	block = tlsf_split(block, adjusted);
+	assert(block);
+    }
+    ptrs[n - 1] = tlsf_block_to_ptr(block);
+    tlsf_trim_used(tlsf, block, adjusted);
+    return true;
+}
+
+static size_t tlsf_malloc_batch(mallocator_tlsf_t *tlsf, size_t size, size_t n, void **ptrs)
+{
+    if (n == 0) return 0;
+    if (tlsf_malloc_slab(tlsf, size, n, ptrs)) return n;
+
+    /* Fall back to individual blocks if the pool is too fragmented */
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+	ptrs[i] = tlsf_malloc(tlsf, size);
+	if (!ptrs[i]) break;
+    }
+    return i;
+}
+
+static void tlsf_free(mallocator_tlsf_t *tlsf, void *ptr)
+{
+    mallocator_tlsf_block_t *block = tlsf_block_from_ptr(ptr);
+    assert(!tlsf_block_is_free(block));
+    tlsf_release(tlsf, block);
+}
+
+/* Resize a block without moving it, returning false if there is insufficient space */
+static bool tlsf_resize(mallocator_tlsf_t *tlsf, void *ptr, size_t new_size)
+{
+    const size_t adjusted = tlsf_adjust_size(new_size);
+    if (!adjusted) return false;
+
+    mallocator_tlsf_block_t *block = tlsf_block_from_ptr(ptr);
+    const size_t size = tlsf_block_size(block);
+    if (adjusted > size)
+    {
+	mallocator_tlsf_block_t *next = tlsf_block_next(block);
+	if (!tlsf_block_is_free(next) || size + TLSF_BLOCK_HEADER + tlsf_block_size(next) < adjusted)
+	    return false;
+	tlsf_remove_block(tlsf, next);
+	tlsf_absorb(block, next);
+    }
+    tlsf_trim_used(tlsf, block, adjusted);
+    return true;
+}
+
+static void tlsf_pool_init(mallocator_tlsf_t *tlsf, void *pool, size_t pool_size)
+{
+    /* Align the pool and reserve space for a zero sized sentinel block at the end */
+    const uintptr_t start = tlsf_align_up((uintptr_t) pool);
+    const uintptr_t end = ((uintptr_t) pool + pool_size) & ~(uintptr_t) (TLSF_ALIGN - 1);
+    mallocator_tlsf_block_t *block = (mallocator_tlsf_block_t *) start;
+    block->prev_phys = NULL;
+    block->size = end - start - 2 * TLSF_BLOCK_HEADER;
+
+    mallocator_tlsf_block_t *sentinel = tlsf_block_next(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+
+    tlsf_release(tlsf, block);
+}
+
+/**************************************************************************************************/
+/* Purging - called without the pool lock */
+
+/* Return the resident bytes of the page aligned range [start, start + len) */
+static size_t tlsf_resident(char *start, size_t len, size_t page_size)
+{
+    unsigned char vec[256];
+    size_t resident = 0;
+    for (size_t offset = 0; offset < len; offset += sizeof(vec) * page_size)
+    {
+	const size_t chunk = len - offset < sizeof(vec) * page_size ? len - offset : sizeof(vec) * page_size;
+	if (mincore(start + offset, chunk, vec) != 0) break;
+	for (size_t i = 0; i < chunk / page_size; i++)
+	{
+	    if (vec[i] & 1) resident += page_size;
+	}
+    }
+    return resident;
+}
+
+static inline void tlsf_lock(mallocator_tlsf_t *tlsf)
+{
+    while (atomic_flag_test_and_set_explicit(&tlsf->pool_lock, memory_order_acquire))
+    {
+	while (atomic_load_explicit(&tlsf->pool_lock, memory_order_relaxed))
+	    ;
+    }
+}
+
+static inline void tlsf_unlock(mallocator_tlsf_t *tlsf)
+{
+    atomic_flag_clear_explicit(&tlsf->pool_lock, memory_order_release);
+}
+
+/*
+ * Take the pages [start, end) of a free block out of the free lists to be discarded, as a block
+ * which looks used to its neighbours. The head and any tail of the block stay free.
+ */
+static mallocator_tlsf_block_t *tlsf_purge_take(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block,
+    uintptr_t start, uintptr_t end)
+{
+    tlsf_remove_block(tlsf, block);
+    mallocator_tlsf_block_t *chunk = tlsf_split(block, start - TLSF_BLOCK_HEADER - (uintptr_t) tlsf_block_to_ptr(block));
+    assert(chunk && !tlsf_block_is_free(chunk));
+    tlsf_insert_block(tlsf, block);
+
+    mallocator_tlsf_block_t *tail = tlsf_split(chunk, end - start);
+    if (tail)
+    {
+	tlsf_block_set_free(tail, true);
+	tlsf_insert_block(tlsf, tail);
+    }
+    return chunk;
+}
+
+/*
+ * Discard the whole pages of a free block, a chunk at a time. Each chunk is taken out of the free
+ * lists and the pool lock dropped while it is discarded, so allocations never wait for a purge.
+ * Released chunks coalesce back, and the purge goes on while the rest of the block stays free.
+ * The block is flagged purged if it is intact at the end. Called and returns with the pool lock held.
+ */
+static size_t tlsf_purge(mallocator_tlsf_t *tlsf, mallocator_tlsf_block_t *block, size_t page_size)
+{
+    const mallocator_tlsf_block_t *first = block;
+    const size_t size = tlsf_block_size(block);
+
+    /* The free list links and the header of each chunk stay in use */
+    uintptr_t start = ((uintptr_t) tlsf_block_to_ptr(block) + TLSF_BLOCK_MIN + TLSF_BLOCK_HEADER + page_size - 1) &
+	~(uintptr_t) (page_size - 1);
+    size_t released = 0;
+    for (;;)
+    {
+	const uintptr_t end = (uintptr_t) tlsf_block_next(block) & ~(uintptr_t) (page_size - 1);
+	if (start >= end || (uintptr_t) block > start - TLSF_BLOCK_HEADER - TLSF_BLOCK_MIN - TLSF_BLOCK_HEADER) break;
+
+	const uintptr_t chunk_end = end - start > TLSF_PURGE_CHUNK ? start + TLSF_PURGE_CHUNK : end;
+	mallocator_tlsf_block_t *chunk = tlsf_purge_take(tlsf, block, start, chunk_end);
+	tlsf_unlock(tlsf);
+
+	const size_t resident = tlsf_resident((char *) start, chunk_end - start, page_size);
+	if (resident && madvise((void *) start, chunk_end - start, MADV_DONTNEED) == 0) released += resident;
+
+	tlsf_lock(tlsf);
+	block = tlsf_release(tlsf, chunk);
+	start = chunk_end;
+    }
+
+    if (block == first && tlsf_block_size(block) == size) block->size |= TLSF_BLOCK_PURGED;
+    return released;
+}
+
+/**************************************************************************************************/
+
+static inline mallocator_tlsf_t *mallocator_tlsf_verify(void *obj)
+{
+    mallocator_tlsf_t *mallocator = obj;
+    assert(mallocator);
+    assert(mallocator->ref_count > 0);
+    return mallocator;
+}
+
+static void mallocator_tlsf_init(mallocator_tlsf_t *mallocator, void *pool, size_t pool_size, bool pool_mapped)
+{
+    *mallocator = (mallocator_tlsf_t)
+    {
+	.impl =
+	{
+	    .obj = mallocator,
+	    .interface = &mallocator_tlsf_interface,
+	},
+	.ref_count = 1,
+	.pool_lock = 0,
+	.pool = pool,
+	.pool_size = pool_size,
+	.pool_mapped = pool_mapped,
+	.bytes_free = 0,
+	.blocks_free = 0,
+	.fl_bitmap = 0,
+    };
+    assert(pthread_mutex_init(&mallocator->lock, NULL) == 0);
+    tlsf_pool_init(mallocator, pool, pool_size);
+}
+
+static void mallocator_tlsf_fini(mallocator_tlsf_t *mallocator)
+{
+    assert(pthread_mutex_destroy(&mallocator->lock) == 0);
+    if (mallocator->pool_mapped)
+	munmap(mallocator->pool, mallocator->pool_size);
+    *mallocator = (mallocator_tlsf_t)
+    {
+	.impl =
+	{
+	    .obj = NULL,
+	    .interface = NULL,
+	},
+	.ref_count = 0,
+	.pool = NULL,
+	.pool_size = 0,
+    };
+}
+
+static inline void mallocator_tlsf_lock(mallocator_tlsf_t *mallocator)
+{
+    assert(pthread_mutex_lock(&mallocator->lock) == 0);
+}
+
+static inline void mallocator_tlsf_unlock(mallocator_tlsf_t *mallocator)
+{
+    assert(pthread_mutex_unlock(&mallocator->lock) == 0);
+}
+
+static mallocator_tlsf_t *mallocator_tlsf_create_int(void *pool, size_t pool_size, bool pool_mapped)
+{
+    /* Must fit a minimum block and the sentinel, and blocks must map to a first level list */
+    if (pool_size < 2 * TLSF_ALIGN + 2 * TLSF_BLOCK_HEADER + TLSF_BLOCK_MIN) return NULL;
+    if (pool_size >= MALLOCATOR_TLSF_POOL_MAX) return NULL;
+
+    mallocator_tlsf_t *mallocator = malloc(sizeof(*mallocator));
+    if (!mallocator) return NULL;
+
+    mallocator_tlsf_init(mallocator, pool, pool_size, pool_mapped);
+    return mallocator;
+}
+
+static void mallocator_tlsf_reference(mallocator_tlsf_t *mallocator)
+{
+    mallocator_tlsf_lock(mallocator);
+    mallocator->ref_count++;
+    mallocator_tlsf_unlock(mallocator);
+}
+
+static void mallocator_tlsf_dereference(mallocator_tlsf_t *mallocator)
+{
+    mallocator_tlsf_lock(mallocator);
+    mallocator->ref_count--;
+    const bool destroy = mallocator->ref_count == 0;
+    mallocator_tlsf_unlock(mallocator);
+
+    if (destroy)
+    {
+	mallocator_tlsf_fini(mallocator);
+	free(mallocator);
+    }
+}
+
+static mallocator_impl_t *mallocator_tlsf_create_child(void *parent_obj, const char *name)
+{
+    mallocator_tlsf_t *parent = mallocator_tlsf_verify(parent_obj);
+    mallocator_tlsf_reference(parent);
+    return &parent->impl;
+}
+
+static void mallocator_tlsf_destroy(void *obj)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    mallocator_tlsf_dereference(mallocator);
+}
+
+static void *mallocator_tlsf_malloc(void *obj, size_t size)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    tlsf_lock(mallocator);
+    void *ptr = tlsf_malloc(mallocator, size);
+    tlsf_unlock(mallocator);
+    return ptr;
+}
+
+static void *mallocator_tlsf_calloc(void *obj, size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+	return NULL;
+
+    void *ptr = mallocator_tlsf_malloc(obj, total);
+    if (ptr) memset(ptr, 0, total);
+    return ptr;
+}
+
+static void *mallocator_tlsf_realloc(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    if (!ptr)
+	return mallocator_tlsf_malloc(obj, new_size);
+
+    if (new_size == 0)
+    {
+	mallocator_tlsf_free(obj, ptr, size);
+	return NULL;
+    }
+
+    tlsf_lock(mallocator);
+    const bool resized = tlsf_resize(mallocator, ptr, new_size);
+    tlsf_unlock(mallocator);
+    if (resized) return ptr;
+
+    void *new_ptr = mallocator_tlsf_malloc(obj, new_size);
+    if (!new_ptr) return NULL;
+
+    memcpy(new_ptr, ptr, size < new_size ? size : new_size);
+    mallocator_tlsf_free(obj, ptr, size);
+    return new_ptr;
+}
+
+static void mallocator_tlsf_free(void *obj, void *ptr, size_t size)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    if (!ptr) return;
+
+    tlsf_lock(mallocator);
+    tlsf_free(mallocator, ptr);
+    tlsf_unlock(mallocator);
+}
+
+static void *mallocator_tlsf_aligned_alloc(void *obj, size_t alignment, size_t size)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    tlsf_lock(mallocator);
+    void *ptr = tlsf_aligned_alloc(mallocator, alignment, size);
+    tlsf_unlock(mallocator);
+    return ptr;
+}
+
+static size_t mallocator_tlsf_malloc_batch(void *obj, size_t size, size_t n, void **ptrs)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    tlsf_lock(mallocator);
+    const size_t allocated = tlsf_malloc_batch(mallocator, size, n, ptrs);
+    tlsf_unlock(mallocator);
+    return allocated;
+}
+
+static void mallocator_tlsf_free_batch(void *obj, void **ptrs, size_t size, size_t n)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    tlsf_lock(mallocator);
+    for (size_t i = 0; i < n; i++)
+    {
+	if (ptrs[i]) tlsf_free(mallocator, ptrs[i]);
+    }
+    tlsf_unlock(mallocator);
+}
+
+static size_t mallocator_tlsf_usable_size(void *obj, void *ptr, size_t size)
+{
+    (void) mallocator_tlsf_verify(obj);
+    /* The block size of a used block is stable without the pool lock */
+    return tlsf_block_size(tlsf_block_from_ptr(ptr));
+}
+
+static size_t mallocator_tlsf_block_size(void *obj, void *ptr)
+{
+    (void) mallocator_tlsf_verify(obj);
+    return tlsf_block_size(tlsf_block_from_ptr(ptr));
+}
+
+static bool mallocator_tlsf_try_expand(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+    tlsf_lock(mallocator);
+    const bool expanded = tlsf_resize(mallocator, ptr, new_size);
+    tlsf_unlock(mallocator);
+    return expanded;
+}
+
+static size_t mallocator_tlsf_trim(void *obj, unsigned flags)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(obj);
+
+    /* The pool is kept resident for latency, so is only released when purging */
+    if (!(flags & MALLOCATOR_TRIM_PURGE)) return 0;
+
+    /*
+     * Free blocks large enough to hold a page are purged a chunk at a time (see tlsf_purge). The
+     * free lists are walked rather than the whole pool, and the pool lock is dropped every
+     * TLSF_PURGE_WALK blocks, with purge_block as the walk position. Purged blocks are flagged
+     * until they leave the free lists, as they cannot grow without leaving them, so are skipped
+     * by later walks, which restart from the list head after each purge.
+     */
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    unsigned fl, sl;
+    tlsf_mapping_insert(page_size, &fl, &sl);
+    size_t released = 0;
+
+    /* One purge at a time */
+    mallocator_tlsf_lock(mallocator);
+    tlsf_lock(mallocator);
+    mallocator_tlsf_block_t *block = mallocator->blocks[fl][sl];
+    for (unsigned walked = 1; ; walked++)
+    {
+	if (!block)
+	{
+	    if (++sl == TLSF_SL_COUNT)
+	    {
+		sl = 0;
+		if (++fl == TLSF_FL_COUNT) break;
+	    }
+	    block = mallocator->blocks[fl][sl];
+	}
+	else if (block->size & TLSF_BLOCK_PURGED)
+	{
+	    block = block->next_free;
+	}
+	else
+	{
+	    released += tlsf_purge(mallocator, block, page_size);
+	    block = mallocator->blocks[fl][sl];
+	    walked = 0;
+	}
+
+	if (walked == TLSF_PURGE_WALK)
+	{
+	    /* Resume from the list head if the position left the free lists meanwhile */
+	    mallocator->purge_block = block;
+	    tlsf_unlock(mallocator);
+	    tlsf_lock(mallocator);
+	    if (block && mallocator->purge_block != block) block = mallocator->blocks[fl][sl];
+	    walked = 0;
+	}
+    }
+    mallocator->purge_block = NULL;
+    tlsf_unlock(mallocator);
+    mallocator_tlsf_unlock(mallocator);
+    return released;
+}
+
+/**************************************************************************************************/
+/* Public interface */
+
+static mallocator_t *mallocator_tlsf_create_custom(const char *name, mallocator_impl_t *impl)
+{
+    if (!impl) return NULL;
+
+    mallocator_t *m = mallocator_create_custom(name, impl);
+    if (!m)
+    {
+	mallocator_impl_destroy(impl);
+	return NULL;
+    }
+    return m;
+}
+
+mallocator_t *mallocator_tlsf_create(const char *name, size_t pool_size)
+{
+    return mallocator_tlsf_create_custom(name, mallocator_tlsf_impl_create(pool_size));
+}
+
+mallocator_t *mallocator_tlsf_create_in_place(const char *name, void *pool, size_t pool_size)
+{
+    return mallocator_tlsf_create_custom(name, mallocator_tlsf_impl_create_in_place(pool, pool_size));
+}
+
+mallocator_impl_t *mallocator_tlsf_impl_create(size_t pool_size)
+{
+    if (pool_size >= MALLOCATOR_TLSF_POOL_MAX) return NULL;
+    void *pool = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (pool == MAP_FAILED) return NULL;
+
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_create_int(pool, pool_size, true);
+    if (!mallocator)
+    {
+	munmap(pool, pool_size);
+	return NULL;
+    }
+    return &mallocator->impl;
+}
+
+mallocator_impl_t *mallocator_tlsf_impl_create_in_place(void *pool, size_t pool_size)
+{
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_create_int(pool, pool_size, false);
+    if (!mallocator) return NULL;
+    return &mallocator->impl;
+}
+
+void mallocator_tlsf_stats(mallocator_t *m, mallocator_tlsf_stats_t *stats)
+{
+    mallocator_impl_t *impl = mallocator_impl_find(mallocator_get_impl(m), &mallocator_tlsf_interface);
+    assert(impl);
+    mallocator_tlsf_t *mallocator = mallocator_tlsf_verify(impl->obj);
+
+    tlsf_lock(mallocator);
+    stats->pool_size = mallocator->pool_size;
+    stats->bytes_free = mallocator->bytes_free;
+    stats->blocks_free = mallocator->blocks_free;
+
+    /* The largest block is in the highest non-empty list */
+    stats->largest_free = 0;
+    if (mallocator->fl_bitmap)
+    {
+	const unsigned fl = tlsf_fls(mallocator->fl_bitmap);
+	const unsigned sl = tlsf_fls(mallocator->sl_bitmap[fl]);
+	for (mallocator_tlsf_block_t *block = mallocator->blocks[fl][sl]; block; block = block->next_free)
+	{
+	    if (tlsf_block_size(block) > stats->largest_free)
+		stats->largest_free = tlsf_block_size(block);
+	}
+    }
+    tlsf_unlock(mallocator);
+
+    stats->bytes_used = stats->pool_size - stats->bytes_free;
+    stats->fragmentation = stats->bytes_free ?
+	100 - (unsigned) (stats->largest_free * 100 / stats->bytes_free) : 0;
+}
@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+
+#include "mallocator_trace.h"
+#include "mallocator_tracer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char mallocator_trace_magic[8] = "MALLTRC";
+
+enum
+{
+    MALLOCATOR_TRACE_HEADER_SIZE = 12,		/* Magic and version */
+    MALLOCATOR_TRACE_BLOCK_HEADER_SIZE = 4,	/* Payload length */
+    MALLOCATOR_TRACE_VARINT_MAX = 10,
+    MALLOCATOR_TRACE_BLOCK_MIN = 256,
+    MALLOCATOR_TRACE_BLOCK_MAX = 64 * 1024 * 1024,	/* Larger blocks are taken as corrupt */
+};
+
+enum
+{
+    MALLOCATOR_TRACE_NAME = 0x01,
+    MALLOCATOR_TRACE_STACK = 0x02,
+    MALLOCATOR_TRACE_EVENT = 0x10,
+};
+
+typedef struct
+{
+    char *name;					/* NULL if unused */
+    uint64_t hash;
+    unsigned id;
+} mallocator_trace_name_t;
+
+typedef struct
+{
+    size_t depth;
+    const void *frames[];
+} mallocator_trace_stack_t;
+
+struct mallocator_trace_writer
+{
+    int fd;
+    pthread_mutex_t lock;			/* Lock for concurrent events */
+    uint8_t *block;				/* Block header and payload */
+    size_t block_capacity;
+    size_t block_size;				/* Flush when a record would exceed this */
+    size_t used;				/* Bytes used in block, including the header */
+    uint64_t prev_timestamp;			/* Delta state, reset for each block */
+    uintptr_t prev_ptr;
+    uint32_t prev_tid;
+    mallocator_trace_name_t *names;		/* Open addressed by hash */
+    size_t names_capacity;
+    unsigned names_count;
+    unsigned *stack_ids;			/* File stack ID by tracer stack ID, 0 if undefined */
+    size_t stack_ids_capacity;
+    unsigned stacks_count;
+    size_t bytes;				/* Bytes written to fd */
+    size_t events;
+    bool failed;
+};
+
+struct mallocator_trace_reader
+{
+    int fd;
+    uint8_t *block;
+    size_t block_capacity;
+    size_t len;					/* Payload length of the current block */
+    size_t pos;					/* Read position in the current block */
+    uint32_t version;
+    uint64_t prev_timestamp;			/* Delta state, reset for each block */
+    uintptr_t prev_ptr;
+    uint32_t prev_tid;
+    char **names;				/* Indexed by node ID */
+    unsigned names_count;
+    mallocator_trace_stack_t **stacks;		/* Indexed by stack ID - 1, so frames do not move */
+    unsigned stacks_count;
+    bool failed;
+};
+
+/**************************************************************************************************/
+/* Encoding utils */
+
+static inline size_t mallocator_trace_put_varint(uint8_t *p, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+	p[n++] = (uint8_t) value | 0x80;
+	value >>= 7;
+    }
+    p[n++] = (uint8_t) value;
+    return n;
+}
+
+static inline uint64_t mallocator_trace_zigzag(uint64_t from, uint64_t to)
+{
+    const int64_t delta = (int64_t) (to - from);
+    return ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+}
+
+static inline uint64_t mallocator_trace_unzigzag(uint64_t from, uint64_t value)
+{
+    return from + ((value >> 1) ^ -(value & 1));
+}
+
+static inline void mallocator_trace_put_u32(uint8_t *p, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; i++)
+	p[i] = (uint8_t) (value >> (8 * i));
+}
+
+static inline uint32_t mallocator_trace_get_u32(const uint8_t *p)
+{
+    uint32_t value = 0;
+    for (unsigned i = 0; i < 4; i++)
+	value |= (uint32_t) p[i] << (8 * i);
+    return value;
+}
+
+static inline uint64_t mallocator_trace_hash(uint64_t hash, const void *data, size_t len)
+{
+    /* FNV-1a */
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++)
+	hash = (hash ^ p[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+static const uint64_t mallocator_trace_hash_init = 0xcbf29ce484222325ull;
+
+static uint64_t mallocator_trace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static bool mallocator_trace_write_all(int fd, const uint8_t *p, size_t len)
+{
+    while (len > 0)
+    {
+	const ssize_t n = write(fd, p, len);
+	if (n < 0 && errno == EINTR) continue;
+	if (n <= 0) return false;
+	p += n;
+	len -= n;
+    }
+    return true;
+}
+
+/* Read exactly len bytes, returning the number read, which is short only at end of file or error */
+static size_t mallocator_trace_read_all(int fd, uint8_t *p, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+	const ssize_t n = read(fd, p + total, len - total);
+	if (n < 0 && errno == EINTR) continue;
+	if (n <= 0) break;
+	total += n;
+    }
+    return total;
+}
+
+/**************************************************************************************************/
+/* Writer */
+
+static inline void mallocator_trace_writer_lock(mallocator_trace_writer_t *writer)
+{
+    assert(pthread_mutex_lock(&writer->lock) == 0);
+}
+
+static inline void mallocator_trace_writer_unlock(mallocator_trace_writer_t *writer)
+{
+    assert(pthread_mutex_unlock(&writer->lock) == 0);
+}
+
+/* Write the current block, called with writer->lock held */
+static void mallocator_trace_writer_flush_int(mallocator_trace_writer_t *writer)
+{
+    if (writer->used > MALLOCATOR_TRACE_BLOCK_HEADER_SIZE && !writer->failed)
+    {
+	mallocator_trace_put_u32(writer->block, writer->used - MALLOCATOR_TRACE_BLOCK_HEADER_SIZE);
+	writer->failed = !mallocator_trace_write_all(writer->fd, writer->block, writer->used);
+	if (!writer->failed) writer->bytes += writer->used;
+    }
+    writer->used = MALLOCATOR_TRACE_BLOCK_HEADER_SIZE;
+    writer->prev_timestamp = 0;
+    writer->prev_ptr = 0;
+    writer->prev_tid = 0;
+}
+
+/* Make room for a record of up to len bytes, returning where to encode it */
+static uint8_t *mallocator_trace_writer_reserve(mallocator_trace_writer_t *writer, size_t len)
+{
+    if (writer->used + len > writer->block_size)
+	mallocator_trace_writer_flush_int(writer);
+
+    /* Records larger than a block, e.g. long names, get a block to themselves */
+    if (writer->used + len > writer->block_capacity)
+    {
+	uint8_t *block = realloc(writer->block, writer->used + len);
+	if (!block) return NULL;
+	writer->block = block;
+	writer->block_capacity = writer->used + len;
+    }
+    return writer->block + writer->used;
+}
+
+/* Return the ID of name, defining it if new */
+static bool mallocator_trace_writer_name(mallocator_trace_writer_t *writer, const char *name, unsigned *id)
+{
+    const size_t len = strlen(name);
+    const uint64_t hash = mallocator_trace_hash(mallocator_trace_hash_init, name, len);
+    size_t mask = writer->names_capacity - 1;
+    size_t i = hash & mask;
+    for (; writer->names[i].name != NULL; i = (i + 1) & mask)
+    {
+	if (writer->names[i].hash == hash && strcmp(writer->names[i].name, name) == 0)
+	{
+	    *id = writer->names[i].id;
+	    return true;
+	}
+    }
+
+    uint8_t *p = mallocator_trace_writer_reserve(writer, 1 + 2 * MALLOCATOR_TRACE_VARINT_MAX + len);
+    char *copy = strdup(name);
+    if (!p || !copy)
+    {
+	free(copy);
+	return false;
+    }
+    writer->names[i] = (mallocator_trace_name_t) { .name = copy, .hash = hash, .id = writer->names_count++ };
+    *id = writer->names[i].id;
+
+    size_t n = 0;
+    p[n++] = MALLOCATOR_TRACE_NAME;
+    n += mallocator_trace_put_varint(p + n, *id);
+    n += mallocator_trace_put_varint(p + n, len);
+    memcpy(p + n, name, len);
+    writer->used += n + len;
+
+    /* Grow at half full */
+    if (writer->names_count * 2 > writer->names_capacity)
+    {
+	mallocator_trace_name_t *names = calloc(writer->names_capacity * 2, sizeof(*names));
+	if (!names) return true;
+	mask = writer->names_capacity * 2 - 1;
+	for (size_t j = 0; j < writer->names_capacity; j++)
+	{
+	    if (!writer->names[j].name) continue;
+	    size_t k = writer->names[j].hash & mask;
+	    while (names[k].name) k = (k + 1) & mask;
+	    names[k] = writer->names[j];
+	}
+	free(writer->names);
+	writer->names = names;
+	writer->names_capacity *= 2;
+    }
+    return true;
+}
+
+/* Return the file ID of a tracer stack, defining it if new */
+static bool mallocator_trace_writer_stack(mallocator_trace_writer_t *writer, const mallocator_tracer_event_t *event, unsigned *id)
+{
+    *id = 0;
+    if (event->stack == 0 || event->backtrace_len == 0) return true;
+    if (event->stack < writer->stack_ids_capacity && writer->stack_ids[event->stack])
+    {
+	*id = writer->stack_ids[event->stack];
+	return true;
+    }
+
+    if (event->stack >= writer->stack_ids_capacity)
+    {
+	size_t capacity = writer->stack_ids_capacity * 2;
+	while (capacity <= event->stack) capacity *= 2;
+	unsigned *stack_ids = realloc(writer->stack_ids, capacity * sizeof(*stack_ids));
+	if (!stack_ids) return false;
+	memset(stack_ids + writer->stack_ids_capacity, 0, (capacity - writer->stack_ids_capacity) * sizeof(*stack_ids));
+	writer->stack_ids = stack_ids;
+	writer->stack_ids_capacity = capacity;
+    }
+
+    const size_t depth = event->backtrace_len < MALLOCATOR_TRACER_BACKTRACE_MAX ? event->backtrace_len : MALLOCATOR_TRACER_BACKTRACE_MAX;
+    uint8_t *p = mallocator_trace_writer_reserve(writer, 1 + (2 + depth) * MALLOCATOR_TRACE_VARINT_MAX);
+    if (!p) return false;
+    *id = writer->stack_ids[event->stack] = ++writer->stacks_count;
+
+    size_t n = 0;
+    p[n++] = MALLOCATOR_TRACE_STACK;
+    n += mallocator_trace_put_varint(p + n, *id);
+    n += mallocator_trace_put_varint(p + n, depth);
+    uintptr_t prev = 0;
+    for (size_t j = 0; j < depth; j++)
+    {
+	n += mallocator_trace_put_varint(p + n, mallocator_trace_zigzag(prev, (uintptr_t) event->backtrace[j]));
+	prev = (uintptr_t) event->backtrace[j];
+    }
+    writer->used += n;
+    return true;
+}
+
+static void mallocator_trace_writer_event_int(mallocator_trace_writer_t *writer, const mallocator_tracer_event_t *event)
+{
+    unsigned node, stack;
+    if (!mallocator_trace_writer_name(writer, event->name ? event->name : "", &node) ||
+	!mallocator_trace_writer_stack(writer, event, &stack))
+    {
+	writer->failed = true;
+	return;
+    }
+
+    uint8_t *p = mallocator_trace_writer_reserve(writer, 1 + 9 * MALLOCATOR_TRACE_VARINT_MAX);
+    if (!p)
+    {
+	writer->failed = true;
+	return;
+    }
+
+    const uint64_t timestamp = event->timestamp ? event->timestamp : mallocator_trace_now();
+    size_t n = 0;
+    p[n++] = MALLOCATOR_TRACE_EVENT | event->type;
+    n += mallocator_trace_put_varint(p + n, node);
+    n += mallocator_trace_put_varint(p + n, stack);
+    n += mallocator_trace_put_varint(p + n, mallocator_trace_zigzag(writer->prev_timestamp, timestamp));
+    n += mallocator_trace_put_varint(p + n, mallocator_trace_zigzag(writer->prev_ptr, (uintptr_t) event->ptr));
+    n += mallocator_trace_put_varint(p + n, mallocator_trace_zigzag(writer->prev_tid, event->tid));
+    n += mallocator_trace_put_varint(p + n, (uint64_t) (event->cpu + 1));
+    writer->prev_timestamp = timestamp;
+    writer->prev_ptr = (uintptr_t) event->ptr;
+    writer->prev_tid = event->tid;
+
+    switch (event->type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	    n += mallocator_trace_put_varint(p + n, event->e.malloc.size);
+	    break;
+	case MALLOCATOR_TRACER_CALLOC:
+	    n += mallocator_trace_put_varint(p + n, event->e.calloc.nmemb);
+	    n += mallocator_trace_put_varint(p + n, event->e.calloc.size);
+	    break;
+	case MALLOCATOR_TRACER_REALLOC:
+	    n += mallocator_trace_put_varint(p + n,
+		mallocator_trace_zigzag((uintptr_t) event->ptr, (uintptr_t) event->e.realloc.old_ptr));
+	    n += mallocator_trace_put_varint(p + n, event->e.realloc.old_size);
+	    n += mallocator_trace_put_varint(p + n, event->e.realloc.new_size);
+	    break;
+	case MALLOCATOR_TRACER_FREE:
+	    n += mallocator_trace_put_varint(p + n, event->e.free.size);
+	    break;
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    n += mallocator_trace_put_varint(p + n, event->e.aligned_alloc.alignment);
+	    n += mallocator_trace_put_varint(p + n, event->e.aligned_alloc.size);
+	    break;
+    }
+    writer->used += n;
+    writer->events++;
+}
+
+static void mallocator_trace_writer_free(mallocator_trace_writer_t *writer)
+{
+    for (size_t i = 0; writer->names && i < writer->names_capacity; i++)
+	free(writer->names[i].name);
+    free(writer->names);
+    free(writer->stack_ids);
+    free(writer->block);
+    assert(pthread_mutex_destroy(&writer->lock) == 0);
+    free(writer);
+}
+
+/**************************************************************************************************/
+/* Reader */
+
+static bool mallocator_trace_get_varint(mallocator_trace_reader_t *reader, uint64_t *value)
+{
+    *value = 0;
+    for (unsigned shift = 0; shift < 64 && reader->pos < reader->len; shift += 7)
+    {
+	const uint8_t byte = reader->block[reader->pos++];
+	*value |= (uint64_t) (byte & 0x7f) << shift;
+	if (!(byte & 0x80)) return true;
+    }
+    reader->failed = true;
+    return false;
+}
+
+/* Read the next block, returning false at the end of the trace */
+static bool mallocator_trace_reader_block(mallocator_trace_reader_t *reader)
+{
+    uint8_t header[MALLOCATOR_TRACE_BLOCK_HEADER_SIZE];
+    const size_t n = mallocator_trace_read_all(reader->fd, header, sizeof(header));
+    if (n == 0) return false;
+    if (n < sizeof(header))
+    {
+	reader->failed = true;
+	return false;
+    }
+
+    /* Writers never write empty blocks */
+    const size_t len = mallocator_trace_get_u32(header);
+    if (len == 0 || len > MALLOCATOR_TRACE_BLOCK_MAX)
+    {
+	reader->failed = true;
+	return false;
+    }
+    if (len > reader->block_capacity)
+    {
+	uint8_t *block = realloc(reader->block, len);
+	if (!block)
+	{
+	    reader->failed = true;
+	    return false;
+	}
+	reader->block = block;
+	reader->block_capacity = len;
+    }
+    if (mallocator_trace_read_all(reader->fd, reader->block, len) < len)
+    {
+	reader->failed = true;
+	return false;
+    }
+    reader->len = len;
+    reader->pos = 0;
+    reader->prev_timestamp = 0;
+    reader->prev_ptr = 0;
+    reader->prev_tid = 0;
+    return true;
+}
+
+/* IDs must be defined in order, which bounds memory on corrupt traces */
+static bool mallocator_trace_reader_define_name(mallocator_trace_reader_t *reader)
+{
+    uint64_t id, len;
+    if (!mallocator_trace_get_varint(reader, &id) || !mallocator_trace_get_varint(reader, &len)) return false;
+    if (id != reader->names_count || len > reader->len - reader->pos) return false;
+
+    char **names = realloc(reader->names, (reader->names_count + 1) * sizeof(*names));
+    if (!names) return false;
+    reader->names = names;
+    char *name = malloc(len + 1);
+    if (!name) return false;
+    memcpy(name, reader->block + reader->pos, len);
+    name[len] = '\0';
+    reader->pos += len;
+    reader->names[reader->names_count++] = name;
+    return true;
+}
+
+static bool mallocator_trace_reader_define_stack(mallocator_trace_reader_t *reader)
+{
+    uint64_t id, depth;
+    if (!mallocator_trace_get_varint(reader, &id) || !mallocator_trace_get_varint(reader, &depth)) return false;
+    if (id != reader->stacks_count + 1 || depth > MALLOCATOR_TRACER_BACKTRACE_MAX) return false;
+
+    mallocator_trace_stack_t **stacks = realloc(reader->stacks, (reader->stacks_count + 1) * sizeof(*stacks));
+    if (!stacks) return false;
+    reader->stacks = stacks;
+    mallocator_trace_stack_t *stack = malloc(sizeof(*stack) + depth * sizeof(stack->frames[0]));
+    if (!stack) return false;
+    reader->stacks[reader->stacks_count++] = stack;
+    stack->depth = depth;
+    uintptr_t prev = 0;
+    for (size_t i = 0; i < depth; i++)
+    {
+	uint64_t value;
+	if (!mallocator_trace_get_varint(reader, &value)) return false;
+	prev = mallocator_trace_unzigzag(prev, value);
+	stack->frames[i] = (void *) prev;
+    }
+    return true;
+}
+
+static bool mallocator_trace_reader_event(mallocator_trace_reader_t *reader, uint8_t tag, mallocator_trace_record_t *record)
+{
+    uint64_t node, stack, timestamp, ptr;
+    if (!mallocator_trace_get_varint(reader, &node) || !mallocator_trace_get_varint(reader, &stack) ||
+	!mallocator_trace_get_varint(reader, &timestamp) || !mallocator_trace_get_varint(reader, &ptr))
+	return false;
+    if (node >= reader->names_count || stack > reader->stacks_count) return false;
+    uint64_t tid = reader->prev_tid, cpu = 0;
+    if (reader->version >= 2)
+    {
+	if (!mallocator_trace_get_varint(reader, &tid) || !mallocator_trace_get_varint(reader, &cpu)) return false;
+	tid = (uint32_t) mallocator_trace_unzigzag(reader->prev_tid, tid);
+    }
+
+    reader->prev_timestamp = mallocator_trace_unzigzag(reader->prev_timestamp, timestamp);
+    reader->prev_ptr = mallocator_trace_unzigzag(reader->prev_ptr, ptr);
+    reader->prev_tid = tid;
+    memset(record, 0, sizeof(*record));
+    record->timestamp = reader->prev_timestamp;
+    record->event.timestamp = reader->prev_timestamp;
+    record->event.tid = tid;
+    record->event.cpu = (int32_t) cpu - 1;
+    record->node = node;
+    record->stack = stack;
+    record->event.stack = stack;
+    record->event.name = reader->names[node];
+    record->event.type = tag & ~MALLOCATOR_TRACE_EVENT;
+    record->event.ptr = (void *) reader->prev_ptr;
+    if (stack)
+    {
+	record->event.backtrace = reader->stacks[stack - 1]->frames;
+	record->event.backtrace_len = reader->stacks[stack - 1]->depth;
+    }
+
+    uint64_t a, b, c;
+    switch (record->event.type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	    if (!mallocator_trace_get_varint(reader, &a)) return false;
+	    record->event.e.malloc.size = a;
+	    return true;
+	case MALLOCATOR_TRACER_CALLOC:
+	    if (!mallocator_trace_get_varint(reader, &a) || !mallocator_trace_get_varint(reader, &b)) return false;
+	    record->event.e.calloc.nmemb = a;
+	    record->event.e.calloc.size = b;
+	    return true;
+	case MALLOCATOR_TRACER_REALLOC:
+	    if (!mallocator_trace_get_varint(reader, &a) || !mallocator_trace_get_varint(reader, &b) ||
+		!mallocator_trace_get_varint(reader, &c))
+		return false;
+	    record->event.e.realloc.old_ptr = (void *) (uintptr_t) mallocator_trace_unzigzag(reader->prev_ptr, a);
+	    record->event.e.realloc.old_size = b;
+	    record->event.e.realloc.new_size = c;
+	    return true;
+	case MALLOCATOR_TRACER_FREE:
+	    if (!mallocator_trace_get_varint(reader, &a)) return false;
+	    record->event.e.free.size = a;
+	    return true;
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    if (!mallocator_trace_get_varint(reader, &a) || !mallocator_trace_get_varint(reader, &b)) return false;
+	    record->event.e.aligned_alloc.alignment = a;
+	    record->event.e.aligned_alloc.size = b;
+	    return true;
+	default:
+	    return false;
+    }
+}
+
+/**************************************************************************************************/
+/* Public interface */
+
+mallocator_trace_writer_t *mallocator_trace_writer_create(int fd, size_t block_size)
+{
+    if (block_size == 0) block_size = MALLOCATOR_TRACE_BLOCK_SIZE;
+    if (block_size < MALLOCATOR_TRACE_BLOCK_MIN) block_size = MALLOCATOR_TRACE_BLOCK_MIN;
+    if (block_size > MALLOCATOR_TRACE_BLOCK_MAX) block_size = MALLOCATOR_TRACE_BLOCK_MAX;
+
+    mallocator_trace_writer_t *writer = malloc(sizeof(*writer));
+    if (!writer) return NULL;
+
+    *writer = (mallocator_trace_writer_t)
+    {
+	.fd = fd,
+	.block = malloc(block_size),
+	.block_capacity = block_size,
+	.block_size = block_size,
+	.used = MALLOCATOR_TRACE_BLOCK_HEADER_SIZE,
+	.prev_timestamp = 0,
+	.prev_ptr = 0,
+	.prev_tid = 0,
+	.names = calloc(16, sizeof(mallocator_trace_name_t)),
+	.names_capacity = 16,
+	.names_count = 0,
+	.stack_ids = calloc(64, sizeof(unsigned)),
+	.stack_ids_capacity = 64,
+	.stacks_count = 0,
+	.bytes = 0,
+	.events = 0,
+	.failed = false,
+    };
+    assert(pthread_mutex_init(&writer->lock, NULL) == 0);
+
+    uint8_t header[MALLOCATOR_TRACE_HEADER_SIZE];
+    memcpy(header, mallocator_trace_magic, sizeof(mallocator_trace_magic));
+    mallocator_trace_put_u32(header + sizeof(mallocator_trace_magic), MALLOCATOR_TRACE_VERSION);
+    if (!writer->block || !writer->names || !writer->stack_ids || !mallocator_trace_write_all(fd, header, sizeof(header)))
+    {
+	mallocator_trace_writer_free(writer);
+	return NULL;
+    }
+    writer->bytes = sizeof(header);
+    return writer;
+}
+
+void mallocator_trace_writer_event(void *arg, const mallocator_tracer_event_t *event)
+{
+    mallocator_trace_writer_t *writer = arg;
+    assert(writer);
+
+    mallocator_trace_writer_lock(writer);
+    if (!writer->failed) mallocator_trace_writer_event_int(writer, event);
+    mallocator_trace_writer_unlock(writer);
+}
+
+bool mallocator_trace_writer_flush(mallocator_trace_writer_t *writer)
+{
+    mallocator_trace_writer_lock(writer);
+    mallocator_trace_writer_flush_int(writer);
+    const bool ok = !writer->failed;
+    mallocator_trace_writer_unlock(writer);
+    return ok;
+}
+
+size_t mallocator_trace_writer_bytes(mallocator_trace_writer_t *writer, size_t *events)
+{
+    mallocator_trace_writer_lock(writer);
+    const size_t bytes = writer->bytes;
+    if (events) *events = writer->events;
+    mallocator_trace_writer_unlock(writer);
+    return bytes;
+}
+
+bool mallocator_trace_writer_destroy(mallocator_trace_writer_t *writer)
+{
+    const bool ok = mallocator_trace_writer_flush(writer);
+    mallocator_trace_writer_free(writer);
+    return ok;
+}
+
+mallocator_trace_reader_t *mallocator_trace_reader_create(int fd)
+{
+    uint8_t header[MALLOCATOR_TRACE_HEADER_SIZE];
+    if (mallocator_trace_read_all(fd, header, sizeof(header)) < sizeof(header) ||
+	memcmp(header, mallocator_trace_magic, sizeof(mallocator_trace_magic)) != 0)
+	return NULL;
+    const uint32_t version = mallocator_trace_get_u32(header + sizeof(mallocator_trace_magic));
+    if (version < 1 || version > MALLOCATOR_TRACE_VERSION) return NULL;
+
+    mallocator_trace_reader_t *reader = malloc(sizeof(*reader));
+    if (!reader) return NULL;
+
+    *reader = (mallocator_trace_reader_t)
+    {
+	.fd = fd,
+	.version = version,
+	.block = NULL,
+	.block_capacity = 0,
+	.len = 0,
+	.pos = 0,
+	.prev_timestamp = 0,
+	.prev_ptr = 0,
+	.prev_tid = 0,
+	.names = NULL,
+	.names_count = 0,
+	.stacks = NULL,
+	.stacks_count = 0,
+	.failed = false,
+    };
+    return reader;
+}
+
+bool mallocator_trace_reader_next(mallocator_trace_reader_t *reader, mallocator_trace_record_t *record)
+{
+    while (!reader->failed)
+    {
+	if (reader->pos >= reader->len && !mallocator_trace_reader_block(reader))
+	    return false;
+
+	const uint8_t tag = reader->block[reader->pos++];
+	bool ok;
+	if (tag == MALLOCATOR_TRACE_NAME)
+	    ok = mallocator_trace_reader_define_name(reader);
+	else if (tag == MALLOCATOR_TRACE_STACK)
+	    ok = mallocator_trace_reader_define_stack(reader);
+	else if ((tag & MALLOCATOR_TRACE_EVENT) && mallocator_trace_reader_event(reader, tag, record))
+	    return true;
+	else
+	    ok = false;
+	reader->failed = !ok;
+    }
+    return false;
+}
+
+bool mallocator_trace_reader_failed(mallocator_trace_reader_t *reader)
+{
+    return reader->failed;
+}
+
+const char *mallocator_trace_reader_name(mallocator_trace_reader_t *reader, unsigned node)
+{
+    return node < reader->names_count ? reader->names[node] : NULL;
+}
+
+void mallocator_trace_reader_destroy(mallocator_trace_reader_t *reader)
+{
+    for (unsigned i = 0; i < reader->names_count; i++)
+	free(reader->names[i]);
+    free(reader->names);
+    for (unsigned i = 0; i < reader->stacks_count; i++)
+	free(reader->stacks[i]);
+    free(reader->stacks);
+    free(reader->block);
+    free(reader);
+}
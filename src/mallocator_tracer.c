@@ -1,21 +1,99 @@
+#define _GNU_SOURCE
+
 #include "mallocator_tracer.h"
 #include "mallocator.h"
 #include "mallocator_impl.h"
 
+#include "atomic.h"
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef struct mallocator_tracer mallocator_tracer_t;
+typedef struct mallocator_tracer_ring mallocator_tracer_ring_t;
+typedef struct mallocator_tracer_name mallocator_tracer_name_t;
+typedef struct mallocator_tracer_async mallocator_tracer_async_t;
+
+/* Single producer single consumer ring of events written by one thread */
+struct mallocator_tracer_ring
+{
+    size_t head;				/* Next event written, by the producer (atomic) */
+    size_t tail __attribute__((aligned(64)));	/* Next event read, by the consumer (atomic) */
+    unsigned closed;				/* The producer thread has exited (atomic) */
+    mallocator_tracer_async_t *async;
+    mallocator_tracer_ring_t *next;		/* Protected by async->lock */
+    mallocator_tracer_event_t events[];
+};
+
+/* Names outlive their tracers, as events may be delivered after the tracer is destroyed */
+struct mallocator_tracer_name
+{
+    mallocator_tracer_name_t *next;
+    char name[];
+};
+
+/* Asynchronous delivery state, shared by a tracer and its children */
+struct mallocator_tracer_async
+{
+    unsigned ref_count;				/* (atomic) */
+    mallocator_tracer_fn fn;			/* Called per event, or NULL if batched */
+    mallocator_tracer_batch_fn batch_fn;	/* Called per batch of events, or NULL */
+    void *arg;
+    size_t batch_size;				/* Most events per batch */
+    size_t wake_events;				/* Events in a ring which wake the consumer */
+    mallocator_tracer_async_config_t config;
+    size_t capacity;				/* Events per ring, a power of 2 */
+    pthread_key_t key;				/* Ring of the calling thread */
+    pthread_t thread;				/* Consumer thread */
+    pthread_mutex_t lock;			/* Lock for async synchronisation */
+    pthread_cond_t cond;			/* Signalled to wake the consumer */
+    pthread_cond_t drained;			/* Signalled at the end of each consumer pass */
+    mallocator_tracer_ring_t *rings;		/* Protected by lock */
+    mallocator_tracer_name_t *names;		/* Protected by lock */
+    size_t passes;				/* Consumer passes completed, protected by lock */
+    bool wake;					/* Protected by lock */
+    bool stop;					/* Protected by lock */
+    size_t dropped;				/* Events dropped on overflow (atomic) */
+};
+
+/* Sampling state, shared by a tracer and its children */
+typedef struct
+{
+    unsigned ref_count;				/* (atomic) */
+    size_t interval;				/* Mean bytes between samples */
+    size_t capacity;				/* Slots, a power of 2 */
+    size_t live;				/* Sampled blocks not yet freed (atomic) */
+    atomic_flag lock;				/* Spin lock serializing inserts and removes */
+    unsigned seq;				/* Odd while a remove moves blocks (atomic) */
+    void **slots;				/* Open addressed set of sampled blocks (atomic) */
+} mallocator_tracer_sampler_t;
 
 struct mallocator_tracer
 {
     mallocator_impl_t impl;
-    char *name;			/* Full name (<parent_name>.<name>) */
+    char *name;			/* Full name (<parent_name>.<name>), owned by async if set */
     mallocator_tracer_fn fn;
     void *arg;
+    mallocator_tracer_async_t *async;	/* Asynchronous delivery, or NULL for synchronous */
+    mallocator_tracer_sampler_t *sampler;	/* Sampling, or NULL to trace every event */
+    size_t depth;				/* Backtrace depth */
+    unsigned context;				/* Mask of context captured in events */
+    unsigned filter;				/* Mask of types traced, and FILTER_SIZE (atomic) */
+    size_t min_size;				/* Size range traced if FILTER_SIZE is set (atomic) */
+    size_t max_size;
+};
+
+enum
+{
+    MALLOCATOR_TRACER_FILTER_TYPES = (1u << (MALLOCATOR_TRACER_ALIGNED_ALLOC + 1)) - 1,
+    MALLOCATOR_TRACER_FILTER_SIZE = 1u << 16,
 };
 
 /**************************************************************************************************/
@@ -27,6 +105,12 @@ static void *mallocator_tracer_malloc(void *obj, size_t size);
 static void *mallocator_tracer_calloc(void *obj, size_t nmemb, size_t size);
 static void *mallocator_tracer_realloc(void *obj, void *ptr, size_t size, size_t new_size);
 static void mallocator_tracer_free(void *obj, void *p, size_t size);
+static void *mallocator_tracer_aligned_alloc(void *obj, size_t alignment, size_t size);
+static size_t mallocator_tracer_usable_size(void *obj, void *ptr, size_t size);
+static size_t mallocator_tracer_block_size(void *obj, void *ptr);
+static size_t mallocator_tracer_trim(void *obj, unsigned flags);
+static void *mallocator_tracer_malloc_at_least(void *obj, size_t size, size_t *actual);
+static bool mallocator_tracer_try_expand(void *obj, void *ptr, size_t size, size_t new_size);
 
 static mallocator_interface_t mallocator_tracer_interface =
 {
@@ -36,6 +120,12 @@ static mallocator_interface_t mallocator_tracer_interface =
     .calloc = mallocator_tracer_calloc,
     .realloc = mallocator_tracer_realloc,
     .free = mallocator_tracer_free,
+    .aligned_alloc = mallocator_tracer_aligned_alloc,
+    .usable_size = mallocator_tracer_usable_size,
+    .block_size = mallocator_tracer_block_size,
+    .trim = mallocator_tracer_trim,
+    .malloc_at_least = mallocator_tracer_malloc_at_least,
+    .try_expand = mallocator_tracer_try_expand,
 };
 
 /**************************************************************************************************/
@@ -49,10 +139,625 @@ const char *mallocator_tracer_type_str(mallocator_tracer_type_t type)
 	case MALLOCATOR_TRACER_CALLOC: return "calloc";
 	case MALLOCATOR_TRACER_REALLOC: return "realloc";
 	case MALLOCATOR_TRACER_FREE: return "free";
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC: return "aligned_alloc";
 	default: return "<unknown>";
     }
 }
 
+/**************************************************************************************************/
+/* Asynchronous delivery */
+
+static inline void mallocator_tracer_async_lock(mallocator_tracer_async_t *async)
+{
+    assert(pthread_mutex_lock(&async->lock) == 0);
+}
+
+static inline void mallocator_tracer_async_unlock(mallocator_tracer_async_t *async)
+{
+    assert(pthread_mutex_unlock(&async->lock) == 0);
+}
+
+/* Called on exit of a producer thread - the consumer delivers its events and frees the ring */
+static void mallocator_tracer_ring_close(void *arg)
+{
+    mallocator_tracer_ring_t *ring = arg;
+    mallocator_tracer_async_t *async = ring->async;
+    atomic_store(&ring->closed, 1);
+
+    mallocator_tracer_async_lock(async);
+    async->wake = true;
+    assert(pthread_cond_signal(&async->cond) == 0);
+    mallocator_tracer_async_unlock(async);
+}
+
+static mallocator_tracer_ring_t *mallocator_tracer_ring(mallocator_tracer_async_t *async)
+{
+    mallocator_tracer_ring_t *ring = pthread_getspecific(async->key);
+    if (ring) return ring;
+
+    ring = malloc(sizeof(*ring) + async->capacity * sizeof(ring->events[0]));
+    if (!ring) return NULL;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->closed = 0;
+    ring->async = async;
+    if (pthread_setspecific(async->key, ring) != 0)
+    {
+	free(ring);
+	return NULL;
+    }
+    mallocator_tracer_async_lock(async);
+    ring->next = async->rings;
+    async->rings = ring;
+    mallocator_tracer_async_unlock(async);
+    return ring;
+}
+
+static void mallocator_tracer_async_push(mallocator_tracer_async_t *async, const mallocator_tracer_event_t *event)
+{
+    mallocator_tracer_ring_t *ring = mallocator_tracer_ring(async);
+    if (!ring)
+    {
+	atomic_fetch_add(&async->dropped, 1);
+	return;
+    }
+
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == async->capacity)
+    {
+	/* The consumer cannot wait for itself */
+	if (async->config.overflow != MALLOCATOR_TRACER_BLOCK || pthread_equal(pthread_self(), async->thread))
+	{
+	    atomic_fetch_add(&async->dropped, 1);
+	    return;
+	}
+	do
+	{
+	    assert(pthread_cond_signal(&async->cond) == 0);
+	    sched_yield();
+	    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	}
+	while (head - tail == async->capacity);
+    }
+
+    ring->events[head & (async->capacity - 1)] = *event;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    /* Wake the consumer early once a batch or half the ring is written, otherwise it polls */
+    if (head + 1 - tail == async->wake_events)
+	assert(pthread_cond_signal(&async->cond) == 0);
+}
+
+/* Deliver the events written to ring so far, returning true if it is closed and empty */
+static bool mallocator_tracer_ring_drain(mallocator_tracer_async_t *async, mallocator_tracer_ring_t *ring)
+{
+    const bool closed = atomic_load(&ring->closed);
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (size_t tail = ring->tail; tail != head; )
+    {
+	/* Batches are contiguous in the ring, so may be short at the end */
+	const size_t index = tail & (async->capacity - 1);
+	size_t count = 1;
+	if (async->batch_fn)
+	{
+	    count = head - tail;
+	    if (count > async->capacity - index) count = async->capacity - index;
+	    if (count > async->batch_size) count = async->batch_size;
+	    async->batch_fn(async->arg, &ring->events[index], count);
+	}
+	else
+	{
+	    async->fn(async->arg, &ring->events[index]);
+	}
+	tail += count;
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return closed;
+}
+
+static void mallocator_tracer_async_pass(mallocator_tracer_async_t *async)
+{
+    /* Rings are only added at the head, and only removed by the consumer */
+    mallocator_tracer_async_lock(async);
+    mallocator_tracer_ring_t *rings = async->rings;
+    mallocator_tracer_async_unlock(async);
+
+    bool closed = false;
+    for (mallocator_tracer_ring_t *ring = rings; ring != NULL; ring = ring->next)
+	closed |= mallocator_tracer_ring_drain(async, ring);
+    if (!closed) return;
+
+    mallocator_tracer_async_lock(async);
+    for (mallocator_tracer_ring_t **p = &async->rings; *p != NULL; )
+    {
+	mallocator_tracer_ring_t *ring = *p;
+	if (atomic_load(&ring->closed) && ring->tail == atomic_load(&ring->head))
+	{
+	    *p = ring->next;
+	    free(ring);
+	}
+	else
+	{
+	    p = &ring->next;
+	}
+    }
+    mallocator_tracer_async_unlock(async);
+}
+
+static void *mallocator_tracer_async_thread(void *arg)
+{
+    mallocator_tracer_async_t *async = arg;
+    mallocator_tracer_async_lock(async);
+    while (!async->stop)
+    {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	const uint64_t nsec = deadline.tv_nsec + (uint64_t) async->config.period_ms * 1000000;
+	deadline.tv_sec += nsec / 1000000000;
+	deadline.tv_nsec = nsec % 1000000000;
+	if (!async->wake)
+	    pthread_cond_timedwait(&async->cond, &async->lock, &deadline);
+	async->wake = false;
+	mallocator_tracer_async_unlock(async);
+
+	mallocator_tracer_async_pass(async);
+
+	mallocator_tracer_async_lock(async);
+	async->passes++;
+	assert(pthread_cond_broadcast(&async->drained) == 0);
+    }
+    mallocator_tracer_async_unlock(async);
+
+    /* Deliver everything written before the stop */
+    mallocator_tracer_async_pass(async);
+    return NULL;
+}
+
+static void mallocator_tracer_async_free(mallocator_tracer_async_t *async)
+{
+    assert(pthread_key_delete(async->key) == 0);
+    assert(pthread_cond_destroy(&async->drained) == 0);
+    assert(pthread_cond_destroy(&async->cond) == 0);
+    assert(pthread_mutex_destroy(&async->lock) == 0);
+    while (async->rings)
+    {
+	mallocator_tracer_ring_t *ring = async->rings;
+	async->rings = ring->next;
+	free(ring);
+    }
+    while (async->names)
+    {
+	mallocator_tracer_name_t *name = async->names;
+	async->names = name->next;
+	free(name);
+    }
+    free(async);
+}
+
+static mallocator_tracer_async_t *mallocator_tracer_async_create(mallocator_tracer_fn fn,
+    mallocator_tracer_batch_fn batch_fn, void *arg, size_t batch_size, const mallocator_tracer_async_config_t *config)
+{
+    mallocator_tracer_async_t *async = malloc(sizeof(*async));
+    if (!async) return NULL;
+
+    *async = (mallocator_tracer_async_t)
+    {
+	.ref_count = 1,
+	.fn = fn,
+	.batch_fn = batch_fn,
+	.arg = arg,
+	.batch_size = batch_size,
+	.config = *config,
+	.capacity = 2,
+	.rings = NULL,
+	.names = NULL,
+	.passes = 0,
+	.wake = false,
+	.stop = false,
+	.dropped = 0,
+    };
+    while (async->capacity < config->ring_events)
+	async->capacity *= 2;
+    async->wake_events = batch_fn && batch_size < async->capacity / 2 ? batch_size : async->capacity / 2;
+
+    if (pthread_key_create(&async->key, mallocator_tracer_ring_close) != 0)
+    {
+	free(async);
+	return NULL;
+    }
+    pthread_condattr_t condattr;
+    assert(pthread_condattr_init(&condattr) == 0);
+    assert(pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC) == 0);
+    assert(pthread_mutex_init(&async->lock, NULL) == 0);
+    assert(pthread_cond_init(&async->cond, &condattr) == 0);
+    assert(pthread_cond_init(&async->drained, NULL) == 0);
+    assert(pthread_condattr_destroy(&condattr) == 0);
+    if (pthread_create(&async->thread, NULL, mallocator_tracer_async_thread, async) != 0)
+    {
+	mallocator_tracer_async_free(async);
+	return NULL;
+    }
+    return async;
+}
+
+static void mallocator_tracer_async_dereference(mallocator_tracer_async_t *async)
+{
+    if (atomic_fetch_sub(&async->ref_count, 1) != 1) return;
+
+    mallocator_tracer_async_lock(async);
+    async->stop = true;
+    assert(pthread_cond_signal(&async->cond) == 0);
+    mallocator_tracer_async_unlock(async);
+    assert(pthread_join(async->thread, NULL) == 0);
+    mallocator_tracer_async_free(async);
+}
+
+/* Wait for a consumer pass started after the call, which delivers all events written before it */
+static void mallocator_tracer_async_flush(mallocator_tracer_async_t *async)
+{
+    mallocator_tracer_async_lock(async);
+    const size_t passes = async->passes + 2;
+    async->wake = true;
+    assert(pthread_cond_signal(&async->cond) == 0);
+    while (async->passes < passes)
+    {
+	assert(pthread_cond_wait(&async->drained, &async->lock) == 0);
+	async->wake = true;
+    }
+    mallocator_tracer_async_unlock(async);
+}
+
+/* Intern name, returning a copy owned by async */
+static char *mallocator_tracer_async_name(mallocator_tracer_async_t *async, const char *name)
+{
+    mallocator_tracer_async_lock(async);
+    mallocator_tracer_name_t *interned = async->names;
+    while (interned && strcmp(interned->name, name) != 0)
+	interned = interned->next;
+    if (!interned)
+    {
+	interned = malloc(sizeof(*interned) + strlen(name) + 1);
+	if (interned)
+	{
+	    strcpy(interned->name, name);
+	    interned->next = async->names;
+	    async->names = interned;
+	}
+    }
+    mallocator_tracer_async_unlock(async);
+    return interned ? interned->name : NULL;
+}
+
+/**************************************************************************************************/
+/* Stacks */
+
+enum { MALLOCATOR_TRACER_STACK_FRAMES = 32 * MALLOCATOR_TRACER_STACKS_MAX };
+
+/* Marks a slot being defined, until its frames are published */
+#define MALLOCATOR_TRACER_STACK_BUSY 1
+
+typedef struct
+{
+    uint64_t hash;				/* 0 if unused (atomic) */
+    const void *const *frames;
+    size_t depth;
+} mallocator_tracer_stack_t;
+
+/*
+ * Process wide open addressed table of distinct backtraces, indexed by stack ID - 1. Slots are
+ * claimed lock free and never removed, so frames remain valid for events delivered at any time.
+ */
+static mallocator_tracer_stack_t mallocator_tracer_stacks[2 * MALLOCATOR_TRACER_STACKS_MAX];
+static unsigned mallocator_tracer_stacks_count;		/* (atomic) */
+static const void *mallocator_tracer_frames[MALLOCATOR_TRACER_STACK_FRAMES];
+static size_t mallocator_tracer_frames_used;		/* (atomic) */
+
+/* Top of the stack of the calling thread, 0 until known */
+static _Thread_local uintptr_t mallocator_tracer_stack_top;
+
+static uintptr_t mallocator_tracer_stack_top_slow(void)
+{
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return 0;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+	mallocator_tracer_stack_top = (uintptr_t) addr + size;
+    pthread_attr_destroy(&attr);
+    return mallocator_tracer_stack_top;
+}
+
+/* Walk the frame pointer chain up from fp, stopping at the top of the stack */
+static size_t mallocator_tracer_walk(void *fp, const void **frames, size_t depth)
+{
+    uintptr_t top = mallocator_tracer_stack_top;
+    if (!top) top = mallocator_tracer_stack_top_slow();
+
+    uintptr_t frame = (uintptr_t) fp;
+    size_t n = 0;
+    while (n < depth && frame % sizeof(void *) == 0 && frame + 2 * sizeof(void *) <= top)
+    {
+	/* Each frame holds the caller frame pointer and the return address */
+	void *const *record = (void *const *) frame;
+	const void *ret = __builtin_extract_return_addr(record[1]);
+	if (!ret) break;
+	frames[n++] = ret;
+
+	/* Stacks grow down, so a caller frame which is not higher is corrupt or the end */
+	const uintptr_t next = (uintptr_t) record[0];
+	if (next <= frame) break;
+	frame = next;
+    }
+    return n;
+}
+
+static inline uint64_t mallocator_tracer_stack_hash(const void **frames, size_t depth)
+{
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; i++)
+    {
+	hash = (hash ^ (uintptr_t) frames[i]) * 0x9e3779b97f4a7c15ull;
+	hash ^= hash >> 29;
+    }
+    return hash > MALLOCATOR_TRACER_STACK_BUSY ? hash : hash + 2;
+}
+
+/* Return the ID of a backtrace, defining it if new, or 0 if the table is full */
+static uint32_t mallocator_tracer_stack_intern(const void **frames, size_t depth)
+{
+    const size_t capacity = sizeof(mallocator_tracer_stacks) / sizeof(mallocator_tracer_stacks[0]);
+    const uint64_t hash = mallocator_tracer_stack_hash(frames, depth);
+    const void **copy = NULL;
+    size_t i = hash & (capacity - 1);
+    for (size_t probes = 0; probes < capacity; probes++)
+    {
+	mallocator_tracer_stack_t *stack = &mallocator_tracer_stacks[i];
+	uint64_t stack_hash = atomic_load_explicit(&stack->hash, memory_order_acquire);
+	while (stack_hash == MALLOCATOR_TRACER_STACK_BUSY)
+	{
+	    sched_yield();
+	    stack_hash = atomic_load_explicit(&stack->hash, memory_order_acquire);
+	}
+
+	if (stack_hash == hash && stack->depth == depth &&
+	    memcmp(stack->frames, frames, depth * sizeof(frames[0])) == 0)
+	    return i + 1;
+
+	if (stack_hash == 0)
+	{
+	    if (atomic_load_explicit(&mallocator_tracer_stacks_count, memory_order_relaxed) >= MALLOCATOR_TRACER_STACKS_MAX)
+		return 0;
+
+	    /* Frames are copied before claiming the slot - they are wasted if another thread wins */
+	    if (!copy)
+	    {
+		const size_t offset = atomic_fetch_add(&mallocator_tracer_frames_used, depth);
+		if (offset + depth > MALLOCATOR_TRACER_STACK_FRAMES) return 0;
+		copy = &mallocator_tracer_frames[offset];
+		memcpy(copy, frames, depth * sizeof(frames[0]));
+	    }
+
+	    if (__atomic_compare_exchange_n(&stack->hash, &stack_hash, MALLOCATOR_TRACER_STACK_BUSY, false,
+		    memory_order_acquire, memory_order_relaxed))
+	    {
+		stack->frames = copy;
+		stack->depth = depth;
+		atomic_fetch_add(&mallocator_tracer_stacks_count, 1);
+		atomic_store_explicit(&stack->hash, hash, memory_order_release);
+		return i + 1;
+	    }
+
+	    /* Lost the race, so check the slot again */
+	    continue;
+	}
+	i = (i + 1) & (capacity - 1);
+    }
+    return 0;
+}
+
+/* Set the stack of an event to the backtrace of the caller of the calling operation */
+static inline __attribute__((always_inline)) void mallocator_backtrace(mallocator_tracer_t *mallocator,
+    mallocator_tracer_event_t *event)
+{
+    if (!mallocator->depth) return;
+
+    const void *frames[MALLOCATOR_TRACER_BACKTRACE_MAX];
+    const size_t depth = mallocator_tracer_walk(__builtin_frame_address(0), frames, mallocator->depth);
+    event->stack = depth ? mallocator_tracer_stack_intern(frames, depth) : 0;
+    if (event->stack)
+    {
+	event->backtrace = mallocator_tracer_stacks[event->stack - 1].frames;
+	event->backtrace_len = depth;
+    }
+}
+
+/**************************************************************************************************/
+/* Sampling */
+
+/* Bytes until the next sample of the calling thread, shared by all tracers */
+static _Thread_local int64_t mallocator_tracer_countdown;
+static _Thread_local uint64_t mallocator_tracer_rng;
+
+/* Draw the bytes to the next sample from an exponential distribution with mean interval */
+static int64_t mallocator_tracer_sample_interval(size_t interval)
+{
+    /* xorshift64 */
+    uint64_t x = mallocator_tracer_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    mallocator_tracer_rng = x;
+
+    /* -ln(q / 2^26) for uniform q in [1, 2^26], with ln of the mantissa from a short atanh series */
+    const uint64_t q = (x >> 38) + 1;
+    const unsigned e = 63 - __builtin_clzll(q);
+    const double m = (double) q / (double) (1ull << e);
+    const double t = (m - 1) / (m + 1);
+    const double ln_m = 2 * t * (1 + t * t / 3 + t * t * t * t / 5);
+    const double ln2 = 0.69314718055994531;
+    const double bytes = ((26 - (double) e) * ln2 - ln_m) * (double) interval;
+    return bytes < (double) INT64_MAX ? (int64_t) bytes : INT64_MAX;
+}
+
+static bool mallocator_tracer_sample_slow(mallocator_tracer_sampler_t *sampler, size_t size)
+{
+    if (!mallocator_tracer_rng)
+    {
+	/* First use by this thread, so draw the first interval */
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	mallocator_tracer_rng = ((uint64_t) (uintptr_t) &mallocator_tracer_rng ^ (uint64_t) now.tv_nsec) | 1;
+	mallocator_tracer_countdown = mallocator_tracer_sample_interval(sampler->interval);
+	if (size <= INT64_MAX && (mallocator_tracer_countdown -= (int64_t) size) >= 0) return false;
+    }
+    mallocator_tracer_countdown = mallocator_tracer_sample_interval(sampler->interval);
+    return true;
+}
+
+/* Return true if an allocation of size bytes should be traced - the common case is a decrement */
+static inline bool mallocator_tracer_sample(mallocator_tracer_t *mallocator, size_t size)
+{
+    if (!mallocator->sampler) return true;
+    if (size <= INT64_MAX && (mallocator_tracer_countdown -= (int64_t) size) >= 0) return false;
+    return mallocator_tracer_sample_slow(mallocator->sampler, size);
+}
+
+static inline size_t mallocator_tracer_sampler_slot(mallocator_tracer_sampler_t *sampler, void *ptr)
+{
+    return (((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ull) >> 20 & (sampler->capacity - 1);
+}
+
+static inline void mallocator_tracer_sampler_lock(mallocator_tracer_sampler_t *sampler)
+{
+    while (atomic_flag_test_and_set_explicit(&sampler->lock, memory_order_acquire))
+    {
+	while (atomic_load_explicit(&sampler->lock, memory_order_relaxed))
+	    ;
+    }
+}
+
+static inline void mallocator_tracer_sampler_unlock(mallocator_tracer_sampler_t *sampler)
+{
+    atomic_flag_clear_explicit(&sampler->lock, memory_order_release);
+}
+
+/* Record a sampled block, returning false if the set is full */
+static bool mallocator_tracer_sampler_insert(mallocator_tracer_sampler_t *sampler, void *ptr)
+{
+    const size_t mask = sampler->capacity - 1;
+    mallocator_tracer_sampler_lock(sampler);
+
+    /* Keep a free slot, so that probing always ends */
+    const bool inserted = atomic_load_explicit(&sampler->live, memory_order_relaxed) < mask;
+    if (inserted)
+    {
+	size_t slot = mallocator_tracer_sampler_slot(sampler, ptr);
+	while (atomic_load_explicit(&sampler->slots[slot], memory_order_relaxed))
+	    slot = (slot + 1) & mask;
+	atomic_store_explicit(&sampler->slots[slot], ptr, memory_order_release);
+	atomic_fetch_add(&sampler->live, 1);
+    }
+    mallocator_tracer_sampler_unlock(sampler);
+    return inserted;
+}
+
+/*
+ * Return true if ptr is a sampled block. This does not lock, so retries if a concurrent remove
+ * moved blocks while probing.
+ */
+static bool mallocator_tracer_sampler_find(mallocator_tracer_sampler_t *sampler, void *ptr)
+{
+    if (!ptr || !atomic_load_explicit(&sampler->live, memory_order_relaxed)) return false;
+
+    const size_t mask = sampler->capacity - 1;
+    for (;;)
+    {
+	const unsigned seq = atomic_load_explicit(&sampler->seq, memory_order_acquire);
+	if (seq & 1) continue;
+
+	void *entry;
+	for (size_t slot = mallocator_tracer_sampler_slot(sampler, ptr);
+	     (entry = atomic_load_explicit(&sampler->slots[slot], memory_order_acquire));
+	     slot = (slot + 1) & mask)
+	{
+	    if (entry == ptr) return true;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&sampler->seq, memory_order_relaxed) == seq) return false;
+    }
+}
+
+/* Forget a sampled block, returning false if it was not sampled */
+static bool mallocator_tracer_sampler_remove(mallocator_tracer_sampler_t *sampler, void *ptr)
+{
+    /* Only a sampled block is removed, and only by the thread freeing it, so the lock is only taken then */
+    if (!mallocator_tracer_sampler_find(sampler, ptr)) return false;
+
+    const size_t mask = sampler->capacity - 1;
+    mallocator_tracer_sampler_lock(sampler);
+    const unsigned seq = atomic_load_explicit(&sampler->seq, memory_order_relaxed);
+    atomic_store_explicit(&sampler->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    size_t i = mallocator_tracer_sampler_slot(sampler, ptr);
+    while (atomic_load_explicit(&sampler->slots[i], memory_order_relaxed) != ptr)
+	i = (i + 1) & mask;
+
+    /* Shift back later blocks of the probe sequence, so that no tombstones are needed */
+    void *entry;
+    for (size_t j = (i + 1) & mask; (entry = atomic_load_explicit(&sampler->slots[j], memory_order_relaxed));
+	 j = (j + 1) & mask)
+    {
+	const size_t home = mallocator_tracer_sampler_slot(sampler, entry);
+	if (((j - home) & mask) >= ((j - i) & mask))
+	{
+	    atomic_store_explicit(&sampler->slots[i], entry, memory_order_relaxed);
+	    i = j;
+	}
+    }
+    atomic_store_explicit(&sampler->slots[i], NULL, memory_order_relaxed);
+    atomic_fetch_sub(&sampler->live, 1);
+
+    atomic_store_explicit(&sampler->seq, seq + 2, memory_order_release);
+    mallocator_tracer_sampler_unlock(sampler);
+    return true;
+}
+
+static mallocator_tracer_sampler_t *mallocator_tracer_sampler_create(size_t interval, size_t capacity)
+{
+    mallocator_tracer_sampler_t *sampler = malloc(sizeof(*sampler));
+    if (!sampler) return NULL;
+
+    *sampler = (mallocator_tracer_sampler_t)
+    {
+	.ref_count = 1,
+	.interval = interval,
+	.capacity = 16,
+	.live = 0,
+	.lock = 0,
+	.seq = 0,
+    };
+    while (sampler->capacity < capacity)
+	sampler->capacity *= 2;
+    sampler->slots = calloc(sampler->capacity, sizeof(sampler->slots[0]));
+    if (!sampler->slots)
+    {
+	free(sampler);
+	return NULL;
+    }
+    return sampler;
+}
+
+static void mallocator_tracer_sampler_dereference(mallocator_tracer_sampler_t *sampler)
+{
+    if (atomic_fetch_sub(&sampler->ref_count, 1) != 1) return;
+
+    free(sampler->slots);
+    free(sampler);
+}
+
 /**************************************************************************************************/
 
 static inline mallocator_tracer_t *mallocator_tracer_verify(void *obj)
@@ -62,7 +767,8 @@ static inline mallocator_tracer_t *mallocator_tracer_verify(void *obj)
     return mallocator;
 }
 
-static void mallocator_tracer_init(mallocator_tracer_t *mallocator, char *name, mallocator_tracer_fn fn, void *arg)
+static void mallocator_tracer_init(mallocator_tracer_t *mallocator, char *name, mallocator_tracer_fn fn, void *arg,
+    mallocator_tracer_async_t *async, mallocator_impl_t *inner)
 {
     *mallocator = (mallocator_tracer_t)
     {
@@ -70,10 +776,18 @@ static void mallocator_tracer_init(mallocator_tracer_t *mallocator, char *name,
 	{
 	    .obj = mallocator,
 	    .interface = &mallocator_tracer_interface,
+	    .inner = inner,
 	},
 	.name = name,
 	.fn = fn,
 	.arg = arg,
+	.async = async,
+	.sampler = NULL,
+	.depth = MALLOCATOR_TRACER_BACKTRACE_DEPTH,
+	.context = 0,
+	.filter = MALLOCATOR_TRACER_FILTER_TYPES,
+	.min_size = 0,
+	.max_size = SIZE_MAX,
     };
 }
 
@@ -85,17 +799,26 @@ static void mallocator_tracer_fini(mallocator_tracer_t *mallocator)
 	{
 	    .obj = NULL,
 	    .interface = NULL,
+	    .inner = NULL,
 	},
 	.name = NULL,
 	.fn = NULL,
 	.arg = NULL,
+	.async = NULL,
+	.sampler = NULL,
+	.depth = 0,
+	.context = 0,
+	.filter = 0,
+	.min_size = 0,
+	.max_size = 0,
     };
 }
 
-static mallocator_tracer_t *mallocator_tracer_create_int(mallocator_tracer_t *parent, const char *name, mallocator_tracer_fn fn, void *arg)
+static mallocator_tracer_t *mallocator_tracer_create_int(mallocator_tracer_t *parent, const char *name, mallocator_tracer_fn fn, void *arg,
+    mallocator_tracer_async_t *async, mallocator_impl_t *inner)
 {
     /* Make a copy of the name */
-    char *name_copy = malloc(strlen(name) + (parent ? strlen(parent->name) : 0) + 1);
+    char *name_copy = malloc(strlen(name) + (parent ? strlen(parent->name) + 1 : 0) + 1);
     if (!name_copy) return NULL;
 
     if (parent)
@@ -109,63 +832,115 @@ static mallocator_tracer_t *mallocator_tracer_create_int(mallocator_tracer_t *pa
     }
     strcat(name_copy, name);
 
+    if (async)
+    {
+	char *interned = mallocator_tracer_async_name(async, name_copy);
+	free(name_copy);
+	if (!interned) return NULL;
+	name_copy = interned;
+    }
+
     mallocator_tracer_t *mallocator = malloc(sizeof(*mallocator));
     if (!mallocator)
     {
-	free(name_copy);
+	if (!async) free(name_copy);
 	return NULL;
     }
 
-    mallocator_tracer_init(mallocator, name_copy, fn, arg);
+    if (async) atomic_fetch_add(&async->ref_count, 1);
+    mallocator_tracer_init(mallocator, name_copy, fn, arg, async, inner);
     return mallocator;
 }
 
 static mallocator_impl_t *mallocator_tracer_create_child(void *parent_obj, const char *name)
 {
     mallocator_tracer_t *parent = mallocator_tracer_verify(parent_obj);
-    mallocator_tracer_t *child = mallocator_tracer_create_int(parent, name, parent->fn, parent->arg);
-    if (!child) return NULL;
+    mallocator_impl_t *inner = mallocator_impl_next_create_child(&parent->impl, name);
+    if (parent->impl.inner && !inner) return NULL;
+
+    mallocator_tracer_t *child = mallocator_tracer_create_int(parent, name, parent->fn, parent->arg, parent->async, inner);
+    if (!child)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    child->sampler = parent->sampler;
+    if (child->sampler) atomic_fetch_add(&child->sampler->ref_count, 1);
+    child->depth = parent->depth;
+    child->context = parent->context;
+    child->min_size = atomic_load_explicit(&parent->min_size, memory_order_relaxed);
+    child->max_size = atomic_load_explicit(&parent->max_size, memory_order_relaxed);
+    child->filter = atomic_load_explicit(&parent->filter, memory_order_relaxed);
     return &child->impl;
 }
 
 static void mallocator_tracer_destroy(void *obj)
 {
     mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
-    free(mallocator->name);
+    mallocator_impl_next_destroy(&mallocator->impl);
+    if (mallocator->sampler)
+	mallocator_tracer_sampler_dereference(mallocator->sampler);
+    if (mallocator->async)
+	mallocator_tracer_async_dereference(mallocator->async);
+    else
+	free(mallocator->name);
     mallocator_tracer_fini(mallocator);
     free(mallocator);
 }
 
-static unsigned mallocator_backtrace(mallocator_tracer_t *mallocator, void **backtrace)
+/* Thread ID of the calling thread, 0 until known */
+static _Thread_local uint32_t mallocator_tracer_tid;
+
+static void mallocator_event(mallocator_tracer_t *mallocator, mallocator_tracer_event_t *event)
 {
-    /* NOTE: Argument must be a constant integer */
-    backtrace[0] = __builtin_return_address(0);
-    backtrace[1] = __builtin_return_address(1);
-    backtrace[2] = __builtin_return_address(2);
-    backtrace[3] = __builtin_return_address(3);
-    backtrace[4] = __builtin_return_address(4);
-    backtrace[5] = __builtin_return_address(5);
-    backtrace[6] = __builtin_return_address(6);
-    backtrace[7] = __builtin_return_address(7);
-    unsigned len = 0;
-    for (unsigned i = 0; i < MALLOCATOR_TRACER_BACKTRACE_MAX; i++)
+    event->cpu = -1;
+    if (mallocator->context)
     {
-	backtrace[i] = __builtin_extract_return_addr(backtrace[i]);
-	if (!backtrace[i]) break;
-	len++;
+	if (mallocator->context & MALLOCATOR_TRACER_TIMESTAMP)
+	{
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    event->timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	}
+	if (mallocator->context & MALLOCATOR_TRACER_TID)
+	{
+	    if (!mallocator_tracer_tid) mallocator_tracer_tid = gettid();
+	    event->tid = mallocator_tracer_tid;
+	}
+	if (mallocator->context & MALLOCATOR_TRACER_CPU)
+	    event->cpu = sched_getcpu();
     }
-    return len;
+
+    if (mallocator->async)
+	mallocator_tracer_async_push(mallocator->async, event);
+    else
+	mallocator->fn(mallocator->arg, event);
 }
 
-static void mallocator_event(mallocator_tracer_t *mallocator, mallocator_tracer_event_t *event)
+/* Return true if an event passes the filter of mallocator, before anything else is done for it */
+static inline bool mallocator_tracer_pass(mallocator_tracer_t *mallocator, mallocator_tracer_type_t type, size_t size)
+{
+    const unsigned filter = atomic_load_explicit(&mallocator->filter, memory_order_relaxed);
+    if (!(filter & (1u << type))) return false;
+    if (!(filter & MALLOCATOR_TRACER_FILTER_SIZE)) return true;
+    return size >= atomic_load_explicit(&mallocator->min_size, memory_order_relaxed) &&
+	size <= atomic_load_explicit(&mallocator->max_size, memory_order_relaxed);
+}
+
+/* Record a sampled allocation, returning false if it cannot be traced because its free would not be */
+static inline bool mallocator_tracer_sampled(mallocator_tracer_t *mallocator, void *ptr)
 {
-    mallocator->fn(mallocator->arg, event);
+    return !mallocator->sampler || !ptr || mallocator_tracer_sampler_insert(mallocator->sampler, ptr);
 }
 
 static void *mallocator_tracer_malloc(void *obj, size_t size)
 {
     mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
-    void *ptr = malloc(size);
+    void *ptr = mallocator_impl_next_malloc(&mallocator->impl, size);
+    if (!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_MALLOC, size) ||
+	!mallocator_tracer_sample(mallocator, size) || !mallocator_tracer_sampled(mallocator, ptr))
+	return ptr;
+
     mallocator_tracer_event_t event =
     {
 	.name = mallocator->name,
@@ -176,7 +951,7 @@ static void *mallocator_tracer_malloc(void *obj, size_t size)
 	    .size = size,
 	},
     };
-    event.backtrace_len = mallocator_backtrace(mallocator, event.backtrace);
+    mallocator_backtrace(mallocator, &event);
     mallocator_event(mallocator, &event);
     return ptr;
 }
@@ -184,7 +959,13 @@ static void *mallocator_tracer_malloc(void *obj, size_t size)
 static void *mallocator_tracer_calloc(void *obj, size_t nmemb, size_t size)
 {
     mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
-    void *ptr = calloc(nmemb, size);
+    void *ptr = mallocator_impl_next_calloc(&mallocator->impl, nmemb, size);
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) total = SIZE_MAX;
+    if (!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_CALLOC, total) ||
+	!mallocator_tracer_sample(mallocator, total) || !mallocator_tracer_sampled(mallocator, ptr))
+	return ptr;
+
     mallocator_tracer_event_t event =
     {
 	.name = mallocator->name,
@@ -196,7 +977,7 @@ static void *mallocator_tracer_calloc(void *obj, size_t nmemb, size_t size)
 	    .size = size,
 	},
     };
-    event.backtrace_len = mallocator_backtrace(mallocator, event.backtrace);
+    mallocator_backtrace(mallocator, &event);
     mallocator_event(mallocator, &event);
     return ptr;
 }
@@ -204,7 +985,26 @@ static void *mallocator_tracer_calloc(void *obj, size_t nmemb, size_t size)
 static void *mallocator_tracer_realloc(void *obj, void *ptr, size_t size, size_t new_size)
 {
     mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
-    void *new_ptr = realloc(ptr, new_size);
+
+    /* Forget the old block before it can be reused by another thread */
+    const bool sampled = mallocator->sampler && mallocator_tracer_sampler_remove(mallocator->sampler, ptr);
+    void *new_ptr = mallocator_impl_next_realloc(&mallocator->impl, ptr, size, new_size);
+    const bool failed = !new_ptr && new_size;
+    if (sampled && failed)
+    {
+	/* The old block remains */
+	mallocator_tracer_sampler_insert(mallocator->sampler, ptr);
+    }
+    if (!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_REALLOC, new_size))
+	return new_ptr;
+    if (mallocator->sampler && !(sampled && failed))
+    {
+	if (!sampled && !mallocator_tracer_sample(mallocator, new_size))
+	    return new_ptr;
+	if (new_ptr && !mallocator_tracer_sampler_insert(mallocator->sampler, new_ptr) && !sampled)
+	    return new_ptr;
+    }
+
     mallocator_tracer_event_t event =
     {
 	.name = mallocator->name,
@@ -217,7 +1017,7 @@ static void *mallocator_tracer_realloc(void *obj, void *ptr, size_t size, size_t
 	    .new_size = new_size,
 	},
     };
-    event.backtrace_len = mallocator_backtrace(mallocator, event.backtrace);
+    mallocator_backtrace(mallocator, &event);
     mallocator_event(mallocator, &event);
     return new_ptr;
 }
@@ -225,6 +1025,13 @@ static void *mallocator_tracer_realloc(void *obj, void *ptr, size_t size, size_t
 static void mallocator_tracer_free(void *obj, void *ptr, size_t size)
 {
     mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    if ((mallocator->sampler && !mallocator_tracer_sampler_remove(mallocator->sampler, ptr)) ||
+	!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_FREE, size))
+    {
+	mallocator_impl_next_free(&mallocator->impl, ptr, size);
+	return;
+    }
+
     mallocator_tracer_event_t event =
     {
 	.name = mallocator->name,
@@ -235,9 +1042,102 @@ static void mallocator_tracer_free(void *obj, void *ptr, size_t size)
 	    .size = size,
 	},
     };
-    event.backtrace_len = mallocator_backtrace(mallocator, event.backtrace);
+    mallocator_backtrace(mallocator, &event);
+    mallocator_event(mallocator, &event);
+    mallocator_impl_next_free(&mallocator->impl, ptr, size);
+}
+
+static void *mallocator_tracer_aligned_alloc(void *obj, size_t alignment, size_t size)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    void *ptr = mallocator_impl_next_aligned_alloc(&mallocator->impl, alignment, size);
+    if (!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_ALIGNED_ALLOC, size) ||
+	!mallocator_tracer_sample(mallocator, size) || !mallocator_tracer_sampled(mallocator, ptr))
+	return ptr;
+
+    mallocator_tracer_event_t event =
+    {
+	.name = mallocator->name,
+	.type = MALLOCATOR_TRACER_ALIGNED_ALLOC,
+	.ptr = ptr,
+	.e.aligned_alloc =
+	{
+	    .alignment = alignment,
+	    .size = size,
+	},
+    };
+    mallocator_backtrace(mallocator, &event);
+    mallocator_event(mallocator, &event);
+    return ptr;
+}
+
+static size_t mallocator_tracer_usable_size(void *obj, void *ptr, size_t size)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    return mallocator_impl_next_usable_size(&mallocator->impl, ptr, size);
+}
+
+static size_t mallocator_tracer_block_size(void *obj, void *ptr)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    return mallocator_impl_next_block_size(&mallocator->impl, ptr);
+}
+
+static size_t mallocator_tracer_trim(void *obj, unsigned flags)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    return mallocator_impl_next_trim(&mallocator->impl, flags);
+}
+
+static void *mallocator_tracer_malloc_at_least(void *obj, size_t size, size_t *actual)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    void *ptr = mallocator_impl_next_malloc_at_least(&mallocator->impl, size, actual);
+    if (!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_MALLOC, ptr ? *actual : size) ||
+	!mallocator_tracer_sample(mallocator, ptr ? *actual : size) || !mallocator_tracer_sampled(mallocator, ptr))
+	return ptr;
+
+    /* Trace the usable size, which is what will be freed */
+    mallocator_tracer_event_t event =
+    {
+	.name = mallocator->name,
+	.type = MALLOCATOR_TRACER_MALLOC,
+	.ptr = ptr,
+	.e.malloc =
+	{
+	    .size = ptr ? *actual : size,
+	},
+    };
+    mallocator_backtrace(mallocator, &event);
+    mallocator_event(mallocator, &event);
+    return ptr;
+}
+
+static bool mallocator_tracer_try_expand(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_verify(obj);
+    if (!mallocator_impl_next_try_expand(&mallocator->impl, ptr, size, new_size))
+	return false;
+    if (!mallocator_tracer_pass(mallocator, MALLOCATOR_TRACER_REALLOC, new_size) ||
+	(mallocator->sampler && !mallocator_tracer_sampler_find(mallocator->sampler, ptr)))
+	return true;
+
+    /* Traced as a realloc which did not move the block */
+    mallocator_tracer_event_t event =
+    {
+	.name = mallocator->name,
+	.type = MALLOCATOR_TRACER_REALLOC,
+	.ptr = ptr,
+	.e.realloc =
+	{
+	    .old_ptr = ptr,
+	    .old_size = size,
+	    .new_size = new_size,
+	},
+    };
+    mallocator_backtrace(mallocator, &event);
     mallocator_event(mallocator, &event);
-    free(ptr);
+    return true;
 }
 
 /**************************************************************************************************/
@@ -245,14 +1145,190 @@ static void mallocator_tracer_free(void *obj, void *ptr, size_t size)
 
 mallocator_t *mallocator_tracer_create(const char *name, mallocator_tracer_fn fn, void *arg)
 {
-    mallocator_tracer_t *tracer = mallocator_tracer_create_int(NULL, name, fn, arg);
-    if (!tracer) return NULL;
+    mallocator_impl_t *impl = mallocator_tracer_impl_create(name, fn, arg, NULL);
+    if (!impl) return NULL;
+
+    mallocator_t *mallocator = mallocator_create_custom(name, impl);
+    if (!mallocator)
+    {
+	mallocator_impl_destroy(impl);
+	return NULL;
+    }
+    return mallocator;
+}
+
+mallocator_impl_t *mallocator_tracer_impl_create(const char *name, mallocator_tracer_fn fn, void *arg, mallocator_impl_t *inner)
+{
+    mallocator_tracer_t *tracer = mallocator_tracer_create_int(NULL, name, fn, arg, NULL, inner);
+    if (!tracer)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &tracer->impl;
+}
+
+mallocator_t *mallocator_tracer_create_async(const char *name, mallocator_tracer_fn fn, void *arg,
+    const mallocator_tracer_async_config_t *config)
+{
+    mallocator_impl_t *impl = mallocator_tracer_impl_create_async(name, fn, arg, config, NULL);
+    if (!impl) return NULL;
+
+    mallocator_t *mallocator = mallocator_create_custom(name, impl);
+    if (!mallocator)
+    {
+	mallocator_impl_destroy(impl);
+	return NULL;
+    }
+    return mallocator;
+}
+
+mallocator_impl_t *mallocator_tracer_impl_create_async(const char *name, mallocator_tracer_fn fn, void *arg,
+    const mallocator_tracer_async_config_t *config, mallocator_impl_t *inner)
+{
+    assert(config && config->period_ms > 0);
+
+    mallocator_tracer_async_t *async = mallocator_tracer_async_create(fn, NULL, arg, 0, config);
+    mallocator_tracer_t *tracer = async ? mallocator_tracer_create_int(NULL, name, fn, arg, async, inner) : NULL;
+
+    /* The tracer holds its own reference */
+    if (async) mallocator_tracer_async_dereference(async);
+    if (!tracer)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &tracer->impl;
+}
+
+mallocator_t *mallocator_tracer_create_batched(const char *name, mallocator_tracer_batch_fn fn, void *arg,
+    size_t batch_size)
+{
+    mallocator_impl_t *impl = mallocator_tracer_impl_create_batched(name, fn, arg, batch_size, NULL);
+    if (!impl) return NULL;
 
-    mallocator_t *mallocator = mallocator_create_custom(name, &tracer->impl);
+    mallocator_t *mallocator = mallocator_create_custom(name, impl);
     if (!mallocator)
     {
-	mallocator_tracer_destroy(&tracer->impl);
+	mallocator_impl_destroy(impl);
 	return NULL;
     }
     return mallocator;
 }
+
+mallocator_impl_t *mallocator_tracer_impl_create_batched(const char *name, mallocator_tracer_batch_fn fn, void *arg,
+    size_t batch_size, mallocator_impl_t *inner)
+{
+    assert(fn && batch_size > 0);
+
+    /* Room for a second batch while the first is delivered */
+    const mallocator_tracer_async_config_t config =
+    {
+	.ring_events = 2 * batch_size,
+	.period_ms = MALLOCATOR_TRACER_BATCH_PERIOD_MS,
+	.overflow = MALLOCATOR_TRACER_BLOCK,
+    };
+    mallocator_tracer_async_t *async = mallocator_tracer_async_create(NULL, fn, arg, batch_size, &config);
+    mallocator_tracer_t *tracer = async ? mallocator_tracer_create_int(NULL, name, NULL, arg, async, inner) : NULL;
+
+    if (async) mallocator_tracer_async_dereference(async);
+    if (!tracer)
+    {
+	if (inner) mallocator_impl_destroy(inner);
+	return NULL;
+    }
+    return &tracer->impl;
+}
+
+static mallocator_tracer_t *mallocator_tracer_find(mallocator_t *m)
+{
+    mallocator_impl_t *impl = mallocator_impl_find(mallocator_get_impl(m), &mallocator_tracer_interface);
+    assert(impl);
+    return mallocator_tracer_verify(impl->obj);
+}
+
+bool mallocator_tracer_set_sampling(mallocator_t *m, size_t interval, size_t max_sampled)
+{
+    assert(interval > 0);
+    mallocator_tracer_t *mallocator = mallocator_tracer_find(m);
+    if (mallocator->sampler) return false;
+
+    mallocator->sampler = mallocator_tracer_sampler_create(interval,
+	max_sampled ? 2 * max_sampled : MALLOCATOR_TRACER_SAMPLED_MAX * 2);
+    return mallocator->sampler != NULL;
+}
+
+void mallocator_tracer_set_context(mallocator_t *m, unsigned context)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_find(m);
+    mallocator->context = context & (MALLOCATOR_TRACER_TIMESTAMP | MALLOCATOR_TRACER_TID | MALLOCATOR_TRACER_CPU);
+}
+
+void mallocator_tracer_set_backtrace_depth(mallocator_t *m, size_t depth)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_find(m);
+    mallocator->depth = depth < MALLOCATOR_TRACER_BACKTRACE_MAX ? depth : MALLOCATOR_TRACER_BACKTRACE_MAX;
+}
+
+static void mallocator_tracer_set_filter_int(mallocator_t *m, unsigned filter, size_t min_size, size_t max_size)
+{
+    /* Descendants created by other stacks have no tracer to filter */
+    mallocator_impl_t *impl = mallocator_impl_find(mallocator_get_impl(m), &mallocator_tracer_interface);
+    if (impl)
+    {
+	mallocator_tracer_t *mallocator = mallocator_tracer_verify(impl->obj);
+	atomic_store_explicit(&mallocator->min_size, min_size, memory_order_relaxed);
+	atomic_store_explicit(&mallocator->max_size, max_size, memory_order_relaxed);
+	atomic_store_explicit(&mallocator->filter, filter, memory_order_release);
+    }
+
+    for (mallocator_t *child = mallocator_child_begin(m); child != NULL; child = mallocator_child_next(child))
+	mallocator_tracer_set_filter_int(child, filter, min_size, max_size);
+}
+
+void mallocator_tracer_set_filter(mallocator_t *m, const mallocator_tracer_filter_t *filter)
+{
+    unsigned word = 0;
+    if (filter->enabled)
+	word = filter->types ? filter->types & MALLOCATOR_TRACER_FILTER_TYPES : MALLOCATOR_TRACER_FILTER_TYPES;
+    if (filter->min_size || filter->max_size)
+	word |= MALLOCATOR_TRACER_FILTER_SIZE;
+    mallocator_tracer_set_filter_int(m, word, filter->min_size, filter->max_size ? filter->max_size : SIZE_MAX);
+}
+
+void mallocator_tracer_get_filter(mallocator_t *m, mallocator_tracer_filter_t *filter)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_find(m);
+    const unsigned word = atomic_load_explicit(&mallocator->filter, memory_order_acquire);
+    const size_t max_size = atomic_load_explicit(&mallocator->max_size, memory_order_relaxed);
+    *filter = (mallocator_tracer_filter_t)
+    {
+	.enabled = (word & MALLOCATOR_TRACER_FILTER_TYPES) != 0,
+	.types = word & MALLOCATOR_TRACER_FILTER_TYPES,
+	.min_size = atomic_load_explicit(&mallocator->min_size, memory_order_relaxed),
+	.max_size = max_size == SIZE_MAX ? 0 : max_size,
+    };
+}
+
+const void *const *mallocator_tracer_stack(uint32_t stack, size_t *depth)
+{
+    const size_t capacity = sizeof(mallocator_tracer_stacks) / sizeof(mallocator_tracer_stacks[0]);
+    if (stack == 0 || stack > capacity) return NULL;
+
+    mallocator_tracer_stack_t *entry = &mallocator_tracer_stacks[stack - 1];
+    if (atomic_load_explicit(&entry->hash, memory_order_acquire) <= MALLOCATOR_TRACER_STACK_BUSY) return NULL;
+    if (depth) *depth = entry->depth;
+    return entry->frames;
+}
+
+void mallocator_tracer_flush(mallocator_t *m)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_find(m);
+    if (mallocator->async) mallocator_tracer_async_flush(mallocator->async);
+}
+
+size_t mallocator_tracer_dropped(mallocator_t *m)
+{
+    mallocator_tracer_t *mallocator = mallocator_tracer_find(m);
+    return mallocator->async ? atomic_load(&mallocator->async->dropped) : 0;
+}
@@ -1,10 +1,13 @@
 #include <cgreen/cgreen.h>
 
 #include "mallocator.h"
+#include "mallocator_tlsf.h"
+#include "mallocator_test_helpers.h"
 
 #include <pthread.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <string.h>
 
 #define debugf(...) //printf(__VA_ARGS__)
 
@@ -12,27 +15,9 @@ Describe(mallocator_concurrency)
 
 static struct mallinfo mallinfo_before;
 
-static void *dummy_thread(void *arg) { return NULL; }
-
 BeforeEach(mallocator_concurrency) 
 {
-    /* HACK! pthreads keeps a number of thread stacks allocated after a thread has terminated
-     * to avoid reallocation when threads are created. This affects our memory low watermark,
-     * so create a number of threads */
-    for (unsigned num_dummy_threads = 8; ; num_dummy_threads *= 2)
-    {
-	mallinfo_before = mallinfo();
-	pthread_t dummy_tid[num_dummy_threads];
-	for (unsigned i = 0; i < num_dummy_threads; i++)
-	    assert_that(pthread_create(&dummy_tid[i], NULL, dummy_thread, NULL), is_equal_to(0));
-	for (unsigned i = 0; i < num_dummy_threads; i++)
-	    assert_that(pthread_join(dummy_tid[i], NULL), is_equal_to(0));
-
-	struct mallinfo mallinfo_after = mallinfo();
-	if (mallinfo_after.uordblks == mallinfo_before.uordblks &&
-	    mallinfo_after.fordblks == mallinfo_before.fordblks)
-	    break;
-    }
+    mallinfo_before = mallocator_test_mallinfo();
 }
 
 AfterEach(mallocator_concurrency)
@@ -227,9 +212,120 @@ Ensure(mallocator_concurrency, is_safe)
     mallocator_dereference(root);
 }
 
+typedef struct
+{
+    mallocator_t *mallocator;
+    unsigned index;
+    unsigned *stop;
+    bool corrupt;
+} trim_data_t;
+
+static void *trim_thread(void *arg)
+{
+    trim_data_t *data = arg;
+    while (!__atomic_load_n(data->stop, __ATOMIC_SEQ_CST))
+    {
+	const size_t size = 1 + rand() % (64 * 1024);
+	unsigned char *ptr = mallocator_malloc(data->mallocator, size);
+	if (!ptr) continue;
+
+	memset(ptr, data->index, size);
+	for (size_t i = 0; i < size; i += 64)
+	{
+	    if (ptr[i] != data->index) data->corrupt = true;
+	}
+	mallocator_free(data->mallocator, ptr, size);
+    }
+    return NULL;
+}
+
+Ensure(mallocator_concurrency, can_trim_during_allocation)
+{
+    unsigned num_threads = 4;
+    trim_data_t data[num_threads];
+    pthread_t threads[num_threads];
+    unsigned stop = 0;
+    mallocator_t *root = mallocator_tlsf_create("root", 4 * 1024 * 1024);
+    assert_that(root, is_non_null);
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+	data[i] = (trim_data_t) { .mallocator = root, .index = i + 1, .stop = &stop, .corrupt = false };
+	assert_that(pthread_create(&threads[i], NULL, trim_thread, &data[i]), is_equal_to(0));
+    }
+    for (unsigned i = 0; i < 100; i++)
+    {
+	mallocator_trim(root, MALLOCATOR_TRIM_PURGE);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+	assert_that(pthread_join(threads[i], NULL), is_equal_to(0));
+	assert_that(data[i].corrupt, is_false);
+    }
+
+    mallocator_tlsf_stats_t stats;
+    mallocator_tlsf_stats(root, &stats);
+    assert_that(stats.blocks_free, is_equal_to(1));
+    mallocator_dereference(root);
+}
+
+static void *defer_thread(void *arg)
+{
+    trim_data_t *data = arg;
+    while (!__atomic_load_n(data->stop, __ATOMIC_SEQ_CST))
+    {
+	const size_t size = 1 + rand() % 1024;
+	unsigned char *ptr = mallocator_malloc(data->mallocator, size);
+	if (!ptr) continue;
+
+	memset(ptr, data->index, size);
+	for (size_t i = 0; i < size; i += 64)
+	{
+	    if (ptr[i] != data->index) data->corrupt = true;
+	}
+	mallocator_free_deferred(data->mallocator, ptr, size);
+    }
+    return NULL;
+}
+
+Ensure(mallocator_concurrency, can_drain_during_deferred_free)
+{
+    unsigned num_threads = 4;
+    trim_data_t data[num_threads];
+    pthread_t threads[num_threads];
+    unsigned stop = 0;
+    mallocator_t *root = mallocator_create("root");
+    mallocator_set_defer_limit(root, 64 * 1024);
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+	data[i] = (trim_data_t) { .mallocator = root, .index = i + 1, .stop = &stop, .corrupt = false };
+	assert_that(pthread_create(&threads[i], NULL, defer_thread, &data[i]), is_equal_to(0));
+    }
+    for (unsigned i = 0; i < 1000; i++)
+    {
+	mallocator_drain_deferred(root);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+	assert_that(pthread_join(threads[i], NULL), is_equal_to(0));
+	assert_that(data[i].corrupt, is_false);
+    }
+
+    mallocator_drain_deferred(root);
+    mallocator_stats_t stats;
+    mallocator_stats(root, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(stats.blocks_allocated));
+    assert_that(stats.bytes_freed, is_equal_to(stats.bytes_allocated));
+    assert_that(stats.bytes_deferred, is_equal_to(0));
+    mallocator_dereference(root);
+}
+
 TestSuite *mallocator_concurrency_tests(void)
 {
     TestSuite *suite = create_test_suite();
     add_test_with_context(suite, mallocator_concurrency, is_safe);
+    add_test_with_context(suite, mallocator_concurrency, can_trim_during_allocation);
+    add_test_with_context(suite, mallocator_concurrency, can_drain_during_deferred_free);
     return suite;
 }
@@ -0,0 +1,170 @@
+#include <cgreen/cgreen.h>
+
+#include "mallocator_header.h"
+#include "mallocator.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+
+static struct mallinfo mallinfo_before;
+
+Describe(mallocator_header);
+
+BeforeEach(mallocator_header)
+{
+    mallinfo_before = mallinfo();
+}
+
+AfterEach(mallocator_header)
+{
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+Ensure(mallocator_header, can_be_created)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    assert_that(m, is_non_null);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, has_a_name)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    const char *name = mallocator_name(m);
+    assert_that(name, is_equal_to_string("test"));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, can_malloc)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    unsigned num = 1024;
+    int *ints = mallocator_malloc(m, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    assert_that((uintptr_t) ints % 16, is_equal_to(0));
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    mallocator_free(m, ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, can_calloc)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    unsigned num = 1024;
+    int *ints = mallocator_calloc(m, num, sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(ints[i], is_equal_to(0));
+    }
+    mallocator_free(m, ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, can_realloc)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    unsigned num = 1024;
+    int *ints = mallocator_realloc(m, NULL, 0, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    unsigned more_num = 10 * num;
+    int *more_ints = mallocator_realloc(m, ints, num * sizeof(int), more_num * sizeof(int));
+    assert_that(more_ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(more_ints[i], is_equal_to(i));
+    }
+    int *no_ints = mallocator_realloc(m, more_ints, more_num * sizeof(int), 0);
+    assert_that(no_ints, is_null);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, accounts_unsized_free_exactly)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    void *ptr = mallocator_malloc(m, 100);
+    assert_that(ptr, is_non_null);
+    mallocator_free_unsized(m, ptr);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(1));
+    assert_that(stats.bytes_freed, is_equal_to(100));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, accounts_unsized_realloc_exactly)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    char *ptr = mallocator_realloc_unsized(m, NULL, 100);
+    assert_that(ptr, is_non_null);
+    memset(ptr, 1, 100);
+    char *more = mallocator_realloc_unsized(m, ptr, 1000);
+    assert_that(more, is_non_null);
+    for (unsigned i = 0; i < 100; i++)
+    {
+	assert_that(more[i], is_equal_to(1));
+    }
+    assert_that(mallocator_realloc_unsized(m, more, 0), is_null);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.bytes_allocated, is_equal_to(1100));
+    assert_that(stats.bytes_freed, is_equal_to(1100));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, can_free_aligned_unsized)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    char *ptr = mallocator_aligned_alloc(m, 4096, 100);
+    assert_that(ptr, is_non_null);
+    assert_that((uintptr_t) ptr % 4096, is_equal_to(0));
+    memset(ptr, 0, 100);
+    char *more = mallocator_realloc_unsized(m, ptr, 200);
+    assert_that(more, is_non_null);
+    mallocator_free_unsized(m, more);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.bytes_freed, is_equal_to(300));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_header, can_malloc_at_least)
+{
+    mallocator_t *m = mallocator_header_create("test");
+    size_t actual = 0;
+    char *ptr = mallocator_malloc_at_least(m, 100, &actual);
+    assert_that(ptr, is_non_null);
+    assert_that(actual, is_greater_than(100 - 1));
+    memset(ptr, 0, actual);
+    mallocator_free_unsized(m, ptr);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.bytes_freed, is_equal_to(actual));
+    mallocator_dereference(m);
+}
+
+TestSuite *mallocator_header_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_header, can_be_created);
+    add_test_with_context(suite, mallocator_header, has_a_name);
+    add_test_with_context(suite, mallocator_header, can_malloc);
+    add_test_with_context(suite, mallocator_header, can_calloc);
+    add_test_with_context(suite, mallocator_header, can_realloc);
+    add_test_with_context(suite, mallocator_header, accounts_unsized_free_exactly);
+    add_test_with_context(suite, mallocator_header, accounts_unsized_realloc_exactly);
+    add_test_with_context(suite, mallocator_header, can_free_aligned_unsized);
+    add_test_with_context(suite, mallocator_header, can_malloc_at_least);
+    return suite;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <cgreen/cgreen.h>
+
+#include "mallocator_heap_profile.h"
+#include "mallocator_tracer.h"
+#include "mallocator.h"
+#include "mallocator_test_helpers.h"
+
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct mallinfo mallinfo_before;
+static FILE *file;
+
+Describe(mallocator_heap_profile);
+
+BeforeEach(mallocator_heap_profile)
+{
+    mallinfo_before = mallocator_test_mallinfo();
+
+    /* Created after the leak check baseline, as its buffer is freed on close */
+    file = tmpfile();
+    assert_that(file, is_non_null);
+}
+
+AfterEach(mallocator_heap_profile)
+{
+    fclose(file);
+
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+/* Read the output written to file, which the caller frees */
+static char *read_output(void)
+{
+    const long len = ftell(file);
+    rewind(file);
+    char *output = malloc(len + 1);
+    assert_that(fread(output, 1, len, file), is_equal_to(len));
+    output[len] = '\0';
+    return output;
+}
+
+Ensure(mallocator_heap_profile, tracks_live_blocks)
+{
+    mallocator_heap_profile_t *profile = mallocator_heap_profile_create(0);
+    assert_that(profile, is_non_null);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_heap_profile_event, profile);
+
+    void *a = mallocator_malloc(m, 100);
+    void *b = mallocator_calloc(m, 10, 20);
+    void *c = mallocator_aligned_alloc(m, 64, 640);
+    size_t bytes;
+    assert_that(mallocator_heap_profile_live(profile, &bytes), is_equal_to(3));
+    assert_that(bytes, is_equal_to(940));
+
+    a = mallocator_realloc(m, a, 100, 1000);
+    mallocator_free(m, b, 200);
+    assert_that(mallocator_heap_profile_live(profile, &bytes), is_equal_to(2));
+    assert_that(bytes, is_equal_to(1640));
+
+    mallocator_free(m, a, 1000);
+    mallocator_free(m, c, 640);
+    assert_that(mallocator_heap_profile_live(profile, &bytes), is_equal_to(0));
+    assert_that(bytes, is_equal_to(0));
+    mallocator_dereference(m);
+    mallocator_heap_profile_destroy(profile);
+}
+
+Ensure(mallocator_heap_profile, writes_pprof)
+{
+    mallocator_heap_profile_t *profile = mallocator_heap_profile_create(0);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_heap_profile_event, profile);
+    void *ptrs[10];
+    for (unsigned i = 0; i < 10; i++)
+	ptrs[i] = mallocator_malloc(m, 100);
+
+    assert_that(mallocator_heap_profile_write(profile, file, MALLOCATOR_HEAP_PROFILE_PPROF), is_true);
+    char *output = read_output();
+    assert_that(strncmp(output, "heap profile: 10: 1000 [0: 0] @ heapprofile\n", 44), is_equal_to(0));
+
+    /* The allocations share a stack */
+    assert_that(strstr(output, "\n10: 1000 [0: 0] @ 0x"), is_non_null);
+    assert_that(strstr(output, "\nMAPPED_LIBRARIES:\n"), is_non_null);
+    free(output);
+
+    for (unsigned i = 0; i < 10; i++)
+	mallocator_free(m, ptrs[i], 100);
+    mallocator_dereference(m);
+    mallocator_heap_profile_destroy(profile);
+}
+
+Ensure(mallocator_heap_profile, writes_folded_by_node)
+{
+    mallocator_heap_profile_t *profile = mallocator_heap_profile_create(0);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_heap_profile_event, profile);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    void *ptr = mallocator_malloc(m, 100);
+    void *cptr = mallocator_malloc(child, 200);
+
+    /* Nodes outlive their mallocators while their blocks are live */
+    mallocator_dereference(child);
+    assert_that(mallocator_heap_profile_write(profile, file, MALLOCATOR_HEAP_PROFILE_FOLDED), is_true);
+    char *output = read_output();
+    const char *line = strstr(output, "test;0x");
+    assert_that(line, is_non_null);
+    assert_that(strncmp(strchr(line, ' '), " 100\n", 5), is_equal_to(0));
+    line = strstr(output, "test.child;0x");
+    assert_that(line, is_non_null);
+    assert_that(strncmp(strchr(line, ' '), " 200\n", 5), is_equal_to(0));
+    free(output);
+
+    mallocator_free(m, cptr, 200);
+    mallocator_free(m, ptr, 100);
+    mallocator_dereference(m);
+    mallocator_heap_profile_destroy(profile);
+}
+
+Ensure(mallocator_heap_profile, scales_sampled_profile)
+{
+    const size_t interval = 64 * 1024, num = 10000, size = 1000;
+    mallocator_heap_profile_t *profile = mallocator_heap_profile_create(interval);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_heap_profile_event, profile);
+    assert_that(mallocator_tracer_set_sampling(m, interval, 0), is_true);
+    void **ptrs = malloc(num * sizeof(*ptrs));
+    for (size_t i = 0; i < num; i++)
+	ptrs[i] = mallocator_malloc(m, size);
+
+    /* About 150 of the 10000 blocks are sampled */
+    const size_t sampled = mallocator_heap_profile_live(profile, NULL);
+    assert_that(sampled, is_greater_than(75));
+    assert_that(sampled, is_less_than(300));
+
+    assert_that(mallocator_heap_profile_write(profile, file, MALLOCATOR_HEAP_PROFILE_FOLDED), is_true);
+    char *output = read_output();
+    double estimate = 0;
+    for (const char *line = output; *line; line = strchr(line, '\n') + 1)
+	estimate += strtod(strrchr(strndupa(line, strchr(line, '\n') - line), ' '), NULL);
+    assert_that(estimate, is_greater_than(num * size / 2));
+    assert_that(estimate, is_less_than(num * size * 2));
+    free(output);
+
+    rewind(file);
+    assert_that(mallocator_heap_profile_write(profile, file, MALLOCATOR_HEAP_PROFILE_PPROF), is_true);
+    output = read_output();
+    assert_that(strstr(output, "@ heap_v2/65536\n"), is_non_null);
+    free(output);
+
+    for (size_t i = 0; i < num; i++)
+	mallocator_free(m, ptrs[i], size);
+    free(ptrs);
+    assert_that(mallocator_heap_profile_live(profile, NULL), is_equal_to(0));
+    mallocator_dereference(m);
+    mallocator_heap_profile_destroy(profile);
+}
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    size_t n;
+} profile_thread_t;
+
+static void *profile_thread(void *arg)
+{
+    profile_thread_t *data = arg;
+    void **ptrs = malloc(data->n * sizeof(*ptrs));
+    for (size_t i = 0; i < data->n; i++)
+	ptrs[i] = mallocator_malloc(data->mallocator, 16 + i % 64);
+    for (size_t i = 0; i < data->n; i++)
+	mallocator_free(data->mallocator, ptrs[i], 16 + i % 64);
+    free(ptrs);
+    return NULL;
+}
+
+Ensure(mallocator_heap_profile, tracks_concurrent_threads)
+{
+    mallocator_heap_profile_t *profile = mallocator_heap_profile_create(0);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_heap_profile_event, profile);
+    unsigned num_threads = 4;
+    pthread_t threads[num_threads];
+    profile_thread_t data = { .mallocator = m, .n = 50000 };
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_create(&threads[i], NULL, profile_thread, &data), is_equal_to(0));
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_join(threads[i], NULL), is_equal_to(0));
+
+    assert_that(mallocator_heap_profile_live(profile, NULL), is_equal_to(0));
+    mallocator_dereference(m);
+    mallocator_heap_profile_destroy(profile);
+}
+
+TestSuite *mallocator_heap_profile_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_heap_profile, tracks_live_blocks);
+    add_test_with_context(suite, mallocator_heap_profile, writes_pprof);
+    add_test_with_context(suite, mallocator_heap_profile, writes_folded_by_node);
+    add_test_with_context(suite, mallocator_heap_profile, scales_sampled_profile);
+    add_test_with_context(suite, mallocator_heap_profile, tracks_concurrent_threads);
+    return suite;
+}
@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+
+#include <cgreen/cgreen.h>
+
+#include "mallocator.h"
+#include "mallocator_test_helpers.h"
+
+#include <pthread.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+
+Describe(mallocator_limit);
+
+static mallocator_t *m;
+static struct mallinfo mallinfo_before;
+
+BeforeEach(mallocator_limit)
+{
+    mallinfo_before = mallocator_test_mallinfo();
+
+    m = mallocator_create("test");
+    assert_that(m, is_non_null);
+}
+
+AfterEach(mallocator_limit)
+{
+    mallocator_dereference(m);
+
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+Ensure(mallocator_limit, is_unlimited_by_default)
+{
+    size_t used = 1;
+    assert_that(mallocator_limit(m, &used), is_equal_to(0));
+    assert_that(used, is_equal_to(0));
+}
+
+Ensure(mallocator_limit, fails_allocations_over_limit)
+{
+    mallocator_set_limit(m, 1000);
+    void *ptr = mallocator_malloc(m, 600);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_malloc(m, 600), is_null);
+    assert_that(mallocator_calloc(m, 6, 100), is_null);
+    assert_that(mallocator_aligned_alloc(m, 64, 640), is_null);
+
+    size_t used;
+    assert_that(mallocator_limit(m, &used), is_equal_to(1000));
+    assert_that(used, is_equal_to(600));
+
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(1));
+    assert_that(stats.blocks_failed, is_equal_to(3));
+
+    mallocator_free(m, ptr, 600);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+    ptr = mallocator_malloc(m, 1000);
+    assert_that(ptr, is_non_null);
+    mallocator_free(m, ptr, 1000);
+}
+
+Ensure(mallocator_limit, applies_to_descendants)
+{
+    mallocator_t *tenant = mallocator_create_child(m, "tenant");
+    mallocator_t *a = mallocator_create_child(tenant, "a");
+    mallocator_t *b = mallocator_create_child(tenant, "b");
+    mallocator_set_limit(tenant, 1000);
+    mallocator_set_limit(a, 800);
+
+    void *pa = mallocator_malloc(a, 700);
+    assert_that(pa, is_non_null);
+    assert_that(mallocator_malloc(a, 200), is_null);
+    assert_that(mallocator_malloc(b, 400), is_null);
+    void *pb = mallocator_malloc(b, 300);
+    assert_that(pb, is_non_null);
+
+    /* A failure at the tenant rolls back the charge to a */
+    mallocator_free(b, pb, 300);
+    pb = mallocator_malloc(b, 250);
+    assert_that(mallocator_malloc(a, 100), is_null);
+    size_t used;
+    mallocator_limit(a, &used);
+    assert_that(used, is_equal_to(700));
+    mallocator_limit(tenant, &used);
+    assert_that(used, is_equal_to(950));
+
+    /* Other subtrees are unaffected */
+    void *ptr = mallocator_malloc(m, 2000);
+    assert_that(ptr, is_non_null);
+
+    mallocator_free(m, ptr, 2000);
+    mallocator_free(b, pb, 250);
+    mallocator_free(a, pa, 700);
+    mallocator_dereference(b);
+    mallocator_dereference(a);
+    mallocator_dereference(tenant);
+}
+
+Ensure(mallocator_limit, charges_live_bytes_when_set)
+{
+    mallocator_t *child = mallocator_create_child(m, "child");
+    void *ptr = mallocator_malloc(child, 300);
+    mallocator_set_limit(m, 1000);
+
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(300));
+    assert_that(mallocator_malloc(m, 800), is_null);
+
+    mallocator_free(child, ptr, 300);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+
+    /* Clearing the limit stops charging */
+    mallocator_set_limit(m, 0);
+    ptr = mallocator_malloc(child, 2000);
+    assert_that(ptr, is_non_null);
+    mallocator_free(child, ptr, 2000);
+    mallocator_dereference(child);
+}
+
+Ensure(mallocator_limit, reserves_realloc_growth)
+{
+    mallocator_set_limit(m, 1000);
+    void *ptr = mallocator_malloc(m, 600);
+    void *new_ptr = mallocator_realloc(m, ptr, 600, 1200);
+    assert_that(new_ptr, is_null);
+
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(600));
+
+    ptr = mallocator_realloc(m, ptr, 600, 900);
+    assert_that(ptr, is_non_null);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(900));
+
+    ptr = mallocator_realloc(m, ptr, 900, 100);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(100));
+
+    assert_that(mallocator_try_expand(m, ptr, 100, 2000), is_false);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(100));
+
+    assert_that(mallocator_realloc(m, ptr, 100, 0), is_null);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+}
+
+Ensure(mallocator_limit, reserves_whole_batches)
+{
+    mallocator_set_limit(m, 1000);
+    void *ptrs[10];
+    assert_that(mallocator_malloc_batch(m, 200, 10, ptrs), is_equal_to(0));
+    assert_that(mallocator_malloc_batch(m, 100, 10, ptrs), is_equal_to(10));
+
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(1000));
+    mallocator_free_batch(m, ptrs, 100, 10);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+}
+
+Ensure(mallocator_limit, saturates_unsized_frees)
+{
+    mallocator_set_limit(m, 1000);
+    void *ptr = mallocator_malloc(m, 1);
+    mallocator_free_unsized(m, ptr);
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+}
+
+Ensure(mallocator_limit, charges_block_sizes_once_freed_unsized)
+{
+    mallocator_set_limit(m, 1000);
+    mallocator_free_unsized(m, mallocator_malloc(m, 1));
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+
+    /* Unsized frees release the usable size, so allocations charge it too */
+    void *keep = mallocator_malloc(m, 500);
+    size_t kept;
+    mallocator_limit(m, &kept);
+    assert_that(kept, is_equal_to(malloc_usable_size(keep)));
+    for (unsigned i = 0; i < 100; i++)
+    {
+	mallocator_free_unsized(m, mallocator_malloc(m, 1));
+	void *ptr = mallocator_realloc_unsized(m, mallocator_malloc(m, 1), 100);
+	mallocator_free(m, ptr, 100);
+    }
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(kept));
+
+    /* So the limit still holds */
+    assert_that(mallocator_malloc(m, 1000 - kept + 1), is_null);
+    mallocator_free(m, keep, 500);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+}
+
+enum { num_threads = 8, num_iterations = 10000, thread_limit = 64 * 1024 };
+
+typedef struct
+{
+    mallocator_t *mallocator;
+} test_data_t;
+
+static void *thread(void *arg)
+{
+    test_data_t *data = arg;
+    void *ptrs[16] = { NULL };
+    size_t sizes[16] = { 0 };
+    for (unsigned i = 0; i < num_iterations; i++)
+    {
+	const unsigned slot = rand() % 16;
+	if (ptrs[slot])
+	{
+	    mallocator_free(data->mallocator, ptrs[slot], sizes[slot]);
+	    ptrs[slot] = NULL;
+	}
+	else
+	{
+	    sizes[slot] = 1 + rand() % 8192;
+	    ptrs[slot] = mallocator_malloc(data->mallocator, sizes[slot]);
+	}
+    }
+
+    for (unsigned slot = 0; slot < 16; slot++)
+	mallocator_free(data->mallocator, ptrs[slot], sizes[slot]);
+    return NULL;
+}
+
+Ensure(mallocator_limit, is_never_exceeded_concurrently)
+{
+    mallocator_t *child = mallocator_create_child(m, "child");
+    mallocator_set_limit(m, thread_limit);
+
+    pthread_t tid[num_threads];
+    test_data_t data[num_threads];
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+	data[i] = (test_data_t) { .mallocator = i % 2 ? child : m };
+	assert_that(pthread_create(&tid[i], NULL, thread, &data[i]), is_equal_to(0));
+    }
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+	assert_that(pthread_join(tid[i], NULL), is_equal_to(0));
+    }
+
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+
+    mallocator_stats_t stats, child_stats;
+    mallocator_stats(m, &stats);
+    mallocator_stats(child, &child_stats);
+    assert_that(stats.blocks_failed + child_stats.blocks_failed, is_greater_than(0));
+    mallocator_dereference(child);
+}
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    void *ptr;
+} test_alloc_t;
+
+static void *alloc_thread(void *arg)
+{
+    test_alloc_t *alloc = arg;
+    alloc->ptr = mallocator_malloc(alloc->mallocator, 1);
+    return NULL;
+}
+
+Ensure(mallocator_limit, reclaims_credit_of_other_threads)
+{
+    enum { limit = 4 << 20 };
+    mallocator_set_limit(m, limit);
+
+    /* Leave the credit charged by another thread outstanding */
+    test_alloc_t alloc = { .mallocator = m };
+    pthread_t tid;
+    assert_that(pthread_create(&tid, NULL, alloc_thread, &alloc), is_equal_to(0));
+    assert_that(pthread_join(tid, NULL), is_equal_to(0));
+    assert_that(alloc.ptr, is_non_null);
+
+    void *ptr = mallocator_malloc(m, limit - 1);
+    assert_that(ptr, is_non_null);
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(limit));
+    assert_that(mallocator_malloc(m, 1), is_null);
+
+    mallocator_free(m, ptr, limit - 1);
+    mallocator_free(m, alloc.ptr, 1);
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+}
+
+enum { cache_size = 16 };
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    void *entries[cache_size];
+    size_t entry_size;
+    unsigned calls;		/* Accessed atomically */
+    size_t target;
+} test_cache_t;
+
+static void cache_fill(test_cache_t *cache, mallocator_t *mallocator, size_t entry_size)
+{
+    *cache = (test_cache_t) { .mallocator = mallocator, .entry_size = entry_size };
+    for (unsigned i = 0; i < cache_size; i++)
+    {
+	cache->entries[i] = mallocator_malloc(mallocator, entry_size);
+	assert_that(cache->entries[i], is_non_null);
+    }
+}
+
+static size_t cache_drain(test_cache_t *cache)
+{
+    size_t released = 0;
+    for (unsigned i = 0; i < cache_size; i++)
+    {
+	if (!cache->entries[i]) continue;
+	mallocator_free(cache->mallocator, cache->entries[i], cache->entry_size);
+	cache->entries[i] = NULL;
+	released += cache->entry_size;
+    }
+    return released;
+}
+
+static size_t cache_shrink(void *arg, mallocator_t *mallocator, size_t target)
+{
+    test_cache_t *cache = arg;
+    cache->target = target;
+    size_t released = 0;
+    for (unsigned i = 0; i < cache_size && released < target; i++)
+    {
+	if (!cache->entries[i]) continue;
+	mallocator_free(cache->mallocator, cache->entries[i], cache->entry_size);
+	cache->entries[i] = NULL;
+	released += cache->entry_size;
+    }
+    __atomic_add_fetch(&cache->calls, 1, __ATOMIC_SEQ_CST);
+    return released;
+}
+
+/* Wait for up to a second for the shrinker to have been called calls times */
+static unsigned cache_wait(test_cache_t *cache, unsigned calls)
+{
+    for (unsigned i = 0; i < 1000 && __atomic_load_n(&cache->calls, __ATOMIC_SEQ_CST) < calls; i++)
+	usleep(1000);
+    return __atomic_load_n(&cache->calls, __ATOMIC_SEQ_CST);
+}
+
+Ensure(mallocator_limit, shrinks_at_high_watermark)
+{
+    test_cache_t cache;
+    assert_that(mallocator_set_watermarks(m, 1000, 2000), is_true);
+    assert_that(mallocator_add_shrinker(m, cache_shrink, &cache), is_true);
+    cache_fill(&cache, m, 100);
+    assert_that(cache.calls, is_equal_to(0));
+
+    /* Cross the high watermark */
+    void *ptr = mallocator_malloc(m, 500);
+    assert_that(cache_wait(&cache, 1), is_equal_to(1));
+    assert_that(cache.target, is_equal_to(1100));
+
+    size_t used;
+    mallocator_limit(m, &used);
+    assert_that(used, is_equal_to(0));
+
+    mallocator_remove_shrinker(m, cache_shrink, &cache);
+    mallocator_free(m, ptr, 500);
+    cache_drain(&cache);
+}
+
+Ensure(mallocator_limit, shrinks_descendants)
+{
+    mallocator_t *a = mallocator_create_child(m, "a");
+    mallocator_t *b = mallocator_create_child(m, "b");
+    test_cache_t cache_a, cache_b;
+    mallocator_add_shrinker(a, cache_shrink, &cache_a);
+    mallocator_add_shrinker(b, cache_shrink, &cache_b);
+    cache_fill(&cache_a, a, 100);
+    cache_fill(&cache_b, b, 100);
+
+    /* Crossing in b shrinks only b's subtree */
+    mallocator_set_watermarks(b, 0, 2000);
+    void *ptr = mallocator_malloc(b, 500);
+    assert_that(cache_wait(&cache_b, 1), is_equal_to(1));
+    assert_that(cache_a.calls, is_equal_to(0));
+    mallocator_free(b, ptr, 500);
+
+    /* Crossing at the root shrinks both */
+    mallocator_set_watermarks(m, 0, 2000);
+    ptr = mallocator_malloc(a, 500);
+    assert_that(cache_wait(&cache_a, 1), is_equal_to(1));
+    mallocator_free(a, ptr, 500);
+
+    mallocator_remove_shrinker(a, cache_shrink, &cache_a);
+    mallocator_remove_shrinker(b, cache_shrink, &cache_b);
+    cache_drain(&cache_a);
+    cache_drain(&cache_b);
+    mallocator_dereference(b);
+    mallocator_dereference(a);
+}
+
+Ensure(mallocator_limit, shrinks_when_set_above_high_watermark)
+{
+    test_cache_t cache;
+    mallocator_add_shrinker(m, cache_shrink, &cache);
+    cache_fill(&cache, m, 100);
+    mallocator_set_watermarks(m, 0, 1000);
+    assert_that(cache_wait(&cache, 1), is_equal_to(1));
+    assert_that(cache.target, is_equal_to(1600));
+    mallocator_remove_shrinker(m, cache_shrink, &cache);
+    cache_drain(&cache);
+}
+
+Ensure(mallocator_limit, does_not_call_removed_shrinkers)
+{
+    test_cache_t cache, other;
+    mallocator_set_watermarks(m, 0, 1000);
+    mallocator_add_shrinker(m, cache_shrink, &other);
+    mallocator_add_shrinker(m, cache_shrink, &cache);
+    cache_fill(&other, m, 1);
+    mallocator_remove_shrinker(m, cache_shrink, &other);
+    cache_fill(&cache, m, 100);
+    assert_that(cache_wait(&cache, 1), is_equal_to(1));
+    assert_that(other.calls, is_equal_to(0));
+    mallocator_remove_shrinker(m, cache_shrink, &cache);
+    cache_drain(&cache);
+    cache_drain(&other);
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+Ensure(mallocator_limit, fails_operations_over_rate)
+{
+    const mallocator_rate_limit_t rate = { .ops_per_sec = 10, .burst_ops = 5, .policy = MALLOCATOR_RATE_FAIL };
+    assert_that(mallocator_set_rate_limit(m, &rate), is_true);
+
+    void *ptrs[6];
+    for (unsigned i = 0; i < 5; i++)
+    {
+	ptrs[i] = mallocator_malloc(m, 8);
+	assert_that(ptrs[i], is_non_null);
+    }
+    ptrs[5] = mallocator_malloc(m, 8);
+    assert_that(ptrs[5], is_null);
+
+    /* Frees are not limited */
+    for (unsigned i = 0; i < 5; i++)
+	mallocator_free(m, ptrs[i], 8);
+
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(5));
+    assert_that(stats.blocks_failed, is_equal_to(1));
+
+    /* Cleared limits admit again */
+    assert_that(mallocator_set_rate_limit(m, NULL), is_true);
+    void *ptr = mallocator_malloc(m, 8);
+    assert_that(ptr, is_non_null);
+    mallocator_free(m, ptr, 8);
+}
+
+Ensure(mallocator_limit, rate_applies_to_descendants)
+{
+    mallocator_t *a = mallocator_create_child(m, "a");
+    mallocator_t *aa = mallocator_create_child(a, "aa");
+    mallocator_t *b = mallocator_create_child(m, "b");
+    const mallocator_rate_limit_t rate = { .bytes_per_sec = 1000, .burst_bytes = 100, .policy = MALLOCATOR_RATE_FAIL };
+    mallocator_set_rate_limit(a, &rate);
+
+    void *ptr = mallocator_malloc(aa, 100);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_malloc(a, 50), is_null);
+    assert_that(mallocator_calloc(aa, 5, 10), is_null);
+    mallocator_free(aa, ptr, 100);
+
+    ptr = mallocator_malloc(b, 1000);
+    assert_that(ptr, is_non_null);
+    mallocator_free(b, ptr, 1000);
+
+    mallocator_dereference(b);
+    mallocator_dereference(aa);
+    mallocator_dereference(a);
+}
+
+Ensure(mallocator_limit, rate_applies_to_children_created_later)
+{
+    mallocator_t *a = mallocator_create_child(m, "a");
+    const mallocator_rate_limit_t rate = { .bytes_per_sec = 1000, .burst_bytes = 100, .policy = MALLOCATOR_RATE_FAIL };
+    mallocator_set_rate_limit(a, &rate);
+
+    mallocator_t *aa = mallocator_create_child(a, "aa");
+    void *ptr = mallocator_malloc(aa, 100);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_malloc(aa, 50), is_null);
+    mallocator_free(aa, ptr, 100);
+
+    /* Cleared for the whole subtree */
+    mallocator_set_rate_limit(a, NULL);
+    ptr = mallocator_malloc(aa, 1000);
+    assert_that(ptr, is_non_null);
+    mallocator_free(aa, ptr, 1000);
+
+    mallocator_dereference(aa);
+    mallocator_dereference(a);
+}
+
+Ensure(mallocator_limit, admits_large_allocations_into_full_bucket)
+{
+    const mallocator_rate_limit_t rate = { .bytes_per_sec = 1000, .policy = MALLOCATOR_RATE_FAIL };
+    mallocator_set_rate_limit(m, &rate);
+    void *ptr = mallocator_malloc(m, 10000);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_malloc(m, 1), is_null);
+    mallocator_free(m, ptr, 10000);
+}
+
+Ensure(mallocator_limit, delays_allocations_over_rate)
+{
+    /* 1 byte per 10 us, so that oversleeping does not refill the bucket */
+    const mallocator_rate_limit_t rate =
+    {
+	.bytes_per_sec = 100000,
+	.burst_bytes = 1000,
+	.policy = MALLOCATOR_RATE_SLEEP,
+	.max_delay_ns = 100000000,
+    };
+    mallocator_set_rate_limit(m, &rate);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    void *ptrs[3];
+    for (unsigned i = 0; i < 3; i++)
+    {
+	ptrs[i] = mallocator_malloc(m, 1000);
+	assert_that(ptrs[i], is_non_null);
+    }
+    assert_that(elapsed_us(&start), is_greater_than(19000));
+
+    /* Delays beyond max_delay_ns fail */
+    assert_that(mallocator_malloc(m, 200000), is_null);
+    for (unsigned i = 0; i < 3; i++)
+	mallocator_free(m, ptrs[i], 1000);
+}
+
+Ensure(mallocator_limit, can_spin_over_rate)
+{
+    const mallocator_rate_limit_t rate =
+    {
+	.ops_per_sec = 10000,
+	.burst_ops = 1,
+	.policy = MALLOCATOR_RATE_SPIN,
+	.max_delay_ns = 1000000,
+    };
+    mallocator_set_rate_limit(m, &rate);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    void *ptrs[11];
+    assert_that(mallocator_malloc_batch(m, 8, 1, ptrs), is_equal_to(1));
+    assert_that(mallocator_malloc_batch(m, 8, 10, ptrs + 1), is_equal_to(10));
+    assert_that(elapsed_us(&start), is_greater_than(900));
+    mallocator_free_batch(m, ptrs, 8, 11);
+}
+
+TestSuite *mallocator_limit_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_limit, is_unlimited_by_default);
+    add_test_with_context(suite, mallocator_limit, fails_allocations_over_limit);
+    add_test_with_context(suite, mallocator_limit, applies_to_descendants);
+    add_test_with_context(suite, mallocator_limit, charges_live_bytes_when_set);
+    add_test_with_context(suite, mallocator_limit, reserves_realloc_growth);
+    add_test_with_context(suite, mallocator_limit, reserves_whole_batches);
+    add_test_with_context(suite, mallocator_limit, saturates_unsized_frees);
+    add_test_with_context(suite, mallocator_limit, charges_block_sizes_once_freed_unsized);
+    add_test_with_context(suite, mallocator_limit, is_never_exceeded_concurrently);
+    add_test_with_context(suite, mallocator_limit, reclaims_credit_of_other_threads);
+    add_test_with_context(suite, mallocator_limit, shrinks_at_high_watermark);
+    add_test_with_context(suite, mallocator_limit, shrinks_descendants);
+    add_test_with_context(suite, mallocator_limit, shrinks_when_set_above_high_watermark);
+    add_test_with_context(suite, mallocator_limit, does_not_call_removed_shrinkers);
+    add_test_with_context(suite, mallocator_limit, fails_operations_over_rate);
+    add_test_with_context(suite, mallocator_limit, rate_applies_to_descendants);
+    add_test_with_context(suite, mallocator_limit, rate_applies_to_children_created_later);
+    add_test_with_context(suite, mallocator_limit, admits_large_allocations_into_full_bucket);
+    add_test_with_context(suite, mallocator_limit, delays_allocations_over_rate);
+    add_test_with_context(suite, mallocator_limit, can_spin_over_rate);
+    return suite;
+}
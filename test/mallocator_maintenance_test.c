@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include <cgreen/cgreen.h>
+
+#include "mallocator.h"
+#include "mallocator_impl.h"
+#include "mallocator_tlsf.h"
+#include "mallocator_test_helpers.h"
+
+#include <malloc.h>
+#include <unistd.h>
+
+Describe(mallocator_maintenance);
+
+static mallocator_t *m;
+static struct mallinfo mallinfo_before;
+
+static const size_t pool_size = 1 << 20;
+
+static const mallocator_maintenance_config_t config =
+{
+    .period_ms = 5,
+    .decay_ms = 20,
+    .trim_flags = MALLOCATOR_TRIM_PURGE,
+    .cpu = -1,
+};
+
+BeforeEach(mallocator_maintenance)
+{
+    mallinfo_before = mallocator_test_mallinfo();
+
+    m = mallocator_create("test");
+    assert_that(m, is_non_null);
+}
+
+AfterEach(mallocator_maintenance)
+{
+    mallocator_dereference(m);
+
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+/* Stdlib implementation shared by children, as with mmap and TLSF, counting its trims */
+typedef struct
+{
+    mallocator_impl_t impl;
+    unsigned ref_count;
+    unsigned trims;
+} shared_impl_t;
+
+static mallocator_impl_t *shared_create_child(void *parent_obj, const char *name)
+{
+    shared_impl_t *shared = parent_obj;
+    shared->ref_count++;
+    return &shared->impl;
+}
+
+static void shared_destroy(void *obj)
+{
+    shared_impl_t *shared = obj;
+    if (--shared->ref_count == 0) free(shared);
+}
+
+static void *shared_malloc(void *obj, size_t size)
+{
+    return malloc(size);
+}
+
+static void *shared_calloc(void *obj, size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+static void *shared_realloc(void *obj, void *ptr, size_t size, size_t new_size)
+{
+    return realloc(ptr, new_size);
+}
+
+static void shared_free(void *obj, void *ptr, size_t size)
+{
+    free(ptr);
+}
+
+static size_t shared_trim(void *obj, unsigned flags)
+{
+    shared_impl_t *shared = obj;
+    __atomic_fetch_add(&shared->trims, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static const mallocator_interface_t shared_interface =
+{
+    .create_child = shared_create_child,
+    .destroy = shared_destroy,
+    .malloc = shared_malloc,
+    .calloc = shared_calloc,
+    .realloc = shared_realloc,
+    .free = shared_free,
+    .trim = shared_trim,
+};
+
+static shared_impl_t *shared_impl_create(void)
+{
+    shared_impl_t *shared = malloc(sizeof(*shared));
+    *shared = (shared_impl_t) { .impl = { .obj = shared, .interface = &shared_interface }, .ref_count = 1 };
+    return shared;
+}
+
+/* Wait up to 1s for the subtree of mallocator to have blocks_allocated */
+static bool subtree_wait(mallocator_t *mallocator, size_t blocks_allocated)
+{
+    mallocator_stats_t stats;
+    for (unsigned i = 0; i < 1000; i++)
+    {
+	mallocator_subtree_stats(mallocator, &stats);
+	if (stats.blocks_allocated == blocks_allocated) return true;
+	usleep(1000);
+    }
+    return false;
+}
+
+Ensure(mallocator_maintenance, can_be_started_and_stopped)
+{
+    assert_that(mallocator_maintenance_start(m, &config), is_true);
+    assert_that(mallocator_maintenance_start(m, &config), is_false);
+    mallocator_maintenance_stop(m);
+    mallocator_maintenance_stop(m);
+
+    mallocator_maintenance_config_t pinned = config;
+    pinned.cpu = 0;
+    assert_that(mallocator_maintenance_start(m, &pinned), is_true);
+    mallocator_maintenance_stop(m);
+}
+
+Ensure(mallocator_maintenance, sums_subtree_stats)
+{
+    mallocator_t *child = mallocator_create_child(m, "child");
+    void *ptr = mallocator_malloc(m, 100);
+    void *child_ptr = mallocator_malloc(child, 200);
+
+    mallocator_stats_t stats;
+    mallocator_subtree_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(2));
+    assert_that(stats.bytes_allocated, is_equal_to(300));
+    mallocator_subtree_stats(child, &stats);
+    assert_that(stats.bytes_allocated, is_equal_to(200));
+
+    mallocator_free(child, child_ptr, 200);
+    mallocator_free(m, ptr, 100);
+    mallocator_dereference(child);
+}
+
+Ensure(mallocator_maintenance, refreshes_subtree_stats)
+{
+    mallocator_t *child = mallocator_create_child(m, "child");
+    assert_that(mallocator_maintenance_start(m, &config), is_true);
+    assert_that(subtree_wait(m, 0), is_true);
+
+    void *ptr = mallocator_malloc(child, 100);
+    assert_that(subtree_wait(m, 1), is_true);
+    mallocator_free(child, ptr, 100);
+    mallocator_dereference(child);
+
+    /* Destroyed mallocators drop out of the aggregate */
+    assert_that(subtree_wait(m, 0), is_true);
+    mallocator_maintenance_stop(m);
+}
+
+Ensure(mallocator_maintenance, defers_destruction)
+{
+    assert_that(mallocator_maintenance_start(m, &config), is_true);
+    for (unsigned i = 0; i < 10; i++)
+    {
+	mallocator_t *child = mallocator_create_child_custom(m, "child", mallocator_tlsf_impl_create(pool_size));
+	assert_that(child, is_non_null);
+	void *ptr = mallocator_malloc(child, 100);
+	assert_that(ptr, is_non_null);
+	mallocator_free(child, ptr, 100);
+	mallocator_dereference(child);
+    }
+
+    /* Destroyed mallocators not yet freed by maintenance are freed on stop */
+    mallocator_maintenance_stop(m);
+}
+
+Ensure(mallocator_maintenance, drains_deferred_frees)
+{
+    assert_that(mallocator_maintenance_start(m, &config), is_true);
+    mallocator_free_deferred(m, mallocator_malloc(m, 100), 100);
+
+    mallocator_stats_t stats;
+    for (unsigned i = 0; i < 1000; i++)
+    {
+	mallocator_stats(m, &stats);
+	if (stats.blocks_freed == 1) break;
+	usleep(1000);
+    }
+    assert_that(stats.blocks_freed, is_equal_to(1));
+    mallocator_maintenance_stop(m);
+}
+
+Ensure(mallocator_maintenance, frees_deferred_frees_of_destroyed_mallocators)
+{
+    /* A long period, so that maintenance does not drain the frees first */
+    mallocator_maintenance_config_t slow_config = config;
+    slow_config.period_ms = 60000;
+    assert_that(mallocator_maintenance_start(m, &slow_config), is_true);
+    usleep(10000);
+
+    mallocator_t *child = mallocator_create_child_custom(m, "child", mallocator_tlsf_impl_create(pool_size));
+    mallocator_free_deferred(child, mallocator_malloc(child, 100), 100);
+
+    /* The last reference is released by iteration, not by mallocator_dereference */
+    mallocator_t *iter = mallocator_child_begin(m);
+    assert_that(iter, is_equal_to(child));
+    mallocator_dereference(child);
+    assert_that(mallocator_child_next(iter), is_null);
+
+    assert_that(mallocator_drain_deferred(m), is_equal_to(0));
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_deferred, is_equal_to(0));
+    mallocator_maintenance_stop(m);
+}
+
+Ensure(mallocator_maintenance, decays_idle_mallocators)
+{
+    mallocator_t *tlsf = mallocator_tlsf_create("tlsf", pool_size);
+    assert_that(mallocator_maintenance_start(tlsf, &config), is_true);
+
+    /* The pool is prefaulted, and is purged once idle */
+    void *ptr = mallocator_malloc(tlsf, 1000);
+    mallocator_free(tlsf, ptr, 1000);
+    usleep(200000);
+    mallocator_maintenance_stop(tlsf);
+    assert_that(mallocator_trim(tlsf, MALLOCATOR_TRIM_PURGE), is_less_than(pool_size / 2));
+    mallocator_dereference(tlsf);
+}
+
+Ensure(mallocator_maintenance, trims_shared_implementations_once)
+{
+    shared_impl_t *shared = shared_impl_create();
+    mallocator_t *root = mallocator_create_custom("shared", &shared->impl);
+    mallocator_t *a = mallocator_create_child(root, "a");
+    mallocator_t *b = mallocator_create_child(a, "b");
+
+    mallocator_trim(root, 0);
+    assert_that(shared->trims, is_equal_to(1));
+
+    /* Also when trimmed from a child */
+    mallocator_trim(a, 0);
+    assert_that(shared->trims, is_equal_to(2));
+
+    mallocator_dereference(b);
+    mallocator_dereference(a);
+    mallocator_dereference(root);
+}
+
+Ensure(mallocator_maintenance, decays_shared_implementations_once_all_users_are_idle)
+{
+    shared_impl_t *shared = shared_impl_create();
+    mallocator_t *root = mallocator_create_custom("shared", &shared->impl);
+    mallocator_t *child = mallocator_create_child(root, "child");
+    assert_that(mallocator_maintenance_start(root, &config), is_true);
+
+    /* The root is idle, but shares its implementation with a busy child */
+    for (unsigned i = 0; i < 100; i++)
+    {
+	mallocator_free(child, mallocator_malloc(child, 100), 100);
+	usleep(2000);
+    }
+    assert_that(__atomic_load_n(&shared->trims, __ATOMIC_RELAXED), is_equal_to(0));
+
+    /* Trimmed once, not once per user */
+    usleep(200000);
+    mallocator_maintenance_stop(root);
+    assert_that(shared->trims, is_equal_to(1));
+
+    mallocator_dereference(child);
+    mallocator_dereference(root);
+}
+
+TestSuite *mallocator_maintenance_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_maintenance, can_be_started_and_stopped);
+    add_test_with_context(suite, mallocator_maintenance, sums_subtree_stats);
+    add_test_with_context(suite, mallocator_maintenance, refreshes_subtree_stats);
+    add_test_with_context(suite, mallocator_maintenance, defers_destruction);
+    add_test_with_context(suite, mallocator_maintenance, drains_deferred_frees);
+    add_test_with_context(suite, mallocator_maintenance, frees_deferred_frees_of_destroyed_mallocators);
+    add_test_with_context(suite, mallocator_maintenance, decays_idle_mallocators);
+    add_test_with_context(suite, mallocator_maintenance, trims_shared_implementations_once);
+    add_test_with_context(suite, mallocator_maintenance, decays_shared_implementations_once_all_users_are_idle);
+    return suite;
+}
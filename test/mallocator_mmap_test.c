@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+
+#include <cgreen/cgreen.h>
+
+#include "mallocator_mmap.h"
+#include "mallocator.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+static struct mallinfo mallinfo_before;
+
+Describe(mallocator_mmap);
+
+BeforeEach(mallocator_mmap)
+{
+    mallinfo_before = mallinfo();
+}
+
+AfterEach(mallocator_mmap)
+{
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+static const size_t threshold = 64 * 1024;
+static const size_t huge = MALLOCATOR_MMAP_HUGE_PAGE_SIZE;
+
+Ensure(mallocator_mmap, can_be_created)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    assert_that(m, is_non_null);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, has_a_name)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    const char *name = mallocator_name(m);
+    assert_that(name, is_equal_to_string("test"));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_malloc_small)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    unsigned num = 1024;
+    int *ints = mallocator_malloc(m, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    assert_that(stats.maps, is_equal_to(0));
+    mallocator_free(m, ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_malloc_large)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    size_t size = 3 * huge + 1;
+    char *ptr = mallocator_malloc(m, size);
+    assert_that(ptr, is_non_null);
+    assert_that((uintptr_t) ptr % huge, is_equal_to(0));
+    ptr[0] = 1;
+    ptr[size - 1] = 1;
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    assert_that(stats.bytes_requested, is_equal_to(size));
+    assert_that(stats.bytes_mapped, is_greater_than(size));
+    assert_that(stats.bytes_mapped, is_less_than(size + 4096 * 16));
+    assert_that(stats.maps, is_equal_to(1));
+    mallocator_free(m, ptr, size);
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    assert_that(stats.bytes_mapped, is_equal_to(0));
+    assert_that(stats.bytes_requested, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_calloc_large)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    unsigned num = threshold;
+    int *ints = mallocator_calloc(m, num, sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(ints[i], is_equal_to(0));
+	ints[i] = i;
+    }
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    mallocator_free(m, ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_realloc_large)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    unsigned num = huge / sizeof(int);
+    int *ints = mallocator_realloc(m, NULL, 0, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    unsigned more_num = 4 * num;
+    int *more_ints = mallocator_realloc(m, ints, num * sizeof(int), more_num * sizeof(int));
+    assert_that(more_ints, is_non_null);
+    for (unsigned i = 0; i < more_num; i++)
+    {
+	if (i < num) assert_that(more_ints[i], is_equal_to(i));
+	else more_ints[i] = i;
+    }
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    assert_that(stats.bytes_requested, is_equal_to(more_num * sizeof(int)));
+    assert_that(stats.maps, is_equal_to(1));
+    assert_that(stats.remaps, is_equal_to(1));
+    int *no_ints = mallocator_realloc(m, more_ints, more_num * sizeof(int), 0);
+    assert_that(no_ints, is_null);
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    assert_that(stats.bytes_mapped, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_realloc_across_threshold)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    unsigned num = 1024;
+    int *ints = mallocator_malloc(m, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    unsigned more_num = threshold;
+    int *more_ints = mallocator_realloc(m, ints, num * sizeof(int), more_num * sizeof(int));
+    assert_that(more_ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(more_ints[i], is_equal_to(i));
+    }
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    int *less_ints = mallocator_realloc(m, more_ints, more_num * sizeof(int), num * sizeof(int));
+    assert_that(less_ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(less_ints[i], is_equal_to(i));
+    }
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    mallocator_free(m, less_ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_aligned_alloc_large)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    size_t alignment = 4 * huge;
+    char *ptr = mallocator_aligned_alloc(m, alignment, threshold);
+    assert_that(ptr, is_non_null);
+    assert_that((uintptr_t) ptr % alignment, is_equal_to(0));
+    ptr[0] = 1;
+    ptr[threshold - 1] = 1;
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    assert_that(stats.bytes_mapped, is_equal_to(threshold));
+    mallocator_free(m, ptr, threshold);
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    assert_that(stats.bytes_mapped, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_malloc_at_least)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    size_t actual = 0;
+    char *ptr = mallocator_malloc_at_least(m, threshold + 1, &actual);
+    assert_that(ptr, is_non_null);
+    assert_that(actual, is_equal_to(threshold + 4096));
+    ptr[actual - 1] = 1;
+    assert_that(mallocator_usable_size(m, ptr, actual), is_equal_to(actual));
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.bytes_requested, is_equal_to(actual));
+    mallocator_free(m, ptr, actual);
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    assert_that(stats.bytes_requested, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, has_usable_size_below_threshold)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    char *ptr = mallocator_malloc(m, threshold - 1);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_usable_size(m, ptr, threshold - 1), is_equal_to(threshold - 1));
+    mallocator_free(m, ptr, threshold - 1);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, can_try_expand_large)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    char *ptr = mallocator_malloc(m, threshold);
+    assert_that(ptr, is_non_null);
+
+    /* Reserve then release the following address space so that the mapping can grow */
+    char *next = ptr + threshold;
+    if (mmap(next, threshold, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == next)
+    {
+	munmap(next, threshold);
+	assert_that(mallocator_try_expand(m, ptr, threshold, 2 * threshold), is_true);
+	ptr[2 * threshold - 1] = 1;
+	mallocator_free(m, ptr, 2 * threshold);
+    }
+    else
+    {
+	mallocator_free(m, ptr, threshold);
+    }
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.bytes_mapped, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, cannot_try_expand_across_threshold)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    char *ptr = mallocator_malloc(m, 1024);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_try_expand(m, ptr, 1024, threshold), is_false);
+    mallocator_free(m, ptr, 1024);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, shares_stats_with_children)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    assert_that(child, is_non_null);
+    void *ptr = mallocator_malloc(child, threshold);
+    assert_that(ptr, is_non_null);
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    mallocator_free(child, ptr, threshold);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_mmap, rejects_unsized_frees)
+{
+    mallocator_t *m = mallocator_mmap_create("test", threshold);
+    void *ptr = mallocator_malloc(m, threshold);
+    assert_that(ptr, is_non_null);
+
+    /* Mapped and heap blocks are told apart by size, so the block must be left allocated */
+    assert_that(mallocator_free_unsized(m, ptr), is_false);
+    assert_that(mallocator_realloc_unsized(m, ptr, 2 * threshold), is_null);
+    assert_that(mallocator_free_unsized(m, NULL), is_true);
+    mallocator_free(m, ptr, threshold);
+    mallocator_dereference(m);
+}
+
+TestSuite *mallocator_mmap_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_mmap, can_be_created);
+    add_test_with_context(suite, mallocator_mmap, has_a_name);
+    add_test_with_context(suite, mallocator_mmap, can_malloc_small);
+    add_test_with_context(suite, mallocator_mmap, can_malloc_large);
+    add_test_with_context(suite, mallocator_mmap, can_calloc_large);
+    add_test_with_context(suite, mallocator_mmap, can_realloc_large);
+    add_test_with_context(suite, mallocator_mmap, can_realloc_across_threshold);
+    add_test_with_context(suite, mallocator_mmap, can_aligned_alloc_large);
+    add_test_with_context(suite, mallocator_mmap, can_malloc_at_least);
+    add_test_with_context(suite, mallocator_mmap, has_usable_size_below_threshold);
+    add_test_with_context(suite, mallocator_mmap, can_try_expand_large);
+    add_test_with_context(suite, mallocator_mmap, cannot_try_expand_across_threshold);
+    add_test_with_context(suite, mallocator_mmap, shares_stats_with_children);
+    add_test_with_context(suite, mallocator_mmap, rejects_unsized_frees);
+    return suite;
+}
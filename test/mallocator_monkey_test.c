@@ -4,6 +4,7 @@
 #include "mallocator.h"
 
 #include <malloc.h>
+#include <stdint.h>
 
 static struct mallinfo mallinfo_before;
 
@@ -99,6 +100,16 @@ Ensure(mallocator_monkey, can_realloc)
     mallocator_dereference(m);
 }
 
+Ensure(mallocator_monkey, can_aligned_alloc)
+{
+    mallocator_t *m = mallocator_monkey_create_custom("test", never_fail, NULL);
+    void *ptr = mallocator_aligned_alloc(m, 256, 1024);
+    assert_that(ptr, is_non_null);
+    assert_that((uintptr_t) ptr % 256, is_equal_to(0));
+    mallocator_free(m, ptr, 1024);
+    mallocator_dereference(m);
+}
+
 Ensure(mallocator_monkey, can_fail_malloc)
 {
     mallocator_t *m = mallocator_monkey_create_custom("test", always_fail, NULL);
@@ -126,6 +137,14 @@ Ensure(mallocator_monkey, can_fail_realloc)
     mallocator_dereference(m);
 }
 
+Ensure(mallocator_monkey, can_fail_aligned_alloc)
+{
+    mallocator_t *m = mallocator_monkey_create_custom("test", always_fail, NULL);
+    void *ptr = mallocator_aligned_alloc(m, 256, 1024);
+    assert_that(ptr, is_null);
+    mallocator_dereference(m);
+}
+
 Ensure(mallocator_monkey, can_step_malloc)
 {
     const unsigned num_success = 3, num_failure = 2;
@@ -151,6 +170,22 @@ Ensure(mallocator_monkey, can_step_malloc)
     mallocator_dereference(m);
 }
 
+Ensure(mallocator_monkey, can_step_malloc_batch)
+{
+    const unsigned num_success = 3;
+    mallocator_t *m = mallocator_monkey_create_step("test", num_success, 0, false);
+    enum { num = 8 };
+    void *ptrs[num];
+    size_t allocated = mallocator_malloc_batch(m, 1024, num, ptrs);
+    assert_that(allocated, is_equal_to(num_success));
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(num_success));
+    assert_that(stats.blocks_failed, is_equal_to(num - num_success));
+    mallocator_free_batch(m, ptrs, 1024, allocated);
+    mallocator_dereference(m);
+}
+
 Ensure(mallocator_monkey, can_step_calloc)
 {
     const unsigned num_success = 2, num_failure = 3;
@@ -341,10 +376,13 @@ TestSuite *mallocator_monkey_tests(void)
     add_test_with_context(suite, mallocator_monkey, can_malloc);
     add_test_with_context(suite, mallocator_monkey, can_calloc);
     add_test_with_context(suite, mallocator_monkey, can_realloc);
+    add_test_with_context(suite, mallocator_monkey, can_aligned_alloc);
     add_test_with_context(suite, mallocator_monkey, can_fail_malloc);
     add_test_with_context(suite, mallocator_monkey, can_fail_calloc);
     add_test_with_context(suite, mallocator_monkey, can_fail_realloc);
+    add_test_with_context(suite, mallocator_monkey, can_fail_aligned_alloc);
     add_test_with_context(suite, mallocator_monkey, can_step_malloc);
+    add_test_with_context(suite, mallocator_monkey, can_step_malloc_batch);
     add_test_with_context(suite, mallocator_monkey, can_step_calloc);
     add_test_with_context(suite, mallocator_monkey, can_step_realloc);
     add_test_with_context(suite, mallocator_monkey, can_step_repeat_malloc);
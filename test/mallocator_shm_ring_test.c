@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+
+#include <cgreen/cgreen.h>
+
+#include "mallocator_shm_ring.h"
+#include "mallocator_tracer.h"
+#include "mallocator.h"
+#include "mallocator_test_helpers.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct mallinfo mallinfo_before;
+
+Describe(mallocator_shm_ring);
+
+BeforeEach(mallocator_shm_ring)
+{
+    mallinfo_before = mallocator_test_mallinfo();
+}
+
+AfterEach(mallocator_shm_ring)
+{
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+/* Attach to a ring as another process would */
+static mallocator_shm_ring_t *open_ring(const char *path, int *fd)
+{
+    *fd = open(path, O_RDWR);
+    assert_that(*fd, is_greater_than(-1));
+    return mallocator_shm_ring_open(*fd);
+}
+
+Ensure(mallocator_shm_ring, round_trips_events)
+{
+    mallocator_shm_ring_t *ring = mallocator_shm_ring_create(NULL, 0);
+    assert_that(ring, is_non_null);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", mallocator_shm_ring_fd(ring));
+    int fd;
+    mallocator_shm_ring_t *reader = open_ring(path, &fd);
+    assert_that(reader, is_non_null);
+    assert_that(mallocator_shm_ring_pid(reader), is_equal_to(getpid()));
+
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_shm_ring_event, ring);
+    mallocator_tracer_set_context(m, MALLOCATOR_TRACER_TID | MALLOCATOR_TRACER_CPU);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    void *a = mallocator_malloc(child, 100);
+    void *b = mallocator_calloc(m, 10, 20);
+    void *c = mallocator_realloc(m, b, 200, 400);
+    mallocator_free(child, a, 100);
+
+    mallocator_tracer_event_t event;
+    assert_that(mallocator_shm_ring_read(reader, &event), is_true);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_MALLOC));
+    assert_that(event.name, is_equal_to_string("test.child"));
+    assert_that(event.ptr, is_equal_to(a));
+    assert_that(event.e.malloc.size, is_equal_to(100));
+    assert_that(event.tid, is_equal_to(gettid()));
+    assert_that(event.cpu, is_greater_than(-1));
+    assert_that(event.timestamp, is_greater_than(0));
+    assert_that(event.backtrace_len, is_greater_than(0));
+    assert_that(event.stack, is_greater_than(0));
+
+    assert_that(mallocator_shm_ring_read(reader, &event), is_true);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_CALLOC));
+    assert_that(event.name, is_equal_to_string("test"));
+    assert_that(event.e.calloc.nmemb, is_equal_to(10));
+    assert_that(event.e.calloc.size, is_equal_to(20));
+
+    assert_that(mallocator_shm_ring_read(reader, &event), is_true);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_REALLOC));
+    assert_that(event.ptr, is_equal_to(c));
+    assert_that(event.e.realloc.old_ptr, is_equal_to(b));
+    assert_that(event.e.realloc.old_size, is_equal_to(200));
+    assert_that(event.e.realloc.new_size, is_equal_to(400));
+
+    assert_that(mallocator_shm_ring_read(reader, &event), is_true);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_FREE));
+    assert_that(event.e.free.size, is_equal_to(100));
+    assert_that(mallocator_shm_ring_read(reader, &event), is_false);
+    assert_that(mallocator_shm_ring_failed(reader), is_false);
+
+    mallocator_free(m, c, 400);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+    mallocator_shm_ring_destroy(reader);
+    close(fd);
+    mallocator_shm_ring_destroy(ring);
+}
+
+Ensure(mallocator_shm_ring, wraps_around)
+{
+    mallocator_shm_ring_t *ring = mallocator_shm_ring_create(NULL, MALLOCATOR_SHM_RING_CAPACITY_MIN);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_shm_ring_event, ring);
+    mallocator_tracer_set_backtrace_depth(m, 0);
+
+    /* Names of varying length so records are misaligned with the end of the ring */
+    const char *names[] = { "a", "bcdefghij", "klmnopqrstuvwxyz0123456789" };
+    mallocator_t *children[3];
+    for (unsigned i = 0; i < 3; i++)
+	children[i] = mallocator_create_child(m, names[i]);
+
+    mallocator_tracer_event_t event;
+    size_t read = 0;
+    for (size_t i = 0; i < 10000; i++)
+    {
+	mallocator_free(children[i % 3], NULL, i);
+	assert_that(mallocator_shm_ring_read(ring, &event), is_true);
+	assert_that(event.e.free.size, is_equal_to(i));
+	assert_that(strstr(event.name, names[i % 3]), is_non_null);
+	read++;
+    }
+    assert_that(read, is_equal_to(10000));
+    assert_that(mallocator_shm_ring_lost(ring), is_equal_to(0));
+
+    for (unsigned i = 0; i < 3; i++)
+	mallocator_dereference(children[i]);
+    mallocator_dereference(m);
+    mallocator_shm_ring_destroy(ring);
+}
+
+Ensure(mallocator_shm_ring, counts_lost_events)
+{
+    mallocator_shm_ring_t *ring = mallocator_shm_ring_create(NULL, MALLOCATOR_SHM_RING_CAPACITY_MIN);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_shm_ring_event, ring);
+    for (size_t i = 0; i < 10000; i++)
+	mallocator_free(m, NULL, i);
+
+    /* The oldest events are kept */
+    const size_t lost = mallocator_shm_ring_lost(ring);
+    assert_that(lost, is_greater_than(0));
+    mallocator_tracer_event_t event;
+    size_t read = 0;
+    while (mallocator_shm_ring_read(ring, &event))
+    {
+	assert_that(event.e.free.size, is_equal_to(read));
+	read++;
+    }
+    assert_that(read + lost, is_equal_to(10000));
+
+    /* Events fit again once read */
+    mallocator_free(m, NULL, 0);
+    assert_that(mallocator_shm_ring_read(ring, &event), is_true);
+    assert_that(mallocator_shm_ring_lost(ring), is_equal_to(lost));
+    mallocator_dereference(m);
+    mallocator_shm_ring_destroy(ring);
+}
+
+Ensure(mallocator_shm_ring, can_be_named)
+{
+    char name[64], path[80];
+    snprintf(name, sizeof(name), "/mallocator_shm_ring_test.%d", getpid());
+    snprintf(path, sizeof(path), "/dev/shm%s", name);
+    mallocator_shm_ring_t *ring = mallocator_shm_ring_create(name, 0);
+    assert_that(ring, is_non_null);
+    int fd;
+    mallocator_shm_ring_t *reader = open_ring(path, &fd);
+    assert_that(reader, is_non_null);
+
+    mallocator_tracer_event_t event = { .name = "test", .type = MALLOCATOR_TRACER_MALLOC, .ptr = &event, .cpu = -1 };
+    mallocator_shm_ring_event(ring, &event);
+    assert_that(mallocator_shm_ring_read(reader, &event), is_true);
+    assert_that(event.name, is_equal_to_string("test"));
+    assert_that(event.backtrace, is_null);
+
+    mallocator_shm_ring_destroy(reader);
+    close(fd);
+    mallocator_shm_ring_destroy(ring);
+    assert_that(access(path, F_OK), is_equal_to(-1));
+}
+
+Ensure(mallocator_shm_ring, rejects_other_files)
+{
+    FILE *file = tmpfile();
+    fputs("not a ring", file);
+    fflush(file);
+    assert_that(mallocator_shm_ring_open(fileno(file)), is_null);
+    fclose(file);
+}
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    unsigned n;
+} ring_thread_t;
+
+static void *ring_thread(void *arg)
+{
+    ring_thread_t *data = arg;
+    for (unsigned i = 0; i < data->n; i++)
+	mallocator_free(data->mallocator, mallocator_malloc(data->mallocator, 100), 100);
+    return NULL;
+}
+
+Ensure(mallocator_shm_ring, reads_concurrent_producers)
+{
+    mallocator_shm_ring_t *ring = mallocator_shm_ring_create(NULL, MALLOCATOR_SHM_RING_CAPACITY_MIN);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_shm_ring_event, ring);
+    unsigned num_threads = 4;
+    pthread_t threads[num_threads];
+    ring_thread_t data = { .mallocator = m, .n = 10000 };
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_create(&threads[i], NULL, ring_thread, &data), is_equal_to(0));
+
+    /* Read while producing, then drain */
+    const size_t total = num_threads * data.n * 2;
+    size_t read = 0, mallocs = 0;
+    mallocator_tracer_event_t event;
+    while (read + mallocator_shm_ring_lost(ring) < total && !mallocator_shm_ring_failed(ring))
+    {
+	if (!mallocator_shm_ring_read(ring, &event)) continue;
+	read++;
+	if (event.type == MALLOCATOR_TRACER_MALLOC) mallocs++;
+	assert_that(event.name, is_equal_to_string("test"));
+    }
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_join(threads[i], NULL), is_equal_to(0));
+
+    assert_that(mallocator_shm_ring_read(ring, &event), is_false);
+    assert_that(mallocator_shm_ring_failed(ring), is_false);
+    assert_that(read + mallocator_shm_ring_lost(ring), is_equal_to(total));
+    assert_that(mallocs, is_greater_than(0));
+    mallocator_dereference(m);
+    mallocator_shm_ring_destroy(ring);
+}
+
+TestSuite *mallocator_shm_ring_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_shm_ring, round_trips_events);
+    add_test_with_context(suite, mallocator_shm_ring, wraps_around);
+    add_test_with_context(suite, mallocator_shm_ring, counts_lost_events);
+    add_test_with_context(suite, mallocator_shm_ring, can_be_named);
+    add_test_with_context(suite, mallocator_shm_ring, rejects_other_files);
+    add_test_with_context(suite, mallocator_shm_ring, reads_concurrent_producers);
+    return suite;
+}
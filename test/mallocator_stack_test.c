@@ -0,0 +1,256 @@
+#include <cgreen/cgreen.h>
+
+#include "mallocator_tracer.h"
+#include "mallocator_monkey.h"
+#include "mallocator_header.h"
+#include "mallocator_mmap.h"
+#include "mallocator_tlsf.h"
+#include "mallocator.h"
+
+#include <malloc.h>
+#include <stdint.h>
+
+static struct mallinfo mallinfo_before;
+
+Describe(mallocator_stack);
+
+BeforeEach(mallocator_stack)
+{
+    mallinfo_before = mallinfo();
+}
+
+AfterEach(mallocator_stack)
+{
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+static const size_t pool_size = 1024 * 1024;
+
+static void trace_copy(void *arg, const mallocator_tracer_event_t *event)
+{
+    mallocator_tracer_event_t *p_event = arg;
+    *p_event = *event;
+}
+
+static bool never_fail(void *arg)
+{
+    return false;
+}
+
+static bool fail_if_set(void *arg)
+{
+    return *(bool *) arg;
+}
+
+/* tracer -> monkey -> TLSF */
+static mallocator_t *create_stack(const char *name, mallocator_tracer_event_t *event, bool *fail)
+{
+    mallocator_impl_t *impl = mallocator_tlsf_impl_create(pool_size);
+    impl = mallocator_monkey_impl_create_custom(fail_if_set, fail, impl);
+    impl = mallocator_tracer_impl_create(name, trace_copy, event, impl);
+    if (!impl) return NULL;
+
+    mallocator_t *m = mallocator_create_custom(name, impl);
+    if (!m) mallocator_impl_destroy(impl);
+    return m;
+}
+
+Ensure(mallocator_stack, can_be_created)
+{
+    mallocator_tracer_event_t event = { 0 };
+    bool fail = false;
+    mallocator_t *m = create_stack("test", &event, &fail);
+    assert_that(m, is_non_null);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, allocates_from_innermost_layer)
+{
+    mallocator_tracer_event_t event = { 0 };
+    bool fail = false;
+    mallocator_t *m = create_stack("test", &event, &fail);
+    mallocator_tlsf_stats_t before, stats;
+    mallocator_tlsf_stats(m, &before);
+
+    void *ptr = mallocator_malloc(m, 1000);
+    assert_that(ptr, is_non_null);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_MALLOC));
+    assert_that(event.ptr, is_equal_to(ptr));
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.bytes_used, is_greater_than(before.bytes_used));
+
+    mallocator_free(m, ptr, 1000);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_FREE));
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.bytes_used, is_equal_to(before.bytes_used));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, traces_injected_failures)
+{
+    mallocator_tracer_event_t event = { 0 };
+    bool fail = true;
+    mallocator_t *m = create_stack("test", &event, &fail);
+    void *ptr = mallocator_malloc(m, 1000);
+    assert_that(ptr, is_null);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_MALLOC));
+    assert_that(event.ptr, is_null);
+    assert_that(event.e.malloc.size, is_equal_to(1000));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, propagates_children)
+{
+    mallocator_tracer_event_t event = { 0 };
+    bool fail = false;
+    mallocator_t *m = create_stack("test", &event, &fail);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    assert_that(child, is_non_null);
+    mallocator_t *grandchild = mallocator_create_child(child, "grandchild");
+    assert_that(grandchild, is_non_null);
+
+    void *ptr = mallocator_malloc(grandchild, 100);
+    assert_that(ptr, is_non_null);
+    assert_that(event.name, is_equal_to_string("test.child.grandchild"));
+    mallocator_tlsf_stats_t stats;
+    mallocator_tlsf_stats(grandchild, &stats);
+    assert_that(stats.pool_size, is_equal_to(pool_size));
+
+    fail = true;
+    assert_that(mallocator_malloc(child, 100), is_null);
+    fail = false;
+
+    mallocator_free(grandchild, ptr, 100);
+    mallocator_dereference(grandchild);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, header_adds_unsized_free)
+{
+    const size_t threshold = 64 * 1024;
+    mallocator_impl_t *impl = mallocator_header_impl_create(mallocator_mmap_impl_create(threshold));
+    assert_that(impl, is_non_null);
+    mallocator_t *m = mallocator_create_custom("test", impl);
+    assert_that(m, is_non_null);
+
+    char *ptr = mallocator_malloc(m, threshold);
+    assert_that(ptr, is_non_null);
+    ptr[threshold - 1] = 1;
+    mallocator_mmap_stats_t stats;
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(1));
+    mallocator_free_unsized(m, ptr);
+    mallocator_mmap_stats(m, &stats);
+    assert_that(stats.blocks_mapped, is_equal_to(0));
+    assert_that(stats.bytes_mapped, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, layers_default_to_stdlib)
+{
+    mallocator_impl_t *impl = mallocator_monkey_impl_create_custom(never_fail, NULL, NULL);
+    impl = mallocator_header_impl_create(impl);
+    mallocator_t *m = mallocator_create_custom("test", impl);
+    assert_that(m, is_non_null);
+    void *ptr = mallocator_aligned_alloc(m, 256, 100);
+    assert_that(ptr, is_non_null);
+    assert_that((uintptr_t) ptr % 256, is_equal_to(0));
+    mallocator_free_unsized(m, ptr);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, children_can_override_backend)
+{
+    mallocator_t *m = mallocator_create("svc");
+    mallocator_t *parser = mallocator_create_child_custom(m, "parser", mallocator_tlsf_impl_create(pool_size));
+    assert_that(parser, is_non_null);
+    mallocator_t *conns = mallocator_create_child_custom(m, "conns", mallocator_header_impl_create(NULL));
+    assert_that(conns, is_non_null);
+    mallocator_t *other = mallocator_create_child(m, "other");
+    assert_that(mallocator_get_impl(other), is_null);
+
+    /* Grandchildren derive from the overriding backend */
+    mallocator_t *tokens = mallocator_create_child(parser, "tokens");
+    assert_that(tokens, is_non_null);
+    void *ptr = mallocator_malloc(tokens, 100);
+    assert_that(ptr, is_non_null);
+    mallocator_tlsf_stats_t tlsf_stats;
+    mallocator_tlsf_stats(tokens, &tlsf_stats);
+    assert_that(tlsf_stats.bytes_used, is_greater_than(100));
+    mallocator_free(tokens, ptr, 100);
+
+    ptr = mallocator_malloc(conns, 100);
+    mallocator_free_unsized(conns, ptr);
+    mallocator_stats_t stats;
+    mallocator_stats(conns, &stats);
+    assert_that(stats.bytes_freed, is_equal_to(100));
+
+    char buf[64];
+    assert_that(mallocator_full_name(tokens, buf, sizeof(buf)), is_equal_to_string("svc.parser.tokens"));
+
+    mallocator_dereference(tokens);
+    mallocator_dereference(other);
+    mallocator_dereference(conns);
+    mallocator_dereference(parser);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_stack, custom_children_are_uniquely_named)
+{
+    mallocator_t *m = mallocator_create("svc");
+    mallocator_t *child = mallocator_create_child(m, "child");
+    mallocator_impl_t *impl = mallocator_header_impl_create(NULL);
+    assert_that(mallocator_create_child_custom(m, "child", impl), is_null);
+    mallocator_impl_destroy(impl);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+}
+
+static void count_leaks(void *arg, const char *name, size_t blocks_leaked, size_t bytes_leaked)
+{
+    (*(unsigned *) arg)++;
+}
+
+Ensure(mallocator_stack, custom_children_share_leak_reporter)
+{
+    unsigned leaks = 0;
+    mallocator_t *m = mallocator_create("svc");
+    mallocator_set_leak_reporter(m, count_leaks, &leaks);
+    mallocator_t *child = mallocator_create_child_custom(m, "child", mallocator_tlsf_impl_create(pool_size));
+    void *ptr = mallocator_malloc(child, 100);
+    assert_that(ptr, is_non_null);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+    assert_that(leaks, is_equal_to(1));
+}
+
+Ensure(mallocator_stack, trims_innermost_layer)
+{
+    mallocator_tracer_event_t event = { 0 };
+    bool fail = false;
+    mallocator_t *m = create_stack("test", &event, &fail);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    assert_that(mallocator_trim(child, MALLOCATOR_TRIM_PURGE), is_greater_than(pool_size / 2));
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+}
+
+TestSuite *mallocator_stack_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_stack, can_be_created);
+    add_test_with_context(suite, mallocator_stack, allocates_from_innermost_layer);
+    add_test_with_context(suite, mallocator_stack, traces_injected_failures);
+    add_test_with_context(suite, mallocator_stack, propagates_children);
+    add_test_with_context(suite, mallocator_stack, header_adds_unsized_free);
+    add_test_with_context(suite, mallocator_stack, layers_default_to_stdlib);
+    add_test_with_context(suite, mallocator_stack, children_can_override_backend);
+    add_test_with_context(suite, mallocator_stack, custom_children_are_uniquely_named);
+    add_test_with_context(suite, mallocator_stack, custom_children_share_leak_reporter);
+    add_test_with_context(suite, mallocator_stack, trims_innermost_layer);
+    return suite;
+}
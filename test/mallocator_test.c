@@ -3,6 +3,7 @@
 #include "mallocator.h"
 
 #include <malloc.h>
+#include <stdint.h>
 #include <string.h>
 
 Describe(mallocator);
@@ -386,6 +387,173 @@ Ensure(mallocator, can_realloc)
     assert_that(no_ints, is_null);
 }
 
+Ensure(mallocator, can_aligned_alloc)
+{
+    for (size_t alignment = 1; alignment <= 4096; alignment *= 2)
+    {
+	char *ptr = mallocator_aligned_alloc(m, alignment, 100);
+	assert_that(ptr, is_non_null);
+	assert_that((uintptr_t) ptr % alignment, is_equal_to(0));
+	memset(ptr, 0, 100);
+	mallocator_free(m, ptr, 100);
+    }
+    void *ptr = mallocator_aligned_alloc(m, 24, 100);
+    assert_that(ptr, is_null);
+}
+
+Ensure(mallocator, can_malloc_at_least)
+{
+    size_t actual = 0;
+    char *ptr = mallocator_malloc_at_least(m, 100, &actual);
+    assert_that(ptr, is_non_null);
+    assert_that(actual, is_greater_than(100 - 1));
+    memset(ptr, 0, actual);
+    assert_that(mallocator_usable_size(m, ptr, actual), is_equal_to(actual));
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.bytes_allocated, is_equal_to(actual));
+    mallocator_free(m, ptr, actual);
+}
+
+Ensure(mallocator, has_usable_size)
+{
+    char *ptr = mallocator_malloc(m, 100);
+    assert_that(ptr, is_non_null);
+    size_t usable = mallocator_usable_size(m, ptr, 100);
+    assert_that(usable, is_greater_than(100 - 1));
+    memset(ptr, 0, usable);
+    mallocator_free(m, ptr, 100);
+}
+
+Ensure(mallocator, can_try_expand)
+{
+    char *ptr = mallocator_malloc(m, 100);
+    assert_that(ptr, is_non_null);
+    size_t actual = mallocator_usable_size(m, ptr, 100);
+    assert_that(mallocator_try_expand(m, ptr, 100, actual), is_true);
+    assert_that(mallocator_try_expand(m, ptr, actual, actual + 1024 * 1024), is_false);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(1));
+    assert_that(stats.blocks_resized, is_equal_to(1));
+    assert_that(stats.bytes_allocated, is_equal_to(actual));
+    mallocator_free(m, ptr, actual);
+}
+
+Ensure(mallocator, can_free_unsized)
+{
+    void *ptr = mallocator_malloc(m, 100);
+    assert_that(ptr, is_non_null);
+    mallocator_free_unsized(m, ptr);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(1));
+    assert_that(stats.bytes_freed, is_greater_than(100 - 1));
+    mallocator_free_unsized(m, NULL);
+}
+
+Ensure(mallocator, can_realloc_unsized)
+{
+    char *ptr = mallocator_realloc_unsized(m, NULL, 100);
+    assert_that(ptr, is_non_null);
+    memset(ptr, 1, 100);
+    char *more = mallocator_realloc_unsized(m, ptr, 1000);
+    assert_that(more, is_non_null);
+    for (unsigned i = 0; i < 100; i++)
+    {
+	assert_that(more[i], is_equal_to(1));
+    }
+    assert_that(mallocator_realloc_unsized(m, more, 0), is_null);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(stats.blocks_allocated));
+}
+
+Ensure(mallocator, can_malloc_batch)
+{
+    enum { num = 64 };
+    void *ptrs[num];
+    size_t allocated = mallocator_malloc_batch(m, 128, num, ptrs);
+    assert_that(allocated, is_equal_to(num));
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(ptrs[i], is_non_null);
+	memset(ptrs[i], i, 128);
+    }
+    mallocator_free(m, ptrs[0], 128);
+    mallocator_free_batch(m, ptrs + 1, 128, num - 1);
+}
+
+Ensure(mallocator, can_trim)
+{
+    mallocator_t *child = mallocator_create_child(m, "child");
+    void *ptrs[64];
+    for (unsigned i = 0; i < 64; i++)
+	ptrs[i] = mallocator_malloc(child, 4096);
+    for (unsigned i = 0; i < 64; i++)
+	mallocator_free(child, ptrs[i], 4096);
+
+    mallocator_trim(m, 0);
+    void *ptr = mallocator_malloc(child, 4096);
+    assert_that(ptr, is_non_null);
+    mallocator_free(child, ptr, 4096);
+    mallocator_dereference(child);
+}
+
+Ensure(mallocator, can_free_deferred)
+{
+    mallocator_stats_t stats;
+    void *ptrs[16];
+    for (unsigned i = 0; i < 16; i++)
+	ptrs[i] = mallocator_malloc(m, 100);
+    for (unsigned i = 0; i < 16; i++)
+	mallocator_free_deferred(m, ptrs[i], 100);
+
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(0));
+    assert_that(stats.blocks_deferred, is_equal_to(16));
+    assert_that(stats.bytes_deferred, is_equal_to(1600));
+
+    assert_that(mallocator_drain_deferred(m), is_equal_to(1600));
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(16));
+    assert_that(stats.bytes_freed, is_equal_to(1600));
+    assert_that(stats.blocks_deferred, is_equal_to(0));
+    assert_that(stats.bytes_deferred, is_equal_to(0));
+    assert_that(mallocator_drain_deferred(m), is_equal_to(0));
+}
+
+Ensure(mallocator, frees_immediately_over_defer_limit)
+{
+    mallocator_stats_t stats;
+    mallocator_set_defer_limit(m, 1000);
+    void *small = mallocator_malloc(m, 8);
+    void *ptr = mallocator_malloc(m, 600);
+    void *over = mallocator_malloc(m, 600);
+    mallocator_free_deferred(m, small, 8);
+    mallocator_free_deferred(m, ptr, 600);
+    mallocator_free_deferred(m, over, 600);
+
+    mallocator_stats(m, &stats);
+    assert_that(stats.bytes_freed, is_equal_to(608));
+    assert_that(stats.bytes_deferred, is_equal_to(600));
+    assert_that(mallocator_drain_deferred(m), is_equal_to(600));
+}
+
+Ensure(mallocator, frees_deferred_on_release)
+{
+    mallocator_t *child = mallocator_create_child(m, "child");
+    mallocator_free_deferred(child, mallocator_malloc(child, 100), 100);
+    mallocator_free_deferred(m, mallocator_malloc(m, 100), 100);
+
+    /* Only the frees of the released mallocator need be made */
+    mallocator_dereference(child);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed + stats.blocks_deferred, is_equal_to(1));
+    mallocator_drain_deferred(m);
+}
+
 Ensure(mallocator, counts_malloc)
 {
     unsigned num = 1024;
@@ -463,6 +631,58 @@ Ensure(mallocator, counts_realloc)
     }
 }
 
+Ensure(mallocator, counts_aligned_alloc)
+{
+    const size_t alignment = 4096;
+    mallocator_stats_t stats;
+    char *ptr = mallocator_aligned_alloc(m, alignment, 100);
+    assert_that(ptr, is_non_null);
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(1));
+    assert_that(stats.bytes_allocated, is_equal_to(100));
+    const size_t padding = mallocator_usable_size(m, ptr, 100) - 100;
+    assert_that(stats.bytes_padding, is_equal_to(padding));
+    mallocator_free(m, ptr, 100);
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(1));
+    assert_that(stats.bytes_freed, is_equal_to(100));
+    assert_that(stats.bytes_padding, is_equal_to(padding));
+
+    ptr = mallocator_aligned_alloc(m, 3, 100);
+    assert_that(ptr, is_null);
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_failed, is_equal_to(1));
+    assert_that(stats.bytes_failed, is_equal_to(100));
+}
+
+Ensure(mallocator, counts_batch)
+{
+    enum { num = 64 };
+    void *ptrs[num];
+    mallocator_stats_t stats;
+    size_t allocated = mallocator_malloc_batch(m, 128, num, ptrs);
+    assert_that(allocated, is_equal_to(num));
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(num));
+    assert_that(stats.bytes_allocated, is_equal_to(num * 128));
+    mallocator_free_batch(m, ptrs, 128, num);
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_freed, is_equal_to(num));
+    assert_that(stats.bytes_freed, is_equal_to(num * 128));
+}
+
+Ensure(mallocator, fails_overflowing_batches)
+{
+    /* 4 blocks of 2^62 bytes wrap to 0 bytes */
+    void *ptrs[4];
+    mallocator_stats_t stats;
+    assert_that(mallocator_malloc_batch(m, SIZE_MAX / 4 + 1, 4, ptrs), is_equal_to(0));
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_allocated, is_equal_to(0));
+    assert_that(stats.blocks_failed, is_equal_to(4));
+    assert_that(stats.bytes_failed, is_equal_to(SIZE_MAX));
+}
+
 typedef struct
 {
     char *name;
@@ -536,6 +756,20 @@ Ensure(mallocator, reports_realloc_leaks)
     free(ptr);
 }
 
+Ensure(mallocator, does_not_report_unsized_frees_as_leaks)
+{
+    mallocator_t *m = mallocator_create("unsized");
+    assert_that(m, is_non_null);
+
+    test_leak_t leak = { .name = NULL, .blocks_leaked = 0, .bytes_leaked = 0 };
+    mallocator_set_leak_reporter(m, report_leak, &leak);
+    void *ptr = mallocator_malloc(m, 1);
+    assert_that(ptr, is_non_null);
+    mallocator_free_unsized(m, ptr);
+    mallocator_dereference(m);
+    assert_that(leak.name, is_null);
+}
+
 TestSuite *mallocator_tests(void)
 {
     TestSuite *suite = create_test_suite();
@@ -557,11 +791,26 @@ TestSuite *mallocator_tests(void)
     add_test_with_context(suite, mallocator, can_malloc);
     add_test_with_context(suite, mallocator, can_calloc);
     add_test_with_context(suite, mallocator, can_realloc);
+    add_test_with_context(suite, mallocator, can_aligned_alloc);
+    add_test_with_context(suite, mallocator, can_malloc_at_least);
+    add_test_with_context(suite, mallocator, has_usable_size);
+    add_test_with_context(suite, mallocator, can_try_expand);
+    add_test_with_context(suite, mallocator, can_free_unsized);
+    add_test_with_context(suite, mallocator, can_realloc_unsized);
+    add_test_with_context(suite, mallocator, can_malloc_batch);
+    add_test_with_context(suite, mallocator, can_trim);
+    add_test_with_context(suite, mallocator, can_free_deferred);
+    add_test_with_context(suite, mallocator, frees_immediately_over_defer_limit);
+    add_test_with_context(suite, mallocator, frees_deferred_on_release);
     add_test_with_context(suite, mallocator, counts_malloc);
     add_test_with_context(suite, mallocator, counts_calloc);
     add_test_with_context(suite, mallocator, counts_realloc);
+    add_test_with_context(suite, mallocator, counts_aligned_alloc);
+    add_test_with_context(suite, mallocator, counts_batch);
+    add_test_with_context(suite, mallocator, fails_overflowing_batches);
     add_test_with_context(suite, mallocator, reports_malloc_leaks);
     add_test_with_context(suite, mallocator, reports_calloc_leaks);
     add_test_with_context(suite, mallocator, reports_realloc_leaks);
+    add_test_with_context(suite, mallocator, does_not_report_unsized_frees_as_leaks);
     return suite;
 }
@@ -0,0 +1,29 @@
+#include <cgreen/cgreen.h>
+
+#include "mallocator_test_helpers.h"
+
+#include <pthread.h>
+#include <malloc.h>
+
+static void *dummy_thread(void *arg) { return NULL; }
+
+struct mallinfo mallocator_test_mallinfo(void)
+{
+    /* HACK! pthreads keeps a number of thread stacks allocated after a thread has terminated
+     * to avoid reallocation when threads are created. This affects our memory low watermark,
+     * so create a number of threads */
+    for (unsigned num_dummy_threads = 8; ; num_dummy_threads *= 2)
+    {
+	struct mallinfo mallinfo_before = mallinfo();
+	pthread_t dummy_tid[num_dummy_threads];
+	for (unsigned i = 0; i < num_dummy_threads; i++)
+	    assert_that(pthread_create(&dummy_tid[i], NULL, dummy_thread, NULL), is_equal_to(0));
+	for (unsigned i = 0; i < num_dummy_threads; i++)
+	    assert_that(pthread_join(dummy_tid[i], NULL), is_equal_to(0));
+
+	struct mallinfo mallinfo_after = mallinfo();
+	if (mallinfo_after.uordblks == mallinfo_before.uordblks &&
+	    mallinfo_after.fordblks == mallinfo_before.fordblks)
+	    return mallinfo_before;
+    }
+}
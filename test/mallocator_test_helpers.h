@@ -0,0 +1,12 @@
+#ifndef MALLOCATOR_TEST_HELPERS_H
+#define MALLOCATOR_TEST_HELPERS_H
+
+#include <malloc.h>
+
+/**
+ * Return mallinfo once creating threads no longer changes it, as a baseline for leak checks in
+ * suites which create threads.
+ */
+struct mallinfo mallocator_test_mallinfo(void);
+
+#endif // MALLOCATOR_TEST_HELPERS_H
@@ -4,6 +4,15 @@ TestSuite *mallocator_tests(void);
 TestSuite *mallocator_monkey_tests(void);
 TestSuite *mallocator_tracer_tests(void);
 TestSuite *mallocator_concurrency_tests(void);
+TestSuite *mallocator_mmap_tests(void);
+TestSuite *mallocator_tlsf_tests(void);
+TestSuite *mallocator_header_tests(void);
+TestSuite *mallocator_stack_tests(void);
+TestSuite *mallocator_limit_tests(void);
+TestSuite *mallocator_maintenance_tests(void);
+TestSuite *mallocator_trace_tests(void);
+TestSuite *mallocator_heap_profile_tests(void);
+TestSuite *mallocator_shm_ring_tests(void);
 
 static TestSuite *mallocator_all_tests(void)
 {
@@ -12,6 +21,15 @@ static TestSuite *mallocator_all_tests(void)
     add_suite(suite, mallocator_monkey_tests());
     add_suite(suite, mallocator_tracer_tests());
     add_suite(suite, mallocator_concurrency_tests());
+    add_suite(suite, mallocator_mmap_tests());
+    add_suite(suite, mallocator_tlsf_tests());
+    add_suite(suite, mallocator_header_tests());
+    add_suite(suite, mallocator_stack_tests());
+    add_suite(suite, mallocator_limit_tests());
+    add_suite(suite, mallocator_maintenance_tests());
+    add_suite(suite, mallocator_trace_tests());
+    add_suite(suite, mallocator_heap_profile_tests());
+    add_suite(suite, mallocator_shm_ring_tests());
     return suite;
 }
 
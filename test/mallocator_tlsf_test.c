@@ -0,0 +1,395 @@
+#include <cgreen/cgreen.h>
+
+#include "mallocator_tlsf.h"
+#include "mallocator.h"
+#include "mallocator_test_helpers.h"
+
+#include <pthread.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+
+static struct mallinfo mallinfo_before;
+
+Describe(mallocator_tlsf);
+
+BeforeEach(mallocator_tlsf)
+{
+    mallinfo_before = mallocator_test_mallinfo();
+}
+
+AfterEach(mallocator_tlsf)
+{
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+}
+
+static const size_t pool_size = 1024 * 1024;
+
+Ensure(mallocator_tlsf, can_be_created)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    assert_that(m, is_non_null);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_be_created_in_place)
+{
+    static char pool[64 * 1024];
+    mallocator_t *m = mallocator_tlsf_create_in_place("test", pool, sizeof(pool));
+    assert_that(m, is_non_null);
+    void *ptr = mallocator_malloc(m, 1024);
+    assert_that((char *) ptr, is_greater_than(pool));
+    assert_that((char *) ptr, is_less_than(pool + sizeof(pool)));
+    mallocator_free(m, ptr, 1024);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, rejects_oversized_pools)
+{
+    /* Rejected before the pool is mapped or touched */
+    static char pool[64 * 1024];
+    assert_that(mallocator_tlsf_create("test", MALLOCATOR_TLSF_POOL_MAX), is_null);
+    assert_that(mallocator_tlsf_create_in_place("test", pool, MALLOCATOR_TLSF_POOL_MAX), is_null);
+    assert_that(mallocator_tlsf_impl_create_in_place(pool, SIZE_MAX), is_null);
+}
+
+Ensure(mallocator_tlsf, has_a_name)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    const char *name = mallocator_name(m);
+    assert_that(name, is_equal_to_string("test"));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_malloc)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    unsigned num = 1024;
+    int *ints = mallocator_malloc(m, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    assert_that((uintptr_t) ints % 16, is_equal_to(0));
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    mallocator_free(m, ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_calloc)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    unsigned num = 1024;
+    int *ints = mallocator_malloc(m, num * sizeof(int));
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+    mallocator_free(m, ints, num * sizeof(int));
+    ints = mallocator_calloc(m, num, sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(ints[i], is_equal_to(0));
+    }
+    mallocator_free(m, ints, num * sizeof(int));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_realloc)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    unsigned num = 1024;
+    int *ints = mallocator_realloc(m, NULL, 0, num * sizeof(int));
+    assert_that(ints, is_non_null);
+    for (unsigned i = 0; i < num; i++)
+    {
+	ints[i] = i;
+    }
+
+    /* Nothing follows the block, so it grows in place */
+    unsigned more_num = 10 * num;
+    int *more_ints = mallocator_realloc(m, ints, num * sizeof(int), more_num * sizeof(int));
+    assert_that(more_ints, is_equal_to(ints));
+
+    /* Block the tail so that the next resize must move */
+    void *blocker = mallocator_malloc(m, 16);
+    unsigned most_num = 20 * num;
+    int *most_ints = mallocator_realloc(m, more_ints, more_num * sizeof(int), most_num * sizeof(int));
+    assert_that(most_ints, is_non_null);
+    assert_that(most_ints, is_not_equal_to(more_ints));
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(most_ints[i], is_equal_to(i));
+    }
+    int *no_ints = mallocator_realloc(m, most_ints, most_num * sizeof(int), 0);
+    assert_that(no_ints, is_null);
+    mallocator_free(m, blocker, 16);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_aligned_alloc)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    enum { num = 8 };
+    void *ptrs[num];
+    for (unsigned i = 0; i < num; i++)
+    {
+	const size_t alignment = (size_t) 32 << i;
+	ptrs[i] = mallocator_aligned_alloc(m, alignment, 100);
+	assert_that(ptrs[i], is_non_null);
+	assert_that((uintptr_t) ptrs[i] % alignment, is_equal_to(0));
+	memset(ptrs[i], 0xff, 100);
+    }
+    for (unsigned i = 0; i < num; i++)
+    {
+	mallocator_free(m, ptrs[i], 100);
+    }
+
+    /* Padding is returned to the pool */
+    mallocator_tlsf_stats_t stats;
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.blocks_free, is_equal_to(1));
+    assert_that(stats.fragmentation, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_malloc_batch)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    enum { num = 256 };
+    void *ptrs[num];
+    size_t allocated = mallocator_malloc_batch(m, 100, num, ptrs);
+    assert_that(allocated, is_equal_to(num));
+    for (unsigned i = 0; i < num; i++)
+    {
+	assert_that(ptrs[i], is_non_null);
+	assert_that((uintptr_t) ptrs[i] % 16, is_equal_to(0));
+	memset(ptrs[i], i, 100);
+    }
+
+    /* The batch is carved from a single slab */
+    for (unsigned i = 1; i < num; i++)
+    {
+	assert_that((char *) ptrs[i], is_greater_than((char *) ptrs[i - 1] + 100 - 1));
+	assert_that((char *) ptrs[i], is_less_than((char *) ptrs[i - 1] + 256));
+    }
+    mallocator_tlsf_stats_t stats;
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.blocks_free, is_equal_to(1));
+
+    mallocator_free(m, ptrs[num / 2], 100);
+    ptrs[num / 2] = NULL;
+    mallocator_free_batch(m, ptrs, 100, num);
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.blocks_free, is_equal_to(1));
+    assert_that(stats.fragmentation, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_malloc_at_least)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    size_t actual = 0;
+    char *ptr = mallocator_malloc_at_least(m, 100, &actual);
+    assert_that(ptr, is_non_null);
+    assert_that(actual, is_equal_to(112));
+    memset(ptr, 0, actual);
+    assert_that(mallocator_usable_size(m, ptr, actual), is_equal_to(actual));
+    mallocator_free(m, ptr, actual);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, can_try_expand)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    char *ptr = mallocator_malloc(m, 1024);
+    assert_that(ptr, is_non_null);
+    assert_that(mallocator_try_expand(m, ptr, 1024, 4096), is_true);
+    memset(ptr, 0, 4096);
+
+    void *blocker = mallocator_malloc(m, 16);
+    assert_that(mallocator_try_expand(m, ptr, 4096, 8192), is_false);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_resized, is_equal_to(1));
+    mallocator_free(m, blocker, 16);
+    mallocator_free(m, ptr, 4096);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, fails_when_exhausted)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    void *ptr = mallocator_malloc(m, pool_size);
+    assert_that(ptr, is_null);
+    mallocator_stats_t stats;
+    mallocator_stats(m, &stats);
+    assert_that(stats.blocks_failed, is_equal_to(1));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, coalesces_free_blocks)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    mallocator_tlsf_stats_t before;
+    mallocator_tlsf_stats(m, &before);
+    assert_that(before.blocks_free, is_equal_to(1));
+    assert_that(before.fragmentation, is_equal_to(0));
+
+    enum { num = 64 };
+    void *ptrs[num];
+    for (unsigned i = 0; i < num; i++)
+    {
+	ptrs[i] = mallocator_malloc(m, 100 * (i + 1));
+	assert_that(ptrs[i], is_non_null);
+    }
+
+    /* Free every other block to fragment the pool */
+    for (unsigned i = 0; i < num; i += 2)
+    {
+	mallocator_free(m, ptrs[i], 100 * (i + 1));
+    }
+    mallocator_tlsf_stats_t stats;
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.blocks_free, is_equal_to(num / 2 + 1));
+    assert_that(stats.fragmentation, is_greater_than(0));
+    assert_that(stats.largest_free, is_less_than(before.largest_free));
+
+    for (unsigned i = 1; i < num; i += 2)
+    {
+	mallocator_free(m, ptrs[i], 100 * (i + 1));
+    }
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.blocks_free, is_equal_to(1));
+    assert_that(stats.bytes_free, is_equal_to(before.bytes_free));
+    assert_that(stats.largest_free, is_equal_to(before.largest_free));
+    assert_that(stats.fragmentation, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, preserves_random_allocations)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    enum { num = 256 };
+    unsigned char *ptrs[num] = { NULL };
+    size_t sizes[num] = { 0 };
+    srand(42);
+    for (unsigned iter = 0; iter < 10000; iter++)
+    {
+	unsigned i = rand() % num;
+	if (ptrs[i])
+	{
+	    for (size_t j = 0; j < sizes[i]; j++)
+		assert_that(ptrs[i][j], is_equal_to((unsigned char) (i + j)));
+	    mallocator_free(m, ptrs[i], sizes[i]);
+	    ptrs[i] = NULL;
+	}
+	else
+	{
+	    sizes[i] = rand() % 2048 + 1;
+	    ptrs[i] = mallocator_malloc(m, sizes[i]);
+	    assert_that(ptrs[i], is_non_null);
+	    for (size_t j = 0; j < sizes[i]; j++)
+		ptrs[i][j] = i + j;
+	}
+    }
+    for (unsigned i = 0; i < num; i++)
+    {
+	if (ptrs[i]) mallocator_free(m, ptrs[i], sizes[i]);
+    }
+    mallocator_tlsf_stats_t stats;
+    mallocator_tlsf_stats(m, &stats);
+    assert_that(stats.blocks_free, is_equal_to(1));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tlsf, purges_free_pages)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    char *ptr = mallocator_malloc(m, 1000);
+    memset(ptr, 0xa5, 1000);
+    mallocator_tlsf_stats_t before, after;
+    mallocator_tlsf_stats(m, &before);
+
+    /* The pool is prefaulted */
+    assert_that(mallocator_trim(m, MALLOCATOR_TRIM_PURGE), is_greater_than(pool_size / 2));
+    assert_that(mallocator_trim(m, MALLOCATOR_TRIM_PURGE), is_less_than(pool_size / 2));
+    mallocator_tlsf_stats(m, &after);
+    assert_that(after.bytes_free, is_equal_to(before.bytes_free));
+    assert_that(after.blocks_free, is_equal_to(before.blocks_free));
+
+    /* Live blocks are preserved, and purged pages can be reused */
+    for (unsigned i = 0; i < 1000; i++)
+	assert_that(ptr[i], is_equal_to((char) 0xa5));
+    char *big = mallocator_malloc(m, pool_size / 2);
+    assert_that(big, is_non_null);
+    memset(big, 0x5a, pool_size / 2);
+    mallocator_free(m, big, pool_size / 2);
+    mallocator_free(m, ptr, 1000);
+    mallocator_dereference(m);
+}
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    volatile bool stop;
+} purge_thread_t;
+
+static void *purge_thread(void *arg)
+{
+    purge_thread_t *data = arg;
+    while (!data->stop)
+	mallocator_trim(data->mallocator, MALLOCATOR_TRIM_PURGE);
+    return NULL;
+}
+
+Ensure(mallocator_tlsf, allocates_while_purging)
+{
+    mallocator_t *m = mallocator_tlsf_create("test", pool_size);
+    purge_thread_t data = { .mallocator = m, .stop = false };
+    pthread_t thread;
+    assert_that(pthread_create(&thread, NULL, purge_thread, &data), is_equal_to(0));
+
+    /* A purge takes at most 256KiB of the free pool at a time, and never writes to allocations */
+    for (unsigned i = 0; i < 1000; i++)
+    {
+	const size_t size = pool_size / 4 + i;
+	char *ptr = mallocator_malloc(m, size);
+	assert_that(ptr, is_non_null);
+	if (!ptr) break;
+	memset(ptr, 0x5a, size);
+	assert_that(ptr[size - 1], is_equal_to(0x5a));
+	assert_that(ptr[size / 2], is_equal_to(0x5a));
+	mallocator_free(m, ptr, size);
+    }
+
+    data.stop = true;
+    assert_that(pthread_join(thread, NULL), is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+TestSuite *mallocator_tlsf_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_tlsf, can_be_created);
+    add_test_with_context(suite, mallocator_tlsf, can_be_created_in_place);
+    add_test_with_context(suite, mallocator_tlsf, rejects_oversized_pools);
+    add_test_with_context(suite, mallocator_tlsf, has_a_name);
+    add_test_with_context(suite, mallocator_tlsf, can_malloc);
+    add_test_with_context(suite, mallocator_tlsf, can_calloc);
+    add_test_with_context(suite, mallocator_tlsf, can_realloc);
+    add_test_with_context(suite, mallocator_tlsf, can_aligned_alloc);
+    add_test_with_context(suite, mallocator_tlsf, can_malloc_batch);
+    add_test_with_context(suite, mallocator_tlsf, can_malloc_at_least);
+    add_test_with_context(suite, mallocator_tlsf, can_try_expand);
+    add_test_with_context(suite, mallocator_tlsf, fails_when_exhausted);
+    add_test_with_context(suite, mallocator_tlsf, coalesces_free_blocks);
+    add_test_with_context(suite, mallocator_tlsf, preserves_random_allocations);
+    add_test_with_context(suite, mallocator_tlsf, purges_free_pages);
+    add_test_with_context(suite, mallocator_tlsf, allocates_while_purging);
+    return suite;
+}
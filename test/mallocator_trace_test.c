@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include <cgreen/cgreen.h>
+
+#include "mallocator_trace.h"
+#include "mallocator_tracer.h"
+#include "mallocator.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+Describe(mallocator_trace);
+
+static struct mallinfo mallinfo_before;
+static FILE *file;
+static int fd;
+
+BeforeEach(mallocator_trace)
+{
+    file = tmpfile();
+    assert_that(file, is_non_null);
+    fd = fileno(file);
+    mallinfo_before = mallinfo();
+}
+
+AfterEach(mallocator_trace)
+{
+    /* Ensure that there are no memory leaks */
+    struct mallinfo mallinfo_after = mallinfo();
+    assert_that(mallinfo_after.uordblks, is_equal_to(mallinfo_before.uordblks));
+    assert_that(mallinfo_after.fordblks, is_equal_to(mallinfo_before.fordblks));
+    fclose(file);
+}
+
+typedef struct
+{
+    mallocator_trace_writer_t *writer;
+    mallocator_tracer_event_t events[16];
+    char names[16][16];			/* Event names are only valid in the callback */
+    size_t n;
+} trace_capture_t;
+
+static void trace_capture(void *arg, const mallocator_tracer_event_t *event)
+{
+    trace_capture_t *capture = arg;
+    if (capture->n < 16)
+    {
+	strcpy(capture->names[capture->n], event->name);
+	capture->events[capture->n++] = *event;
+    }
+    mallocator_trace_writer_event(capture->writer, event);
+}
+
+Ensure(mallocator_trace, round_trips_events)
+{
+    trace_capture_t capture = { .writer = mallocator_trace_writer_create(fd, 0) };
+    assert_that(capture.writer, is_non_null);
+    mallocator_t *m = mallocator_tracer_create("test", trace_capture, &capture);
+    mallocator_tracer_set_context(m, MALLOCATOR_TRACER_TIMESTAMP | MALLOCATOR_TRACER_TID | MALLOCATOR_TRACER_CPU);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    void *ptr = mallocator_malloc(m, 100);
+    void *cptr = mallocator_calloc(child, 10, 20);
+    ptr = mallocator_realloc(m, ptr, 100, 1000);
+    void *aptr = mallocator_aligned_alloc(child, 64, 640);
+    mallocator_free(child, aptr, 640);
+    mallocator_free(child, cptr, 200);
+    mallocator_free(m, ptr, 1000);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+    assert_that(mallocator_trace_writer_destroy(capture.writer), is_true);
+
+    lseek(fd, 0, SEEK_SET);
+    mallocator_trace_reader_t *reader = mallocator_trace_reader_create(fd);
+    assert_that(reader, is_non_null);
+    mallocator_trace_record_t record;
+    size_t n = 0;
+    uint64_t timestamp = 0;
+    while (mallocator_trace_reader_next(reader, &record))
+    {
+	assert_that(record.event.name, is_equal_to_string(capture.names[n]));
+	const mallocator_tracer_event_t *expected = &capture.events[n++];
+	assert_that(record.event.type, is_equal_to(expected->type));
+	assert_that(record.event.ptr, is_equal_to(expected->ptr));
+	assert_that(memcmp(&record.event.e, &expected->e, sizeof(expected->e)), is_equal_to(0));
+	assert_that(record.event.backtrace_len, is_equal_to(expected->backtrace_len));
+	assert_that(memcmp(record.event.backtrace, expected->backtrace,
+	    expected->backtrace_len * sizeof(expected->backtrace[0])), is_equal_to(0));
+	assert_that(record.event.tid, is_equal_to(expected->tid));
+	assert_that(record.event.cpu, is_equal_to(expected->cpu));
+	assert_that(record.timestamp, is_equal_to(expected->timestamp));
+	assert_that(record.timestamp, is_greater_than(timestamp - 1));
+	timestamp = record.timestamp;
+    }
+    assert_that(n, is_equal_to(capture.n));
+    assert_that(n, is_equal_to(7));
+    assert_that(mallocator_trace_reader_failed(reader), is_false);
+    assert_that(mallocator_trace_reader_name(reader, 0), is_equal_to_string("test"));
+    assert_that(mallocator_trace_reader_name(reader, 1), is_equal_to_string("test.child"));
+    assert_that(mallocator_trace_reader_name(reader, 2), is_null);
+    mallocator_trace_reader_destroy(reader);
+}
+
+static void __attribute__((noinline)) trace_loop(mallocator_t *m, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+	mallocator_free(m, mallocator_malloc(m, 64 + i % 64), 64 + i % 64);
+}
+
+Ensure(mallocator_trace, encodes_compactly)
+{
+    mallocator_trace_writer_t *writer = mallocator_trace_writer_create(fd, 1024);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_trace_writer_event, writer);
+    trace_loop(m, 10000);
+    mallocator_dereference(m);
+    assert_that(mallocator_trace_writer_flush(writer), is_true);
+
+    size_t events;
+    const size_t bytes = mallocator_trace_writer_bytes(writer, &events);
+    assert_that(events, is_equal_to(20000));
+    assert_that(bytes, is_less_than(events * 16));
+    assert_that(mallocator_trace_writer_destroy(writer), is_true);
+
+    lseek(fd, 0, SEEK_SET);
+    mallocator_trace_reader_t *reader = mallocator_trace_reader_create(fd);
+    mallocator_trace_record_t record;
+    size_t n = 0, bytes_allocated = 0, bytes_freed = 0;
+    while (mallocator_trace_reader_next(reader, &record))
+    {
+	if (record.event.type == MALLOCATOR_TRACER_MALLOC) bytes_allocated += record.event.e.malloc.size;
+	if (record.event.type == MALLOCATOR_TRACER_FREE) bytes_freed += record.event.e.free.size;
+	n++;
+    }
+    assert_that(n, is_equal_to(events));
+    assert_that(bytes_allocated, is_equal_to(bytes_freed));
+    assert_that(mallocator_trace_reader_failed(reader), is_false);
+    mallocator_trace_reader_destroy(reader);
+}
+
+Ensure(mallocator_trace, detects_truncation)
+{
+    mallocator_trace_writer_t *writer = mallocator_trace_writer_create(fd, 0);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_trace_writer_event, writer);
+    trace_loop(m, 100);
+    mallocator_dereference(m);
+    mallocator_trace_writer_destroy(writer);
+    assert_that(ftruncate(fd, lseek(fd, 0, SEEK_END) - 1), is_equal_to(0));
+
+    lseek(fd, 0, SEEK_SET);
+    mallocator_trace_reader_t *reader = mallocator_trace_reader_create(fd);
+    mallocator_trace_record_t record;
+    while (mallocator_trace_reader_next(reader, &record))
+	;
+    assert_that(mallocator_trace_reader_failed(reader), is_true);
+    mallocator_trace_reader_destroy(reader);
+}
+
+Ensure(mallocator_trace, rejects_other_files)
+{
+    assert_that(write(fd, "not a trace file", 16), is_equal_to(16));
+    lseek(fd, 0, SEEK_SET);
+    assert_that(mallocator_trace_reader_create(fd), is_null);
+}
+
+/* Read a whole trace, returning the events read and whether reading failed */
+static size_t trace_read_all(bool *failed)
+{
+    lseek(fd, 0, SEEK_SET);
+    mallocator_trace_reader_t *reader = mallocator_trace_reader_create(fd);
+    if (!reader)
+    {
+	*failed = true;
+	return 0;
+    }
+    mallocator_trace_record_t record;
+    size_t n = 0;
+    while (mallocator_trace_reader_next(reader, &record))
+	n++;
+    *failed = mallocator_trace_reader_failed(reader);
+    mallocator_trace_reader_destroy(reader);
+    return n;
+}
+
+Ensure(mallocator_trace, rejects_empty_blocks)
+{
+    static const uint8_t trace[16] = { 'M', 'A', 'L', 'L', 'T', 'R', 'C', 0, 2, 0, 0, 0, 0, 0, 0, 0 };
+    assert_that(write(fd, trace, sizeof(trace)), is_equal_to(sizeof(trace)));
+    bool failed;
+    assert_that(trace_read_all(&failed), is_equal_to(0));
+    assert_that(failed, is_true);
+}
+
+Ensure(mallocator_trace, rejects_oversized_blocks)
+{
+    static const uint8_t trace[18] = { 'M', 'A', 'L', 'L', 'T', 'R', 'C', 0, 2, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0x11, 0 };
+    assert_that(write(fd, trace, sizeof(trace)), is_equal_to(sizeof(trace)));
+    bool failed;
+    assert_that(trace_read_all(&failed), is_equal_to(0));
+    assert_that(failed, is_true);
+}
+
+/* Write a trace of small blocks, returning its length */
+static off_t trace_write_small_blocks(void)
+{
+    mallocator_trace_writer_t *writer = mallocator_trace_writer_create(fd, 256);
+    mallocator_t *m = mallocator_tracer_create("test", mallocator_trace_writer_event, writer);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    trace_loop(m, 20);
+    trace_loop(child, 20);
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+    mallocator_trace_writer_destroy(writer);
+    return lseek(fd, 0, SEEK_END);
+}
+
+Ensure(mallocator_trace, detects_truncation_at_any_length)
+{
+    const off_t len = trace_write_small_blocks();
+    bool failed;
+    const size_t events = trace_read_all(&failed);
+    assert_that(failed, is_false);
+
+    /* Truncation is only undetectable at block boundaries, where fewer events are read */
+    for (off_t truncated = len - 1; truncated >= 0; truncated--)
+    {
+	assert_that(ftruncate(fd, truncated), is_equal_to(0));
+	const size_t n = trace_read_all(&failed);
+	assert_that(n, is_less_than(events));
+	if (truncated < 12) assert_that(failed, is_true);
+    }
+}
+
+Ensure(mallocator_trace, survives_corruption)
+{
+    const off_t len = trace_write_small_blocks();
+    uint8_t *trace = malloc(len);
+    assert_that(pread(fd, trace, len, 0), is_equal_to(len));
+
+    /* Corrupt each byte after the header in turn - reading must stop cleanly or decode garbage */
+    for (off_t i = 12; i < len; i++)
+    {
+	static const uint8_t values[] = { 0x00, 0xff, 0x80, 0x7f };
+	for (unsigned v = 0; v < sizeof(values); v++)
+	{
+	    const uint8_t byte = values[v];
+	    assert_that(pwrite(fd, &byte, 1, i), is_equal_to(1));
+	    bool failed;
+	    trace_read_all(&failed);
+	}
+	assert_that(pwrite(fd, &trace[i], 1, i), is_equal_to(1));
+    }
+    free(trace);
+}
+
+TestSuite *mallocator_trace_tests(void)
+{
+    TestSuite *suite = create_test_suite();
+    add_test_with_context(suite, mallocator_trace, round_trips_events);
+    add_test_with_context(suite, mallocator_trace, encodes_compactly);
+    add_test_with_context(suite, mallocator_trace, detects_truncation);
+    add_test_with_context(suite, mallocator_trace, rejects_other_files);
+    add_test_with_context(suite, mallocator_trace, rejects_empty_blocks);
+    add_test_with_context(suite, mallocator_trace, rejects_oversized_blocks);
+    add_test_with_context(suite, mallocator_trace, detects_truncation_at_any_length);
+    add_test_with_context(suite, mallocator_trace, survives_corruption);
+    return suite;
+}
@@ -1,9 +1,16 @@
+#define _GNU_SOURCE
+
 #include <cgreen/cgreen.h>
 
 #include "mallocator_tracer.h"
 #include "mallocator.h"
+#include "mallocator_test_helpers.h"
 
+#include <pthread.h>
 #include <malloc.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 static struct mallinfo mallinfo_before;
 
@@ -11,7 +18,7 @@ Describe(mallocator_tracer);
 
 BeforeEach(mallocator_tracer) 
 {
-    mallinfo_before = mallinfo();
+    mallinfo_before = mallocator_test_mallinfo();
 }
 
 AfterEach(mallocator_tracer)
@@ -76,6 +83,40 @@ Ensure(mallocator_tracer, traces_malloc)
     mallocator_dereference(m);
 }
 
+Ensure(mallocator_tracer, traces_aligned_alloc)
+{
+    mallocator_tracer_event_t event = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_copy, &event);
+    void *ptr = mallocator_aligned_alloc(m, 64, 1000);
+    assert_that(ptr, is_non_null);
+    assert_that(event.name, is_equal_to_string("test"));
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_ALIGNED_ALLOC));
+    assert_that(event.ptr, is_equal_to(ptr));
+    assert_that(event.e.aligned_alloc.alignment, is_equal_to(64));
+    assert_that(event.e.aligned_alloc.size, is_equal_to(1000));
+    assert_that(event.backtrace_len, is_greater_than(0));
+    mallocator_free(m, ptr, 1000);
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_FREE));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, traces_malloc_at_least)
+{
+    mallocator_tracer_event_t event = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_copy, &event);
+    size_t actual = 0;
+    void *ptr = mallocator_malloc_at_least(m, 100, &actual);
+    assert_that(ptr, is_non_null);
+    assert_that(actual, is_greater_than(100 - 1));
+    assert_that(event.type, is_equal_to(MALLOCATOR_TRACER_MALLOC));
+    assert_that(event.ptr, is_equal_to(ptr));
+    assert_that(event.e.malloc.size, is_equal_to(actual));
+    assert_that(mallocator_usable_size(m, ptr, actual), is_equal_to(actual));
+    mallocator_free(m, ptr, actual);
+    assert_that(event.e.free.size, is_equal_to(actual));
+    mallocator_dereference(m);
+}
+
 Ensure(mallocator_tracer, traces_calloc)
 {
     mallocator_tracer_event_t event = { 0 };
@@ -387,6 +428,450 @@ Ensure(mallocator_tracer, traces_child_realloc)
     mallocator_dereference(m);
 }
 
+typedef struct
+{
+    size_t events;
+    size_t mallocs;
+    size_t frees;
+    char name[64];
+    useconds_t delay;
+} trace_count_t;
+
+static void trace_count(void *arg, const mallocator_tracer_event_t *event)
+{
+    trace_count_t *count = arg;
+    count->events++;
+    if (event->type == MALLOCATOR_TRACER_MALLOC) count->mallocs++;
+    if (event->type == MALLOCATOR_TRACER_FREE) count->frees++;
+    strncpy(count->name, event->name, sizeof(count->name) - 1);
+    if (count->delay) usleep(count->delay);
+}
+
+static const mallocator_tracer_async_config_t async_config =
+{
+    .ring_events = 1024,
+    .period_ms = 10,
+    .overflow = MALLOCATOR_TRACER_BLOCK,
+};
+
+Ensure(mallocator_tracer, traces_async)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create_async("test", trace_count, &count, &async_config);
+    assert_that(m, is_non_null);
+    void *ptrs[100];
+    for (unsigned i = 0; i < 100; i++)
+	ptrs[i] = mallocator_malloc(m, 100);
+    for (unsigned i = 0; i < 100; i++)
+	mallocator_free(m, ptrs[i], 100);
+
+    mallocator_tracer_flush(m);
+    assert_that(count.mallocs, is_equal_to(100));
+    assert_that(count.frees, is_equal_to(100));
+    assert_that(count.name, is_equal_to_string("test"));
+    assert_that(mallocator_tracer_dropped(m), is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, delivers_async_events_on_destroy)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create_async("test", trace_count, &count, &async_config);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    mallocator_free(child, mallocator_malloc(child, 100), 100);
+
+    /* Names remain valid after the child is destroyed */
+    mallocator_dereference(child);
+    mallocator_tracer_flush(m);
+    assert_that(count.name, is_equal_to_string("test.child"));
+
+    mallocator_free(m, mallocator_malloc(m, 100), 100);
+    mallocator_dereference(m);
+    assert_that(count.events, is_equal_to(4));
+    assert_that(count.name, is_equal_to_string("test"));
+}
+
+Ensure(mallocator_tracer, drops_async_events_on_overflow)
+{
+    trace_count_t count = { .delay = 1000 };
+    mallocator_tracer_async_config_t config = async_config;
+    config.ring_events = 4;
+    config.overflow = MALLOCATOR_TRACER_DROP;
+    mallocator_t *m = mallocator_tracer_create_async("test", trace_count, &count, &config);
+    for (unsigned i = 0; i < 100; i++)
+	mallocator_free(m, mallocator_malloc(m, 100), 100);
+
+    mallocator_tracer_flush(m);
+    const size_t dropped = mallocator_tracer_dropped(m);
+    assert_that(dropped, is_greater_than(0));
+    assert_that(count.events + dropped, is_equal_to(200));
+    mallocator_dereference(m);
+}
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    unsigned n;
+} trace_thread_t;
+
+static void *trace_thread(void *arg)
+{
+    trace_thread_t *data = arg;
+    for (unsigned i = 0; i < data->n; i++)
+	mallocator_free(data->mallocator, mallocator_malloc(data->mallocator, 100), 100);
+    return NULL;
+}
+
+Ensure(mallocator_tracer, blocks_async_events_on_overflow)
+{
+    trace_count_t count = { .delay = 10 };
+    mallocator_tracer_async_config_t config = async_config;
+    config.ring_events = 4;
+    mallocator_t *m = mallocator_tracer_create_async("test", trace_count, &count, &config);
+    unsigned num_threads = 4;
+    pthread_t threads[num_threads];
+    trace_thread_t data = { .mallocator = m, .n = 100 };
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_create(&threads[i], NULL, trace_thread, &data), is_equal_to(0));
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_join(threads[i], NULL), is_equal_to(0));
+
+    mallocator_tracer_flush(m);
+    assert_that(mallocator_tracer_dropped(m), is_equal_to(0));
+    assert_that(count.mallocs, is_equal_to(num_threads * 100));
+    assert_that(count.frees, is_equal_to(num_threads * 100));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, samples_by_bytes)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_count, &count);
+    assert_that(mallocator_tracer_set_sampling(m, 64 * 1024, 0), is_true);
+    assert_that(mallocator_tracer_set_sampling(m, 64 * 1024, 0), is_false);
+    mallocator_t *child = mallocator_create_child(m, "child");
+
+    /* 10000 * 1000 bytes, so about 150 samples */
+    for (unsigned i = 0; i < 10000; i++)
+	mallocator_free(child, mallocator_malloc(child, 1000), 1000);
+
+    assert_that(count.mallocs, is_greater_than(75));
+    assert_that(count.mallocs, is_less_than(300));
+    assert_that(count.frees, is_equal_to(count.mallocs));
+    assert_that(count.name, is_equal_to_string("test.child"));
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, traces_frees_of_sampled_blocks)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_count, &count);
+    void *unsampled = mallocator_malloc(m, 100);
+    assert_that(count.mallocs, is_equal_to(1));
+
+    /* Every allocation is sampled at an interval of 1 byte */
+    assert_that(mallocator_tracer_set_sampling(m, 1, 0), is_true);
+    void *ptr = mallocator_malloc(m, 100);
+    ptr = mallocator_realloc(m, ptr, 100, 200);
+    mallocator_free(m, ptr, 200);
+    assert_that(count.events, is_equal_to(4));
+
+    /* Blocks allocated before sampling began were not sampled, so their frees are not traced */
+    mallocator_free(m, unsampled, 100);
+    assert_that(count.frees, is_equal_to(1));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, tracks_churning_sampled_blocks)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_count, &count);
+    void *unsampled = mallocator_malloc(m, 100);
+
+    /* Blocks are freed out of allocation order, so removes move blocks back along probe sequences */
+    assert_that(mallocator_tracer_set_sampling(m, 1, 8), is_true);
+    void *ptrs[8];
+    for (unsigned i = 0; i < 8; i++)
+	ptrs[i] = mallocator_malloc(m, 100);
+    for (unsigned i = 0; i < 10000; i++)
+    {
+	const unsigned j = (i * 5) % 8;
+	mallocator_free(m, ptrs[j], 100);
+	ptrs[j] = mallocator_malloc(m, 100);
+    }
+    for (unsigned i = 0; i < 8; i++)
+	mallocator_free(m, ptrs[i], 100);
+    assert_that(count.mallocs, is_equal_to(10009));
+    assert_that(count.frees, is_equal_to(10008));
+
+    mallocator_free(m, unsampled, 100);
+    assert_that(count.frees, is_equal_to(10008));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, tracks_sampled_blocks_concurrently)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create_async("test", trace_count, &count, &async_config);
+    assert_that(mallocator_tracer_set_sampling(m, 1, 0), is_true);
+    unsigned num_threads = 4;
+    pthread_t threads[num_threads];
+    trace_thread_t data = { .mallocator = m, .n = 10000 };
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_create(&threads[i], NULL, trace_thread, &data), is_equal_to(0));
+    for (unsigned i = 0; i < num_threads; i++)
+	assert_that(pthread_join(threads[i], NULL), is_equal_to(0));
+
+    /* Every free is traced, though others' removes move blocks while it is looked up */
+    mallocator_tracer_flush(m);
+    assert_that(mallocator_tracer_dropped(m), is_equal_to(0));
+    assert_that(count.mallocs, is_equal_to(num_threads * 10000));
+    assert_that(count.frees, is_equal_to(num_threads * 10000));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, deduplicates_stacks)
+{
+    mallocator_tracer_event_t event = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_copy, &event);
+    mallocator_tracer_event_t events[2];
+    for (unsigned i = 0; i < 2; i++)
+    {
+	mallocator_free(m, mallocator_malloc(m, 100), 100);
+	events[i] = event;
+    }
+
+    /* The same call site has the same stack, stored once */
+    assert_that(events[0].stack, is_not_equal_to(0));
+    assert_that(events[1].stack, is_equal_to(events[0].stack));
+    assert_that(events[1].backtrace, is_equal_to(events[0].backtrace));
+    size_t depth = 0;
+    assert_that(mallocator_tracer_stack(events[0].stack, &depth), is_equal_to(events[0].backtrace));
+    assert_that(depth, is_equal_to(events[0].backtrace_len));
+
+    void *ptr = mallocator_malloc(m, 100);
+    assert_that(event.stack, is_not_equal_to(events[0].stack));
+    mallocator_free(m, ptr, 100);
+    assert_that(mallocator_tracer_stack(0, NULL), is_null);
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, limits_backtrace_depth)
+{
+    mallocator_tracer_event_t event = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_copy, &event);
+    mallocator_tracer_set_backtrace_depth(m, 2);
+    mallocator_free(m, mallocator_malloc(m, 100), 100);
+    assert_that(event.backtrace_len, is_equal_to(2));
+
+    mallocator_tracer_set_backtrace_depth(m, 0);
+    mallocator_free(m, mallocator_malloc(m, 100), 100);
+    assert_that(event.stack, is_equal_to(0));
+    assert_that(event.backtrace_len, is_equal_to(0));
+    mallocator_dereference(m);
+}
+
+typedef struct
+{
+    mallocator_t *mallocator;
+    mallocator_tracer_event_t event;
+} trace_shallow_t;
+
+static void *trace_shallow_thread(void *arg)
+{
+    trace_shallow_t *data = arg;
+    mallocator_free(data->mallocator, mallocator_malloc(data->mallocator, 100), 100);
+    return NULL;
+}
+
+Ensure(mallocator_tracer, stops_backtrace_at_top_of_stack)
+{
+    trace_shallow_t data = { 0 };
+    data.mallocator = mallocator_tracer_create("test", trace_copy, &data.event);
+    mallocator_tracer_set_backtrace_depth(data.mallocator, MALLOCATOR_TRACER_BACKTRACE_MAX);
+    pthread_t thread;
+    assert_that(pthread_create(&thread, NULL, trace_shallow_thread, &data), is_equal_to(0));
+    assert_that(pthread_join(thread, NULL), is_equal_to(0));
+    assert_that(data.event.backtrace_len, is_greater_than(0));
+    assert_that(data.event.backtrace_len, is_less_than(MALLOCATOR_TRACER_BACKTRACE_MAX));
+    mallocator_dereference(data.mallocator);
+}
+
+Ensure(mallocator_tracer, filters_subtrees)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create("svc", trace_count, &count);
+    mallocator_t *db = mallocator_create_child(m, "db");
+    mallocator_t *cache = mallocator_create_child(m, "cache");
+
+    /* Trace just svc.cache, including children created later */
+    mallocator_tracer_set_filter(m, &(mallocator_tracer_filter_t) { .enabled = false });
+    mallocator_tracer_set_filter(cache, &(mallocator_tracer_filter_t) { .enabled = true });
+    mallocator_t *lru = mallocator_create_child(cache, "lru");
+    mallocator_t *index = mallocator_create_child(db, "index");
+    mallocator_t *all[] = { m, db, cache, lru, index };
+    for (unsigned i = 0; i < 5; i++)
+	mallocator_free(all[i], mallocator_malloc(all[i], 100), 100);
+    assert_that(count.events, is_equal_to(4));
+    assert_that(count.name, is_equal_to_string("svc.cache.lru"));
+
+    mallocator_tracer_filter_t filter;
+    mallocator_tracer_get_filter(index, &filter);
+    assert_that(filter.enabled, is_false);
+    mallocator_tracer_get_filter(lru, &filter);
+    assert_that(filter.enabled, is_true);
+
+    for (unsigned i = 5; i > 0; i--)
+	mallocator_dereference(all[i - 1]);
+}
+
+Ensure(mallocator_tracer, filters_sizes_and_types)
+{
+    trace_count_t count = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_count, &count);
+    const mallocator_tracer_filter_t filter =
+    {
+	.enabled = true,
+	.types = 1 << MALLOCATOR_TRACER_MALLOC,
+	.min_size = 100,
+	.max_size = 1000,
+    };
+    mallocator_tracer_set_filter(m, &filter);
+    const size_t sizes[] = { 50, 100, 500, 1000, 5000 };
+    for (unsigned i = 0; i < 5; i++)
+	mallocator_free(m, mallocator_malloc(m, sizes[i]), sizes[i]);
+    assert_that(count.mallocs, is_equal_to(3));
+    assert_that(count.frees, is_equal_to(0));
+
+    mallocator_tracer_filter_t get;
+    mallocator_tracer_get_filter(m, &get);
+    assert_that(get.enabled, is_true);
+    assert_that(get.types, is_equal_to(filter.types));
+    assert_that(get.min_size, is_equal_to(filter.min_size));
+    assert_that(get.max_size, is_equal_to(filter.max_size));
+
+    /* Back to tracing everything */
+    mallocator_tracer_set_filter(m, &(mallocator_tracer_filter_t) { .enabled = true });
+    mallocator_free(m, mallocator_malloc(m, 5000), 5000);
+    assert_that(count.events, is_equal_to(5));
+    mallocator_dereference(m);
+}
+
+Ensure(mallocator_tracer, captures_context)
+{
+    mallocator_tracer_event_t event = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_copy, &event);
+    mallocator_free(m, mallocator_malloc(m, 100), 100);
+    assert_that(event.timestamp, is_equal_to(0));
+    assert_that(event.tid, is_equal_to(0));
+    assert_that(event.cpu, is_equal_to(-1));
+
+    mallocator_tracer_set_context(m, MALLOCATOR_TRACER_TIMESTAMP | MALLOCATOR_TRACER_TID | MALLOCATOR_TRACER_CPU);
+    mallocator_t *child = mallocator_create_child(m, "child");
+    mallocator_free(child, mallocator_malloc(child, 100), 100);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    assert_that(event.timestamp, is_greater_than(0));
+    assert_that(event.timestamp, is_less_than((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec + 1));
+    assert_that(event.tid, is_equal_to(gettid()));
+    assert_that(event.cpu, is_greater_than(-1));
+    mallocator_dereference(child);
+    mallocator_dereference(m);
+}
+
+typedef struct
+{
+    size_t batches;		/* (atomic) */
+    size_t events;		/* (atomic) */
+    size_t largest;
+    bool ordered;
+} trace_batch_t;
+
+static void trace_batch(void *arg, const mallocator_tracer_event_t *events, size_t count)
+{
+    trace_batch_t *batch = arg;
+    if (count > batch->largest) batch->largest = count;
+    for (size_t i = 0; i < count; i++)
+    {
+	/* Each thread mallocs then frees */
+	const size_t n = batch->events + i;
+	if (events[i].type != (n % 2 ? MALLOCATOR_TRACER_FREE : MALLOCATOR_TRACER_MALLOC)) batch->ordered = false;
+    }
+    __atomic_add_fetch(&batch->events, count, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&batch->batches, 1, __ATOMIC_RELEASE);
+}
+
+Ensure(mallocator_tracer, delivers_batches)
+{
+    trace_batch_t batch = { .ordered = true };
+    mallocator_t *m = mallocator_tracer_create_batched("test", trace_batch, &batch, 16);
+    assert_that(m, is_non_null);
+    for (unsigned i = 0; i < 100; i++)
+	mallocator_free(m, mallocator_malloc(m, 100), 100);
+
+    mallocator_tracer_flush(m);
+    assert_that(batch.events, is_equal_to(200));
+    assert_that(batch.batches, is_greater_than(200 / 16));
+    assert_that(batch.largest, is_less_than(16 + 1));
+    assert_that(batch.ordered, is_true);
+
+    /* A partial batch is delivered on destroy */
+    mallocator_free(m, mallocator_malloc(m, 100), 100);
+    mallocator_dereference(m);
+    assert_that(batch.events, is_equal_to(202));
+}
+
+Ensure(mallocator_tracer, delivers_batches_on_thread_exit)
+{
+    trace_batch_t batch = { .ordered = true };
+    mallocator_t *m = mallocator_tracer_create_batched("test", trace_batch, &batch, 1024);
+    pthread_t thread;
+    trace_thread_t data = { .mallocator = m, .n = 10 };
+    assert_that(pthread_create(&thread, NULL, trace_thread, &data), is_equal_to(0));
+    assert_that(pthread_join(thread, NULL), is_equal_to(0));
+
+    /* Delivered without a flush, well before a full batch */
+    for (unsigned i = 0; i < 1000 && __atomic_load_n(&batch.events, __ATOMIC_ACQUIRE) < 20; i++)
+	usleep(1000);
+    assert_that(__atomic_load_n(&batch.events, __ATOMIC_ACQUIRE), is_equal_to(20));
+    assert_that(batch.ordered, is_true);
+    mallocator_dereference(m);
+}
+
+typedef struct
+{
+    mallocator_t *root;
+    unsigned frees;
+} trace_lookup_t;
+
+static void trace_lookup(void *arg, const mallocator_tracer_event_t *event)
+{
+    trace_lookup_t *lookup = arg;
+    if (event->type != MALLOCATOR_TRACER_FREE) return;
+
+    /* Takes the tree lock */
+    mallocator_t *child = mallocator_child_lookup(lookup->root, "child");
+    if (child) mallocator_dereference(child);
+    lookup->frees++;
+}
+
+Ensure(mallocator_tracer, traces_deferred_frees_of_destroyed_children)
+{
+    trace_lookup_t lookup = { 0 };
+    mallocator_t *m = mallocator_tracer_create("test", trace_lookup, &lookup);
+    lookup.root = m;
+    mallocator_t *child = mallocator_create_child(m, "child");
+    mallocator_free_deferred(child, mallocator_malloc(child, 100), 100);
+
+    /* The last reference is released by iteration, destroying the child with its free pending */
+    mallocator_t *iter = mallocator_child_begin(m);
+    mallocator_dereference(child);
+    assert_that(mallocator_child_next(iter), is_null);
+    assert_that(lookup.frees, is_equal_to(1));
+    mallocator_dereference(m);
+}
+
 TestSuite *mallocator_tracer_tests(void)
 {
     TestSuite *suite = create_test_suite();
@@ -394,9 +879,28 @@ TestSuite *mallocator_tracer_tests(void)
     add_test_with_context(suite, mallocator_tracer, has_a_name);
     add_test_with_context(suite, mallocator_tracer, traces_malloc);
     add_test_with_context(suite, mallocator_tracer, traces_calloc);
+    add_test_with_context(suite, mallocator_tracer, traces_aligned_alloc);
+    add_test_with_context(suite, mallocator_tracer, traces_malloc_at_least);
     add_test_with_context(suite, mallocator_tracer, traces_child_realloc);
     add_test_with_context(suite, mallocator_tracer, traces_child_malloc);
     add_test_with_context(suite, mallocator_tracer, traces_child_calloc);
     add_test_with_context(suite, mallocator_tracer, traces_realloc);
+    add_test_with_context(suite, mallocator_tracer, traces_async);
+    add_test_with_context(suite, mallocator_tracer, delivers_async_events_on_destroy);
+    add_test_with_context(suite, mallocator_tracer, drops_async_events_on_overflow);
+    add_test_with_context(suite, mallocator_tracer, blocks_async_events_on_overflow);
+    add_test_with_context(suite, mallocator_tracer, samples_by_bytes);
+    add_test_with_context(suite, mallocator_tracer, traces_frees_of_sampled_blocks);
+    add_test_with_context(suite, mallocator_tracer, tracks_churning_sampled_blocks);
+    add_test_with_context(suite, mallocator_tracer, tracks_sampled_blocks_concurrently);
+    add_test_with_context(suite, mallocator_tracer, deduplicates_stacks);
+    add_test_with_context(suite, mallocator_tracer, limits_backtrace_depth);
+    add_test_with_context(suite, mallocator_tracer, stops_backtrace_at_top_of_stack);
+    add_test_with_context(suite, mallocator_tracer, filters_subtrees);
+    add_test_with_context(suite, mallocator_tracer, filters_sizes_and_types);
+    add_test_with_context(suite, mallocator_tracer, captures_context);
+    add_test_with_context(suite, mallocator_tracer, delivers_batches);
+    add_test_with_context(suite, mallocator_tracer, delivers_batches_on_thread_exit);
+    add_test_with_context(suite, mallocator_tracer, traces_deferred_frees_of_destroyed_children);
     return suite;
 }
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+
+#include "mallocator_trace.h"
+#include "mallocator_tracer.h"
+#include "mallocator.h"
+#include "mallocator_header.h"
+#include "mallocator_mmap.h"
+#include "mallocator_tlsf.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/*
+ * Replay the allocations of a binary trace written by mallocator_trace_writer_t against a backend.
+ *   mallocator_replay [-b stdlib|header|mmap|tlsf] [-p tlsf_pool_size] [-t mmap_threshold] [-r repeat] <file>
+ * The node tree of the trace is rebuilt under a root named "replay". Operations are replayed in
+ * trace order on the calling thread, and the mallocator call of each is timed, excluding the
+ * lookup of its block. Blocks allocated before the trace started are replayed as allocations when
+ * reallocated, and skipped when freed.
+ */
+
+enum
+{
+    TLSF_POOL_SIZE = 256 * 1024 * 1024,
+    MMAP_THRESHOLD = 128 * 1024,
+};
+
+typedef struct
+{
+    mallocator_tracer_type_t type;
+    unsigned node;
+    uintptr_t ptr;			/* Traced pointer */
+    uintptr_t old_ptr;			/* Traced pointer before realloc */
+    size_t size;
+    size_t arg;				/* calloc nmemb or aligned_alloc alignment */
+} replay_op_t;
+
+typedef struct
+{
+    uintptr_t traced;			/* 0 if unused */
+    void *ptr;
+    size_t size;
+} replay_block_t;
+
+typedef struct
+{
+    replay_op_t *ops;
+    size_t ops_count;
+    size_t ops_capacity;
+    mallocator_t **nodes;		/* Indexed by node ID */
+    unsigned nodes_count;
+    replay_block_t *blocks;		/* Open addressed by traced pointer */
+    size_t blocks_capacity;
+    size_t blocks_count;
+    uint32_t *latencies;		/* ns of each timed op */
+    size_t timed;			/* Ops timed in the current repetition */
+    size_t failed;
+    size_t unknown;
+} replay_t;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr)
+    {
+	perror("realloc");
+	exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t max_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**************************************************************************************************/
+/* Blocks */
+
+static inline size_t block_hash(uintptr_t traced, size_t capacity)
+{
+    return (traced >> 4) * 0x9e3779b97f4a7c15ull >> 20 & (capacity - 1);
+}
+
+static replay_block_t *block_find(replay_t *replay, uintptr_t traced)
+{
+    size_t i = block_hash(traced, replay->blocks_capacity);
+    for (; replay->blocks[i].traced; i = (i + 1) & (replay->blocks_capacity - 1))
+    {
+	if (replay->blocks[i].traced == traced) return &replay->blocks[i];
+    }
+    return NULL;
+}
+
+static void block_insert(replay_t *replay, uintptr_t traced, void *ptr, size_t size)
+{
+    if ((replay->blocks_count + 1) * 2 > replay->blocks_capacity)
+    {
+	const size_t capacity = replay->blocks_capacity * 2;
+	replay_block_t *blocks = calloc(capacity, sizeof(*blocks));
+	if (!blocks)
+	{
+	    perror("calloc");
+	    exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < replay->blocks_capacity; i++)
+	{
+	    if (!replay->blocks[i].traced) continue;
+	    size_t j = block_hash(replay->blocks[i].traced, capacity);
+	    while (blocks[j].traced) j = (j + 1) & (capacity - 1);
+	    blocks[j] = replay->blocks[i];
+	}
+	free(replay->blocks);
+	replay->blocks = blocks;
+	replay->blocks_capacity = capacity;
+    }
+
+    size_t i = block_hash(traced, replay->blocks_capacity);
+    while (replay->blocks[i].traced && replay->blocks[i].traced != traced)
+	i = (i + 1) & (replay->blocks_capacity - 1);
+    if (!replay->blocks[i].traced) replay->blocks_count++;
+    replay->blocks[i] = (replay_block_t) { .traced = traced, .ptr = ptr, .size = size };
+}
+
+static void block_remove(replay_t *replay, replay_block_t *block)
+{
+    const size_t mask = replay->blocks_capacity - 1;
+    size_t i = block - replay->blocks;
+    for (size_t j = (i + 1) & mask; replay->blocks[j].traced; j = (j + 1) & mask)
+    {
+	const size_t home = block_hash(replay->blocks[j].traced, replay->blocks_capacity);
+	if (((j - home) & mask) >= ((j - i) & mask))
+	{
+	    replay->blocks[i] = replay->blocks[j];
+	    i = j;
+	}
+    }
+    replay->blocks[i].traced = 0;
+    replay->blocks_count--;
+}
+
+/**************************************************************************************************/
+/* Loading */
+
+static mallocator_t *node_create(mallocator_t *root, const char *name)
+{
+    /* Each component of the dotted name is a level of the tree */
+    mallocator_t *node = root;
+    mallocator_reference(node);
+    char *copy = strdup(name);
+    for (char *save, *component = strtok_r(copy, ".", &save); component; component = strtok_r(NULL, ".", &save))
+    {
+	mallocator_t *child = mallocator_child_lookup(node, component);
+	if (!child) child = mallocator_create_child(node, component);
+	mallocator_dereference(node);
+	if (!child)
+	{
+	    fprintf(stderr, "cannot create node %s\n", name);
+	    exit(EXIT_FAILURE);
+	}
+	node = child;
+    }
+    free(copy);
+    return node;
+}
+
+static bool load(replay_t *replay, mallocator_trace_reader_t *reader, mallocator_t *root)
+{
+    mallocator_trace_record_t record;
+    while (mallocator_trace_reader_next(reader, &record))
+    {
+	const mallocator_tracer_event_t *event = &record.event;
+	if (record.node >= replay->nodes_count)
+	{
+	    replay->nodes = xrealloc(replay->nodes, (record.node + 1) * sizeof(*replay->nodes));
+	    memset(replay->nodes + replay->nodes_count, 0, (record.node + 1 - replay->nodes_count) * sizeof(*replay->nodes));
+	    replay->nodes_count = record.node + 1;
+	}
+	if (!replay->nodes[record.node]) replay->nodes[record.node] = node_create(root, event->name);
+
+	if (replay->ops_count == replay->ops_capacity)
+	{
+	    replay->ops_capacity = replay->ops_capacity ? replay->ops_capacity * 2 : 1024;
+	    replay->ops = xrealloc(replay->ops, replay->ops_capacity * sizeof(*replay->ops));
+	}
+	replay_op_t *op = &replay->ops[replay->ops_count++];
+	*op = (replay_op_t) { .type = event->type, .node = record.node, .ptr = (uintptr_t) event->ptr };
+	switch (event->type)
+	{
+	    case MALLOCATOR_TRACER_MALLOC:
+		op->size = event->e.malloc.size;
+		break;
+	    case MALLOCATOR_TRACER_CALLOC:
+		op->arg = event->e.calloc.nmemb;
+		op->size = event->e.calloc.size;
+		break;
+	    case MALLOCATOR_TRACER_REALLOC:
+		op->old_ptr = (uintptr_t) event->e.realloc.old_ptr;
+		op->arg = event->e.realloc.old_size;
+		op->size = event->e.realloc.new_size;
+		break;
+	    case MALLOCATOR_TRACER_FREE:
+		op->size = event->e.free.size;
+		break;
+	    case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+		op->arg = event->e.aligned_alloc.alignment;
+		op->size = event->e.aligned_alloc.size;
+		break;
+	}
+    }
+    return !mallocator_trace_reader_failed(reader);
+}
+
+/**************************************************************************************************/
+/* Replay */
+
+/* Record the latency of the mallocator call of an op, started at start */
+static uint64_t replay_timed(replay_t *replay, uint64_t start)
+{
+    const uint64_t ns = now_ns() - start;
+    replay->latencies[replay->timed++] = ns < UINT32_MAX ? ns : UINT32_MAX;
+    return ns;
+}
+
+/* Replay an op, returning the ns spent in the mallocator call, or 0 if it was skipped */
+static uint64_t replay_op(replay_t *replay, const replay_op_t *op)
+{
+    mallocator_t *m = replay->nodes[op->node];
+    void *ptr;
+    replay_block_t *block;
+    uint64_t start, ns;
+    switch (op->type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	case MALLOCATOR_TRACER_CALLOC:
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    /* Allocations which failed when traced are not replayed */
+	    if (!op->ptr) return 0;
+	    start = now_ns();
+	    if (op->type == MALLOCATOR_TRACER_MALLOC)
+		ptr = mallocator_malloc(m, op->size);
+	    else if (op->type == MALLOCATOR_TRACER_CALLOC)
+		ptr = mallocator_calloc(m, op->arg, op->size);
+	    else
+		ptr = mallocator_aligned_alloc(m, op->arg, op->size);
+	    ns = replay_timed(replay, start);
+	    if (ptr)
+		block_insert(replay, op->ptr, ptr, op->type == MALLOCATOR_TRACER_CALLOC ? op->arg * op->size : op->size);
+	    else
+		replay->failed++;
+	    return ns;
+	case MALLOCATOR_TRACER_REALLOC:
+	    if (!op->ptr && op->size) return 0;
+	    block = op->old_ptr ? block_find(replay, op->old_ptr) : NULL;
+	    if (op->old_ptr && !block) replay->unknown++;
+	    start = now_ns();
+	    ptr = mallocator_realloc(m, block ? block->ptr : NULL, block ? block->size : 0, op->size);
+	    ns = replay_timed(replay, start);
+	    if (block && (ptr || !op->size)) block_remove(replay, block);
+	    if (ptr)
+		block_insert(replay, op->ptr, ptr, op->size);
+	    else if (op->size)
+		replay->failed++;
+	    return ns;
+	case MALLOCATOR_TRACER_FREE:
+	    block = op->ptr ? block_find(replay, op->ptr) : NULL;
+	    if (!block)
+	    {
+		if (op->ptr) replay->unknown++;
+		return 0;
+	    }
+	    start = now_ns();
+	    mallocator_free(m, block->ptr, block->size);
+	    ns = replay_timed(replay, start);
+	    block_remove(replay, block);
+	    return ns;
+    }
+    return 0;
+}
+
+/* Free blocks still live at the end of the trace */
+static void replay_free_live(replay_t *replay)
+{
+    for (size_t i = 0; i < replay->ops_count; i++)
+    {
+	const replay_op_t *op = &replay->ops[i];
+	replay_block_t *block = op->ptr ? block_find(replay, op->ptr) : NULL;
+	if (!block) continue;
+	mallocator_free(replay->nodes[op->node], block->ptr, block->size);
+	block_remove(replay, block);
+    }
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    const uint32_t la = *(const uint32_t *) a, lb = *(const uint32_t *) b;
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+static mallocator_t *backend_create(const char *backend, size_t pool_size, size_t threshold)
+{
+    if (strcmp(backend, "stdlib") == 0) return mallocator_create("replay");
+    if (strcmp(backend, "header") == 0) return mallocator_header_create("replay");
+    if (strcmp(backend, "mmap") == 0) return mallocator_mmap_create("replay", threshold);
+    if (strcmp(backend, "tlsf") == 0) return mallocator_tlsf_create("replay", pool_size);
+    return NULL;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-b stdlib|header|mmap|tlsf] [-p tlsf_pool_size] [-t mmap_threshold] [-r repeat] <file>\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *backend = "stdlib";
+    size_t pool_size = TLSF_POOL_SIZE;
+    size_t threshold = MMAP_THRESHOLD;
+    unsigned repeat = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:t:r:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'b':
+		backend = optarg;
+		break;
+	    case 'p':
+		pool_size = strtoull(optarg, NULL, 0);
+		break;
+	    case 't':
+		threshold = strtoull(optarg, NULL, 0);
+		break;
+	    case 'r':
+		repeat = strtoul(optarg, NULL, 0);
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || repeat == 0) usage(argv[0]);
+
+    const char *path = argv[optind];
+    const int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+    {
+	perror(path);
+	return EXIT_FAILURE;
+    }
+    mallocator_trace_reader_t *reader = mallocator_trace_reader_create(fd);
+    if (!reader)
+    {
+	fprintf(stderr, "%s: not a mallocator trace\n", path);
+	return EXIT_FAILURE;
+    }
+    mallocator_t *root = backend_create(backend, pool_size, threshold);
+    if (!root)
+    {
+	fprintf(stderr, "cannot create backend %s\n", backend);
+	return EXIT_FAILURE;
+    }
+
+    replay_t replay = { 0 };
+    const bool loaded = load(&replay, reader, root);
+    mallocator_trace_reader_destroy(reader);
+    if (fd != STDIN_FILENO) close(fd);
+    if (!loaded) fprintf(stderr, "%s: truncated or corrupt trace, replaying the events read\n", path);
+
+    /* At most one block is live per op, so the table never grows while timing */
+    replay.blocks_capacity = 1024;
+    while (replay.blocks_capacity < 2 * (replay.ops_count + 1))
+	replay.blocks_capacity *= 2;
+    replay.blocks = calloc(replay.blocks_capacity, sizeof(*replay.blocks));
+    replay.latencies = malloc(replay.ops_count * sizeof(*replay.latencies) + 1);
+    if (!replay.blocks || !replay.latencies)
+    {
+	perror("malloc");
+	return EXIT_FAILURE;
+    }
+    const size_t rss_before = max_rss_kb();
+
+    uint64_t total_ns = 0, wall_ns = 0;
+    size_t total_timed = 0;
+    for (unsigned r = 0; r < repeat; r++)
+    {
+	replay.timed = 0;
+	const uint64_t wall_start = now_ns();
+	for (size_t i = 0; i < replay.ops_count; i++)
+	    total_ns += replay_op(&replay, &replay.ops[i]);
+	wall_ns += now_ns() - wall_start;
+	total_timed += replay.timed;
+	replay_free_live(&replay);
+    }
+    const size_t rss_after = max_rss_kb();
+
+    /* Latencies of the last repetition */
+    qsort(replay.latencies, replay.timed, sizeof(*replay.latencies), compare_latencies);
+    const double percentiles[] = { 50, 90, 99, 99.9 };
+    printf("backend: %s\n", backend);
+    printf("operations: %zu x %u (%zu replayed)\n", replay.ops_count, repeat, replay.timed);
+    printf("nodes: %u\n", replay.nodes_count);
+    printf("failed: %zu\n", replay.failed);
+    printf("unknown blocks: %zu\n", replay.unknown);
+    printf("wall time: %.6f s\n", (double) wall_ns / 1e9);
+    printf("throughput: %.0f ops/s\n", total_ns ? (double) total_timed * 1e9 / total_ns : 0.0);
+    for (unsigned i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+	const size_t index = replay.timed ? (size_t) (percentiles[i] / 100 * (replay.timed - 1)) : 0;
+	printf("latency p%g: %u ns\n", percentiles[i], replay.timed ? replay.latencies[index] : 0);
+    }
+    printf("latency max: %u ns\n", replay.timed ? replay.latencies[replay.timed - 1] : 0);
+    printf("peak rss: %zu KiB (%zu KiB before replay)\n", rss_after, rss_before);
+
+    for (unsigned i = 0; i < replay.nodes_count; i++)
+	if (replay.nodes[i]) mallocator_dereference(replay.nodes[i]);
+    mallocator_dereference(root);
+    free(replay.nodes);
+    free(replay.ops);
+    free(replay.blocks);
+    free(replay.latencies);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+
+#include "mallocator_shm_ring.h"
+#include "mallocator_trace.h"
+#include "mallocator_tracer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Follow a shared memory ring written by mallocator_shm_ring_event, writing its events as a binary
+ * trace, as mallocator_trace_writer_t would in the traced process.
+ *   mallocator_shm_trace [-o file] [-p period_ms] <ring>
+ * ring is /dev/shm/<name> for a named ring, or /proc/<pid>/fd/<fd> for a memfd. The trace is
+ * written to stdout by default, so may be piped to "mallocator_trace dump -". The ring is polled
+ * every period_ms once empty, and events dropped by the producer are reported on stderr. Reading
+ * stops once the producer has exited and the ring is drained, or on SIGINT or SIGTERM.
+ */
+
+enum { PERIOD_MS = 10 };
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int signum)
+{
+    stop = 1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-o file] [-p period_ms] <ring>\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    unsigned period_ms = PERIOD_MS;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:p:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'o':
+		output = optarg;
+		break;
+	    case 'p':
+		period_ms = strtoul(optarg, NULL, 0);
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || period_ms == 0) usage(argv[0]);
+
+    const char *path = argv[optind];
+    const int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+	perror(path);
+	return EXIT_FAILURE;
+    }
+    mallocator_shm_ring_t *ring = mallocator_shm_ring_open(fd);
+    if (!ring)
+    {
+	fprintf(stderr, "%s: not a mallocator ring\n", path);
+	return EXIT_FAILURE;
+    }
+    close(fd);
+
+    const int out = output ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (out < 0)
+    {
+	perror(output);
+	return EXIT_FAILURE;
+    }
+    mallocator_trace_writer_t *writer = mallocator_trace_writer_create(out, 0);
+    if (!writer)
+    {
+	perror("write");
+	return EXIT_FAILURE;
+    }
+
+    struct sigaction action = { .sa_handler = on_signal };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    const pid_t pid = mallocator_shm_ring_pid(ring);
+    const struct timespec period = { .tv_sec = period_ms / 1000, .tv_nsec = (period_ms % 1000) * 1000000L };
+    size_t lost = 0;
+    bool exited = false;
+    mallocator_tracer_event_t event;
+    while (!stop)
+    {
+	if (mallocator_shm_ring_read(ring, &event))
+	{
+	    mallocator_trace_writer_event(writer, &event);
+	    continue;
+	}
+	if (mallocator_shm_ring_failed(ring)) break;
+
+	/* Empty - report losses, flush and poll, stopping once a producer which has exited is drained */
+	const size_t new_lost = mallocator_shm_ring_lost(ring);
+	if (new_lost != lost) fprintf(stderr, "%s: lost %zu events\n", path, new_lost - lost);
+	lost = new_lost;
+	if (!mallocator_trace_writer_flush(writer) || exited) break;
+	exited = kill(pid, 0) != 0 && errno == ESRCH;
+	if (!exited) nanosleep(&period, NULL);
+    }
+
+    size_t events;
+    mallocator_trace_writer_bytes(writer, &events);
+    const bool failed = mallocator_shm_ring_failed(ring);
+    const bool written = mallocator_trace_writer_destroy(writer);
+    if (failed) fprintf(stderr, "%s: corrupt ring\n", path);
+    if (!written) perror("write");
+    fprintf(stderr, "%s: %zu events, %zu lost\n", path, events, mallocator_shm_ring_lost(ring));
+    mallocator_shm_ring_destroy(ring);
+    if (out != STDOUT_FILENO) close(out);
+    return failed || !written ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "mallocator_trace.h"
+#include "mallocator_tracer.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Decode and summarize binary trace files written by mallocator_trace_writer_t.
+ *   mallocator_trace dump <file>	Print each event
+ *   mallocator_trace summary <file>	Print per node totals and the top allocating stacks
+ */
+
+enum { TOP_STACKS = 10 };
+
+typedef struct
+{
+    size_t allocs;
+    size_t frees;
+    size_t failed;
+    size_t bytes_allocated;
+    size_t bytes_freed;
+    size_t live;
+    size_t peak;
+} node_summary_t;
+
+typedef struct
+{
+    unsigned id;
+    size_t allocs;
+    size_t bytes;
+    mallocator_tracer_event_t event;	/* An event with this stack, for the backtrace */
+} stack_summary_t;
+
+static void *grow(void *array, size_t *count, size_t index, size_t size)
+{
+    if (index < *count) return array;
+
+    const size_t new_count = index + 1 > *count * 2 ? index + 1 : *count * 2;
+    char *new_array = realloc(array, new_count * size);
+    if (!new_array)
+    {
+	perror("realloc");
+	exit(EXIT_FAILURE);
+    }
+    memset(new_array + *count * size, 0, (new_count - *count) * size);
+    *count = new_count;
+    return new_array;
+}
+
+/* Return the bytes allocated and freed by an event, and whether it failed */
+static void event_bytes(const mallocator_tracer_event_t *event, size_t *allocated, size_t *freed, bool *failed)
+{
+    *allocated = *freed = 0;
+    *failed = false;
+    switch (event->type)
+    {
+	case MALLOCATOR_TRACER_MALLOC:
+	    *allocated = event->e.malloc.size;
+	    *failed = !event->ptr;
+	    break;
+	case MALLOCATOR_TRACER_CALLOC:
+	    *allocated = event->e.calloc.nmemb * event->e.calloc.size;
+	    *failed = !event->ptr;
+	    break;
+	case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+	    *allocated = event->e.aligned_alloc.size;
+	    *failed = !event->ptr;
+	    break;
+	case MALLOCATOR_TRACER_REALLOC:
+	    *failed = !event->ptr && event->e.realloc.new_size;
+	    if (!*failed)
+	    {
+		*allocated = event->e.realloc.new_size;
+		*freed = event->e.realloc.old_size;
+	    }
+	    break;
+	case MALLOCATOR_TRACER_FREE:
+	    *freed = event->ptr ? event->e.free.size : 0;
+	    break;
+    }
+}
+
+static void dump(mallocator_trace_reader_t *reader)
+{
+    mallocator_trace_record_t record;
+    uint64_t start = 0;
+    for (size_t n = 0; mallocator_trace_reader_next(reader, &record); n++)
+    {
+	if (n == 0) start = record.timestamp;
+	const mallocator_tracer_event_t *event = &record.event;
+	printf("%12.6f %-14s %-24s %p", (double) (record.timestamp - start) / 1e9,
+	    mallocator_tracer_type_str(event->type), event->name, event->ptr);
+	switch (event->type)
+	{
+	    case MALLOCATOR_TRACER_MALLOC:
+		printf(" size=%zu", event->e.malloc.size);
+		break;
+	    case MALLOCATOR_TRACER_CALLOC:
+		printf(" nmemb=%zu size=%zu", event->e.calloc.nmemb, event->e.calloc.size);
+		break;
+	    case MALLOCATOR_TRACER_REALLOC:
+		printf(" old_ptr=%p old_size=%zu new_size=%zu", event->e.realloc.old_ptr,
+		    event->e.realloc.old_size, event->e.realloc.new_size);
+		break;
+	    case MALLOCATOR_TRACER_FREE:
+		printf(" size=%zu", event->e.free.size);
+		break;
+	    case MALLOCATOR_TRACER_ALIGNED_ALLOC:
+		printf(" alignment=%zu size=%zu", event->e.aligned_alloc.alignment, event->e.aligned_alloc.size);
+		break;
+	}
+	if (event->tid) printf(" tid=%u", event->tid);
+	if (event->cpu >= 0) printf(" cpu=%d", event->cpu);
+	printf(" stack=%u\n", record.stack);
+    }
+}
+
+static int compare_stacks(const void *a, const void *b)
+{
+    const stack_summary_t *sa = a, *sb = b;
+    return sa->bytes < sb->bytes ? 1 : sa->bytes > sb->bytes ? -1 : 0;
+}
+
+static void summary(mallocator_trace_reader_t *reader)
+{
+    node_summary_t *nodes = NULL;
+    size_t nodes_count = 0;
+    stack_summary_t *stacks = NULL;
+    size_t stacks_count = 0;
+    size_t events = 0;
+    uint64_t first = 0, last = 0;
+
+    mallocator_trace_record_t record;
+    while (mallocator_trace_reader_next(reader, &record))
+    {
+	if (events++ == 0) first = record.timestamp;
+	if (record.timestamp > last) last = record.timestamp;
+
+	size_t allocated, freed;
+	bool failed;
+	event_bytes(&record.event, &allocated, &freed, &failed);
+
+	nodes = grow(nodes, &nodes_count, record.node, sizeof(*nodes));
+	node_summary_t *node = &nodes[record.node];
+	if (failed)
+	{
+	    node->failed++;
+	    continue;
+	}
+	if (allocated) node->allocs++;
+	if (freed || record.event.type == MALLOCATOR_TRACER_FREE) node->frees++;
+	node->bytes_allocated += allocated;
+	node->bytes_freed += freed;
+	node->live = node->live + allocated > freed ? node->live + allocated - freed : 0;
+	if (node->live > node->peak) node->peak = node->live;
+
+	if (allocated && record.stack)
+	{
+	    stacks = grow(stacks, &stacks_count, record.stack, sizeof(*stacks));
+	    stack_summary_t *stack = &stacks[record.stack];
+	    stack->id = record.stack;
+	    stack->allocs++;
+	    stack->bytes += allocated;
+	    stack->event = record.event;
+	}
+    }
+
+    printf("events: %zu\n", events);
+    printf("duration: %.6f s\n", events ? (double) (last - first) / 1e9 : 0.0);
+    printf("\n%-24s %10s %10s %8s %14s %14s %12s %12s\n", "node", "allocs", "frees", "failed",
+	"allocated", "freed", "live", "peak");
+    for (size_t i = 0; i < nodes_count; i++)
+    {
+	const node_summary_t *node = &nodes[i];
+	if (!node->allocs && !node->frees && !node->failed) continue;
+	printf("%-24s %10zu %10zu %8zu %14zu %14zu %12zu %12zu\n", mallocator_trace_reader_name(reader, i),
+	    node->allocs, node->frees, node->failed, node->bytes_allocated, node->bytes_freed, node->live,
+	    node->peak);
+    }
+
+    if (stacks_count)
+    {
+	qsort(stacks, stacks_count, sizeof(*stacks), compare_stacks);
+	printf("\nTop allocating stacks:\n");
+	for (size_t i = 0; i < stacks_count && i < TOP_STACKS && stacks[i].bytes; i++)
+	{
+	    printf("  stack %u: %zu bytes in %zu allocations\n", stacks[i].id, stacks[i].bytes, stacks[i].allocs);
+	    for (size_t j = 0; j < stacks[i].event.backtrace_len; j++)
+		printf("    %p\n", stacks[i].event.backtrace[j]);
+	}
+    }
+    free(nodes);
+    free(stacks);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 || (strcmp(argv[1], "dump") != 0 && strcmp(argv[1], "summary") != 0))
+    {
+	fprintf(stderr, "Usage: %s dump|summary <file>\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    const int fd = strcmp(argv[2], "-") == 0 ? STDIN_FILENO : open(argv[2], O_RDONLY);
+    if (fd < 0)
+    {
+	perror(argv[2]);
+	return EXIT_FAILURE;
+    }
+    mallocator_trace_reader_t *reader = mallocator_trace_reader_create(fd);
+    if (!reader)
+    {
+	fprintf(stderr, "%s: not a mallocator trace\n", argv[2]);
+	return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "dump") == 0)
+	dump(reader);
+    else
+	summary(reader);
+
+    const bool failed = mallocator_trace_reader_failed(reader);
+    if (failed) fprintf(stderr, "%s: truncated or corrupt trace\n", argv[2]);
+    mallocator_trace_reader_destroy(reader);
+    if (fd != STDIN_FILENO) close(fd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}